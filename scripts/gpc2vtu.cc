@@ -0,0 +1,218 @@
+/*  Copyright 2013 Alexis Herault, Giuseppe Bilotta, Robert A. Dalrymple, Eugenio Rustico, Ciro Del Negro
+
+    Istituto Nazionale di Geofisica e Vulcanologia
+        Sezione di Catania, Catania, Italy
+
+    Università di Catania, Catania, Italy
+
+    Johns Hopkins University, Baltimore, MD
+
+    This file is part of GPUSPH.
+
+    GPUSPH is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GPUSPH is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GPUSPH.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Convert the columnar output of the ColumnWriter (PART.gpc) to VTU files,
+ * one per frame, plus a .pvd collection indexing them by time.
+ *
+ * Usage: gpc2vtu FILE.gpc [OUTDIR] [T0 [T1]]
+ *
+ * The files are written to OUTDIR (default: the directory of FILE.gpc); if T0
+ * (and T1) are given, only the frame at time T0 (or the frames between T0 and T1)
+ * are converted. Built with `make gpc2vtu`.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "ColumnReader.h"
+
+using namespace std;
+
+static const char *vtk_type[] = { "UInt8", "UInt16", "UInt32", "UInt64", "Float32", "Float64" };
+
+static int endian_int = 1;
+static const char *endianness[2] = { "BigEndian", "LittleEndian" };
+
+template<typename T>
+static inline void
+write_var(ofstream &out, T const& var)
+{
+	out.write(reinterpret_cast<const char *>(&var), sizeof(T));
+}
+
+static void
+convert_frame(ColumnReader &reader, uint32_t f, string const& fname)
+{
+	vector<ColumnEntry> const& columns = reader.columns(f);
+	const uint64_t numParts = reader.numParts(f);
+
+	int points = -1;
+	for (size_t c = 0; c < columns.size(); ++c)
+		if (columns[c].flags & COLUMN_FLAG_POINTS)
+			points = c;
+	if (points < 0 || columns[points].type != COLUMN_FLOAT64 || columns[points].components < 3)
+		throw runtime_error("frame has no particle positions");
+
+	ofstream out(fname.c_str(), ios::binary);
+	if (!out)
+		throw runtime_error("cannot create " + fname);
+	out.exceptions(ofstream::failbit | ofstream::badbit);
+
+	out << "<?xml version='1.0'?>\n";
+	out << "<VTKFile type='UnstructuredGrid' version='1.0' byte_order='"
+		<< endianness[*(char*)&endian_int & 1] << "' header_type='UInt64'>\n";
+	out << " <UnstructuredGrid>\n";
+	out << "  <Piece NumberOfPoints='" << numParts << "' NumberOfCells='" << numParts << "'>\n";
+
+	// the appended arrays are: the columns but the positions, the positions, then the cells
+	uint64_t offset = 0;
+	out << "   <PointData>\n";
+	for (size_t c = 0; c < columns.size(); ++c) {
+		if ((int)c == points)
+			continue;
+		out << "	<DataArray type='" << vtk_type[columns[c].type] << "' Name='" << columns[c].name
+			<< "' NumberOfComponents='" << columns[c].components
+			<< "' format='appended' offset='" << offset << "'/>\n";
+		offset += sizeof(uint64_t) + numParts*columns[c].elsize;
+	}
+	out << "   </PointData>\n";
+	out << "   <Points>\n";
+	out << "	<DataArray type='Float64' NumberOfComponents='3' format='appended' offset='"
+		<< offset << "'/>\n";
+	offset += sizeof(uint64_t) + numParts*3*sizeof(double);
+	out << "   </Points>\n";
+	out << "   <Cells>\n";
+	out << "	<DataArray type='UInt32' Name='connectivity' format='appended' offset='" << offset << "'/>\n";
+	offset += sizeof(uint64_t) + numParts*sizeof(uint32_t);
+	out << "	<DataArray type='UInt32' Name='offsets' format='appended' offset='" << offset << "'/>\n";
+	offset += sizeof(uint64_t) + numParts*sizeof(uint32_t);
+	out << "	<DataArray type='UInt8' Name='types' format='appended' offset='" << offset << "'/>\n";
+	out << "   </Cells>\n";
+	out << "  </Piece>\n";
+	out << " </UnstructuredGrid>\n";
+	out << " <AppendedData encoding='raw'>\n_";
+
+	vector<char> data;
+	for (size_t c = 0; c < columns.size(); ++c) {
+		if ((int)c == points)
+			continue;
+		const uint64_t size = numParts*columns[c].elsize;
+		data.resize(size);
+		if (size)
+			reader.readColumn(f, c, &data[0]);
+		write_var(out, size);
+		if (size)
+			out.write(&data[0], size);
+	}
+
+	// only the first three components of the positions
+	const uint32_t poscomps = columns[points].components;
+	data.resize(numParts*columns[points].elsize);
+	if (numParts)
+		reader.readColumn(f, points, &data[0]);
+	const double *pos = (const double*)(numParts ? &data[0] : NULL);
+	write_var(out, (uint64_t)(numParts*3*sizeof(double)));
+	for (uint64_t p = 0; p < numParts; ++p)
+		out.write(reinterpret_cast<const char*>(pos + p*poscomps), 3*sizeof(double));
+
+	// one single-vertex cell per particle
+	write_var(out, (uint64_t)(numParts*sizeof(uint32_t)));
+	for (uint32_t p = 0; p < numParts; ++p)
+		write_var(out, p);
+	write_var(out, (uint64_t)(numParts*sizeof(uint32_t)));
+	for (uint32_t p = 0; p < numParts; ++p)
+		write_var(out, p + 1);
+	write_var(out, (uint64_t)numParts);
+	for (uint32_t p = 0; p < numParts; ++p)
+		write_var(out, (unsigned char)1);
+
+	out << " </AppendedData>\n";
+	out << "</VTKFile>\n";
+}
+
+int
+main(int argc, char *argv[])
+{
+	if (argc < 2 || argc > 5) {
+		cerr << "Usage: " << argv[0] << " FILE.gpc [OUTDIR] [T0 [T1]]" << endl;
+		return 1;
+	}
+
+	const string fname(argv[1]);
+	string outdir;
+	if (argc > 2) {
+		outdir = argv[2];
+	} else {
+		const size_t slash = fname.rfind('/');
+		outdir = (slash == string::npos ? "." : fname.substr(0, slash));
+	}
+
+	// base name of the output files, from the input file name
+	string base = fname.substr(fname.rfind('/') == string::npos ? 0 : fname.rfind('/') + 1);
+	if (base.size() > 4 && base.substr(base.size() - 4) == ".gpc")
+		base.erase(base.size() - 4);
+
+	try {
+		ColumnReader reader(fname);
+		if (!reader.numFrames()) {
+			cerr << fname << " has no frames" << endl;
+			return 0;
+		}
+
+		uint32_t first = 0, last = reader.numFrames() - 1;
+		if (argc > 3) {
+			first = last = reader.findFrame(atof(argv[3]));
+			if (argc > 4)
+				last = reader.findFrame(atof(argv[4]));
+		}
+
+		const string pvdname = outdir + "/" + base + ".pvd";
+		ofstream pvd(pvdname.c_str());
+		if (!pvd)
+			throw runtime_error("cannot create " + pvdname);
+		pvd << "<?xml version='1.0'?>\n";
+		pvd << "<VTKFile type='Collection' version='0.1'>\n";
+		pvd << " <Collection>\n";
+
+		for (uint32_t f = first; f <= last; ++f) {
+			stringstream ss;
+			ss << base << "_";
+			ss.width(5);
+			ss.fill('0');
+			ss << f << ".vtu";
+			const string vtuname = ss.str();
+
+			convert_frame(reader, f, outdir + "/" + vtuname);
+			pvd << "<DataSet timestep='" << reader.frameTime(f) << "' group='' part='0' "
+				<< "file='" << vtuname << "'/>\n";
+			cout << "\r" << vtuname << " (t=" << reader.frameTime(f) << ")" << flush;
+		}
+		cout << endl;
+
+		pvd << " </Collection>\n";
+		pvd << "</VTKFile>\n";
+	} catch (exception &e) {
+		cerr << endl << e.what() << endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,767 @@
+/*  Copyright 2013 Alexis Herault, Giuseppe Bilotta, Robert A. Dalrymple, Eugenio Rustico, Ciro Del Negro
+
+    Istituto Nazionale di Geofisica e Vulcanologia
+        Sezione di Catania, Catania, Italy
+
+    Università di Catania, Catania, Italy
+
+    Johns Hopkins University, Baltimore, MD
+
+    This file is part of GPUSPH.
+
+    GPUSPH is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GPUSPH is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GPUSPH.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Convert the PART_*.txt files of the TextWriter to binary VTU files, replacing
+ * the txt2vtk awk script.
+ *
+ * Usage: txt2vtu [-j THREADS] DIR|FILE.txt...
+ *
+ * Each FILE.txt is converted to FILE.vtu; for a DIR, all of its PART_*.txt files
+ * are converted, and if the DIR has the time.txt of the TextWriter, a PART.pvd
+ * collection indexing the VTU files by time is written too.
+ *
+ * The files are memory-mapped and split in chunks of lines, which are parsed in
+ * parallel (by THREADS threads, default: one per core) with a parser specialized
+ * for the output of the TextWriter; the VTU files are then written in parallel.
+ * Built with `make txt2vtu`.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+using namespace std;
+
+// bytes of text parsed by each job
+#define CHUNK_SIZE	(4U << 20)
+// bytes of text mapped (and parsed values held) at a time, at least one file
+#define BATCH_SIZE	(1ULL << 30)
+
+// columns of the TextWriter: id, type, object, position, velocity, mass, density,
+// pressure and, optionally, vorticity
+#define BASE_COLUMNS	12
+#define VORT_COLUMNS	15
+
+static int endian_int = 1;
+static const char *endianness[2] = { "BigEndian", "LittleEndian" };
+
+// a text file being converted
+struct TextFile {
+	string		name;
+	string		out;
+	int			fd;
+	const char	*data;
+	size_t		size;
+	// number of columns, from the first line
+	int			columns;
+	// number of particles, once parsed
+	uint64_t	numParts;
+	string		error;
+};
+
+// the values of a chunk of lines of a file
+struct Chunk {
+	TextFile		*file;
+	size_t			begin;
+	size_t			end;
+	vector<uint32_t>	id;
+	vector<uint32_t>	type;
+	vector<uint32_t>	object;
+	vector<float>	pos;
+	vector<float>	vel;
+	vector<float>	mass;
+	vector<float>	density;
+	vector<float>	pressure;
+	vector<float>	vort;
+	string			error;
+};
+
+// jobs shared by the threads of a phase: the chunks to parse, or the files to write
+struct Jobs {
+	vector<Chunk>		*chunks;
+	vector<TextFile*>	*files;
+	volatile uint		next;
+};
+
+static double
+now_seconds()
+{
+	timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec*1.0e-6;
+}
+
+static inline bool
+is_blank(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+static inline bool
+is_digit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+static inline const char *
+skip_blanks(const char *p, const char *end)
+{
+	while (p < end && is_blank(*p))
+		++p;
+	return p;
+}
+
+// does a value end at p?
+static inline bool
+at_delimiter(const char *p, const char *end)
+{
+	return p == end || is_blank(*p) || *p == '\n';
+}
+
+// parse an unsigned integer; returns NULL if there is none at p
+static inline const char *
+parse_uint(const char *p, const char *end, uint32_t &val)
+{
+	const char *start = p;
+	uint64_t v = 0;
+	while (p < end && is_digit(*p)) {
+		v = v*10 + (*p - '0');
+		++p;
+	}
+	if (p == start || v > 0xffffffffULL || !at_delimiter(p, end))
+		return NULL;
+	val = v;
+	return p;
+}
+
+// exact powers of ten in double precision
+static const double exact_pow10[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static inline double
+power_of_ten(int e)
+{
+	return e <= 22 ? exact_pow10[e] : pow(10.0, e);
+}
+
+// parse a floating-point value as written by the TextWriter (%g); returns NULL
+// if there is none at p. The significant digits are accumulated as an integer
+// and scaled by a power of ten, which is exact up to 1e22, so the values of the
+// TextWriter are parsed exactly as strtod() would; nan and inf are left to strtod()
+static const char *
+parse_float(const char *p, const char *end, float &val)
+{
+	const char *start = p;
+	bool neg = false;
+	if (p < end && (*p == '-' || *p == '+')) {
+		neg = (*p == '-');
+		++p;
+	}
+
+	uint64_t mant = 0;
+	int digits = 0, exp10 = 0;
+	bool any = false;
+	for ( ; p < end && is_digit(*p); ++p, any = true) {
+		if (digits < 19) {
+			mant = mant*10 + (*p - '0');
+			if (mant)
+				++digits;
+		} else {
+			++exp10;
+		}
+	}
+	if (p < end && *p == '.') {
+		for (++p; p < end && is_digit(*p); ++p, any = true) {
+			if (digits < 19) {
+				mant = mant*10 + (*p - '0');
+				if (mant)
+					++digits;
+				--exp10;
+			}
+		}
+	}
+
+	if (!any) {
+		char buf[32];
+		size_t len = 0;
+		for (p = start; !at_delimiter(p, end) && len < sizeof(buf) - 1; ++p)
+			buf[len++] = *p;
+		buf[len] = '\0';
+		char *parsed;
+		val = strtod(buf, &parsed);
+		if (!len || *parsed || !at_delimiter(p, end))
+			return NULL;
+		return p;
+	}
+
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		++p;
+		bool eneg = false;
+		if (p < end && (*p == '-' || *p == '+')) {
+			eneg = (*p == '-');
+			++p;
+		}
+		if (p == end || !is_digit(*p))
+			return NULL;
+		int e = 0;
+		for ( ; p < end && is_digit(*p); ++p)
+			if (e < 10000)
+				e = e*10 + (*p - '0');
+		exp10 += eneg ? -e : e;
+	}
+	if (!at_delimiter(p, end))
+		return NULL;
+
+	double v = mant;
+	if (!mant)
+		v = 0;
+	else if (exp10 < -340)
+		v = 0;
+	else if (exp10 < 0)
+		v /= power_of_ten(-exp10);
+	else if (exp10 > 0)
+		v *= power_of_ten(min(exp10, 400));
+	val = neg ? -v : v;
+	return p;
+}
+
+// number of values in the first non-empty line of the file
+static int
+count_columns(const char *p, const char *end)
+{
+	while (p < end) {
+		const char *eol = (const char*)memchr(p, '\n', end - p);
+		if (!eol)
+			eol = end;
+		int count = 0;
+		const char *q = skip_blanks(p, eol);
+		while (q < eol) {
+			while (q < eol && !is_blank(*q))
+				++q;
+			++count;
+			q = skip_blanks(q, eol);
+		}
+		if (count)
+			return count;
+		p = eol + 1;
+	}
+	return 0;
+}
+
+static void
+parse_chunk(Chunk &chunk)
+{
+	const TextFile &file = *chunk.file;
+	const bool has_vort = (file.columns == VORT_COLUMNS);
+	const char *p = file.data + chunk.begin;
+	const char *end = file.data + chunk.end;
+
+	// one particle per line, but for empty lines
+	const size_t lines = count(p, end, '\n') + (end[-1] != '\n');
+	chunk.id.resize(lines);
+	chunk.type.resize(lines);
+	chunk.object.resize(lines);
+	chunk.pos.resize(3*lines);
+	chunk.vel.resize(3*lines);
+	chunk.mass.resize(lines);
+	chunk.density.resize(lines);
+	chunk.pressure.resize(lines);
+	if (has_vort)
+		chunk.vort.resize(3*lines);
+
+	uint32_t ival[3];
+	float fval[VORT_COLUMNS - 3];
+	size_t n = 0;
+	while (p < end) {
+		p = skip_blanks(p, end);
+		// empty line
+		if (p < end && *p == '\n') {
+			++p;
+			continue;
+		}
+		if (p == end)
+			break;
+
+		const char *line = p;
+		for (int c = 0; c < 3 && p; ++c)
+			p = parse_uint(skip_blanks(p, end), end, ival[c]);
+		for (int c = 0; c < file.columns - 3 && p; ++c)
+			p = parse_float(skip_blanks(p, end), end, fval[c]);
+		if (p)
+			p = skip_blanks(p, end);
+		if (!p || (p < end && *p != '\n')) {
+			const char *eol = (const char*)memchr(line, '\n', end - line);
+			chunk.error = "malformed line: " + string(line, eol ? eol : end);
+			return;
+		}
+		if (p < end)
+			++p;
+
+		chunk.id[n] = ival[0];
+		chunk.type[n] = ival[1];
+		chunk.object[n] = ival[2];
+		copy(fval, fval + 3, &chunk.pos[3*n]);
+		copy(fval + 3, fval + 6, &chunk.vel[3*n]);
+		chunk.mass[n] = fval[6];
+		chunk.density[n] = fval[7];
+		chunk.pressure[n] = fval[8];
+		if (has_vort)
+			copy(fval + 9, fval + 12, &chunk.vort[3*n]);
+		++n;
+	}
+
+	chunk.id.resize(n);
+	chunk.type.resize(n);
+	chunk.object.resize(n);
+	chunk.pos.resize(3*n);
+	chunk.vel.resize(3*n);
+	chunk.mass.resize(n);
+	chunk.density.resize(n);
+	chunk.pressure.resize(n);
+	if (has_vort)
+		chunk.vort.resize(3*n);
+}
+
+// the chunks of file (from first to last) are in chunks
+typedef vector<float> Chunk::*FloatArray;
+typedef vector<uint32_t> Chunk::*UIntArray;
+
+template<typename T>
+static void
+write_var(ofstream &out, T const& var)
+{
+	out.write(reinterpret_cast<const char *>(&var), sizeof(T));
+}
+
+// write the given array of all the chunks of a file, preceded by its size
+template<typename T>
+static void
+write_array(ofstream &out, vector<Chunk> const& chunks, size_t first, size_t last,
+	vector<T> Chunk::*array, uint64_t size)
+{
+	write_var(out, size);
+	for (size_t c = first; c < last; ++c) {
+		vector<T> const& values = chunks[c].*array;
+		if (!values.empty())
+			out.write(reinterpret_cast<const char*>(&values[0]), values.size()*sizeof(T));
+	}
+}
+
+static void
+data_array(ofstream &out, const char *type, const char *name, int dim, uint64_t &offset,
+	uint64_t size)
+{
+	out << "	<DataArray type='" << type << "'";
+	if (name)
+		out << " Name='" << name << "'";
+	if (dim > 1)
+		out << " NumberOfComponents='" << dim << "'";
+	out << " format='appended' offset='" << offset << "'/>\n";
+	offset += sizeof(uint64_t) + size;
+}
+
+// write the VTU of a file whose chunks are chunks[first] to chunks[last - 1]
+static void
+write_vtu(TextFile const& file, vector<Chunk> const& chunks, size_t first, size_t last)
+{
+	const uint64_t numParts = file.numParts;
+	const bool has_vort = (file.columns == VORT_COLUMNS);
+
+	ofstream out(file.out.c_str(), ios::binary);
+	if (!out)
+		throw runtime_error("cannot create " + file.out);
+	out.exceptions(ofstream::failbit | ofstream::badbit);
+
+	const uint64_t scalar = numParts*sizeof(float);
+	const uint64_t vector3 = 3*scalar;
+	const uint64_t ids = numParts*sizeof(uint32_t);
+
+	out << "<?xml version='1.0'?>\n";
+	out << "<VTKFile type='UnstructuredGrid' version='1.0' byte_order='"
+		<< endianness[*(char*)&endian_int & 1] << "' header_type='UInt64'>\n";
+	out << " <UnstructuredGrid>\n";
+	out << "  <Piece NumberOfPoints='" << numParts << "' NumberOfCells='" << numParts << "'>\n";
+
+	uint64_t offset = 0;
+	out << "   <PointData Scalars='Pressure' Vectors='Velocity'>\n";
+	data_array(out, "Float32", "Pressure", 1, offset, scalar);
+	data_array(out, "Float32", "Density", 1, offset, scalar);
+	data_array(out, "Float32", "Mass", 1, offset, scalar);
+	data_array(out, "UInt32", "Type", 1, offset, ids);
+	data_array(out, "UInt32", "Object", 1, offset, ids);
+	data_array(out, "UInt32", "ParticleId", 1, offset, ids);
+	data_array(out, "Float32", "Velocity", 3, offset, vector3);
+	if (has_vort)
+		data_array(out, "Float32", "Vorticity", 3, offset, vector3);
+	out << "   </PointData>\n";
+	out << "   <Points>\n";
+	data_array(out, "Float32", NULL, 3, offset, vector3);
+	out << "   </Points>\n";
+	out << "   <Cells>\n";
+	data_array(out, "UInt32", "connectivity", 1, offset, ids);
+	data_array(out, "UInt32", "offsets", 1, offset, ids);
+	data_array(out, "UInt8", "types", 1, offset, numParts);
+	out << "   </Cells>\n";
+	out << "  </Piece>\n";
+	out << " </UnstructuredGrid>\n";
+	out << " <AppendedData encoding='raw'>\n_";
+
+	write_array(out, chunks, first, last, &Chunk::pressure, scalar);
+	write_array(out, chunks, first, last, &Chunk::density, scalar);
+	write_array(out, chunks, first, last, &Chunk::mass, scalar);
+	write_array(out, chunks, first, last, &Chunk::type, ids);
+	write_array(out, chunks, first, last, &Chunk::object, ids);
+	write_array(out, chunks, first, last, &Chunk::id, ids);
+	write_array(out, chunks, first, last, &Chunk::vel, vector3);
+	if (has_vort)
+		write_array(out, chunks, first, last, &Chunk::vort, vector3);
+	write_array(out, chunks, first, last, &Chunk::pos, vector3);
+
+	// one single-vertex cell per particle
+	vector<uint32_t> cells(numParts);
+	write_var(out, ids);
+	for (uint64_t p = 0; p < numParts; ++p)
+		cells[p] = p;
+	if (numParts)
+		out.write(reinterpret_cast<const char*>(&cells[0]), ids);
+	write_var(out, ids);
+	for (uint64_t p = 0; p < numParts; ++p)
+		cells[p] = p + 1;
+	if (numParts)
+		out.write(reinterpret_cast<const char*>(&cells[0]), ids);
+	write_var(out, numParts);
+	const vector<unsigned char> types(numParts, 1);
+	if (numParts)
+		out.write(reinterpret_cast<const char*>(&types[0]), numParts);
+
+	out << " </AppendedData>\n";
+	out << "</VTKFile>\n";
+}
+
+static void *
+parse_thread(void *arg)
+{
+	Jobs *jobs = (Jobs*)arg;
+	vector<Chunk> &chunks = *jobs->chunks;
+	uint c;
+	while ((c = __sync_fetch_and_add(&jobs->next, 1)) < chunks.size())
+		parse_chunk(chunks[c]);
+	return NULL;
+}
+
+static void *
+write_thread(void *arg)
+{
+	Jobs *jobs = (Jobs*)arg;
+	vector<Chunk> &chunks = *jobs->chunks;
+	vector<TextFile*> &files = *jobs->files;
+	uint f;
+	while ((f = __sync_fetch_and_add(&jobs->next, 1)) < files.size()) {
+		TextFile &file = *files[f];
+		if (!file.error.empty())
+			continue;
+		// the chunks of the file are contiguous
+		size_t first = 0;
+		while (first < chunks.size() && chunks[first].file != &file)
+			++first;
+		size_t last = first;
+		while (last < chunks.size() && chunks[last].file == &file)
+			++last;
+		try {
+			write_vtu(file, chunks, first, last);
+		} catch (exception &e) {
+			file.error = e.what();
+		}
+	}
+	return NULL;
+}
+
+// run fn on the jobs with numThreads threads, the calling one included
+static void
+run_parallel(void *(*fn)(void*), Jobs &jobs, uint numThreads)
+{
+	jobs.next = 0;
+	vector<pthread_t> threads(numThreads - 1);
+	uint started = 0;
+	for ( ; started < threads.size(); ++started)
+		if (pthread_create(&threads[started], NULL, fn, &jobs))
+			break;
+	fn(&jobs);
+	for (uint th = 0; th < started; ++th)
+		pthread_join(threads[th], NULL);
+}
+
+static void
+map_file(TextFile &file)
+{
+	file.fd = open(file.name.c_str(), O_RDONLY);
+	if (file.fd < 0)
+		throw runtime_error("cannot open " + file.name + ": " + strerror(errno));
+
+	struct stat st;
+	if (fstat(file.fd, &st))
+		throw runtime_error("cannot stat " + file.name + ": " + strerror(errno));
+	file.size = st.st_size;
+	if (!file.size)
+		return;
+
+	void *data = mmap(NULL, file.size, PROT_READ, MAP_PRIVATE, file.fd, 0);
+	if (data == MAP_FAILED)
+		throw runtime_error("cannot map " + file.name + ": " + strerror(errno));
+	madvise(data, file.size, MADV_SEQUENTIAL);
+	file.data = (const char*)data;
+}
+
+static void
+unmap_file(TextFile &file)
+{
+	if (file.data)
+		munmap((void*)file.data, file.size);
+	if (file.fd >= 0)
+		close(file.fd);
+	file.data = NULL;
+	file.fd = -1;
+}
+
+// split the file in chunks of about CHUNK_SIZE bytes, at line boundaries
+static void
+split_file(TextFile &file, vector<Chunk> &chunks)
+{
+	file.columns = count_columns(file.data, file.data + file.size);
+	if (file.size && file.columns != BASE_COLUMNS && file.columns != VORT_COLUMNS) {
+		stringstream ss;
+		ss << "unexpected number of columns (" << file.columns << ")";
+		throw runtime_error(ss.str());
+	}
+
+	size_t begin = 0;
+	while (begin < file.size) {
+		size_t end = file.size;
+		if (file.size - begin > CHUNK_SIZE) {
+			const char *eol = (const char*)memchr(file.data + begin + CHUNK_SIZE, '\n',
+				file.size - begin - CHUNK_SIZE);
+			if (eol)
+				end = eol - file.data + 1;
+		}
+		chunks.push_back(Chunk());
+		chunks.back().file = &file;
+		chunks.back().begin = begin;
+		chunks.back().end = end;
+		begin = end;
+	}
+}
+
+static bool
+ends_with(string const& str, string const& sfx)
+{
+	return str.size() >= sfx.size() && str.compare(str.size() - sfx.size(), sfx.size(), sfx) == 0;
+}
+
+// the PART_*.txt files in dirname, sorted
+static vector<string>
+list_dir(string const& dirname)
+{
+	vector<string> names;
+	DIR *dir = opendir(dirname.c_str());
+	if (!dir)
+		throw runtime_error("cannot open directory " + dirname);
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		const string name(entry->d_name);
+		if (name.compare(0, 5, "PART_") == 0 && ends_with(name, ".txt"))
+			names.push_back(name);
+	}
+	closedir(dir);
+	sort(names.begin(), names.end());
+	return names;
+}
+
+// write the PART.pvd of the files converted in dirname, with the times in its
+// time.txt (the line of file number N reads N+1, time); returns false if there's
+// no time.txt
+static bool
+write_pvd(string const& dirname, vector<string> const& names)
+{
+	ifstream timefile((dirname + "/time.txt").c_str());
+	if (!timefile)
+		return false;
+
+	map<unsigned int, double> times;
+	unsigned int counter;
+	double t;
+	while (timefile >> counter >> t)
+		if (counter > 0)
+			times[counter - 1] = t;
+
+	const string pvdname = dirname + "/PART.pvd";
+	ofstream pvd(pvdname.c_str());
+	if (!pvd)
+		throw runtime_error("cannot create " + pvdname);
+	pvd << "<?xml version='1.0'?>\n";
+	pvd << "<VTKFile type='Collection' version='0.1'>\n";
+	pvd << " <Collection>\n";
+	for (size_t n = 0; n < names.size(); ++n) {
+		unsigned int num;
+		char tail;
+		// only the single-node PART_<num>.txt
+		if (sscanf(names[n].c_str(), "PART_%u.tx%c", &num, &tail) != 2 || !times.count(num))
+			continue;
+		pvd << "<DataSet timestep='" << times[num] << "' group='' part='0' "
+			<< "file='" << names[n].substr(0, names[n].size() - 4) << ".vtu'/>\n";
+	}
+	pvd << " </Collection>\n";
+	pvd << "</VTKFile>\n";
+	return true;
+}
+
+int
+main(int argc, char *argv[])
+{
+	uint numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+	int arg = 1;
+	if (arg + 1 < argc && !strcmp(argv[arg], "-j")) {
+		numThreads = atoi(argv[arg + 1]);
+		arg += 2;
+	}
+	if (arg >= argc || numThreads < 1) {
+		cerr << "Usage: " << argv[0] << " [-j THREADS] DIR|FILE.txt..." << endl;
+		return 1;
+	}
+
+	// the files to convert, and the directories to write a .pvd for
+	vector<TextFile> files;
+	vector<pair<string, vector<string> > > dirs;
+	for ( ; arg < argc; ++arg) {
+		const string path(argv[arg]);
+		struct stat st;
+		if (stat(path.c_str(), &st)) {
+			cerr << "cannot access " << path << endl;
+			return 1;
+		}
+		vector<string> names;
+		string prefix;
+		if (S_ISDIR(st.st_mode)) {
+			try {
+				names = list_dir(path);
+			} catch (exception &e) {
+				cerr << e.what() << endl;
+				return 1;
+			}
+			prefix = path + "/";
+			dirs.push_back(make_pair(path, names));
+		} else {
+			names.push_back(path);
+		}
+		for (size_t n = 0; n < names.size(); ++n) {
+			TextFile file;
+			file.name = prefix + names[n];
+			file.out = (ends_with(file.name, ".txt") ?
+				file.name.substr(0, file.name.size() - 4) : file.name) + ".vtu";
+			file.fd = -1;
+			file.data = NULL;
+			file.size = 0;
+			file.columns = 0;
+			file.numParts = 0;
+			files.push_back(file);
+		}
+	}
+
+	const double start = now_seconds();
+	uint64_t total = 0;
+	int failed = 0;
+
+	// map a batch of files, parse all their chunks in parallel, then write all
+	// their VTUs in parallel
+	size_t next = 0;
+	while (next < files.size()) {
+		vector<TextFile*> batch;
+		vector<Chunk> chunks;
+		uint64_t batch_size = 0;
+		while (next < files.size() && (batch.empty() || batch_size < BATCH_SIZE)) {
+			TextFile &file = files[next++];
+			batch.push_back(&file);
+			try {
+				map_file(file);
+				split_file(file, chunks);
+				batch_size += file.size;
+			} catch (exception &e) {
+				file.error = e.what();
+			}
+		}
+
+		Jobs jobs;
+		jobs.chunks = &chunks;
+		jobs.files = &batch;
+		run_parallel(parse_thread, jobs, min<size_t>(numThreads, max<size_t>(chunks.size(), 1)));
+
+		for (size_t c = 0; c < chunks.size(); ++c) {
+			TextFile &file = *chunks[c].file;
+			if (!chunks[c].error.empty() && file.error.empty())
+				file.error = chunks[c].error;
+			file.numParts += chunks[c].id.size();
+		}
+
+		run_parallel(write_thread, jobs, min<size_t>(numThreads, batch.size()));
+
+		for (size_t f = 0; f < batch.size(); ++f) {
+			TextFile &file = *batch[f];
+			unmap_file(file);
+			if (!file.error.empty()) {
+				cerr << "\n" << file.name << ": " << file.error << endl;
+				++failed;
+				continue;
+			}
+			total += file.size;
+		}
+		cout << "\r" << next << "/" << files.size() << " files" << flush;
+	}
+
+	for (size_t d = 0; d < dirs.size(); ++d) {
+		try {
+			write_pvd(dirs[d].first, dirs[d].second);
+		} catch (exception &e) {
+			cerr << "\n" << e.what() << endl;
+			++failed;
+		}
+	}
+
+	const double elapsed = now_seconds() - start;
+	const double gb = total*1.0e-9;
+	printf("\nconverted %zu files, %.3f GB in %.3f s (%.2f GB/s)\n",
+		files.size() - failed, gb, elapsed, elapsed > 0 ? gb/elapsed : 0.0);
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,62 @@
+/*  Copyright 2013 Alexis Herault, Giuseppe Bilotta, Robert A. Dalrymple, Eugenio Rustico, Ciro Del Negro
+
+    Istituto Nazionale di Geofisica e Vulcanologia
+        Sezione di Catania, Catania, Italy
+
+    Università di Catania, Catania, Italy
+
+    Johns Hopkins University, Baltimore, MD
+
+    This file is part of GPUSPH.
+
+    GPUSPH is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GPUSPH is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GPUSPH.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ABSTRACTWORKER_H_
+#define ABSTRACTWORKER_H_
+
+#include "common_types.h"
+
+// buffers and buffer lists
+#include "buffer.h"
+
+class CommandProfiler;
+
+// AbstractWorker is the interface GPUSPH uses to drive a worker thread, regardless
+// of the hardware it runs on. Each implementation (GPUWorker, CPUWorker) runs its
+// own simulationThread(), synchronized with the main thread through the
+// threadSynchronizer in GlobalData, and executes the command in gdata->nextCommand.
+class AbstractWorker {
+public:
+	virtual ~AbstractWorker() {}
+
+	// getters of the number of particles
+	virtual uint getNumParticles() = 0;
+	virtual uint getNumInternalParticles() = 0;
+	virtual uint getMaxParticles() = 0;
+
+	// thread management
+	virtual void run_worker() = 0;
+	virtual void join_worker() = 0;
+
+	// utility getters
+	virtual size_t getHostMemory() = 0;
+	virtual size_t getDeviceMemory() = 0;
+	// for peer transfers
+	virtual const AbstractBuffer* getBuffer(flag_t) const = 0;
+	// command times and timeline of the worker thread
+	virtual CommandProfiler* getProfiler() = 0;
+};
+
+#endif /* ABSTRACTWORKER_H_ */
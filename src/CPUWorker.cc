@@ -0,0 +1,2984 @@
+/*  Copyright 2013 Alexis Herault, Giuseppe Bilotta, Robert A. Dalrymple, Eugenio Rustico, Ciro Del Negro
+
+    Istituto Nazionale di Geofisica e Vulcanologia
+        Sezione di Catania, Catania, Italy
+
+    Università di Catania, Catania, Italy
+
+    Johns Hopkins University, Baltimore, MD
+
+    This file is part of GPUSPH.
+
+    GPUSPH is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GPUSPH is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GPUSPH.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// ostringstream
+#include <sstream>
+// FLT_MAX
+#include <float.h>
+// sort, lower_bound
+#include <algorithm>
+// sysconf
+#include <unistd.h>
+// sched_yield
+#include <sched.h>
+
+#include "CPUWorker.h"
+#include "cpubuffer.h"
+#include "RunningStats.h"
+#include "Tracers.h"
+#include "Loads.h"
+
+// symtensor3, symtensor4
+#include "tensor.h"
+
+// round_up
+#include "utils.h"
+
+// kernel_shape, kernel_coeff
+#include "sph_kernels.h"
+
+// UINT_MAX
+#include "limits.h"
+
+// particle types that are moved by calcHash besides the fluid ones
+#define MOVINGNOTFLUID (PISTONPART | PADDLEPART | GATEPART | OBJECTPART | VERTEXPART)
+
+// neighbor list encoding, same as in cellgrid.h (which is device-only)
+#define CELLNUM_SHIFT		11
+#define CELLNUM_ENCODED		(1U<<CELLNUM_SHIFT)
+#define NEIBINDEX_MASK		(CELLNUM_ENCODED-1)
+#define ENCODE_CELL(cell)	((cell + 1) << CELLNUM_SHIFT)
+#define DECODE_CELL(data)	((data >> CELLNUM_SHIFT) - 1)
+
+// minimum number of particles handed to a pool thread at once
+#define MIN_POOL_CHUNK		64
+// number of chunks per thread, for load balancing
+#define POOL_CHUNKS_PER_THREAD	16
+// bits sorted by each pass of the radix sort, and the resulting number of buckets
+#define RADIX_BITS		8
+#define RADIX_BUCKETS	(1 << RADIX_BITS)
+
+// offset of the neighbor cell with number cellnum (0...26)
+static inline int3
+cellToOffset(char cellnum)
+{
+	return make_int3(cellnum % 3 - 1, (cellnum / 3) % 3 - 1, cellnum / 9 - 1);
+}
+
+// host version of the grid position clamping done by calcHash
+static inline int3
+clampGridPos(const int3& gridPos, int3& gridOffset, bool *toofar,
+	Periodicity periodicbound, uint3 const& gridSize)
+{
+	int3 newGridPos = gridPos + gridOffset;
+	const int3 size = make_int3(gridSize.x, gridSize.y, gridSize.z);
+
+	// For the axis involved in periodicity the new grid position reflects
+	// the periodicity and should not be clamped and the grid offset remains
+	// unchanged.
+	// For the axis not involved in periodicity the new grid position
+	// is equal to the clamped old one and the grid offset is updated.
+	if (periodicbound & PERIODIC_X) {
+		if (newGridPos.x < 0) newGridPos.x += size.x;
+		if (newGridPos.x >= size.x) newGridPos.x -= size.x;
+	} else {
+		newGridPos.x = std::min(std::max(0, newGridPos.x), size.x - 1);
+		if (abs(gridOffset.x) > 1 && newGridPos.x == gridPos.x)
+			*toofar = true;
+		gridOffset.x = newGridPos.x - gridPos.x;
+	}
+
+	if (periodicbound & PERIODIC_Y) {
+		if (newGridPos.y < 0) newGridPos.y += size.y;
+		if (newGridPos.y >= size.y) newGridPos.y -= size.y;
+	} else {
+		newGridPos.y = std::min(std::max(0, newGridPos.y), size.y - 1);
+		if (abs(gridOffset.y) > 1 && newGridPos.y == gridPos.y)
+			*toofar = true;
+		gridOffset.y = newGridPos.y - gridPos.y;
+	}
+
+	if (periodicbound & PERIODIC_Z) {
+		if (newGridPos.z < 0) newGridPos.z += size.z;
+		if (newGridPos.z >= size.z) newGridPos.z -= size.z;
+	} else {
+		newGridPos.z = std::min(std::max(0, newGridPos.z), size.z - 1);
+		if (abs(gridOffset.z) > 1 && newGridPos.z == gridPos.z)
+			*toofar = true;
+		gridOffset.z = newGridPos.z - gridPos.z;
+	}
+
+	return newGridPos;
+}
+
+// determinant of a 4x4 symmetric tensor (host version of the one in tensor.cu)
+static inline float
+det(symtensor4 const& T)
+{
+	float ret = 0;
+
+	// first minor: ww * (xyz × xyz)
+	float M = 0;
+	M += T.xx*(T.yy*T.zz - T.yz*T.yz);
+	M -= T.xy*(T.xy*T.zz - T.xz*T.yz);
+	M += T.xz*(T.xy*T.yz - T.xz*T.yy);
+	ret += M*T.ww;
+
+	// second minor: -zw * (xyz × xyw)
+	M = 0;
+	M += T.xx*(T.yy*T.zw - T.yz*T.yw);
+	M -= T.xy*(T.xy*T.zw - T.xz*T.yw);
+	M += T.xw*(T.xy*T.yz - T.xz*T.yy);
+	ret -= M*T.zw;
+
+	// third minor: yw * (xyz × xzw)
+	M = 0;
+	M += T.xx*(T.yz*T.zw - T.zz*T.yw);
+	M -= T.xz*(T.xy*T.zw - T.xz*T.yw);
+	M += T.xw*(T.xy*T.zz - T.xz*T.yz);
+	ret += M*T.yw;
+
+	// last minor: xw * (xyz × yzw)
+	M = 0;
+	M += T.xy*(T.yz*T.zw - T.zz*T.yw);
+	M -= T.xz*(T.yy*T.zw - T.yz*T.yw);
+	M += T.xw*(T.yy*T.zz - T.yz*T.yz);
+	ret -= M*T.xw;
+
+	return ret;
+}
+
+// L-infinity norm of a symmetric 4x4 tensor (host version of the one in tensor.cu)
+static inline float
+norm_inf(symtensor4 const& T)
+{
+	float m = fmaxf(T.xx, T.xy);
+	m = fmaxf(m, T.xz);
+	m = fmaxf(m, T.xw);
+	m = fmaxf(m, T.yy);
+	m = fmaxf(m, T.yz);
+	m = fmaxf(m, T.yw);
+	m = fmaxf(m, T.zz);
+	m = fmaxf(m, T.zw);
+	m = fmaxf(m, T.ww);
+	return m;
+}
+
+CPUWorker::CPUWorker(GlobalData* _gdata, unsigned int _deviceIndex) {
+	gdata = _gdata;
+	m_deviceIndex = _deviceIndex;
+
+	// we know that CPUWorker is initialized when Problem was already
+	m_simparams = gdata->problem->get_simparams();
+	m_physparams = gdata->problem->get_physparams();
+
+	// we also know Problem::fillparts() has already been called
+	m_numInternalParticles = m_numParticles = gdata->s_hPartsPerDevice[m_deviceIndex];
+
+	m_particleRangeBegin = 0;
+	m_particleRangeEnd = m_numInternalParticles;
+
+	m_commandFlags = NO_FLAGS;
+	m_onlyInternal = false;
+	m_profiler.enable(gdata->clOptions->profile, !gdata->clOptions->trace_file.empty());
+
+	// host memory is not as scarce as device memory: being the only worker,
+	// we simply allocate room for all the particles
+	m_numAllocatedParticles = gdata->totParticles;
+	m_nGridCells = gdata->nGridCells;
+
+	m_hostMemory = 0;
+
+	m_cellStart = m_cellEnd = NULL;
+	m_sortKeys = NULL;
+	m_sortIndex = NULL;
+	m_sortHistograms = NULL;
+	m_sortBlocks = m_sortBlockSize = m_sortNumItems = m_sortShift = 0;
+	m_sortSrcKeys = m_sortDstKeys = NULL;
+	m_sortSrcIndex = m_sortDstIndex = NULL;
+
+	m_statsCount = m_probeCount = NULL;
+	m_stats = m_probeStats = NULL;
+
+	m_tracerIndex = NULL;
+	m_tracerPos = m_tracerVel = NULL;
+	m_tracerHash = NULL;
+
+	m_loads = NULL;
+
+	m_numBodiesParticles = 0;
+	m_rbForces = m_rbTorques = NULL;
+
+	m_numPlanes = 0;
+
+	m_numThreads = gdata->clOptions->num_threads;
+	if (m_numThreads == 0)
+		m_numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (m_numThreads == 0)
+		m_numThreads = 1;
+	m_poolThreads = NULL;
+	m_poolThreadArgs = NULL;
+	m_poolSynchronizer = NULL;
+	m_poolKeepGoing = false;
+	m_poolJob = NULL;
+	m_poolNumItems = m_poolChunkSize = m_poolNextItem = 0;
+	m_threadCfl = m_threadMaxDisp = NULL;
+	m_threadMaxNeibs = m_threadNumInteractions = NULL;
+	m_poolNextTask = m_poolDoneTasks = 0;
+	pthread_mutex_init(&m_profilerMutex, NULL);
+
+	m_buffers << new CPUBuffer<BUFFER_POS>();
+	m_buffers << new CPUBuffer<BUFFER_VEL>();
+	m_buffers << new CPUBuffer<BUFFER_INFO>();
+	m_buffers << new CPUBuffer<BUFFER_FORCES>();
+
+	m_buffers << new CPUBuffer<BUFFER_HASH>();
+	m_buffers << new CPUBuffer<BUFFER_PARTINDEX>();
+	// the tracers are moved with the inverse particle index after each sort
+	if (gdata->tracers)
+		m_buffers << new CPUBuffer<BUFFER_INVINDEX>();
+	m_buffers << new CPUBuffer<BUFFER_NEIBSLIST>(-1); // neib list is initialized to all bits set
+
+	if (m_simparams->xsph)
+		m_buffers << new CPUBuffer<BUFFER_XSPH>();
+
+	if (m_simparams->visctype == SPSVISC)
+		m_buffers << new CPUBuffer<BUFFER_TAU>();
+
+	if (m_simparams->savenormals)
+		m_buffers << new CPUBuffer<BUFFER_NORMALS>();
+	if (m_simparams->vorticity)
+		m_buffers << new CPUBuffer<BUFFER_VORTICITY>();
+
+	// no CFL buffers: the maximum is reduced per pool thread, see forcesRange()
+
+	if (m_simparams->calcPrivate)
+		m_buffers << new CPUBuffer<BUFFER_PRIVATE>();
+}
+
+CPUWorker::~CPUWorker() {
+	// Free everything and pthread terminate
+	// should check whether the pthread is still running and force its termination?
+	pthread_mutex_destroy(&m_profilerMutex);
+}
+
+// Return the number of particles currently being handled (internal and r.o.)
+uint CPUWorker::getNumParticles()
+{
+	return m_numParticles;
+}
+
+uint CPUWorker::getNumInternalParticles() {
+	return m_numInternalParticles;
+}
+
+// Return the maximum number of particles the worker can handle
+uint CPUWorker::getMaxParticles()
+{
+	return m_numAllocatedParticles;
+}
+
+void CPUWorker::dropExternalParticles()
+{
+	m_particleRangeEnd =  m_numParticles = m_numInternalParticles;
+	if (gdata->s_dSegmentsStart) {
+		gdata->s_dSegmentsStart[m_deviceIndex][CELLTYPE_OUTER_EDGE_CELL] = EMPTY_SEGMENT;
+		gdata->s_dSegmentsStart[m_deviceIndex][CELLTYPE_OUTER_CELL] = EMPTY_SEGMENT;
+	}
+}
+
+// A single worker holds all the particles, so there are no external cells to import
+void CPUWorker::importExternalCells()
+{
+}
+
+// Allocate the working arrays. Since they live in host memory, there is no
+// separate host/device allocation as in the GPUWorker
+size_t CPUWorker::allocateHostBuffers() {
+	// common sizes
+	const size_t uintCellsSize = sizeof(uint) * m_nGridCells;
+
+	size_t allocated = 0;
+
+	BufferList::iterator iter = m_buffers.begin();
+	while (iter != m_buffers.end()) {
+		// number of elements to allocate
+		// most have m_numAllocatedParticles. Exceptions follow
+		size_t nels = m_numAllocatedParticles;
+
+		if (iter->first & BUFFER_NEIBSLIST)
+			nels *= m_simparams->maxneibsnum; // number of particles times max neibs num
+
+		allocated += iter->second->alloc(nels);
+		++iter;
+	}
+
+	m_cellStart = new uint[m_nGridCells];
+	m_cellEnd = new uint[m_nGridCells];
+	memset(m_cellStart, UINT_MAX, uintCellsSize);
+	memset(m_cellEnd, 0, uintCellsSize);
+	allocated += 2 * uintCellsSize;
+
+	m_sortKeys = new hashKey[m_numAllocatedParticles];
+	m_sortIndex = new uint[m_numAllocatedParticles];
+	allocated += m_numAllocatedParticles * (sizeof(hashKey) + sizeof(uint));
+	// the sort never uses more blocks than the pool has chunks
+	m_sortHistograms = new uint[m_numThreads*POOL_CHUNKS_PER_THREAD*RADIX_BUCKETS];
+	allocated += m_numThreads*POOL_CHUNKS_PER_THREAD*RADIX_BUCKETS*sizeof(uint);
+
+	if (gdata->runningStats) {
+		const RunningStats *stats = gdata->runningStats;
+		const size_t numStats = (size_t)m_nGridCells*stats->numFields();
+
+		m_statsCount = new uint[m_nGridCells];
+		m_stats = new float4[numStats];
+		memset(m_statsCount, 0, uintCellsSize);
+		memset(m_stats, 0, numStats*sizeof(float4));
+		allocated += uintCellsSize + numStats*sizeof(float4);
+
+		const uint numProbes = stats->numProbes();
+		if (numProbes) {
+			const size_t numProbeStats = (size_t)numProbes*stats->numFields();
+
+			m_probeCount = new uint[numProbes];
+			m_probeStats = new float4[numProbeStats];
+			memset(m_probeCount, 0, numProbes*sizeof(uint));
+			memset(m_probeStats, 0, numProbeStats*sizeof(float4));
+			allocated += numProbes*sizeof(uint) + numProbeStats*sizeof(float4);
+		}
+	}
+
+	if (gdata->tracers) {
+		const uint numTracers = gdata->tracers->numTracers();
+
+		// no tracer is known to be on the worker until they are located
+		m_tracerIndex = new uint[numTracers];
+		std::fill(m_tracerIndex, m_tracerIndex + numTracers, UINT_MAX);
+		m_tracerPos = new float4[numTracers];
+		m_tracerHash = new hashKey[numTracers];
+		m_tracerVel = new float4[numTracers];
+		allocated += numTracers*(sizeof(uint) + 2*sizeof(float4) + sizeof(hashKey));
+	}
+
+	if (gdata->loads) {
+		const uint numSlots = gdata->loads->numSlots();
+		// the slots of the particles the worker doesn't hold stay empty
+		m_loads = new float4[numSlots];
+		std::fill(m_loads, m_loads + numSlots, make_float4(0.0f));
+		allocated += numSlots*sizeof(float4);
+	}
+
+	if (m_simparams->numODEbodies) {
+		m_numBodiesParticles = gdata->problem->get_ODE_bodies_numparts();
+		printf("number of rigid bodies particles = %d\n", m_numBodiesParticles);
+
+		const size_t objParticlesFloat4Size = m_numBodiesParticles*sizeof(float4);
+
+		m_rbForces = new float4[m_numBodiesParticles];
+		m_rbTorques = new float4[m_numBodiesParticles];
+		memset(m_rbForces, 0, objParticlesFloat4Size);
+		memset(m_rbTorques, 0, objParticlesFloat4Size);
+		allocated += 2 * objParticlesFloat4Size;
+
+		m_rbFirstIndex[0] = 0;
+		for (uint i = 1; i < m_simparams->numODEbodies; i++) {
+			m_rbFirstIndex[i] = m_rbFirstIndex[i - 1] + gdata->problem->get_ODE_body_numparts(i - 1);
+		}
+
+		int offset = 0;
+		for (uint i = 0; i < m_simparams->numODEbodies; i++) {
+			gdata->s_hRbLastIndex[i] = gdata->problem->get_ODE_body_numparts(i) - 1 + offset;
+			offset += gdata->problem->get_ODE_body_numparts(i);
+		}
+	}
+
+	m_hostMemory += allocated;
+	return allocated;
+}
+
+void CPUWorker::deallocateHostBuffers() {
+	m_buffers.clear();
+
+	delete [] m_cellStart;
+	delete [] m_cellEnd;
+	delete [] m_sortKeys;
+	delete [] m_sortIndex;
+	delete [] m_sortHistograms;
+
+	delete [] m_statsCount;
+	delete [] m_stats;
+	delete [] m_probeCount;
+	delete [] m_probeStats;
+
+	delete [] m_tracerIndex;
+	delete [] m_tracerPos;
+	delete [] m_tracerHash;
+	delete [] m_tracerVel;
+
+	delete [] m_loads;
+
+	if (m_simparams->numODEbodies) {
+		delete [] m_rbForces;
+		delete [] m_rbTorques;
+	}
+}
+
+void CPUWorker::printAllocatedMemory()
+{
+	printf("Device idx %u (CPU, %u threads) allocated %s on host\n"
+			"  assigned particles: %s; allocated: %s\n", m_deviceIndex, m_numThreads,
+			gdata->memString(getHostMemory()).c_str(),
+			gdata->addSeparators(m_numParticles).c_str(), gdata->addSeparators(m_numAllocatedParticles).c_str());
+}
+
+// upload subdomain, just allocated and sorted by main thread
+void CPUWorker::uploadSubdomain() {
+	// indices
+	const uint firstInnerParticle	= gdata->s_hStartPerDevice[m_deviceIndex];
+	const uint howManyParticles	= gdata->s_hPartsPerDevice[m_deviceIndex];
+
+	// is the device empty? (unlikely but possible before LB kicks in)
+	if (howManyParticles == 0) return;
+
+	// buffers to skip in the upload, see GPUWorker::uploadSubdomain()
+	static const flag_t skip_bufs = BUFFER_POS_GLOBAL |
+		BUFFER_NORMALS | BUFFER_VORTICITY;
+
+	// iterate over each array in the _host_ buffer list, and copy data
+	// if it is not in the skip list
+	BufferList::iterator onhost = gdata->s_hBuffers.begin();
+	const BufferList::iterator stop = gdata->s_hBuffers.end();
+	for ( ; onhost != stop ; ++onhost) {
+		flag_t buf_to_up = onhost->first;
+		if (buf_to_up & skip_bufs)
+			continue;
+
+		AbstractBuffer *buf = m_buffers[buf_to_up];
+		size_t _size = howManyParticles * buf->get_element_size();
+
+		printf("Thread %d uploading %d %s items (%s) on device %d from position %d\n",
+				m_deviceIndex, howManyParticles, buf->get_buffer_name(),
+				gdata->memString(_size).c_str(), m_deviceIndex, firstInnerParticle);
+
+		void *dstptr = buf->get_buffer(gdata->currentRead[buf_to_up]);
+		const void *srcptr = onhost->second->get_offset_buffer(0, firstInnerParticle);
+		memcpy(dstptr, srcptr, _size);
+	}
+}
+
+// Copy the subset of the specified buffer to the correspondent shared host array.
+// For double buffered arrays, uses the READ buffers unless otherwise specified. Can be
+// used for either the read or the write buffers, not both.
+void CPUWorker::dumpBuffers() {
+	// indices
+	uint firstInnerParticle	= gdata->s_hStartPerDevice[m_deviceIndex];
+	uint howManyParticles	= gdata->s_hPartsPerDevice[m_deviceIndex];
+
+	gdata->s_hDumpPartsPerDevice[m_deviceIndex] = 0;
+
+	// is the device empty? (unlikely but possible before LB kicks in)
+	if (howManyParticles == 0) return;
+
+	// particles to copy: all of them, or those of the dumpCellRuns
+	ParticleRanges ranges;
+	if (gdata->dumpCellRuns.empty()) {
+		ranges.push_back(make_pair(0U, howManyParticles));
+	} else {
+		CellRuns::const_iterator run = gdata->dumpCellRuns.begin();
+		for ( ; run != gdata->dumpCellRuns.end(); ++run)
+			append_particle_ranges(m_cellStart + run->first, m_cellEnd + run->first,
+				run->second - run->first, howManyParticles, ranges);
+	}
+
+	uint dumped = 0;
+	ParticleRanges::const_iterator range = ranges.begin();
+	for ( ; range != ranges.end(); ++range)
+		dumped += range->second - range->first;
+	gdata->s_hDumpPartsPerDevice[m_deviceIndex] = dumped;
+
+	const flag_t flags = commandFlags();
+
+	// iterate over each array in the _host_ buffer list, and copy data
+	// if it was requested
+	BufferList::iterator onhost = gdata->s_hBuffers.begin();
+	const BufferList::iterator stop = gdata->s_hBuffers.end();
+	for ( ; onhost != stop ; ++onhost) {
+		flag_t buf_to_get = onhost->first;
+		if (!(buf_to_get & flags))
+			continue;
+
+		const AbstractBuffer *buf = m_buffers[buf_to_get];
+		const size_t elsize = buf->get_element_size();
+
+		uint which_buffer = 0;
+		if (flags & DBLBUFFER_READ) which_buffer = gdata->currentRead[buf_to_get];
+		if (flags & DBLBUFFER_WRITE) which_buffer = gdata->currentWrite[buf_to_get];
+
+		// the ranges are stored one after the other
+		uint offset = firstInnerParticle;
+		for (range = ranges.begin(); range != ranges.end(); ++range) {
+			const uint count = range->second - range->first;
+			const void *srcptr = buf->get_offset_buffer(which_buffer, range->first);
+			void *dstptr = onhost->second->get_offset_buffer(0, offset);
+			memcpy(dstptr, srcptr, count*elsize);
+			offset += count;
+		}
+	}
+}
+
+// Sets all cells as empty. Used before reorder
+void CPUWorker::setCellsAsEmpty()
+{
+	memset(m_cellStart, UINT_MAX, gdata->nGridCells * sizeof(uint));
+}
+
+void CPUWorker::downloadCellsIndices()
+{
+	size_t _size = gdata->nGridCells * sizeof(uint);
+	memcpy(gdata->s_dCellStarts[m_deviceIndex], m_cellStart, _size);
+	memcpy(gdata->s_dCellEnds[m_deviceIndex], m_cellEnd, _size);
+}
+
+// update the number of internal particles. Since a single worker owns
+// all the cells, all of its particles are internal
+void CPUWorker::updateSegments()
+{
+	if (m_numParticles == 0)
+		resetSegments();
+	else
+		m_particleRangeEnd = m_numInternalParticles = m_numParticles;
+}
+
+// set all segments as empty
+void CPUWorker::resetSegments()
+{
+	if (!gdata->s_dSegmentsStart)
+		return;
+	for (uint s = 0; s < 4; s++)
+		gdata->s_dSegmentsStart[m_deviceIndex][s] = EMPTY_SEGMENT;
+}
+
+// copy mbData for moving boundaries (possibily called many times)
+void CPUWorker::uploadMBData()
+{
+	// check if MB are active and if gdata->s_mbData is not NULL
+	if (m_simparams->mbcallback && gdata->s_mbData)
+		memcpy(m_mbData, gdata->s_mbData, std::min((size_t)gdata->mbDataSize, sizeof(m_mbData)));
+}
+
+// copy gravity (possibily called many times)
+void CPUWorker::uploadGravity()
+{
+	// check if variable gravity is enabled
+	if (m_simparams->gcallback)
+		m_gravity = gdata->s_varGravity;
+}
+
+// copy planes (called once until planes arae constant)
+void CPUWorker::uploadPlanes()
+{
+	m_numPlanes = std::min(gdata->numPlanes, (uint)MAXPLANES);
+	if (m_numPlanes > 0) {
+		memcpy(m_planes, gdata->s_hPlanes, m_numPlanes*sizeof(float4));
+		memcpy(m_planesDiv, gdata->s_hPlanesDiv, m_numPlanes*sizeof(float));
+	}
+}
+
+void CPUWorker::run_worker() {
+	// wrapper for pthread_create()
+	// NOTE: the dynamic instance of the CPUWorker is passed as parameter
+	pthread_create(&pthread_id, NULL, simulationThread, (void*)this);
+}
+
+// Join the simulation thread (in pthreads' terminology)
+// WARNING: blocks the caller until the thread reaches pthread_exit. Be sure to call it after all barriers
+// have been reached or may result in deadlock!
+void CPUWorker::join_worker() {
+	pthread_join(pthread_id, NULL);
+}
+
+GlobalData* CPUWorker::getGlobalData() {
+	return gdata;
+}
+
+unsigned int CPUWorker::getDeviceIndex()
+{
+	return m_deviceIndex;
+}
+
+size_t CPUWorker::getHostMemory() {
+	return m_hostMemory;
+}
+
+// there is no device memory: all the working arrays are accounted as host memory
+size_t CPUWorker::getDeviceMemory() {
+	return 0;
+}
+
+const AbstractBuffer* CPUWorker::getBuffer(flag_t key) const
+{
+	return m_buffers[key];
+}
+
+CommandProfiler* CPUWorker::getProfiler()
+{
+	return &m_profiler;
+}
+
+// step of the current level run by the calling pool thread (-1: none, see
+// runLevelTasks()), and the index of the calling thread in the pool
+static __thread int s_poolTask = -1;
+static __thread uint s_poolThread = 0;
+
+// Thread pool. The worker thread itself is pool thread 0, so only
+// m_numThreads - 1 helper threads are actually created. Both the start and
+// the end of each job are marked by a barrier on m_poolSynchronizer.
+void CPUWorker::startThreadPool()
+{
+	m_threadCfl = new float[m_numThreads];
+	m_threadMaxDisp = new float[m_numThreads];
+	m_threadMaxNeibs = new uint[m_numThreads];
+	m_threadNumInteractions = new uint[m_numThreads];
+
+	m_poolSynchronizer = new Synchronizer(m_numThreads);
+	m_poolKeepGoing = true;
+
+	m_poolThreads = new pthread_t[m_numThreads];
+	m_poolThreadArgs = new PoolThreadArgs[m_numThreads];
+	for (uint t = 1; t < m_numThreads; t++) {
+		m_poolThreadArgs[t].worker = this;
+		m_poolThreadArgs[t].thread = t;
+		pthread_create(&m_poolThreads[t], NULL, poolThread, (void*)&m_poolThreadArgs[t]);
+	}
+
+	printf("Thread %d started a pool of %u CPU threads\n", m_deviceIndex, m_numThreads);
+}
+
+void CPUWorker::stopThreadPool()
+{
+	// wake up the helpers with no job: they will see m_poolKeepGoing and exit
+	m_poolKeepGoing = false;
+	m_poolSynchronizer->barrier();
+
+	for (uint t = 1; t < m_numThreads; t++)
+		pthread_join(m_poolThreads[t], NULL);
+
+	char poolName[32];
+	snprintf(poolName, sizeof(poolName), "Device %d pool", m_deviceIndex);
+	m_poolSynchronizer->printWaitStats(poolName);
+
+	delete [] m_poolThreads;
+	delete [] m_poolThreadArgs;
+	delete m_poolSynchronizer;
+
+	delete [] m_threadCfl;
+	delete [] m_threadMaxDisp;
+	delete [] m_threadMaxNeibs;
+	delete [] m_threadNumInteractions;
+}
+
+void* CPUWorker::poolThread(void *ptr)
+{
+	PoolThreadArgs *args = (PoolThreadArgs*) ptr;
+	CPUWorker *instance = args->worker;
+
+	while (true) {
+		instance->m_poolSynchronizer->barrier(); // job start
+		if (!instance->m_poolKeepGoing)
+			break;
+		instance->runPoolJob(args->thread);
+		instance->m_poolSynchronizer->barrier(); // job end
+	}
+
+	return NULL;
+}
+
+void CPUWorker::parallel_for(RangeJob job, uint numItems, uint chunkSize)
+{
+	if (numItems == 0) return;
+
+	// the pool is busy with the steps of a level
+	if (s_poolTask >= 0) {
+		runTaskJob(job, numItems, chunkSize);
+		return;
+	}
+
+	m_poolJob = job;
+	m_poolNumItems = numItems;
+	m_poolNextItem = 0;
+	m_poolChunkSize = chunkSize ? chunkSize :
+		std::max(numItems/(m_numThreads*POOL_CHUNKS_PER_THREAD), (uint)MIN_POOL_CHUNK);
+
+	// single-threaded pools skip the barriers altogether
+	if (m_numThreads == 1) {
+		runPoolJob(0);
+		return;
+	}
+
+	m_poolSynchronizer->barrier(); // job start
+	runPoolJob(0);
+	m_poolSynchronizer->barrier(); // job end
+}
+
+// chunks are grabbed dynamically, since the cost per particle depends
+// on the particle type and on the number of neighbors
+void CPUWorker::runPoolJob(uint thread)
+{
+	while (true) {
+		const uint from = __sync_fetch_and_add(&m_poolNextItem, m_poolChunkSize);
+		if (from >= m_poolNumItems)
+			break;
+		const uint to = std::min(from + m_poolChunkSize, m_poolNumItems);
+		(this->*m_poolJob)(from, to, thread);
+	}
+}
+
+void* CPUWorker::simulationThread(void *ptr) {
+	// INITIALIZATION PHASE
+
+	// take the pointer of the instance starting this thread
+	CPUWorker* instance = (CPUWorker*) ptr;
+
+	// retrieve GlobalData and device number (index in process array)
+	const GlobalData* gdata = instance->getGlobalData();
+
+	instance->startThreadPool();
+
+	// copy constants (PhysParames, some SimParams)
+	instance->uploadConstants();
+
+	// copy planes, if any
+	instance->uploadPlanes();
+
+	// copy centers of gravity of the bodies
+	instance->uploadBodiesCentersOfGravity();
+
+	// allocate working arrays
+	instance->allocateHostBuffers();
+	instance->printAllocatedMemory();
+
+	gdata->threadSynchronizer->barrier(); // end of INITIALIZATION ***
+
+	// here GPUSPH::initialize is over and GPUSPH::runSimulation() is called
+
+	gdata->threadSynchronizer->barrier(); // begins UPLOAD ***
+
+	instance->uploadSubdomain();
+
+	gdata->threadSynchronizer->barrier();  // end of UPLOAD, begins SIMULATION ***
+
+	while (gdata->keep_going) {
+		instance->runCommand(gdata->nextCommand, gdata->commandFlags, gdata->only_internal);
+		if (gdata->keep_going) {
+			const bool tracing = instance->m_profiler.tracing();
+			const unsigned long long wait_start = tracing ? CommandProfiler::now() : 0;
+			// the first barrier waits for the main thread to set the next command; the second is to unlock
+			gdata->threadSynchronizer->barrier();  // CYCLE BARRIER 1
+			gdata->threadSynchronizer->barrier();  // CYCLE BARRIER 2
+			// recorded after both barriers: between the two the main thread may be reading the profiler
+			if (tracing)
+				instance->m_profiler.recordEvent("barrier", wait_start, CommandProfiler::now());
+		}
+	}
+
+	gdata->threadSynchronizer->barrier();  // end of SIMULATION, begins FINALIZATION ***
+
+	// deallocate buffers
+	instance->deallocateHostBuffers();
+
+	instance->stopThreadPool();
+
+	gdata->threadSynchronizer->barrier();  // end of FINALIZATION ***
+
+	pthread_exit(NULL);
+}
+
+// Run a single command, with the given parameters
+void CPUWorker::runCommand(CommandType cmd, flag_t flags, bool only_internal)
+{
+	const bool dbg_step_printf = false;
+
+	// the parameters of the steps run as tasks are in m_poolTasks
+	if (s_poolTask < 0) {
+		m_commandFlags = flags;
+		m_onlyInternal = only_internal;
+	}
+
+	const unsigned long long start = m_profiler.timing() ? CommandProfiler::now() : 0;
+
+	switch (cmd) {
+		// logging here?
+		case IDLE:
+			break;
+		case CALCHASH:
+			if (dbg_step_printf) printf(" T %d issuing HASH\n", m_deviceIndex);
+			kernel_calcHash();
+			break;
+		case SORT:
+			if (dbg_step_printf) printf(" T %d issuing SORT\n", m_deviceIndex);
+			kernel_sort();
+			break;
+		case INVINDEX:
+			if (dbg_step_printf) printf(" T %d issuing INVINDEX\n", m_deviceIndex);
+			kernel_inverseParticleIndex();
+			break;
+		case CROP:
+			if (dbg_step_printf) printf(" T %d issuing CROP\n", m_deviceIndex);
+			dropExternalParticles();
+			break;
+		case REORDER:
+			if (dbg_step_printf) printf(" T %d issuing REORDER\n", m_deviceIndex);
+			kernel_reorderDataAndFindCellStart();
+			break;
+		case BUILDNEIBS:
+			if (dbg_step_printf) printf(" T %d issuing BUILDNEIBS\n", m_deviceIndex);
+			kernel_buildNeibsList();
+			break;
+		case FORCES_SYNC:
+			if (dbg_step_printf) printf(" T %d issuing FORCES_SYNC\n", m_deviceIndex);
+			kernel_forces();
+			break;
+		case FORCES_ENQUEUE:
+			if (dbg_step_printf) printf(" T %d issuing FORCES_ENQUEUE\n", m_deviceIndex);
+			kernel_forces_async_enqueue();
+			break;
+		case FORCES_COMPLETE:
+			if (dbg_step_printf) printf(" T %d issuing FORCES_COMPLETE\n", m_deviceIndex);
+			kernel_forces_async_complete();
+			break;
+		case EULER:
+			if (dbg_step_printf) printf(" T %d issuing EULER\n", m_deviceIndex);
+			kernel_euler();
+			break;
+		case DUMP:
+			if (dbg_step_printf) printf(" T %d issuing DUMP\n", m_deviceIndex);
+			dumpBuffers();
+			break;
+		case DUMP_CELLS:
+			if (dbg_step_printf) printf(" T %d issuing DUMP_CELLS\n", m_deviceIndex);
+			downloadCellsIndices();
+			break;
+		case UPDATE_SEGMENTS:
+			if (dbg_step_printf) printf(" T %d issuing UPDATE_SEGMENTS\n", m_deviceIndex);
+			updateSegments();
+			break;
+		case APPEND_EXTERNAL:
+			if (dbg_step_printf) printf(" T %d issuing APPEND_EXTERNAL\n", m_deviceIndex);
+			importExternalCells();
+			break;
+		case UPDATE_EXTERNAL:
+			if (dbg_step_printf) printf(" T %d issuing UPDATE_EXTERNAL\n", m_deviceIndex);
+			importExternalCells();
+			break;
+		case MLS:
+			if (dbg_step_printf) printf(" T %d issuing MLS\n", m_deviceIndex);
+			kernel_mls();
+			break;
+		case SHEPARD:
+			if (dbg_step_printf) printf(" T %d issuing SHEPARD\n", m_deviceIndex);
+			kernel_shepard();
+			break;
+		case VORTICITY:
+			if (dbg_step_printf) printf(" T %d issuing VORTICITY\n", m_deviceIndex);
+			kernel_vorticity();
+			break;
+		case SURFACE_PARTICLES:
+			if (dbg_step_printf) printf(" T %d issuing SURFACE_PARTICLES\n", m_deviceIndex);
+			kernel_surfaceParticles();
+			break;
+		case SA_CALC_BOUND_CONDITIONS:
+			if (dbg_step_printf) printf(" T %d issuing SA_CALC_BOUND_CONDITIONS\n", m_deviceIndex);
+			kernel_unsupported("SA_CALC_BOUND_CONDITIONS");
+			break;
+		case SA_UPDATE_BOUND_VALUES:
+			if (dbg_step_printf) printf(" T %d issuing SA_UPDATE_BOUND_VALUES\n", m_deviceIndex);
+			kernel_unsupported("SA_UPDATE_BOUND_VALUES");
+			break;
+		case SPS:
+			if (dbg_step_printf) printf(" T %d issuing SPS\n", m_deviceIndex);
+			kernel_sps();
+			break;
+		case REDUCE_BODIES_FORCES:
+			if (dbg_step_printf) printf(" T %d issuing REDUCE_BODIES_FORCES\n", m_deviceIndex);
+			kernel_reduceRBForces();
+			break;
+		case UPLOAD_MBDATA:
+			if (dbg_step_printf) printf(" T %d issuing UPLOAD_MBDATA\n", m_deviceIndex);
+			uploadMBData();
+			break;
+		case UPLOAD_GRAVITY:
+			if (dbg_step_printf) printf(" T %d issuing UPLOAD_GRAVITY\n", m_deviceIndex);
+			uploadGravity();
+			break;
+		case UPLOAD_PLANES:
+			if (dbg_step_printf) printf(" T %d issuing UPLOAD_PLANES\n", m_deviceIndex);
+			uploadPlanes();
+			break;
+		case UPLOAD_OBJECTS_CG:
+			if (dbg_step_printf) printf(" T %d issuing UPLOAD_OBJECTS_CG\n", m_deviceIndex);
+			uploadBodiesCentersOfGravity();
+			break;
+		case UPLOAD_OBJECTS_MATRICES:
+			if (dbg_step_printf) printf(" T %d issuing UPLOAD_OBJECTS_MATRICES\n", m_deviceIndex);
+			uploadBodiesTransRotMatrices();
+			break;
+		case CALC_PRIVATE:
+			if (dbg_step_printf) printf(" T %d issuing CALC_PRIVATE\n", m_deviceIndex);
+			kernel_calcPrivate();
+			break;
+		case COMPUTE_TESTPOINTS:
+			if (dbg_step_printf) printf(" T %d issuing COMPUTE_TESTPOINTS\n", m_deviceIndex);
+			kernel_testpoints();
+			break;
+		case ACCUMULATE_STATS:
+			if (dbg_step_printf) printf(" T %d issuing ACCUMULATE_STATS\n", m_deviceIndex);
+			kernel_accumulateStats();
+			break;
+		case DUMP_STATS:
+			if (dbg_step_printf) printf(" T %d issuing DUMP_STATS\n", m_deviceIndex);
+			downloadStats();
+			break;
+		case TRACK_TRACERS:
+			if (dbg_step_printf) printf(" T %d issuing TRACK_TRACERS\n", m_deviceIndex);
+			kernel_trackTracers();
+			break;
+		case LOCATE_TRACERS:
+			if (dbg_step_printf) printf(" T %d issuing LOCATE_TRACERS\n", m_deviceIndex);
+			kernel_locateTracers();
+			break;
+		case GATHER_TRACERS:
+			if (dbg_step_printf) printf(" T %d issuing GATHER_TRACERS\n", m_deviceIndex);
+			downloadTracers();
+			break;
+		case REDUCE_LOADS:
+			if (dbg_step_printf) printf(" T %d issuing REDUCE_LOADS\n", m_deviceIndex);
+			kernel_reduceLoads();
+			break;
+		case RUN_SEQUENCE:
+			if (dbg_step_printf) printf(" T %d issuing RUN_SEQUENCE\n", m_deviceIndex);
+			runCommandSequence();
+			break;
+		case QUIT:
+			if (dbg_step_printf) printf(" T %d issuing QUIT\n", m_deviceIndex);
+			// actually, setting keep_going to false and unlocking the barrier should be enough to quit the cycle
+			break;
+	}
+
+	if (m_profiler.timing()) {
+		// the steps of a level share the profiler of the worker
+		if (s_poolTask >= 0) pthread_mutex_lock(&m_profilerMutex);
+		m_profiler.recordCommand(cmd, start, CommandProfiler::now());
+		if (s_poolTask >= 0) pthread_mutex_unlock(&m_profilerMutex);
+	}
+}
+
+// Run all the steps recorded by the main thread in gdata->commandSequence.
+// The sequence has been sorted by CommandScheduler into levels of independent
+// steps: the steps of a level are run concurrently as pool tasks (see
+// runLevelTasks()), and the workers only synchronize at the end of each level.
+// Buffer swaps are applied by the first worker between levels. With a single
+// device no synchronization is needed at all.
+void CPUWorker::runCommandSequence()
+{
+	Synchronizer *sync = gdata->sequenceSynchronizer;
+	const CommandSequence &sequence = gdata->commandSequence;
+
+	CommandSequence::const_iterator level_begin = sequence.begin();
+	while (level_begin != sequence.end()) {
+		CommandSequence::const_iterator step = level_begin;
+		flag_t swaps = NO_FLAGS;
+		uint numSteps = 0;
+		for (; step != sequence.end() && step->level == level_begin->level; ++step) {
+			swaps |= step->swapBuffers;
+			++numSteps;
+		}
+
+		if (numSteps > 1 && m_numThreads > 1)
+			runLevelTasks(level_begin, numSteps);
+		else
+			for (step = level_begin; step != sequence.end() && step->level == level_begin->level; ++step)
+				runCommand(step->command, step->flags, step->only_internal);
+
+		if (sync) m_profiler.barrier(sync);
+		if (swaps) {
+			if (m_deviceIndex == 0)
+				gdata->swapDeviceBuffers(swaps);
+			if (sync) m_profiler.barrier(sync);
+		}
+
+		level_begin = step;
+	}
+}
+
+// Each pool thread takes the next step of the level and runs it on its own:
+// the parallel_for()s of the step become jobs of its task, whose chunks are
+// also grabbed by the threads which have no step left to run
+void CPUWorker::runLevelTasks(CommandSequence::const_iterator begin, uint numSteps)
+{
+	m_poolTasks.resize(numSteps);
+	for (uint t = 0; t < numSteps; t++, ++begin) {
+		PoolTask &task = m_poolTasks[t];
+		task.step = &*begin;
+		task.active = false;
+		task.helpers = 0;
+	}
+	m_poolNextTask = m_poolDoneTasks = 0;
+
+	parallel_for(&CPUWorker::levelTasksRange, m_numThreads, 1);
+}
+
+void CPUWorker::levelTasksRange(uint from, uint to, uint thread)
+{
+	const uint numTasks = m_poolTasks.size();
+
+	s_poolThread = thread;
+	while (m_poolDoneTasks < numTasks) {
+		const uint t = __sync_fetch_and_add(&m_poolNextTask, 1);
+		if (t < numTasks) {
+			const CommandStep *step = m_poolTasks[t].step;
+			s_poolTask = t;
+			runCommand(step->command, step->flags, step->only_internal);
+			s_poolTask = -1;
+			__sync_fetch_and_add(&m_poolDoneTasks, 1);
+		} else if (!helpTasks(thread))
+			sched_yield();
+	}
+}
+
+// parallel_for() from a task: publish the job, work on it and help the other
+// tasks until all its chunks are done
+void CPUWorker::runTaskJob(RangeJob job, uint numItems, uint chunkSize)
+{
+	const int t = s_poolTask;
+	const uint thread = s_poolThread;
+	PoolTask &task = m_poolTasks[t];
+
+	task.job = job;
+	task.numItems = numItems;
+	task.chunkSize = chunkSize ? chunkSize :
+		std::max(numItems/(m_numThreads*POOL_CHUNKS_PER_THREAD), (uint)MIN_POOL_CHUNK);
+	task.nextItem = 0;
+	task.doneItems = 0;
+	__sync_synchronize();
+	task.active = true;
+
+	while (runTaskChunk(t, thread)) {}
+	while (task.doneItems < numItems)
+		if (!helpTasks(thread))
+			sched_yield();
+
+	// the helpers might still be looking at the job: wait for them before reusing it
+	task.active = false;
+	__sync_synchronize();
+	while (task.helpers)
+		sched_yield();
+}
+
+// run a chunk of the job of task t, if there is any left
+bool CPUWorker::runTaskChunk(uint t, uint thread)
+{
+	PoolTask &task = m_poolTasks[t];
+	bool ran = false;
+
+	__sync_fetch_and_add(&task.helpers, 1);
+	if (task.active) {
+		const uint from = __sync_fetch_and_add(&task.nextItem, task.chunkSize);
+		if (from < task.numItems) {
+			const uint to = std::min(from + task.chunkSize, task.numItems);
+			// the range runs with the parameters of the step it belongs to
+			const int ownTask = s_poolTask;
+			s_poolTask = t;
+			(this->*task.job)(from, to, thread);
+			s_poolTask = ownTask;
+			__sync_fetch_and_add(&task.doneItems, to - from);
+			ran = true;
+		}
+	}
+	__sync_fetch_and_sub(&task.helpers, 1);
+
+	return ran;
+}
+
+bool CPUWorker::helpTasks(uint thread)
+{
+	for (uint t = 0; t < m_poolTasks.size(); t++)
+		if (runTaskChunk(t, thread))
+			return true;
+	return false;
+}
+
+flag_t CPUWorker::commandFlags() const
+{
+	return s_poolTask < 0 ? m_commandFlags : m_poolTasks[s_poolTask].step->flags;
+}
+
+bool CPUWorker::onlyInternal() const
+{
+	return s_poolTask < 0 ? m_onlyInternal : m_poolTasks[s_poolTask].step->only_internal;
+}
+
+/* Grid and neighbor list helpers */
+
+int3 CPUWorker::gridPosFromParticleHash(hashKey particleHash) const
+{
+	return gdata->reverseGridHashHost(cellHashFromParticleHash(particleHash));
+}
+
+// Compute the hash of a cell which may lie one cell outside of the grid,
+// which can only happen with periodicity
+uint CPUWorker::gridHashPeriodic(int3 gridPos) const
+{
+	const int3 size = make_int3(gdata->gridSize.x, gdata->gridSize.y, gdata->gridSize.z);
+	if (gridPos.x < 0) gridPos.x = size.x - 1;
+	if (gridPos.x >= size.x) gridPos.x = 0;
+	if (gridPos.y < 0) gridPos.y = size.y - 1;
+	if (gridPos.y >= size.y) gridPos.y = 0;
+	if (gridPos.z < 0) gridPos.z = size.z - 1;
+	if (gridPos.z >= size.z) gridPos.z = 0;
+	return gdata->calcGridHashHost(gridPos);
+}
+
+// Move gridPos by gridOffset, wrapping around periodic axes.
+// Returns false if the neighbor cell is out of the grid
+bool CPUWorker::calcNeibCell(int3 &gridPos, int3 const& gridOffset) const
+{
+	const int3 size = make_int3(gdata->gridSize.x, gdata->gridSize.y, gdata->gridSize.z);
+	const Periodicity periodicbound = m_simparams->periodicbound;
+
+	gridPos = gridPos + gridOffset;
+
+	if (gridPos.x < 0 || gridPos.x >= size.x) {
+		if (!(periodicbound & PERIODIC_X)) return false;
+		gridPos.x = (gridPos.x < 0 ? size.x - 1 : 0);
+	}
+	if (gridPos.y < 0 || gridPos.y >= size.y) {
+		if (!(periodicbound & PERIODIC_Y)) return false;
+		gridPos.y = (gridPos.y < 0 ? size.y - 1 : 0);
+	}
+	if (gridPos.z < 0 || gridPos.z >= size.z) {
+		if (!(periodicbound & PERIODIC_Z)) return false;
+		gridPos.z = (gridPos.z < 0 ? size.z - 1 : 0);
+	}
+
+	return true;
+}
+
+// Return neighbor index and update pos_corr when the neighbor cell changes,
+// see getNeibIndex() in forces_kernel.cu
+uint CPUWorker::getNeibIndex(float4 const& pos, float3& pos_corr, neibdata neib_data,
+	int3 const& gridPos, char& neib_cellnum, uint& neib_cell_base_index) const
+{
+	if (neib_data >= CELLNUM_ENCODED) {
+		// Update current neib cell number
+		neib_cellnum = DECODE_CELL(neib_data);
+
+		// Compute neighbor index relative to belonging cell
+		neib_data &= NEIBINDEX_MASK;
+
+		// Substract current cell offset vector to pos
+		const int3 offset = cellToOffset(neib_cellnum);
+		pos_corr = as_float3(pos) - offset*gdata->cellSize;
+
+		// Compute index of the first particle in the current cell
+		neib_cell_base_index = m_cellStart[gridHashPeriodic(gridPos + offset)];
+	}
+
+	// Compute and return neighbor index
+	return neib_cell_base_index + neib_data;
+}
+
+float3 CPUWorker::globalPos(float4 const& pos, int3 const& gridPos) const
+{
+	return gdata->worldOrigin + as_float3(pos) + gridPos*gdata->cellSize + 0.5f*gdata->cellSize;
+}
+
+/* SPH kernels, equation of state, boundary forces. See forces_kernel.cu */
+
+float CPUWorker::W(float r) const
+{
+	return kernel_shape(m_simparams->kerneltype, r/m_simparams->slength)*m_wcoeff;
+}
+
+// Return 1/r dW/dr at distance r
+float CPUWorker::F(float r) const
+{
+	const float slength = m_simparams->slength;
+	const float R = r/slength;
+	float val = 0.0f;
+
+	switch (m_simparams->kerneltype) {
+	case CUBICSPLINE:
+		if (R < 1.0f)
+			val = (-4.0f + 3.0f*R)/slength;		// val = (-4 + 3R)/h
+		else
+			val = -(-2.0f + R)*(-2.0f + R)/r;	// val = -(-2 + R)^2/r
+		break;
+	case QUADRATIC:
+		val = (-2.0f + R)/r;		// val = (-2 + R)/r
+		break;
+	case WENDLAND: {
+		const float qm2 = R - 2.0f;	// val = (-2 + R)^3
+		val = qm2*qm2*qm2;
+		}
+		break;
+	default:
+		break;
+	}
+
+	return val*m_fcoeff;
+}
+
+// Equation of state: pressure from density, where fluid is the fluid kind, not particle_id
+float CPUWorker::P(float rho, uint fluid) const
+{
+	return m_physparams->bcoeff[fluid]*(powf(rho/m_physparams->rho0[fluid], m_physparams->gammacoeff[fluid]) - 1);
+}
+
+// Sound speed computed from density
+float CPUWorker::soundSpeed(float rho, uint fluid) const
+{
+	return m_physparams->sscoeff[fluid]*powf(rho/m_physparams->rho0[fluid], m_physparams->sspowercoeff[fluid]);
+}
+
+// Lennard-Jones boundary repulsion force
+float CPUWorker::LJForce(float r) const
+{
+	const float r0 = m_physparams->r0;
+	float force = 0.0f;
+
+	if (r <= r0)
+		force = m_physparams->dcoeff*(powf(r0/r, m_physparams->p1coeff) - powf(r0/r, m_physparams->p2coeff))/(r*r);
+
+	return force;
+}
+
+// Monaghan-Kajtar boundary repulsion force doi:10.1016/j.cpc.2009.05.008
+float CPUWorker::MKForce(float r, float slength, float mass_f, float mass_b) const
+{
+	float force = 0.0f;
+
+	// Wendland has radius 2
+	if (r <= 2*slength) {
+		const float qq = r/slength;
+		const float w = 1.8f * powf(1.0f - 0.5f*qq, 4.0f) * (2.0f*qq + 1.0f);
+		const float dist = std::max(m_physparams->epsartvisc, r - m_physparams->MK_d);
+		force = m_physparams->MK_K*w*2*mass_b/(m_physparams->MK_beta * dist * r * (mass_f+mass_b));
+	}
+
+	return force;
+}
+
+// Normal and viscous force wrt to a plane
+float CPUWorker::PlaneForce(float3 const& pos, float mass, float4 const& plane, float l,
+	float3 const& vel, float dynvisc, float4& force) const
+{
+	const float r = fabsf(dot(pos, as_float3(plane)) + plane.w)/l;
+	if (r < m_physparams->r0) {
+		const float DvDt = LJForce(r);
+		// Unitary normal vector of the surface
+		const float3 relPos = make_float3(plane)*r/l;
+
+		as_float3(force) += DvDt*relPos;
+
+		// tangential velocity component
+		const float3 v_t = vel - dot(vel, relPos)/r*relPos/r;
+
+		// viscosity
+		const float coeff = -dynvisc*m_partsurf/(mass*r);
+
+		as_float3(force) += coeff*v_t;
+
+		return -coeff;
+	}
+
+	return 0.0f;
+}
+
+/* Kernels */
+
+// commands of the features that main() rejects with --cpu, so they are never issued
+void CPUWorker::kernel_unsupported(const char *cmd)
+{
+	fprintf(stderr, "FATAL: command %s is not supported by the CPU worker\n", cmd);
+	exit(1);
+}
+
+void CPUWorker::kernel_calcHash()
+{
+	// is the device empty? (unlikely but possible before LB kicks in)
+	if (m_numParticles == 0) return;
+
+	// as in GPUWorker, at iteration 0 the hashes computed on host are kept
+	if (gdata->iterations == 0)
+		parallel_for(&CPUWorker::fixHashRange, m_numParticles);
+	else
+		parallel_for(&CPUWorker::calcHashRange, m_numParticles);
+}
+
+void CPUWorker::calcHashRange(uint from, uint to, uint thread)
+{
+	float4 *posArray = m_buffers.getData<BUFFER_POS>(gdata->currentRead[BUFFER_POS]);
+	hashKey *particleHash = m_buffers.getData<BUFFER_HASH>();
+	uint *particleIndex = m_buffers.getData<BUFFER_PARTINDEX>();
+	const particleinfo *infoArray = m_buffers.getData<BUFFER_INFO>(gdata->currentRead[BUFFER_INFO]);
+
+	for (uint index = from; index < to; index++) {
+		const particleinfo info = infoArray[index];
+
+		// Only fluid and moving boundary particles need to be rehashed
+		if (FLUID(info) || (type(info) & MOVINGNOTFLUID)) {
+			float4 pos = posArray[index];
+
+			const int3 gridPos = gridPosFromParticleHash(particleHash[index]);
+			// Compute the new grid offset from the position relative to the cell center
+			int3 gridOffset = make_int3(floor((as_float3(pos) + 0.5f*gdata->cellSize)/gdata->cellSize));
+
+			bool toofar = false;
+			const uint gridHash = gdata->calcGridHashHost(
+				clampGridPos(gridPos, gridOffset, &toofar, m_simparams->periodicbound, gdata->gridSize));
+
+			// Adjust position
+			as_float3(pos) -= gridOffset*gdata->cellSize;
+			// if the particle would have flown out of the domain by more than a cell, disable it
+			if (toofar)
+				disable_particle(pos);
+
+			particleHash[index] = makeParticleHash(gridHash, info);
+			posArray[index] = pos;
+		}
+
+		// Preparing particle index array for the sort phase
+		particleIndex[index] = index;
+	}
+}
+
+// there is no compact device map for a single worker, so only the index has to be prepared
+void CPUWorker::fixHashRange(uint from, uint to, uint thread)
+{
+	uint *particleIndex = m_buffers.getData<BUFFER_PARTINDEX>();
+
+	for (uint index = from; index < to; index++)
+		particleIndex[index] = index;
+}
+
+// LSD radix sort of the (hash, index) pairs, RADIX_BITS bits per pass.
+// The particles are split into blocks: each pass counts the digits of each
+// block in parallel, scans the counts (bucket-major, so that the blocks keep
+// their order within a bucket) and scatters each block in parallel. Every
+// pass is stable and the indices are sorted before the sort, so the result
+// is the same as the stable sort by key used on the device
+void CPUWorker::kernel_sort()
+{
+	uint numPartsToElaborate = (onlyInternal() ? m_numInternalParticles : m_numParticles);
+
+	// is the device empty? (unlikely but possible before LB kicks in)
+	if (numPartsToElaborate == 0) return;
+
+	hashKey *particleHash = m_buffers.getData<BUFFER_HASH>();
+	uint *particleIndex = m_buffers.getData<BUFFER_PARTINDEX>();
+
+	m_sortNumItems = numPartsToElaborate;
+	m_sortBlocks = std::min(m_numThreads*POOL_CHUNKS_PER_THREAD,
+		(numPartsToElaborate + MIN_POOL_CHUNK - 1)/MIN_POOL_CHUNK);
+	m_sortBlockSize = (numPartsToElaborate + m_sortBlocks - 1)/m_sortBlocks;
+	m_sortBlocks = (numPartsToElaborate + m_sortBlockSize - 1)/m_sortBlockSize;
+
+	m_sortSrcKeys = particleHash;
+	m_sortSrcIndex = particleIndex;
+	m_sortDstKeys = m_sortKeys;
+	m_sortDstIndex = m_sortIndex;
+
+	for (m_sortShift = 0; m_sortShift < 8*sizeof(hashKey); m_sortShift += RADIX_BITS) {
+		parallel_for(&CPUWorker::sortHistogramRange, m_sortBlocks, 1);
+
+		// turn the counts into the first destination of each (bucket, block)
+		uint offset = 0;
+		bool trivial = false;
+		for (uint bucket = 0; bucket < RADIX_BUCKETS; bucket++) {
+			const uint bucketStart = offset;
+			for (uint block = 0; block < m_sortBlocks; block++) {
+				uint &count = m_sortHistograms[block*RADIX_BUCKETS + bucket];
+				const uint blockCount = count;
+				count = offset;
+				offset += blockCount;
+			}
+			// all the keys share this digit: the pass would not move anything
+			if (offset - bucketStart == numPartsToElaborate)
+				trivial = true;
+		}
+		if (trivial)
+			continue;
+
+		parallel_for(&CPUWorker::sortScatterRange, m_sortBlocks, 1);
+
+		std::swap(m_sortSrcKeys, m_sortDstKeys);
+		std::swap(m_sortSrcIndex, m_sortDstIndex);
+	}
+
+	// an odd number of passes left the sorted pairs in the scratch arrays
+	if (m_sortSrcKeys != particleHash) {
+		m_sortDstKeys = particleHash;
+		m_sortDstIndex = particleIndex;
+		parallel_for(&CPUWorker::sortCopyRange, numPartsToElaborate);
+	}
+}
+
+void CPUWorker::sortHistogramRange(uint from, uint to, uint thread)
+{
+	for (uint block = from; block < to; block++) {
+		uint *histogram = m_sortHistograms + block*RADIX_BUCKETS;
+		const uint begin = block*m_sortBlockSize;
+		const uint end = std::min(begin + m_sortBlockSize, m_sortNumItems);
+
+		memset(histogram, 0, RADIX_BUCKETS*sizeof(uint));
+		for (uint index = begin; index < end; index++)
+			histogram[(m_sortSrcKeys[index] >> m_sortShift) & (RADIX_BUCKETS - 1)]++;
+	}
+}
+
+void CPUWorker::sortScatterRange(uint from, uint to, uint thread)
+{
+	for (uint block = from; block < to; block++) {
+		uint *offsets = m_sortHistograms + block*RADIX_BUCKETS;
+		const uint begin = block*m_sortBlockSize;
+		const uint end = std::min(begin + m_sortBlockSize, m_sortNumItems);
+
+		for (uint index = begin; index < end; index++) {
+			const hashKey key = m_sortSrcKeys[index];
+			const uint dest = offsets[(key >> m_sortShift) & (RADIX_BUCKETS - 1)]++;
+			m_sortDstKeys[dest] = key;
+			m_sortDstIndex[dest] = m_sortSrcIndex[index];
+		}
+	}
+}
+
+void CPUWorker::sortCopyRange(uint from, uint to, uint thread)
+{
+	for (uint index = from; index < to; index++) {
+		m_sortDstKeys[index] = m_sortSrcKeys[index];
+		m_sortDstIndex[index] = m_sortSrcIndex[index];
+	}
+}
+
+// SA_BOUNDARY is refused at startup, so this is only needed by the tracers
+void CPUWorker::kernel_inverseParticleIndex()
+{
+	uint numPartsToElaborate = (onlyInternal() ? m_numInternalParticles : m_numParticles);
+
+	parallel_for(&CPUWorker::inverseIndexRange, numPartsToElaborate);
+}
+
+// particleIndex is a permutation, so each thread writes distinct elements
+void CPUWorker::inverseIndexRange(uint from, uint to, uint thread)
+{
+	const uint *particleIndex = m_buffers.getData<BUFFER_PARTINDEX>();
+	uint *inversedParticleIndex = m_buffers.getData<BUFFER_INVINDEX>();
+
+	for (uint index = from; index < to; index++)
+		inversedParticleIndex[particleIndex[index]] = index;
+}
+
+void CPUWorker::kernel_reorderDataAndFindCellStart()
+{
+	// reset also if the device is empty (or we will download uninitialized values)
+	setCellsAsEmpty();
+
+	// is the device empty? (unlikely but possible before LB kicks in)
+	if (m_numParticles == 0) return;
+
+	parallel_for(&CPUWorker::reorderRange, m_numParticles);
+}
+
+void CPUWorker::reorderRange(uint from, uint to, uint thread)
+{
+	const hashKey *particleHash = m_buffers.getData<BUFFER_HASH>();
+	const uint *particleIndex = m_buffers.getData<BUFFER_PARTINDEX>();
+
+	const float4 *oldPos = m_buffers.getData<BUFFER_POS>(gdata->currentRead[BUFFER_POS]);
+	const float4 *oldVel = m_buffers.getData<BUFFER_VEL>(gdata->currentRead[BUFFER_VEL]);
+	const particleinfo *oldInfo = m_buffers.getData<BUFFER_INFO>(gdata->currentRead[BUFFER_INFO]);
+
+	float4 *newPos = m_buffers.getData<BUFFER_POS>(gdata->currentWrite[BUFFER_POS]);
+	float4 *newVel = m_buffers.getData<BUFFER_VEL>(gdata->currentWrite[BUFFER_VEL]);
+	particleinfo *newInfo = m_buffers.getData<BUFFER_INFO>(gdata->currentWrite[BUFFER_INFO]);
+
+	for (uint index = from; index < to; index++) {
+		const uint cellHash = cellHashFromParticleHash(particleHash[index]);
+
+		// the first particle of each cell marks its start and the end of the previous one
+		if (index == 0 || cellHash != cellHashFromParticleHash(particleHash[index - 1])) {
+			m_cellStart[cellHash] = index;
+			if (index > 0)
+				m_cellEnd[cellHashFromParticleHash(particleHash[index - 1])] = index;
+		}
+
+		if (index == m_numParticles - 1)
+			m_cellEnd[cellHash] = index + 1;
+
+		const uint sortedIndex = particleIndex[index];
+		newPos[index] = oldPos[sortedIndex];
+		newVel[index] = oldVel[sortedIndex];
+		newInfo[index] = oldInfo[sortedIndex];
+	}
+}
+
+void CPUWorker::kernel_buildNeibsList()
+{
+	uint numPartsToElaborate = (onlyInternal() ? m_particleRangeEnd : m_numParticles);
+
+	// is the device empty? (unlikely but possible before LB kicks in)
+	if (numPartsToElaborate == 0) return;
+
+	for (uint t = 0; t < m_numThreads; t++)
+		m_threadMaxNeibs[t] = m_threadNumInteractions[t] = 0;
+
+	parallel_for(&CPUWorker::buildNeibsRange, numPartsToElaborate);
+
+	// reduce the peak number of neighbors and the estimated number of interactions
+	uint maxNeibs = 0, numInteractions = 0;
+	for (uint t = 0; t < m_numThreads; t++) {
+		maxNeibs = std::max(maxNeibs, m_threadMaxNeibs[t]);
+		numInteractions += m_threadNumInteractions[t];
+	}
+	gdata->timingInfo[m_deviceIndex].maxNeibs = maxNeibs;
+	gdata->timingInfo[m_deviceIndex].numInteractions = numInteractions;
+}
+
+void CPUWorker::buildNeibsRange(uint from, uint to, uint thread)
+{
+	const float4 *posArray = m_buffers.getData<BUFFER_POS>(gdata->currentRead[BUFFER_POS]);
+	const particleinfo *infoArray = m_buffers.getData<BUFFER_INFO>(gdata->currentRead[BUFFER_INFO]);
+	const hashKey *particleHash = m_buffers.getData<BUFFER_HASH>();
+	neibdata *neibsList = m_buffers.getData<BUFFER_NEIBSLIST>();
+
+	const idx_t stride = m_numAllocatedParticles;
+	const uint maxneibsnum = m_simparams->maxneibsnum;
+	const float sqinfluenceradius = m_simparams->nlSqInfluenceRadius;
+	const uint numLoads = gdata->loads ? gdata->loads->numWallLoads() : 0;
+
+	uint maxNeibs = 0, numInteractions = 0;
+
+	for (uint index = from; index < to; index++) {
+		uint neibs_num = 0;
+
+		const particleinfo info = infoArray[index];
+		const float4 pos = posArray[index];
+
+		// the particles of the loaded objects need their fluid neighbors
+		const bool build_nl = FLUID(info) || TESTPOINTS(info) || OBJECT(info) ||
+			loadIndex(info) < numLoads;
+
+		if (build_nl && ACTIVE(pos)) {
+			const int3 gridPos = gridPosFromParticleHash(particleHash[index]);
+
+			// Go through the 27 neighbor cells
+			for (int z = -1; z <= 1; z++) {
+				for (int y = -1; y <= 1; y++) {
+					for (int x = -1; x <= 1; x++) {
+						const int3 gridOffset = make_int3(x, y, z);
+						int3 neibGridPos = gridPos;
+						if (!calcNeibCell(neibGridPos, gridOffset))
+							continue;
+
+						const uint neibCell = gdata->calcGridHashHost(neibGridPos);
+						const uint bucketStart = m_cellStart[neibCell];
+						// Skip empty cells
+						if (bucketStart == UINT_MAX)
+							continue;
+						const uint bucketEnd = m_cellEnd[neibCell];
+
+						// position relative to the neighbor cell
+						const float3 pos_corr = as_float3(pos) - gridOffset*gdata->cellSize;
+						const uchar cell = (x + 1) + (y + 1)*3 + (z + 1)*9;
+						bool encode_cell = true;
+
+						for (uint neib_index = bucketStart; neib_index < bucketEnd; neib_index++) {
+							if (neib_index == index)
+								continue;
+							if (TESTPOINTS(infoArray[neib_index]))
+								continue;
+
+							const float4 neib_pos = posArray[neib_index];
+							if (INACTIVE(neib_pos))
+								continue;
+
+							const float3 relPos = pos_corr - as_float3(neib_pos);
+							if (sqlength(relPos) < sqinfluenceradius) {
+								if (neibs_num < maxneibsnum) {
+									neibsList[neibs_num*stride + index] =
+										neib_index - bucketStart + (encode_cell ? ENCODE_CELL(cell) : 0);
+									encode_cell = false;
+								}
+								neibs_num++;
+							}
+						}
+					}
+				}
+			}
+		}
+
+		// Setting the end marker
+		if (neibs_num < maxneibsnum)
+			neibsList[neibs_num*stride + index] = 0xffff;
+
+		numInteractions += neibs_num;
+		maxNeibs = std::max(maxNeibs, neibs_num);
+	}
+
+	m_threadMaxNeibs[thread] = std::max(m_threadMaxNeibs[thread], maxNeibs);
+	m_threadNumInteractions[thread] += numInteractions;
+}
+
+// reduce the per-thread CFL maxima, see forces_dtreduce() in forces.cu
+float CPUWorker::forces_dt_reduce()
+{
+	// no reduction for fixed timestep
+	if (!m_simparams->dtadapt)
+		return m_simparams->dt;
+
+	float maxcfl = 0;
+	for (uint t = 0; t < m_numThreads; t++)
+		maxcfl = fmaxf(maxcfl, m_threadCfl[t]);
+
+	float dt = m_simparams->dtadaptfactor*sqrtf(m_simparams->slength/maxcfl);
+
+	if (m_simparams->visctype != ARTVISC) {
+		/* Stability condition from viscosity h²/ν */
+		float dt_visc = m_simparams->slength*m_simparams->slength/m_physparams->visccoeff;
+		switch (m_simparams->visctype) {
+			case KINEMATICVISC:
+			case SPSVISC:
+			/* ν = visccoeff/4 for kinematic viscosity */
+				dt_visc *= 4;
+				break;
+			default:
+			/* ν = visccoeff for dynamic viscosity */
+				break;
+		}
+		dt_visc *= 0.125;
+		if (dt_visc < dt)
+			dt = dt_visc;
+	}
+
+	return dt;
+}
+
+// there is no asynchronous execution on host: forces are computed at enqueue time,
+// while the dt is reduced and stored on completion, as in GPUWorker
+void CPUWorker::kernel_forces_async_enqueue()
+{
+	if (!onlyInternal())
+		printf("WARNING: forces kernel called with only_internal == true, ignoring flag!\n");
+
+	uint numPartsToElaborate = m_particleRangeEnd;
+
+	for (uint t = 0; t < m_numThreads; t++)
+		m_threadCfl[t] = 0;
+
+	// particles of the loaded objects may have moved to another worker
+	if (gdata->loads && MULTI_DEVICE)
+		std::fill(m_loads, m_loads + gdata->loads->numSlots(), make_float4(0.0f));
+
+	parallel_for(&CPUWorker::forcesRange, numPartsToElaborate);
+}
+
+void CPUWorker::kernel_forces_async_complete()
+{
+	uint numPartsToElaborate = (onlyInternal() ? m_particleRangeEnd : m_numParticles);
+
+	// FLOAT_MAX is returned if kernels are not run (e.g. numPartsToElaborate == 0)
+	float returned_dt = FLT_MAX;
+
+	bool firstStep = (commandFlags() == INTEGRATOR_STEP_1);
+
+	if (numPartsToElaborate > 0 )
+		returned_dt = forces_dt_reduce();
+
+	// gdata->dts is directly used instead of handling dt1 and dt2
+	if (firstStep)
+		gdata->dts[m_deviceIndex] = returned_dt;
+	else
+		gdata->dts[m_deviceIndex] = std::min(gdata->dts[m_deviceIndex], returned_dt);
+}
+
+void CPUWorker::kernel_forces()
+{
+	if (!onlyInternal())
+		printf("WARNING: forces kernel called with only_internal == true, ignoring flag!\n");
+
+	uint numPartsToElaborate = m_particleRangeEnd;
+
+	// FLOAT_MAX is returned if kernels are not run (e.g. numPartsToElaborate == 0)
+	float returned_dt = FLT_MAX;
+
+	bool firstStep = (commandFlags() == INTEGRATOR_STEP_1);
+
+	// particles of the loaded objects may have moved to another worker
+	if (gdata->loads && MULTI_DEVICE)
+		std::fill(m_loads, m_loads + gdata->loads->numSlots(), make_float4(0.0f));
+
+	if (numPartsToElaborate > 0 ) {
+		for (uint t = 0; t < m_numThreads; t++)
+			m_threadCfl[t] = 0;
+
+		parallel_for(&CPUWorker::forcesRange, numPartsToElaborate);
+
+		// reduce dt
+		returned_dt = forces_dt_reduce();
+	}
+
+	// gdata->dts is directly used instead of handling dt1 and dt2
+	if (firstStep)
+		gdata->dts[m_deviceIndex] = returned_dt;
+	else
+		gdata->dts[m_deviceIndex] = std::min(gdata->dts[m_deviceIndex], returned_dt);
+}
+
+// Host version of forcesDevice() (forces_kernel.def) for LJ and MK boundaries
+void CPUWorker::forcesRange(uint from, uint to, uint thread)
+{
+	const float4 *posArray = m_buffers.getData<BUFFER_POS>(gdata->currentRead[BUFFER_POS]);
+	const float4 *velArray = m_buffers.getData<BUFFER_VEL>(gdata->currentRead[BUFFER_VEL]);
+	const particleinfo *infoArray = m_buffers.getData<BUFFER_INFO>(gdata->currentRead[BUFFER_INFO]);
+	const hashKey *particleHash = m_buffers.getData<BUFFER_HASH>();
+	const neibdata *neibsList = m_buffers.getData<BUFFER_NEIBSLIST>();
+	float4 *forces = m_buffers.getData<BUFFER_FORCES>();
+	float4 *xsph = m_buffers.getData<BUFFER_XSPH>();
+	float2 **tau = m_buffers.getRawPtr<BUFFER_TAU>();
+
+	const float slength = m_simparams->slength;
+	const float influenceradius = m_simparams->influenceRadius;
+	const float visccoeff = m_physparams->visccoeff;
+	const ViscosityType visctype = m_simparams->visctype;
+	const SPHFormulation sph_formulation = m_simparams->sph_formulation;
+	const bool usexsph = m_simparams->xsph;
+	const Loads *loads = gdata->loads;
+	const uint numLoads = loads ? loads->numWallLoads() : 0;
+
+	const idx_t stride = m_numAllocatedParticles;
+	const idx_t neiblist_end = m_simparams->maxneibsnum*stride;
+
+	float maxcfl = 0;
+
+	for (uint index = from; index < to; index++) {
+		const particleinfo info = infoArray[index];
+		const uint load = loadIndex(info);
+
+		if (!(FLUID(info) || OBJECT(info) || load < numLoads))
+			continue;
+
+		const float4 pos = posArray[index];
+
+		if (INACTIVE(pos))
+			continue;
+
+		const float4 vel = velArray[index];
+		const int3 gridPos = gridPosFromParticleHash(particleHash[index]);
+		const uint fluid = PART_FLUID_NUM(info);
+
+		const float pressure = P(vel.w, fluid);
+		const float p_precalc = (sph_formulation == SPH_F1 ? pressure/(vel.w*vel.w) : pressure);
+		const float sspeed = soundSpeed(vel.w, fluid);
+
+		symtensor3 tau_i;
+		if (visctype == SPSVISC) {
+			tau_i.xx = tau[0][index].x; tau_i.xy = tau[0][index].y;
+			tau_i.xz = tau[1][index].x; tau_i.yy = tau[1][index].y;
+			tau_i.yz = tau[2][index].x; tau_i.zz = tau[2][index].y;
+		}
+
+		float4 force = make_float4(0.0f);
+		float3 mean_vel = make_float3(0.0f);
+
+		char neib_cellnum = 0;
+		uint neib_cell_base_index = 0;
+		float3 pos_corr;
+
+		for (idx_t i = 0; i < neiblist_end; i += stride) {
+			neibdata neib_data = neibsList[i + index];
+
+			if (neib_data == 0xffff) break;
+
+			const uint neib_index = getNeibIndex(pos, pos_corr, neib_data, gridPos,
+				neib_cellnum, neib_cell_base_index);
+
+			const float4 relPos = pos_corr - posArray[neib_index];
+
+			if (INACTIVE(relPos))
+				continue;
+
+			const float r = length3(relPos);
+
+			const particleinfo neib_info = infoArray[neib_index];
+
+			bool computes_stuff = (r < influenceradius);
+
+			if (OBJECT(info) || load < numLoads)
+				computes_stuff = computes_stuff && (FLUID(neib_info) && !OBJECT(neib_info));
+
+			if (!computes_stuff)
+				continue;
+
+			if (FLUID(info)) {
+				float DvDt = 0;
+
+				if (FLUID(neib_info)) {
+					const float4 relVel = as_float3(vel) - velArray[neib_index];
+					const float vel_dot_pos = dot3(relVel, relPos);
+					const float f = F(r);
+					const float neib_rho = relVel.w;
+					const float neib_mass = relPos.w;
+					const uint neib_fluid = PART_FLUID_NUM(neib_info);
+
+					// density derivative
+					float DrDt = neib_mass*vel_dot_pos*f;
+					if (sph_formulation == SPH_F2)
+						DrDt *= vel.w/neib_rho;
+					force.w += DrDt;
+
+					// pressure contribution
+					if (sph_formulation == SPH_F1)
+						DvDt -= p_precalc + P(neib_rho, neib_fluid)/(neib_rho*neib_rho);
+					else
+						DvDt -= (p_precalc + P(neib_rho, neib_fluid))/(vel.w*neib_rho);
+
+					// viscous forces
+					float visc = 0;
+					switch (visctype) {
+					case ARTVISC:
+						if (vel_dot_pos < 0.0f)
+							DvDt += vel_dot_pos*slength*visccoeff*(sspeed + soundSpeed(neib_rho, neib_fluid))/
+								((r*r + m_physparams->epsartvisc)*(vel.w + neib_rho));
+						break;
+					case SPSVISC:
+						force.x += neib_mass*f*(
+							(tau_i.xx + tau[0][neib_index].x)*relPos.x +
+							(tau_i.xy + tau[0][neib_index].y)*relPos.y +
+							(tau_i.xz + tau[1][neib_index].x)*relPos.z);
+						force.y += neib_mass*f*(
+							(tau_i.xy + tau[0][neib_index].y)*relPos.x +
+							(tau_i.yy + tau[1][neib_index].y)*relPos.y +
+							(tau_i.yz + tau[2][neib_index].x)*relPos.z);
+						force.z += neib_mass*f*(
+							(tau_i.xz + tau[1][neib_index].x)*relPos.x +
+							(tau_i.yz + tau[2][neib_index].x)*relPos.y +
+							(tau_i.zz + tau[2][neib_index].y)*relPos.z);
+						// fall through
+					case KINEMATICVISC:
+						visc = neib_mass*visccoeff*f/(vel.w + neib_rho);
+						break;
+					case DYNAMICVISC:
+						visc = neib_mass*(visccoeff*vel.w + visccoeff*neib_rho)*f/(vel.w*neib_rho);
+						break;
+					default:
+						break;
+					}
+					if (visctype != ARTVISC)
+						as_float3(force) += visc*as_float3(relVel);
+
+					if (usexsph)
+						mean_vel -= neib_mass*W(r)*as_float3(relVel)/(vel.w + neib_rho);
+
+					DvDt *= neib_mass*f;
+				} else {
+					// repulsive force from boundary particles
+					if (m_simparams->boundarytype == MK_BOUNDARY)
+						DvDt = MKForce(r, slength, pos.w, pos.w);
+					else
+						DvDt = LJForce(r);
+				}
+
+				as_float3(force) += DvDt*as_float3(relPos);
+			}
+			else if (OBJECT(info)) {
+				as_float3(force) += relPos.w*LJForce(r)*as_float3(relPos);
+			}
+			else if (load < numLoads) {
+				// opposite of the repulsive force on the fluid particle, times its mass
+				const float neib_mass = relPos.w;
+				const float DvDt = neib_mass*(m_simparams->boundarytype == MK_BOUNDARY ?
+					MKForce(r, slength, neib_mass, neib_mass) : LJForce(r));
+				as_float3(force) += DvDt*as_float3(relPos);
+			}
+		} // end of loop over neighbors
+
+		if (FLUID(info)) {
+			float dynvisc = 0;
+			switch (visctype) {
+			case DYNAMICVISC:
+				dynvisc = visccoeff*vel.w;
+				break;
+			case KINEMATICVISC:
+			case SPSVISC:
+				dynvisc = visccoeff*vel.w/4;
+				break;
+			default:
+				break;
+			}
+
+			as_float3(force) += m_gravity;
+
+			if (m_numPlanes) {
+				const float3 globalpos = globalPos(pos, gridPos);
+				for (uint p = 0; p < m_numPlanes; p++)
+					PlaneForce(globalpos, pos.w, m_planes[p], m_planesDiv[p], as_float3(vel), dynvisc, force);
+			}
+
+			maxcfl = fmaxf(maxcfl, fmaxf(length(as_float3(force)), sspeed*sspeed/slength));
+		}
+
+		if (OBJECT(info)) {
+			const uint rbindex = id(info) + m_rbFirstIndex[object(info)];
+			m_rbForces[rbindex] = force;
+			m_rbTorques[rbindex] = make_float4(
+				cross(globalPos(pos, gridPos) - m_rbcg[object(info)], as_float3(force)));
+		} else if (load < numLoads) {
+			const uint slot = loads->firstSlot(load) + id(info) - loads->firstId(load);
+			m_loads[slot] = force;
+			m_loads[slot + loads->numIds(load)] = make_float4(
+				cross(globalPos(pos, gridPos) - loads->center(load), as_float3(force)));
+		} else
+			forces[index] = force;
+
+		if (FLUID(info) && usexsph)
+			xsph[index] = make_float4(2.0f*mean_vel, 0.0f);
+	}
+
+	m_threadCfl[thread] = fmaxf(m_threadCfl[thread], maxcfl);
+}
+
+void CPUWorker::kernel_euler()
+{
+	uint numPartsToElaborate = (onlyInternal() ? m_particleRangeEnd : m_numParticles);
+
+	// is the device empty? (unlikely but possible before LB kicks in)
+	if (numPartsToElaborate == 0) return;
+
+	for (uint t = 0; t < m_numThreads; t++)
+		m_threadMaxDisp[t] = 0;
+
+	parallel_for(&CPUWorker::eulerRange, numPartsToElaborate);
+
+	// maximum displacement in the whole step, for the neighbor list skin
+	const int step = eulerStep(commandFlags());
+	if (m_simparams->adaptiveneibsfreq && (step == 2 || step == 3)) {
+		float maxDisp = 0;
+		for (uint t = 0; t < m_numThreads; t++)
+			maxDisp = fmaxf(maxDisp, m_threadMaxDisp[t]);
+		gdata->maxDisplacements[m_deviceIndex] = maxDisp;
+	}
+}
+
+// Host version of eulerDevice() (euler_kernel.def)
+void CPUWorker::eulerRange(uint from, uint to, uint thread)
+{
+	const float4 *oldPos = m_buffers.getData<BUFFER_POS>(gdata->currentRead[BUFFER_POS]);
+	const float4 *oldVel = m_buffers.getData<BUFFER_VEL>(gdata->currentRead[BUFFER_VEL]);
+	const particleinfo *infoArray = m_buffers.getData<BUFFER_INFO>(gdata->currentRead[BUFFER_INFO]);
+	const hashKey *particleHash = m_buffers.getData<BUFFER_HASH>();
+	const float4 *forces = m_buffers.getData<BUFFER_FORCES>();
+	const float4 *xsph = m_buffers.getData<BUFFER_XSPH>();
+	float4 *newPos = m_buffers.getData<BUFFER_POS>(gdata->currentWrite[BUFFER_POS]);
+	float4 *newVel = m_buffers.getData<BUFFER_VEL>(gdata->currentWrite[BUFFER_VEL]);
+
+	const int step = eulerStep(commandFlags());
+	const float full_dt = gdata->dt;
+	const float half_dt = gdata->dt/2.0f;
+	const float dt = (step == 1) ? half_dt : full_dt;
+	const float kick_dt = (step == 2) ? full_dt : half_dt;
+	const bool xsphcorr = m_simparams->xsph;
+	const float epsxsph = m_physparams->epsxsph;
+	const bool trackDisplacement = m_simparams->adaptiveneibsfreq && (step == 2 || step == 3);
+	float maxDisp = 0;
+
+	for (uint index = from; index < to; index++) {
+		float4 pos = oldPos[index];		// always pos(n)
+		float4 vel = oldVel[index];		// always vel(n)
+
+		const particleinfo pinfo = infoArray[index];
+
+		if (ACTIVE(pos) && type(pinfo) != BOUNDPART) {
+			const float4 force = forces[index];	// f(n) at steps 1 and 3, f(n+1/2) at step 2, f(n+1) at step 4
+			const float4 mean_vel = xsphcorr ? xsph[index] : make_float4(0.0f);
+			/*
+			   velc = vel if step == 1, but
+			   velc = vel + forces[index]*dt/2.0f if step == 2 or 3
+			 */
+			const float4 velc = (step == 2 || step == 3) ? vel + force*half_dt : vel;
+
+			if (FLUID(pinfo)) {
+				if (!FIXED_PART(pinfo) && step != 4) {
+					pos.x += (velc.x + xsphcorr*epsxsph*mean_vel.x)*dt;
+					pos.y += (velc.y + xsphcorr*epsxsph*mean_vel.y)*dt;
+					pos.z += (velc.z + xsphcorr*epsxsph*mean_vel.z)*dt;
+				}
+
+				if (FIXED_PART(pinfo)) {
+					vel.w += kick_dt*force.w;
+				} else {
+					vel += kick_dt*force;
+				}
+			}
+			// the closing kick of kick-drift-kick does not move the boundaries
+			else if (step == 4) {
+			}
+			else if (type(pinfo) == PISTONPART) {
+				const int i = object(pinfo);
+				pos.x += m_mbData[i].x*dt;
+			}
+			else if (type(pinfo) == PADDLEPART) {
+				const int i = object(pinfo);
+				const float3 absPos = globalPos(pos, gridPosFromParticleHash(particleHash[index]));
+				const float2 relPos = make_float2(absPos.x - m_mbData[i].x, absPos.z - m_mbData[i].y);
+				const float c = cosf(m_mbData[i].z*dt) - 1.0f;
+				const float s = sinf(m_mbData[i].z*dt);
+				pos.x += c*relPos.x + s*relPos.y;
+				pos.z += -s*relPos.x + c*relPos.y;
+			}
+			else if (type(pinfo) == GATEPART) {
+				const int i = object(pinfo);
+				as_float3(pos) += as_float3(m_mbData[i])*dt;
+			}
+			else if (type(pinfo) == OBJECTPART && (step == 2 || step == 3)) {
+				const int i = object(pinfo);
+				as_float3(pos) += m_rbtrans[i];
+
+				// Applying rotation
+				const float3 relPos = globalPos(pos, gridPosFromParticleHash(particleHash[index])) - m_rbcg[i];
+				const float *rot = &m_rbsteprot[9*i];
+				pos.x += (rot[0] - 1.0f)*relPos.x + rot[1]*relPos.y + rot[2]*relPos.z;
+				pos.y += rot[3]*relPos.x + (rot[4] - 1.0f)*relPos.y + rot[5]*relPos.z;
+				pos.z += rot[6]*relPos.x + rot[7]*relPos.y + (rot[8] - 1.0f)*relPos.z;
+			}
+		}
+
+		newPos[index] = pos;
+		newVel[index] = vel;
+
+		if (trackDisplacement)
+			maxDisp = fmaxf(maxDisp, length(as_float3(pos) - as_float3(oldPos[index])));
+	}
+
+	m_threadMaxDisp[thread] = fmaxf(m_threadMaxDisp[thread], maxDisp);
+}
+
+void CPUWorker::kernel_mls()
+{
+	uint numPartsToElaborate = (onlyInternal() ? m_particleRangeEnd : m_numParticles);
+
+	// is the device empty? (unlikely but possible before LB kicks in)
+	if (numPartsToElaborate == 0) return;
+
+	parallel_for(&CPUWorker::mlsRange, numPartsToElaborate);
+}
+
+// Host version of MlsDevice() (forces_kernel.cu)
+void CPUWorker::mlsRange(uint from, uint to, uint thread)
+{
+	const float4 *posArray = m_buffers.getData<BUFFER_POS>(gdata->currentRead[BUFFER_POS]);
+	const float4 *velArray = m_buffers.getData<BUFFER_VEL>(gdata->currentRead[BUFFER_VEL]);
+	const particleinfo *infoArray = m_buffers.getData<BUFFER_INFO>(gdata->currentRead[BUFFER_INFO]);
+	const hashKey *particleHash = m_buffers.getData<BUFFER_HASH>();
+	const neibdata *neibsList = m_buffers.getData<BUFFER_NEIBSLIST>();
+	float4 *newVel = m_buffers.getData<BUFFER_VEL>(gdata->currentWrite[BUFFER_VEL]);
+
+	const float influenceradius = m_simparams->influenceRadius;
+	const idx_t stride = m_numAllocatedParticles;
+	const idx_t neiblist_end = m_simparams->maxneibsnum*stride;
+	const float W0 = W(0);
+
+	for (uint index = from; index < to; index++) {
+		const particleinfo info = infoArray[index];
+		const float4 pos = posArray[index];
+		float4 vel = velArray[index];
+
+		if (NOT_FLUID(info)) {
+			newVel[index] = vel;
+			continue;
+		}
+
+		symtensor4 mls;
+		mls.xx = mls.xy = mls.xz = mls.xw =
+			mls.yy = mls.yz = mls.yw =
+			mls.zz = mls.zw = mls.ww = 0;
+
+		int neibs_num = 0;
+
+		mls.xx = W0*pos.w/vel.w;
+
+		const int3 gridPos = gridPosFromParticleHash(particleHash[index]);
+
+		char neib_cellnum = 0;
+		uint neib_cell_base_index = 0;
+		float3 pos_corr;
+
+		for (idx_t i = 0; i < neiblist_end; i += stride) {
+			neibdata neib_data = neibsList[i + index];
+
+			if (neib_data == 0xffff) break;
+
+			const uint neib_index = getNeibIndex(pos, pos_corr, neib_data, gridPos,
+				neib_cellnum, neib_cell_base_index);
+
+			const float4 relPos = pos_corr - posArray[neib_index];
+
+			if (INACTIVE(relPos))
+				continue;
+
+			const float r = length3(relPos);
+
+			if (r < influenceradius && FLUID(infoArray[neib_index])) {
+				neibs_num++;
+				const float w = W(r)*relPos.w/velArray[neib_index].w;	// Wij*Vj
+				mls.xx += w;
+				mls.xy += relPos.x*w;
+				mls.xz += relPos.y*w;
+				mls.xw += relPos.z*w;
+				mls.yy += relPos.x*relPos.x*w;
+				mls.yz += relPos.x*relPos.y*w;
+				mls.yw += relPos.x*relPos.z*w;
+				mls.zz += relPos.y*relPos.y*w;
+				mls.zw += relPos.y*relPos.z*w;
+				mls.ww += relPos.z*relPos.z*w;
+			}
+		}
+
+		neib_cellnum = 0;
+		neib_cell_base_index = 0;
+
+		float maxa = norm_inf(mls);
+		maxa *= maxa;
+		maxa *= maxa;
+		float D = det(mls);
+		const bool corr = (D > maxa*EPSDETMLS && neibs_num > MINCORRNEIBSMLS);
+
+		float4 B = make_float4(0.0f);
+		float temp1 = 0, temp2 = 0;
+		if (corr) {
+			D = 1/D;
+			B.x = (mls.yy*mls.zz*mls.ww + mls.yz*mls.zw*mls.yw + mls.yw*mls.yz*mls.zw - mls.yy*mls.zw*mls.zw - mls.yz*mls.yz*mls.ww - mls.yw*mls.zz*mls.yw)*D;
+			B.y = (mls.xy*mls.zw*mls.zw + mls.yz*mls.xz*mls.ww + mls.yw*mls.zz*mls.xw - mls.xy*mls.zz*mls.ww - mls.yz*mls.zw*mls.xw - mls.yw*mls.xz*mls.zw)*D;
+			B.z = (mls.xy*mls.yz*mls.ww + mls.yy*mls.zw*mls.xw + mls.yw*mls.xz*mls.yw - mls.xy*mls.zw*mls.yw - mls.yy*mls.xz*mls.ww - mls.yw*mls.yz*mls.xw)*D;
+			B.w = (mls.xy*mls.zz*mls.yw + mls.yy*mls.xz*mls.zw + mls.yz*mls.yz*mls.xw - mls.xy*mls.yz*mls.zw - mls.yy*mls.zz*mls.xw - mls.yz*mls.xz*mls.yw)*D;
+
+			vel.w = B.x*W0*pos.w;
+		} else {
+			// Shepard filter fallback
+			temp1 = pos.w*W0;
+			temp2 = temp1/vel.w;
+		}
+
+		for (idx_t i = 0; i < neiblist_end; i += stride) {
+			neibdata neib_data = neibsList[i + index];
+
+			if (neib_data == 0xffff) break;
+
+			const uint neib_index = getNeibIndex(pos, pos_corr, neib_data, gridPos,
+				neib_cellnum, neib_cell_base_index);
+
+			const float4 relPos = pos_corr - posArray[neib_index];
+
+			if (INACTIVE(relPos))
+				continue;
+
+			const float r = length3(relPos);
+
+			if (r < influenceradius && FLUID(infoArray[neib_index])) {
+				const float w = W(r)*relPos.w;	 // ρj*Wij*Vj = mj*Wij
+				if (corr) {
+					vel.w += (B.x + B.y*relPos.x + B.z*relPos.y + B.w*relPos.z)*w;
+				} else {
+					temp1 += w;
+					temp2 += w/velArray[neib_index].w;
+				}
+			}
+		}
+
+		if (!corr)
+			vel.w = temp1/temp2;
+
+		newVel[index] = vel;
+	}
+}
+
+void CPUWorker::kernel_shepard()
+{
+	uint numPartsToElaborate = (onlyInternal() ? m_particleRangeEnd : m_numParticles);
+
+	// is the device empty? (unlikely but possible before LB kicks in)
+	if (numPartsToElaborate == 0) return;
+
+	parallel_for(&CPUWorker::shepardRange, numPartsToElaborate);
+}
+
+// Host version of shepardDevice() (forces_kernel.cu)
+void CPUWorker::shepardRange(uint from, uint to, uint thread)
+{
+	const float4 *posArray = m_buffers.getData<BUFFER_POS>(gdata->currentRead[BUFFER_POS]);
+	const float4 *velArray = m_buffers.getData<BUFFER_VEL>(gdata->currentRead[BUFFER_VEL]);
+	const particleinfo *infoArray = m_buffers.getData<BUFFER_INFO>(gdata->currentRead[BUFFER_INFO]);
+	const hashKey *particleHash = m_buffers.getData<BUFFER_HASH>();
+	const neibdata *neibsList = m_buffers.getData<BUFFER_NEIBSLIST>();
+	float4 *newVel = m_buffers.getData<BUFFER_VEL>(gdata->currentWrite[BUFFER_VEL]);
+
+	const float influenceradius = m_simparams->influenceRadius;
+	const idx_t stride = m_numAllocatedParticles;
+	const idx_t neiblist_end = m_simparams->maxneibsnum*stride;
+
+	for (uint index = from; index < to; index++) {
+		const particleinfo info = infoArray[index];
+		const float4 pos = posArray[index];
+		float4 vel = velArray[index];
+
+		if (NOT_FLUID(info) && !VERTEX(info)) {
+			newVel[index] = vel;
+			continue;
+		}
+
+		float temp1 = pos.w*W(0);
+		float temp2 = temp1/vel.w;
+
+		const int3 gridPos = gridPosFromParticleHash(particleHash[index]);
+
+		char neib_cellnum = 0;
+		uint neib_cell_base_index = 0;
+		float3 pos_corr;
+
+		for (idx_t i = 0; i < neiblist_end; i += stride) {
+			neibdata neib_data = neibsList[i + index];
+
+			if (neib_data == 0xffff) break;
+
+			const uint neib_index = getNeibIndex(pos, pos_corr, neib_data, gridPos,
+				neib_cellnum, neib_cell_base_index);
+
+			const float4 relPos = pos_corr - posArray[neib_index];
+
+			if (INACTIVE(relPos))
+				continue;
+
+			const float r = length3(relPos);
+
+			if (r < influenceradius && FLUID(infoArray[neib_index])) {
+				const float w = W(r)*relPos.w;
+				temp1 += w;
+				temp2 += w/velArray[neib_index].w;
+			}
+		}
+
+		vel.w = temp1/temp2;
+		newVel[index] = vel;
+	}
+}
+
+void CPUWorker::kernel_vorticity()
+{
+	uint numPartsToElaborate = (onlyInternal() ? m_particleRangeEnd : m_numParticles);
+
+	// is the device empty? (unlikely but possible before LB kicks in)
+	if (numPartsToElaborate == 0) return;
+
+	parallel_for(&CPUWorker::vorticityRange, numPartsToElaborate);
+}
+
+// Host version of calcVortDevice() (forces_kernel.cu)
+void CPUWorker::vorticityRange(uint from, uint to, uint thread)
+{
+	const float4 *posArray = m_buffers.getData<BUFFER_POS>(gdata->currentRead[BUFFER_POS]);
+	const float4 *velArray = m_buffers.getData<BUFFER_VEL>(gdata->currentRead[BUFFER_VEL]);
+	const particleinfo *infoArray = m_buffers.getData<BUFFER_INFO>(gdata->currentRead[BUFFER_INFO]);
+	const hashKey *particleHash = m_buffers.getData<BUFFER_HASH>();
+	const neibdata *neibsList = m_buffers.getData<BUFFER_NEIBSLIST>();
+	float3 *vorticity = m_buffers.getData<BUFFER_VORTICITY>();
+
+	const float influenceradius = m_simparams->influenceRadius;
+	const idx_t stride = m_numAllocatedParticles;
+	const idx_t neiblist_end = m_simparams->maxneibsnum*stride;
+
+	for (uint index = from; index < to; index++) {
+		const particleinfo info = infoArray[index];
+		if (NOT_FLUID(info))
+			continue;
+
+		const float4 pos = posArray[index];
+		const float4 vel = velArray[index];
+
+		float3 vort = make_float3(0.0f);
+
+		const int3 gridPos = gridPosFromParticleHash(particleHash[index]);
+
+		char neib_cellnum = 0;
+		uint neib_cell_base_index = 0;
+		float3 pos_corr;
+
+		for (idx_t i = 0; i < neiblist_end; i += stride) {
+			neibdata neib_data = neibsList[i + index];
+
+			if (neib_data == 0xffff) break;
+
+			const uint neib_index = getNeibIndex(pos, pos_corr, neib_data, gridPos,
+				neib_cellnum, neib_cell_base_index);
+
+			const float4 relPos = pos_corr - posArray[neib_index];
+
+			if (INACTIVE(relPos))
+				continue;
+
+			const float r = length3(relPos);
+
+			const float4 relVel = as_float3(vel) - velArray[neib_index];
+
+			if (r < influenceradius && FLUID(infoArray[neib_index])) {
+				const float f = F(r)*relPos.w/relVel.w;	// ∂Wij/∂r*Vj
+				vort.x += f*(relVel.y*relPos.z - relVel.z*relPos.y);
+				vort.y += f*(relVel.z*relPos.x - relVel.x*relPos.z);
+				vort.z += f*(relVel.x*relPos.y - relVel.y*relPos.x);
+			}
+		}
+
+		vorticity[index] = vort;
+	}
+}
+
+void CPUWorker::kernel_surfaceParticles()
+{
+	uint numPartsToElaborate = (onlyInternal() ? m_particleRangeEnd : m_numParticles);
+
+	// is the device empty? (unlikely but possible before LB kicks in)
+	if (numPartsToElaborate == 0) return;
+
+	parallel_for(&CPUWorker::surfaceParticlesRange, numPartsToElaborate);
+}
+
+// Host version of calcSurfaceparticleDevice() (forces_kernel.cu)
+void CPUWorker::surfaceParticlesRange(uint from, uint to, uint thread)
+{
+	const float4 *posArray = m_buffers.getData<BUFFER_POS>(gdata->currentRead[BUFFER_POS]);
+	const float4 *velArray = m_buffers.getData<BUFFER_VEL>(gdata->currentRead[BUFFER_VEL]);
+	const particleinfo *infoArray = m_buffers.getData<BUFFER_INFO>(gdata->currentRead[BUFFER_INFO]);
+	particleinfo *newInfo = m_buffers.getData<BUFFER_INFO>(gdata->currentWrite[BUFFER_INFO]);
+	const hashKey *particleHash = m_buffers.getData<BUFFER_HASH>();
+	const neibdata *neibsList = m_buffers.getData<BUFFER_NEIBSLIST>();
+	float4 *normals = m_buffers.getData<BUFFER_NORMALS>();
+
+	const float influenceradius = m_simparams->influenceRadius;
+	const bool savenormals = m_simparams->savenormals;
+	const idx_t stride = m_numAllocatedParticles;
+	const idx_t neiblist_end = m_simparams->maxneibsnum*stride;
+
+	for (uint index = from; index < to; index++) {
+		particleinfo info = infoArray[index];
+		const float4 pos = posArray[index];
+		float4 normal = make_float4(0.0f);
+
+		if (NOT_FLUID(info) || INACTIVE(pos)) {
+			newInfo[index] = info;
+			continue;
+		}
+
+		const int3 gridPos = gridPosFromParticleHash(particleHash[index]);
+
+		CLEAR_FLAG(info, SURFACE_PARTICLE_FLAG);
+		normal.w = W(0.0f)*pos.w;
+
+		char neib_cellnum = 0;
+		uint neib_cell_base_index = 0;
+		float3 pos_corr;
+
+		// First loop over all neighbors: compute the normal
+		for (idx_t i = 0; i < neiblist_end; i += stride) {
+			neibdata neib_data = neibsList[i + index];
+
+			if (neib_data == 0xffff) break;
+
+			const uint neib_index = getNeibIndex(pos, pos_corr, neib_data, gridPos,
+				neib_cellnum, neib_cell_base_index);
+
+			const float4 relPos = pos_corr - posArray[neib_index];
+
+			if (INACTIVE(relPos))
+				continue;
+
+			const float r = length3(relPos);
+
+			if (r < influenceradius) {
+				const float f = F(r)*relPos.w/velArray[neib_index].w; // 1/r ∂Wij/∂r Vj
+				normal.x -= f * relPos.x;
+				normal.y -= f * relPos.y;
+				normal.z -= f * relPos.z;
+				normal.w += W(r)*relPos.w;	// Wij*mj
+			}
+		}
+
+		float normal_length = length(as_float3(normal));
+
+		// Checking the planes
+		const float3 globalpos = globalPos(pos, gridPos);
+		for (uint p = 0; p < m_numPlanes; ++p) {
+			const float r = fabsf(dot(globalpos, as_float3(m_planes[p])) + m_planes[p].w)/m_planesDiv[p];
+			if (r < influenceradius) {
+				as_float3(normal) += as_float3(m_planes[p])*normal_length;
+				normal_length = length(as_float3(normal));
+			}
+		}
+
+		neib_cellnum = 0;
+		neib_cell_base_index = 0;
+
+		// Second loop over all neighbors: check the cone
+		int nc = 0;
+		for (idx_t i = 0; i < neiblist_end; i += stride) {
+			neibdata neib_data = neibsList[i + index];
+
+			if (neib_data == 0xffff) break;
+
+			const uint neib_index = getNeibIndex(pos, pos_corr, neib_data, gridPos,
+				neib_cellnum, neib_cell_base_index);
+
+			const float4 relPos = pos_corr - posArray[neib_index];
+
+			if (INACTIVE(relPos))
+				continue;
+
+			const float r = length3(relPos);
+
+			if (r < influenceradius) {
+				const float criteria = -(normal.x * relPos.x + normal.y * relPos.y + normal.z * relPos.z);
+				const float cosconeangle = FLUID(infoArray[neib_index]) ?
+					m_physparams->cosconeanglefluid : m_physparams->cosconeanglenonfluid;
+
+				if (criteria > r*normal_length*cosconeangle)
+					nc++;
+			}
+		}
+
+		if (!nc)
+			SET_FLAG(info, SURFACE_PARTICLE_FLAG);
+
+		newInfo[index] = info;
+
+		if (savenormals) {
+			normal.x /= normal_length;
+			normal.y /= normal_length;
+			normal.z /= normal_length;
+			normals[index] = normal;
+		}
+	}
+}
+
+void CPUWorker::kernel_sps()
+{
+	uint numPartsToElaborate = (onlyInternal() ? m_particleRangeEnd : m_numParticles);
+
+	// is the device empty? (unlikely but possible before LB kicks in)
+	if (numPartsToElaborate == 0) return;
+
+	parallel_for(&CPUWorker::spsRange, numPartsToElaborate);
+}
+
+// Host version of SPSstressMatrixDevice() (forces_kernel.cu)
+void CPUWorker::spsRange(uint from, uint to, uint thread)
+{
+	const float4 *posArray = m_buffers.getData<BUFFER_POS>(gdata->currentRead[BUFFER_POS]);
+	const float4 *velArray = m_buffers.getData<BUFFER_VEL>(gdata->currentRead[BUFFER_VEL]);
+	const particleinfo *infoArray = m_buffers.getData<BUFFER_INFO>(gdata->currentRead[BUFFER_INFO]);
+	const hashKey *particleHash = m_buffers.getData<BUFFER_HASH>();
+	const neibdata *neibsList = m_buffers.getData<BUFFER_NEIBSLIST>();
+	float2 **tau = m_buffers.getRawPtr<BUFFER_TAU>();
+
+	const float influenceradius = m_simparams->influenceRadius;
+	const idx_t stride = m_numAllocatedParticles;
+	const idx_t neiblist_end = m_simparams->maxneibsnum*stride;
+
+	for (uint index = from; index < to; index++) {
+		const particleinfo info = infoArray[index];
+		if (NOT_FLUID(info))
+			continue;
+
+		const float4 pos = posArray[index];
+		if (INACTIVE(pos))
+			continue;
+
+		const float4 vel = velArray[index];
+
+		symtensor3 tau_i;
+
+		float3 dvx = make_float3(0.0f);
+		float3 dvy = make_float3(0.0f);
+		float3 dvz = make_float3(0.0f);
+
+		const int3 gridPos = gridPosFromParticleHash(particleHash[index]);
+
+		char neib_cellnum = -1;
+		uint neib_cell_base_index = 0;
+		float3 pos_corr;
+
+		for (idx_t i = 0; i < neiblist_end; i += stride) {
+			neibdata neib_data = neibsList[i + index];
+
+			if (neib_data == 0xffff) break;
+
+			const uint neib_index = getNeibIndex(pos, pos_corr, neib_data, gridPos,
+				neib_cellnum, neib_cell_base_index);
+
+			const float4 relPos = pos_corr - posArray[neib_index];
+
+			if (INACTIVE(relPos))
+				continue;
+
+			const float r = length3(relPos);
+
+			const float4 relVel = as_float3(vel) - velArray[neib_index];
+
+			if (r < influenceradius && FLUID(infoArray[neib_index])) {
+				const float f = F(r)*relPos.w/relVel.w;	// 1/r ∂Wij/∂r Vj
+
+				dvx -= relVel.x*as_float3(relPos)*f;	// dvx = -∑mj/ρj vxij (ri - rj)/r ∂Wij/∂r
+				dvy -= relVel.y*as_float3(relPos)*f;	// dvy = -∑mj/ρj vyij (ri - rj)/r ∂Wij/∂r
+				dvz -= relVel.z*as_float3(relPos)*f;	// dvz = -∑mj/ρj vzij (ri - rj)/r ∂Wij/∂r
+			}
+		}
+
+		float SijSij_bytwo = 2.0f*(dvx.x*dvx.x + dvy.y*dvy.y + dvz.z*dvz.z);	// 2*SijSij = 2.0((∂vx/∂x)^2 + (∂vy/∂yx)^2 + (∂vz/∂z)^2)
+		float temp = dvx.y + dvy.x;		// 2*SijSij += (∂vx/∂y + ∂vy/∂x)^2
+		tau_i.xy = temp;
+		SijSij_bytwo += temp*temp;
+		temp = dvx.z + dvz.x;			// 2*SijSij += (∂vx/∂z + ∂vz/∂x)^2
+		tau_i.xz = temp;
+		SijSij_bytwo += temp*temp;
+		temp = dvy.z + dvz.y;			// 2*SijSij += (∂vy/∂z + ∂vz/∂y)^2
+		tau_i.yz = temp;
+		SijSij_bytwo += temp*temp;
+		const float S = sqrtf(SijSij_bytwo);
+		const float nu_SPS = m_physparams->smagfactor*S;		// Dalrymple & Rogers (2006): eq. (12)
+		const float divu_SPS = 0.6666666666f*nu_SPS*(dvx.x + dvy.y + dvz.z);
+		const float Blinetal_SPS = m_physparams->kspsfactor*SijSij_bytwo;
+
+		tau_i.xx = nu_SPS*(dvx.x + dvx.x) - divu_SPS - Blinetal_SPS;	// tau11 = tau_xx/ρ^2
+		tau_i.xx /= vel.w;
+		tau_i.xy *= nu_SPS/vel.w;								// tau12 = tau_xy/ρ^2
+		tau_i.xz *= nu_SPS/vel.w;								// tau13 = tau_xz/ρ^2
+		tau_i.yy = nu_SPS*(dvy.y + dvy.y) - divu_SPS - Blinetal_SPS;	// tau22 = tau_yy/ρ^2
+		tau_i.yy /= vel.w;
+		tau_i.yz *= nu_SPS/vel.w;								// tau23 = tau_yz/ρ^2
+		tau_i.zz = nu_SPS*(dvz.z + dvz.z) - divu_SPS - Blinetal_SPS;	// tau33 = tau_zz/ρ^2
+		tau_i.zz /= vel.w;
+
+		tau[0][index] = make_float2(tau_i.xx, tau_i.xy);
+		tau[1][index] = make_float2(tau_i.xz, tau_i.yy);
+		tau[2][index] = make_float2(tau_i.yz, tau_i.zz);
+	}
+}
+
+// the per-particle forces and torques of each body are contiguous, so a plain
+// sum over each body replaces the segmented scan done on the device
+void CPUWorker::kernel_reduceRBForces()
+{
+	// is the device empty? (unlikely but possible before LB kicks in)
+	if (m_numParticles == 0) return;
+
+	for (uint ob = 0; ob < m_simparams->numODEbodies; ob++) {
+		float3 totalForce = make_float3(0.0f);
+		float3 totalTorque = make_float3(0.0f);
+		for (uint i = m_rbFirstIndex[ob]; i <= gdata->s_hRbLastIndex[ob]; i++) {
+			totalForce += as_float3(m_rbForces[i]);
+			totalTorque += as_float3(m_rbTorques[i]);
+		}
+		gdata->s_hRbTotalForce[m_deviceIndex][ob] = totalForce;
+		gdata->s_hRbTotalTorque[m_deviceIndex][ob] = totalTorque;
+	}
+}
+
+uint CPUWorker::loadIndex(const particleinfo &info) const
+{
+	const uint numLoads = gdata->loads ? gdata->loads->numWallLoads() : 0;
+	uint load = numLoads;
+	if (WALL(info))
+		for (load = 0; load < numLoads; load++)
+			if (gdata->loads->object(load) == object(info))
+				break;
+	return load;
+}
+
+// the forces of each loaded object, and then its moments, are contiguous, so
+// a plain sum replaces the segmented reduction done on the device
+void CPUWorker::kernel_reduceLoads()
+{
+	Loads *loads = gdata->loads;
+	float4 *partial = loads->partial(m_deviceIndex);
+
+	for (uint l = 0; l < loads->numWallLoads(); l++) {
+		const float4 *forces = m_loads + loads->firstSlot(l);
+		const float4 *moments = forces + loads->numIds(l);
+		float4 force = make_float4(0.0f);
+		float4 moment = make_float4(0.0f);
+		for (uint i = 0; i < loads->numIds(l); i++) {
+			force += forces[i];
+			moment += moments[i];
+		}
+		partial[2*l] = force;
+		partial[2*l + 1] = moment;
+	}
+}
+
+void CPUWorker::kernel_calcPrivate()
+{
+	uint numPartsToElaborate = (onlyInternal() ? m_particleRangeEnd : m_numParticles);
+
+	// is the device empty? (unlikely but possible before LB kicks in)
+	if (numPartsToElaborate == 0) return;
+
+	parallel_for(&CPUWorker::calcPrivateRange, numPartsToElaborate);
+}
+
+// Host version of calcPrivateDevice() (forces_kernel.cu): counts the neighbors
+void CPUWorker::calcPrivateRange(uint from, uint to, uint thread)
+{
+	const float4 *posArray = m_buffers.getData<BUFFER_POS>(gdata->currentRead[BUFFER_POS]);
+	const hashKey *particleHash = m_buffers.getData<BUFFER_HASH>();
+	const neibdata *neibsList = m_buffers.getData<BUFFER_NEIBSLIST>();
+	float *priv = m_buffers.getData<BUFFER_PRIVATE>();
+
+	const float influenceradius = m_simparams->influenceRadius;
+	const idx_t stride = m_numAllocatedParticles;
+	const idx_t neiblist_end = m_simparams->maxneibsnum*stride;
+
+	for (uint index = from; index < to; index++) {
+		const float4 pos = posArray[index];
+		const int3 gridPos = gridPosFromParticleHash(particleHash[index]);
+
+		char neib_cellnum = 0;
+		uint neib_cell_base_index = 0;
+		float3 pos_corr;
+
+		float count = 0.0f;
+
+		for (idx_t i = 0; i < neiblist_end; i += stride) {
+			neibdata neib_data = neibsList[i + index];
+
+			if (neib_data == 0xffff) break;
+
+			const uint neib_index = getNeibIndex(pos, pos_corr, neib_data, gridPos,
+				neib_cellnum, neib_cell_base_index);
+
+			const float4 relPos = pos_corr - posArray[neib_index];
+			if (length3(relPos) < influenceradius)
+				count += 1.0f;
+		}
+
+		priv[index] = count;
+	}
+}
+
+void CPUWorker::kernel_testpoints()
+{
+	uint numPartsToElaborate = (onlyInternal() ? m_particleRangeEnd : m_numParticles);
+
+	// is the device empty? (unlikely but possible before LB kicks in)
+	if (numPartsToElaborate == 0) return;
+
+	parallel_for(&CPUWorker::testpointsRange, numPartsToElaborate);
+}
+
+// Host version of calcTestpointsVelocityDevice() (forces_kernel.cu).
+// As on the device, the velocity of the testpoints is updated in place
+void CPUWorker::testpointsRange(uint from, uint to, uint thread)
+{
+	const float4 *posArray = m_buffers.getData<BUFFER_POS>(gdata->currentRead[BUFFER_POS]);
+	float4 *velArray = m_buffers.getData<BUFFER_VEL>(gdata->currentRead[BUFFER_VEL]);
+	const particleinfo *infoArray = m_buffers.getData<BUFFER_INFO>(gdata->currentRead[BUFFER_INFO]);
+	const hashKey *particleHash = m_buffers.getData<BUFFER_HASH>();
+	const neibdata *neibsList = m_buffers.getData<BUFFER_NEIBSLIST>();
+
+	const float influenceradius = m_simparams->influenceRadius;
+	const idx_t stride = m_numAllocatedParticles;
+	const idx_t neiblist_end = m_simparams->maxneibsnum*stride;
+
+	for (uint index = from; index < to; index++) {
+		const particleinfo info = infoArray[index];
+		if (type(info) != TESTPOINTSPART)
+			continue;
+
+		const float4 pos = posArray[index];
+
+		float4 temp = make_float4(0.0f);
+		float alpha = 0.0f;
+
+		const int3 gridPos = gridPosFromParticleHash(particleHash[index]);
+
+		char neib_cellnum = 0;
+		uint neib_cell_base_index = 0;
+		float3 pos_corr;
+
+		for (idx_t i = 0; i < neiblist_end; i += stride) {
+			neibdata neib_data = neibsList[i + index];
+
+			if (neib_data == 0xffff) break;
+
+			const uint neib_index = getNeibIndex(pos, pos_corr, neib_data, gridPos,
+				neib_cellnum, neib_cell_base_index);
+
+			const float4 relPos = pos_corr - posArray[neib_index];
+
+			if (INACTIVE(relPos))
+				continue;
+
+			const float r = length3(relPos);
+
+			const particleinfo neib_info = infoArray[neib_index];
+
+			// testpoints never appear as neighbors, so their velocity is never
+			// read here while other pool threads update it
+			if (r < influenceradius && FLUID(neib_info)) {
+				const float4 neib_vel = velArray[neib_index];
+				const float w = W(r)*relPos.w/neib_vel.w;	// Wij*mj
+				temp.x += w*neib_vel.x;
+				temp.y += w*neib_vel.y;
+				temp.z += w*neib_vel.z;
+				temp.w += w*P(neib_vel.w, object(neib_info));
+				alpha += w;
+			}
+		}
+
+		if (alpha > 1e-5)
+			velArray[index] = temp/alpha;
+		else
+			velArray[index] = make_float4(0.0f);
+	}
+}
+
+// Welford's update of a running statistics accumulator with its n-th sample,
+// as statsUpdate() (forces_kernel.cu)
+static inline void
+statsUpdate(float4 &acc, const float value, const uint n)
+{
+	if (n == 1) {
+		acc = make_float4(value, 0.0f, value, value);
+		return;
+	}
+	const float delta = value - acc.x;
+	acc.x += delta/n;
+	acc.y += delta*(value - acc.x);
+	acc.z = fminf(acc.z, value);
+	acc.w = fmaxf(acc.w, value);
+}
+
+void CPUWorker::kernel_accumulateStats()
+{
+	if (!gdata->runningStats) return;
+
+	parallel_for(&CPUWorker::cellStatsRange, m_nGridCells);
+
+	uint numPartsToElaborate = (onlyInternal() ? m_particleRangeEnd : m_numParticles);
+	if (m_probeCount && numPartsToElaborate)
+		parallel_for(&CPUWorker::probeStatsRange, numPartsToElaborate);
+}
+
+// Host version of accumulateCellStatsDevice() (forces_kernel.cu), on cells [from, to)
+void CPUWorker::cellStatsRange(uint from, uint to, uint thread)
+{
+	const float4 *velArray = m_buffers.getData<BUFFER_VEL>(gdata->currentRead[BUFFER_VEL]);
+	const particleinfo *infoArray = m_buffers.getData<BUFFER_INFO>(gdata->currentRead[BUFFER_INFO]);
+
+	const uint particleRangeEnd = (onlyInternal() ? m_particleRangeEnd : m_numParticles);
+
+	for (uint cell = from; cell < to; cell++) {
+		const uint start = m_cellStart[cell];
+		if (start == UINT_MAX || start >= particleRangeEnd)
+			continue;
+		const uint end = m_cellEnd[cell];
+
+		uint n = m_statsCount[cell];
+		for (uint index = start; index < end; index++) {
+			const particleinfo info = infoArray[index];
+			if (NOT_FLUID(info))
+				continue;
+
+			const float4 vel = velArray[index];
+			++n;
+			statsUpdate(m_stats[STATS_VELX*m_nGridCells + cell], vel.x, n);
+			statsUpdate(m_stats[STATS_VELY*m_nGridCells + cell], vel.y, n);
+			statsUpdate(m_stats[STATS_VELZ*m_nGridCells + cell], vel.z, n);
+			statsUpdate(m_stats[STATS_DENSITY*m_nGridCells + cell], vel.w, n);
+			statsUpdate(m_stats[STATS_PRESSURE*m_nGridCells + cell], P(vel.w, PART_FLUID_NUM(info)), n);
+		}
+		m_statsCount[cell] = n;
+	}
+}
+
+// Host version of accumulateProbeStatsDevice() (forces_kernel.cu)
+void CPUWorker::probeStatsRange(uint from, uint to, uint thread)
+{
+	const float4 *velArray = m_buffers.getData<BUFFER_VEL>(gdata->currentRead[BUFFER_VEL]);
+	const particleinfo *infoArray = m_buffers.getData<BUFFER_INFO>(gdata->currentRead[BUFFER_INFO]);
+
+	const RunningStats *stats = gdata->runningStats;
+	const uint *probeIds = stats->probeIds();
+	const uint numProbes = stats->numProbes();
+
+	for (uint index = from; index < to; index++) {
+		const particleinfo info = infoArray[index];
+		if (type(info) != TESTPOINTSPART)
+			continue;
+
+		const uint *probe = std::lower_bound(probeIds, probeIds + numProbes, id(info));
+		if (probe == probeIds + numProbes || *probe != id(info))
+			continue;
+		const uint p = probe - probeIds;
+
+		const float4 vel = velArray[index];
+		const uint n = ++m_probeCount[p];
+		statsUpdate(m_probeStats[STATS_VELX*numProbes + p], vel.x, n);
+		statsUpdate(m_probeStats[STATS_VELY*numProbes + p], vel.y, n);
+		statsUpdate(m_probeStats[STATS_VELZ*numProbes + p], vel.z, n);
+		statsUpdate(m_probeStats[STATS_PRESSURE*numProbes + p], vel.w, n);
+	}
+}
+
+// merge the statistics accumulated by the worker and restart accumulating
+void CPUWorker::downloadStats()
+{
+	RunningStats *stats = gdata->runningStats;
+	if (!stats) return;
+
+	const uint numFields = stats->numFields();
+
+	stats->merge(0, m_nGridCells, m_statsCount, m_stats);
+	memset(m_statsCount, 0, m_nGridCells*sizeof(uint));
+	memset(m_stats, 0, (size_t)m_nGridCells*numFields*sizeof(float4));
+
+	const uint numProbes = stats->numProbes();
+	if (!numProbes) return;
+
+	stats->merge(m_nGridCells, numProbes, m_probeCount, m_probeStats);
+	memset(m_probeCount, 0, numProbes*sizeof(uint));
+	memset(m_probeStats, 0, (size_t)numProbes*numFields*sizeof(float4));
+}
+
+// Host version of trackTracersDevice() (buildneibs_kernel.cu)
+void CPUWorker::kernel_trackTracers()
+{
+	if (!gdata->tracers) return;
+
+	uint numPartsToElaborate = (onlyInternal() ? m_numInternalParticles : m_numParticles);
+
+	const uint *inversedParticleIndex = m_buffers.getData<BUFFER_INVINDEX>();
+	const uint numTracers = gdata->tracers->numTracers();
+
+	for (uint t = 0; t < numTracers; t++) {
+		const uint index = m_tracerIndex[t];
+		m_tracerIndex[t] = (index < numPartsToElaborate ? inversedParticleIndex[index] : UINT_MAX);
+	}
+}
+
+void CPUWorker::kernel_locateTracers()
+{
+	if (!gdata->tracers) return;
+
+	std::fill(m_tracerIndex, m_tracerIndex + gdata->tracers->numTracers(), UINT_MAX);
+	if (m_numInternalParticles)
+		parallel_for(&CPUWorker::locateTracersRange, m_numInternalParticles);
+}
+
+// Host version of locateTracersDevice() (buildneibs_kernel.cu)
+void CPUWorker::locateTracersRange(uint from, uint to, uint thread)
+{
+	const particleinfo *infoArray = m_buffers.getData<BUFFER_INFO>(gdata->currentRead[BUFFER_INFO]);
+
+	const uint *tracerIds = gdata->tracers->ids();
+	const uint numTracers = gdata->tracers->numTracers();
+
+	for (uint index = from; index < to; index++) {
+		const uint pid = id(infoArray[index]);
+		const uint *tracer = std::lower_bound(tracerIds, tracerIds + numTracers, pid);
+		if (tracer != tracerIds + numTracers && *tracer == pid)
+			m_tracerIndex[tracer - tracerIds] = index;
+	}
+}
+
+// Host version of gatherTracersDevice() (buildneibs_kernel.cu): gather the tracers
+// held by the worker and merge them into the shared Tracers
+void CPUWorker::downloadTracers()
+{
+	Tracers *tracers = gdata->tracers;
+	if (!tracers) return;
+
+	const float4 *posArray = m_buffers.getData<BUFFER_POS>(gdata->currentRead[BUFFER_POS]);
+	const hashKey *hashArray = m_buffers.getData<BUFFER_HASH>();
+	const float4 *velArray = m_buffers.getData<BUFFER_VEL>(gdata->currentRead[BUFFER_VEL]);
+	const particleinfo *infoArray = m_buffers.getData<BUFFER_INFO>(gdata->currentRead[BUFFER_INFO]);
+
+	const uint *tracerIds = tracers->ids();
+	const uint numTracers = tracers->numTracers();
+
+	for (uint t = 0; t < numTracers; t++) {
+		const uint index = m_tracerIndex[t];
+		if (index >= m_numInternalParticles || id(infoArray[index]) != tracerIds[t]) {
+			m_tracerIndex[t] = UINT_MAX;
+			continue;
+		}
+		m_tracerPos[t] = posArray[index];
+		m_tracerHash[t] = hashArray[index];
+		m_tracerVel[t] = velArray[index];
+	}
+
+	tracers->merge(m_tracerIndex, m_tracerPos, m_tracerHash, m_tracerVel);
+}
+
+void CPUWorker::uploadConstants()
+{
+	// NOTE: visccoeff must be set before uploading the constants. This is done in GPUSPH main cycle
+
+	// Setting kernels and kernels derivative factors
+	const float h = m_simparams->slength;
+	const float h3 = h*h*h;
+	const float h4 = h3*h;
+	const float h5 = h4*h;
+	m_wcoeff = kernel_coeff(m_simparams->kerneltype, h);
+	switch (m_simparams->kerneltype) {
+	case CUBICSPLINE:
+		m_fcoeff = 3.0f/(4.0f*M_PI*h4);
+		break;
+	case QUADRATIC:
+		m_fcoeff = 15.0f/(32.0f*M_PI*h4);
+		break;
+	case WENDLAND:
+		m_fcoeff = 105.0f/(128.0f*M_PI*h5);
+		break;
+	default:
+		fprintf(stderr, "FATAL: unknown kernel type %d\n", m_simparams->kerneltype);
+		exit(1);
+	}
+
+	m_gravity = m_physparams->gravity;
+
+	m_partsurf = m_physparams->partsurf;
+	if (m_partsurf == 0.0f)
+		m_partsurf = m_physparams->r0*m_physparams->r0;
+}
+
+void CPUWorker::uploadBodiesCentersOfGravity()
+{
+	if (m_simparams->numODEbodies && gdata->s_hRbGravityCenters)
+		memcpy(m_rbcg, gdata->s_hRbGravityCenters, m_simparams->numODEbodies*sizeof(float3));
+}
+
+void CPUWorker::uploadBodiesTransRotMatrices()
+{
+	if (!m_simparams->numODEbodies)
+		return;
+	memcpy(m_rbtrans, gdata->s_hRbTranslations, m_simparams->numODEbodies*sizeof(float3));
+	memcpy(m_rbsteprot, gdata->s_hRbRotationMatrices, 9*m_simparams->numODEbodies*sizeof(float));
+}
@@ -0,0 +1,340 @@
+/*  Copyright 2013 Alexis Herault, Giuseppe Bilotta, Robert A. Dalrymple, Eugenio Rustico, Ciro Del Negro
+
+    Istituto Nazionale di Geofisica e Vulcanologia
+        Sezione di Catania, Catania, Italy
+
+    Università di Catania, Catania, Italy
+
+    Johns Hopkins University, Baltimore, MD
+
+    This file is part of GPUSPH.
+
+    GPUSPH is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GPUSPH is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GPUSPH.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CPUWORKER_H_
+#define CPUWORKER_H_
+
+#include <pthread.h>
+#include <utility>
+#include <vector>
+
+#include "vector_types.h"
+#include "common_types.h"
+#include "GlobalData.h"
+
+#include "physparams.h"
+#include "simparams.h"
+
+// buffers and buffer lists
+#include "buffer.h"
+
+// common worker interface
+#include "AbstractWorker.h"
+
+// for the thread pool
+#include "Synchronizer.h"
+
+// per-command timing
+#include "CommandProfiler.h"
+
+// The CPUWorker is a drop-in replacement for the GPUWorker which runs all the
+// commands issued by GPUSPH on the host. It follows exactly the same protocol
+// (barriers, double buffers, shared arrays in GlobalData) so that GPUSPH does not
+// need to know which backend is actually computing. Each "kernel" is split in
+// chunks of particles which are processed by a private pool of host threads.
+// As in GPUWorker, all the methods which are only called by simulationThread()
+// are private.
+class CPUWorker : public AbstractWorker {
+private:
+	pthread_t pthread_id;
+	static void* simulationThread(void *ptr);
+	GlobalData* gdata;
+
+	// parameters of the command being run, from GlobalData or from the command sequence.
+	// Read them with commandFlags() and onlyInternal(), which also know about the
+	// steps run as pool tasks
+	flag_t	m_commandFlags;
+	bool	m_onlyInternal;
+	flag_t	commandFlags() const;
+	bool	onlyInternal() const;
+
+	// execute a command, or all the steps of gdata->commandSequence
+	void runCommand(CommandType cmd, flag_t flags, bool only_internal);
+	void runCommandSequence();
+
+	// command times and timeline (see --profile and --trace)
+	CommandProfiler m_profiler;
+
+	unsigned int m_deviceIndex;
+	GlobalData* getGlobalData();
+	unsigned int getDeviceIndex();
+
+	// number of particles of the assigned subset
+	uint m_numParticles;
+	// number of cells of the grid of the whole world
+	uint m_nGridCells;
+	// number of allocated particles (includes internal, external and unused slots)
+	uint m_numAllocatedParticles;
+	// number of internal particles, used for multi-GPU
+	uint m_numInternalParticles;
+
+	// range of particles the kernels should write to
+	uint m_particleRangeBegin; // inclusive
+	uint m_particleRangeEnd;   // exclusive
+
+	// memory allocated
+	size_t m_hostMemory;
+
+	// utility pointers - the actual structures are in Problem
+	PhysParams*	m_physparams;
+	SimParams*	m_simparams;
+
+	// working arrays, in host memory
+	BufferList	m_buffers;
+
+	uint*		m_cellStart;			// index of cell start in sorted order
+	uint*		m_cellEnd;				// index of cell end in sorted order
+
+	// arrays for rigid bodies (totals are in GlobalData)
+	uint		m_numBodiesParticles;	// Total number of particles belonging to rigid bodies
+	float4*		m_rbForces;				// Forces on particles belonging to rigid bodies
+	float4*		m_rbTorques;			// Torques on particles belonging to rigid bodies
+	uint		m_rbFirstIndex[MAXBODIES];	// index of the first particle of each body
+
+	// host copies of the constants the GPUWorker uploads to the device
+	float3		m_gravity;
+	float4		m_mbData[MAXMOVINGBOUND];
+	uint		m_numPlanes;
+	float4		m_planes[MAXPLANES];
+	float		m_planesDiv[MAXPLANES];
+	float3		m_rbcg[MAXBODIES];
+	float3		m_rbtrans[MAXBODIES];
+	float		m_rbsteprot[9*MAXBODIES];
+	float		m_wcoeff;				// kernel coefficient, for the chosen kernel
+	float		m_fcoeff;				// kernel derivative coefficient, for the chosen kernel
+	float		m_partsurf;				// particle surface, for planes
+
+	// running statistics accumulated since the last DUMP_STATS: number of
+	// samples and accumulators of the cells and of the probes (see RunningStats.h)
+	uint*		m_statsCount;
+	float4*		m_stats;
+	uint*		m_probeCount;
+	float4*		m_probeStats;
+
+	// tracers (see Tracers.h): index of those held by the worker (UINT_MAX
+	// for the others), and their gathered positions, hashes and velocities
+	uint*		m_tracerIndex;
+	float4*		m_tracerPos;
+	hashKey*	m_tracerHash;
+	float4*		m_tracerVel;
+
+	// forces and moments of the particles of the loaded objects (see Loads.h)
+	float4*		m_loads;
+
+	// radix sort: scratch copies of the hashes and indices, the digit
+	// histograms of each block of particles, and the state of the current pass
+	hashKey*	m_sortKeys;
+	uint*		m_sortIndex;
+	uint*		m_sortHistograms;
+	uint		m_sortBlocks;		// number of blocks the particles are split into
+	uint		m_sortBlockSize;	// particles per block
+	uint		m_sortNumItems;		// particles being sorted
+	uint		m_sortShift;		// position of the digit of the current pass
+	hashKey*	m_sortSrcKeys;
+	uint*		m_sortSrcIndex;
+	hashKey*	m_sortDstKeys;
+	uint*		m_sortDstIndex;
+
+	// thread pool. A range job processes particles [from, to) on pool thread `thread`
+	typedef void (CPUWorker::*RangeJob)(uint from, uint to, uint thread);
+
+	struct PoolThreadArgs {
+		CPUWorker*	worker;
+		uint		thread;
+	};
+
+	uint			m_numThreads;		// number of threads, including the worker thread
+	pthread_t*		m_poolThreads;		// numThreads - 1 helper threads
+	PoolThreadArgs*	m_poolThreadArgs;
+	Synchronizer*	m_poolSynchronizer;	// waits on numThreads threads
+	bool			m_poolKeepGoing;
+	RangeJob		m_poolJob;			// the job being run
+	uint			m_poolNumItems;		// number of particles in the job
+	uint			m_poolChunkSize;	// particles grabbed at once by each thread
+	volatile uint	m_poolNextItem;		// first particle not yet grabbed
+
+	// the steps of a level of a command sequence, run concurrently as pool tasks:
+	// a task is run by a single pool thread, and its range jobs are shared with
+	// the threads which have no step left to run
+	struct PoolTask {
+		const CommandStep*	step;
+		RangeJob		job;			// the range job of the step being run, if active
+		uint			numItems;
+		uint			chunkSize;
+		volatile uint	nextItem;
+		volatile uint	doneItems;
+		volatile uint	helpers;		// threads looking at the job
+		volatile bool	active;
+	};
+	std::vector<PoolTask>	m_poolTasks;
+	volatile uint	m_poolNextTask;		// first step not yet taken
+	volatile uint	m_poolDoneTasks;	// steps completed
+	pthread_mutex_t	m_profilerMutex;	// the tasks record their commands in m_profiler
+
+	// per-thread partial reductions
+	float*			m_threadCfl;
+	float*			m_threadMaxDisp;
+	uint*			m_threadMaxNeibs;
+	uint*			m_threadNumInteractions;
+
+	static void* poolThread(void *ptr);
+	void startThreadPool();
+	void stopThreadPool();
+	// run job on [0, numItems) with the whole pool, returns when all the threads are done.
+	// Items are grabbed chunkSize at a time; 0 picks the chunk size from the pool size
+	void parallel_for(RangeJob job, uint numItems, uint chunkSize = 0);
+	// grab chunks of the current job until there are none left
+	void runPoolJob(uint thread);
+	// run the numSteps steps of a level from begin as pool tasks
+	void runLevelTasks(CommandSequence::const_iterator begin, uint numSteps);
+	void levelTasksRange(uint from, uint to, uint thread);
+	// parallel_for() from within a task
+	void runTaskJob(RangeJob job, uint numItems, uint chunkSize);
+	bool runTaskChunk(uint task, uint thread);
+	// run a chunk of any task, returns false if there were none
+	bool helpTasks(uint thread);
+
+	// cuts all external particles
+	void dropExternalParticles();
+
+	size_t allocateHostBuffers();
+	void deallocateHostBuffers();
+
+	void printAllocatedMemory();
+
+	void uploadSubdomain();
+	void dumpBuffers();
+	void setCellsAsEmpty();
+	void downloadCellsIndices();
+	void updateSegments();
+	void resetSegments();
+	void importExternalCells();
+
+	// moving boundaries, gravity, planes
+	void uploadMBData();
+	void uploadGravity();
+	void uploadPlanes();
+
+	void uploadConstants();
+
+	// bodies
+	void uploadBodiesCentersOfGravity();
+	void uploadBodiesTransRotMatrices();
+
+	// grid and neighbor list helpers
+	int3 gridPosFromParticleHash(hashKey particleHash) const;
+	uint gridHashPeriodic(int3 gridPos) const;
+	bool calcNeibCell(int3 &gridPos, int3 const& gridOffset) const;
+	uint getNeibIndex(float4 const& pos, float3& pos_corr, neibdata neib_data,
+		int3 const& gridPos, char& neib_cellnum, uint& neib_cell_base_index) const;
+	float3 globalPos(float4 const& pos, int3 const& gridPos) const;
+
+	// SPH kernel, equation of state and boundary forces
+	float W(float r) const;
+	float F(float r) const;
+	float P(float rho, uint fluid) const;
+	float soundSpeed(float rho, uint fluid) const;
+	float LJForce(float r) const;
+	float MKForce(float r, float slength, float mass_f, float mass_b) const;
+	float PlaneForce(float3 const& pos, float mass, float4 const& plane, float l,
+		float3 const& vel, float dynvisc, float4& force) const;
+
+	// kernels: called by simulationThread
+	void kernel_calcHash();
+	void kernel_sort();
+	void kernel_inverseParticleIndex();
+	void kernel_reorderDataAndFindCellStart();
+	void kernel_buildNeibsList();
+	void kernel_forces();
+	void kernel_euler();
+	void kernel_mls();
+	void kernel_shepard();
+	void kernel_vorticity();
+	void kernel_surfaceParticles();
+	void kernel_sps();
+	void kernel_reduceRBForces();
+	void kernel_calcPrivate();
+	void kernel_testpoints();
+	void kernel_accumulateStats();
+	void downloadStats();
+	void kernel_trackTracers();
+	void kernel_locateTracers();
+	void downloadTracers();
+	void kernel_reduceLoads();
+	void kernel_unsupported(const char *cmd);
+
+	// index of the loaded object a particle belongs to, numLoads() if none
+	uint loadIndex(const particleinfo &info) const;
+
+	// kernel bodies: each processes a range of particles
+	void calcHashRange(uint from, uint to, uint thread);
+	void fixHashRange(uint from, uint to, uint thread);
+	void inverseIndexRange(uint from, uint to, uint thread);
+	void reorderRange(uint from, uint to, uint thread);
+	void buildNeibsRange(uint from, uint to, uint thread);
+	void forcesRange(uint from, uint to, uint thread);
+	void eulerRange(uint from, uint to, uint thread);
+	void mlsRange(uint from, uint to, uint thread);
+	void shepardRange(uint from, uint to, uint thread);
+	void vorticityRange(uint from, uint to, uint thread);
+	void surfaceParticlesRange(uint from, uint to, uint thread);
+	void spsRange(uint from, uint to, uint thread);
+	void calcPrivateRange(uint from, uint to, uint thread);
+	void testpointsRange(uint from, uint to, uint thread);
+	// these process a range of blocks of particles (see kernel_sort)
+	void sortHistogramRange(uint from, uint to, uint thread);
+	void sortScatterRange(uint from, uint to, uint thread);
+	void sortCopyRange(uint from, uint to, uint thread);
+	// these process a range of cells and of particles
+	void cellStatsRange(uint from, uint to, uint thread);
+	void probeStatsRange(uint from, uint to, uint thread);
+	void locateTracersRange(uint from, uint to, uint thread);
+
+	// forces are computed in a single pass, so the async variants only split the dt update
+	void kernel_forces_async_enqueue();
+	void kernel_forces_async_complete();
+	float forces_dt_reduce();
+public:
+	// constructor & destructor
+	CPUWorker(GlobalData* _gdata, unsigned int _devnum);
+	~CPUWorker();
+
+	// getters of the number of particles
+	uint getNumParticles();
+	uint getNumInternalParticles();
+	uint getMaxParticles();
+
+	// thread management
+	void run_worker();
+	void join_worker();
+
+	// utility getters
+	size_t getHostMemory();
+	size_t getDeviceMemory();
+	const AbstractBuffer* getBuffer(flag_t) const;
+	CommandProfiler* getProfiler();
+};
+
+#endif /* CPUWORKER_H_ */
@@ -0,0 +1,517 @@
+/*  Copyright 2013 Alexis Herault, Giuseppe Bilotta, Robert A. Dalrymple, Eugenio Rustico, Ciro Del Negro
+
+    Istituto Nazionale di Geofisica e Vulcanologia
+        Sezione di Catania, Catania, Italy
+
+    Università di Catania, Catania, Italy
+
+    Johns Hopkins University, Baltimore, MD
+
+    This file is part of GPUSPH.
+
+    GPUSPH is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GPUSPH is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GPUSPH.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Checkpoint.h"
+#include "Problem.h"
+#include "NetworkManager.h"
+// makeParticleHash, cellHashFromParticleHash
+#include "hashkey.h"
+
+using namespace std;
+
+#define CHECKPOINT_MAGIC	"GPUSPHCK"
+#define CHECKPOINT_VERSION	2
+
+// file in the checkpoint/ directory with the name of the latest complete checkpoint
+#define CHECKPOINT_LATEST	"latest"
+
+// Beginning of each checkpoint file. It is followed by numWriters WriterStates,
+// numBodies*ODE_BODY_STATE_SIZE doubles, numMovingBounds MbCallBacks, as many
+// float4 moving boundary data and, for each buffer, the length of its name, the
+// name, the size of its elements and numParts elements
+struct CheckpointHeader {
+	char			magic[8];
+	uint			version;
+	uint			numRanks;
+	uint			rank;
+	uint			numParts;
+	uint			totParticles;
+	float			t;
+	float			dt;
+	unsigned long	iterations;
+	uint			numBuffers;
+	uint			numWriters;
+	uint			numBodies;
+	uint			numMovingBounds;
+};
+
+// longest buffer name accepted when reading a checkpoint
+#define CHECKPOINT_MAX_NAME	256
+
+static void
+read_or_throw(void *ptr, size_t size, FILE *fp, string const& fname)
+{
+	if (fread(ptr, size, 1, fp) != 1) {
+		fclose(fp);
+		throw runtime_error("checkpoint file " + fname + " is truncated");
+	}
+}
+
+static void
+write_or_throw(const void *ptr, size_t size, FILE *fp, string const& fname)
+{
+	if (fwrite(ptr, size, 1, fp) != 1) {
+		fclose(fp);
+		throw runtime_error("cannot write checkpoint file " + fname);
+	}
+}
+
+// open the checkpoint file of a rank and read its header
+static FILE *
+open_checkpoint(string const& fname, CheckpointHeader &header)
+{
+	FILE *fp = fopen(fname.c_str(), "rb");
+	if (!fp)
+		throw runtime_error("cannot open checkpoint file " + fname);
+
+	read_or_throw(&header, sizeof(header), fp, fname);
+	if (memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) ||
+		header.version != CHECKPOINT_VERSION) {
+		fclose(fp);
+		throw runtime_error(fname + " is not a GPUSPH checkpoint of a supported version");
+	}
+	return fp;
+}
+
+// make sure that the renames and removals in a directory are on disk
+static void
+sync_dir(string const& dirname)
+{
+	int fd = open(dirname.c_str(), O_RDONLY);
+	if (fd < 0)
+		return;
+	fsync(fd);
+	close(fd);
+}
+
+// remove a checkpoint directory and its files
+static void
+remove_checkpoint(string const& dirname)
+{
+	DIR *dir = opendir(dirname.c_str());
+	if (!dir)
+		return;
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+			continue;
+		unlink((dirname + "/" + entry->d_name).c_str());
+	}
+	closedir(dir);
+	if (rmdir(dirname.c_str()))
+		fprintf(stderr, "WARNING: cannot remove old checkpoint %s\n", dirname.c_str());
+}
+
+string
+Checkpoint::fileName(string const& dirname, int rank)
+{
+	stringstream ss;
+	ss << dirname << "/rank" << rank << ".ckp";
+	return ss.str();
+}
+
+string
+Checkpoint::resolve(string const& dirname)
+{
+	const string latest = dirname + "/" CHECKPOINT_LATEST;
+	FILE *fp = fopen(latest.c_str(), "r");
+	if (!fp)
+		return dirname;
+
+	char name[256];
+	const bool ok = fgets(name, sizeof(name), fp) != NULL;
+	fclose(fp);
+	if (!ok)
+		throw runtime_error("cannot read the latest checkpoint from " + latest);
+	name[strcspn(name, "\n")] = '\0';
+	return dirname + "/" + name;
+}
+
+void
+Checkpoint::readState(string const& dirname, CheckpointState &state)
+{
+	const string fname = fileName(dirname, 0);
+	CheckpointHeader header;
+	FILE *fp = open_checkpoint(fname, header);
+
+	state.numRanks = header.numRanks;
+	state.totParticles = header.totParticles;
+	state.t = header.t;
+	state.dt = header.dt;
+	state.iterations = header.iterations;
+
+	state.writers.resize(header.numWriters);
+	if (!state.writers.empty())
+		read_or_throw(&state.writers[0], header.numWriters*sizeof(WriterState), fp, fname);
+	state.bodies.resize(header.numBodies*ODE_BODY_STATE_SIZE);
+	if (!state.bodies.empty())
+		read_or_throw(&state.bodies[0], state.bodies.size()*sizeof(double), fp, fname);
+	state.mbcallbacks.resize(header.numMovingBounds);
+	state.mbdata.resize(header.numMovingBounds);
+	if (header.numMovingBounds) {
+		read_or_throw(&state.mbcallbacks[0], header.numMovingBounds*sizeof(MbCallBack), fp, fname);
+		read_or_throw(&state.mbdata[0], header.numMovingBounds*sizeof(float4), fp, fname);
+	}
+
+	fclose(fp);
+}
+
+void
+Checkpoint::readParticles(string const& dirname, CheckpointState const& state,
+	BufferList &buffers)
+{
+	// the buffers this run needs from the checkpoint
+	flag_t needed = NO_FLAGS;
+	BufferList::iterator iter = buffers.begin();
+	for ( ; iter != buffers.end(); ++iter)
+		if (!(iter->first & CHECKPOINT_SKIP_BUFFERS))
+			needed |= iter->first;
+
+	uint offset = 0;
+
+	for (uint rank = 0; rank < state.numRanks; ++rank) {
+		const string fname = fileName(dirname, rank);
+		CheckpointHeader header;
+		FILE *fp = open_checkpoint(fname, header);
+
+		// the ranks save their files independently: make sure they are all
+		// from the same checkpoint
+		if (header.iterations != state.iterations || header.numRanks != state.numRanks ||
+			offset + header.numParts > state.totParticles) {
+			fclose(fp);
+			throw runtime_error("checkpoint file " + fname + " does not belong to the same checkpoint as the others");
+		}
+
+		fseek(fp, header.numWriters*sizeof(WriterState) +
+			header.numBodies*ODE_BODY_STATE_SIZE*sizeof(double) +
+			header.numMovingBounds*(sizeof(MbCallBack) + sizeof(float4)), SEEK_CUR);
+
+		flag_t found = NO_FLAGS;
+		for (uint b = 0; b < header.numBuffers; ++b) {
+			uint namelen;
+			char name[CHECKPOINT_MAX_NAME];
+			uint elsize;
+			read_or_throw(&namelen, sizeof(namelen), fp, fname);
+			if (namelen >= CHECKPOINT_MAX_NAME) {
+				fclose(fp);
+				throw runtime_error("checkpoint file " + fname + " is corrupted");
+			}
+			read_or_throw(name, namelen, fp, fname);
+			name[namelen] = '\0';
+			read_or_throw(&elsize, sizeof(elsize), fp, fname);
+
+			const size_t size = (size_t)header.numParts*elsize;
+			AbstractBuffer *buf = NULL;
+			for (iter = buffers.begin(); iter != buffers.end(); ++iter) {
+				if ((iter->first & needed) && !strcmp(iter->second->get_buffer_name(), name)) {
+					buf = iter->second;
+					found |= iter->first;
+					break;
+				}
+			}
+			if (!buf) {
+				// e.g. a checkpoint taken with different simulation parameters
+				if (rank == 0)
+					fprintf(stderr, "WARNING: skipping buffer %s of the checkpoint, not used by this run\n", name);
+				fseek(fp, size, SEEK_CUR);
+				continue;
+			}
+			if (buf->get_element_size() != elsize) {
+				fclose(fp);
+				throw runtime_error("buffer " + string(name) + " of checkpoint file " + fname +
+					" has elements of a different size");
+			}
+			if (size)
+				read_or_throw(buf->get_offset_buffer(0, offset), size, fp, fname);
+		}
+
+		fclose(fp);
+
+		// the particles would be left uninitialized
+		if (found != needed) {
+			for (iter = buffers.begin(); iter != buffers.end(); ++iter)
+				if (iter->first & needed & ~found)
+					throw runtime_error("checkpoint file " + fname + " has no buffer " +
+						iter->second->get_buffer_name());
+		}
+		offset += header.numParts;
+	}
+
+	if (offset != state.totParticles) {
+		stringstream ss;
+		ss << "checkpoint in " << dirname << " has " << offset << " particles instead of " << state.totParticles;
+		throw runtime_error(ss.str());
+	}
+
+	// clear the cell type bits of the hashes, which depend on the old partitioning
+	hashKey *hash = buffers.getData<BUFFER_HASH>();
+	const particleinfo *info = buffers.getData<BUFFER_INFO>();
+	for (uint p = 0; p < state.totParticles; ++p)
+		hash[p] = makeParticleHash(cellHashFromParticleHash(hash[p]), info[p]);
+}
+
+Checkpoint::Checkpoint(const GlobalData *_gdata, float interval, BufferList *buffers) :
+	gdata(_gdata),
+	m_interval(interval),
+	m_last_save_time(_gdata->t),
+	m_buffers(buffers),
+	m_numParts(0),
+	m_saving(false),
+	m_pending(false)
+{
+	m_dirname = gdata->problem->get_dirname() + "/checkpoint";
+	mkdir(m_dirname.c_str(), S_IRWXU | S_IRWXG | S_IRWXO);
+
+	// the checkpoint this run starts from, if any, stays until a new one is committed
+	if (access((m_dirname + "/" CHECKPOINT_LATEST).c_str(), F_OK) == 0)
+		m_lastdir = resolve(m_dirname);
+
+	BufferList::iterator iter = m_buffers->begin();
+	while (iter != m_buffers->end()) {
+		if (!(iter->first & CHECKPOINT_SKIP_BUFFERS))
+			iter->second->alloc(gdata->totParticles);
+		++iter;
+	}
+}
+
+// a pending save is not committed here, since the other ranks may not get here:
+// its directory is left in place, but the latest pointer is not moved to it
+Checkpoint::~Checkpoint()
+{
+	try {
+		wait();
+	} catch (exception &e) {
+		fprintf(stderr, "%s\n", e.what());
+	}
+	m_buffers->clear();
+	delete m_buffers;
+}
+
+bool
+Checkpoint::need_save(float t) const
+{
+	return m_interval > 0 && t - m_last_save_time >= m_interval;
+}
+
+flag_t
+Checkpoint::buffersToDump() const
+{
+	flag_t which = NO_FLAGS;
+	BufferList::const_iterator iter = m_buffers->begin();
+	for ( ; iter != m_buffers->end(); ++iter)
+		if (!(iter->first & CHECKPOINT_SKIP_BUFFERS))
+			which |= iter->first;
+	return which;
+}
+
+void
+Checkpoint::save(CheckpointState const& state)
+{
+	commit();
+
+	stringstream ss;
+	ss << m_dirname << "/" << state.iterations;
+	m_savedir = ss.str();
+	// the other ranks may have created it already
+	if (mkdir(m_savedir.c_str(), S_IRWXU | S_IRWXG | S_IRWXO) && errno != EEXIST)
+		throw runtime_error("cannot create checkpoint directory " + m_savedir);
+
+	// copy the particles of this rank, so that the simulation can go on
+	const uint node_offset = gdata->s_hStartPerDevice[0];
+	m_numParts = gdata->processParticles[gdata->mpi_rank];
+
+	BufferList::iterator iter = m_buffers->begin();
+	for ( ; iter != m_buffers->end(); ++iter) {
+		if (iter->first & CHECKPOINT_SKIP_BUFFERS)
+			continue;
+		const AbstractBuffer *src = gdata->s_hBuffers[iter->first];
+		memcpy(iter->second->get_buffer(), src->get_offset_buffer(0, node_offset),
+			(size_t)m_numParts*src->get_element_size());
+	}
+
+	m_state = state;
+	m_last_save_time = state.t;
+
+	int err = pthread_create(&m_thread, NULL, saveThread, (void*)this);
+	if (err) {
+		stringstream ss;
+		ss << "cannot create checkpoint thread (error " << err << ")";
+		throw runtime_error(ss.str());
+	}
+	m_saving = true;
+	m_pending = true;
+}
+
+void
+Checkpoint::wait()
+{
+	if (!m_saving)
+		return;
+
+	pthread_join(m_thread, NULL);
+	m_saving = false;
+
+	if (!m_error.empty()) {
+		string error = m_error;
+		m_error.clear();
+		throw runtime_error(error);
+	}
+}
+
+void
+Checkpoint::commit()
+{
+	if (!m_pending)
+		return;
+	m_pending = false;
+
+	// every rank takes part in the reduction, even if its own save failed
+	string error;
+	try {
+		wait();
+	} catch (exception &e) {
+		error = e.what();
+	}
+	float saved = error.empty() ? 1 : 0;
+	if (gdata->mpi_nodes > 1)
+		gdata->networkManager->networkFloatReduction(&saved, 1, MIN_REDUCTION);
+
+	if (!saved) {
+		// keep the previous checkpoint as the latest one
+		if (gdata->mpi_rank == 0)
+			remove_checkpoint(m_savedir);
+		throw runtime_error(error.empty() ?
+			"checkpoint " + m_savedir + " failed on another rank" : error);
+	}
+
+	if (gdata->mpi_rank == 0) {
+		const string latest = m_dirname + "/" CHECKPOINT_LATEST;
+		const string tmpname = latest + ".tmp";
+		FILE *fp = fopen(tmpname.c_str(), "w");
+		if (!fp)
+			throw runtime_error("cannot create " + tmpname);
+		fprintf(fp, "%s\n", m_savedir.substr(m_dirname.size() + 1).c_str());
+		if (fflush(fp) || fsync(fileno(fp))) {
+			fclose(fp);
+			throw runtime_error("cannot write " + tmpname);
+		}
+		fclose(fp);
+		if (rename(tmpname.c_str(), latest.c_str()))
+			throw runtime_error("cannot rename " + tmpname + " to " + latest);
+		sync_dir(m_dirname);
+
+		// a checkpoint saved twice at the same iteration replaces itself
+		if (!m_lastdir.empty() && m_lastdir != m_savedir)
+			remove_checkpoint(m_lastdir);
+	}
+	m_lastdir = m_savedir;
+}
+
+void *
+Checkpoint::saveThread(void *arg)
+{
+	Checkpoint *ckp = (Checkpoint*)arg;
+	try {
+		ckp->writeFile();
+	} catch (exception &e) {
+		ckp->m_error = e.what();
+	}
+	return NULL;
+}
+
+void
+Checkpoint::writeFile()
+{
+	const string fname = fileName(m_savedir, gdata->mpi_rank);
+	const string tmpname = fname + ".tmp";
+
+	CheckpointHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+	header.version = CHECKPOINT_VERSION;
+	header.numRanks = m_state.numRanks;
+	header.rank = gdata->mpi_rank;
+	header.numParts = m_numParts;
+	header.totParticles = m_state.totParticles;
+	header.t = m_state.t;
+	header.dt = m_state.dt;
+	header.iterations = m_state.iterations;
+	header.numBuffers = 0;
+	BufferList::const_iterator iter = m_buffers->begin();
+	for ( ; iter != m_buffers->end(); ++iter)
+		if (!(iter->first & CHECKPOINT_SKIP_BUFFERS))
+			header.numBuffers++;
+	header.numWriters = m_state.writers.size();
+	header.numBodies = m_state.bodies.size()/ODE_BODY_STATE_SIZE;
+	header.numMovingBounds = m_state.mbcallbacks.size();
+
+	FILE *fp = fopen(tmpname.c_str(), "wb");
+	if (!fp)
+		throw runtime_error("cannot create checkpoint file " + tmpname);
+
+	write_or_throw(&header, sizeof(header), fp, tmpname);
+	if (!m_state.writers.empty())
+		write_or_throw(&m_state.writers[0], header.numWriters*sizeof(WriterState), fp, tmpname);
+	if (!m_state.bodies.empty())
+		write_or_throw(&m_state.bodies[0], m_state.bodies.size()*sizeof(double), fp, tmpname);
+	if (header.numMovingBounds) {
+		write_or_throw(&m_state.mbcallbacks[0], header.numMovingBounds*sizeof(MbCallBack), fp, tmpname);
+		write_or_throw(&m_state.mbdata[0], header.numMovingBounds*sizeof(float4), fp, tmpname);
+	}
+
+	for (iter = m_buffers->begin(); iter != m_buffers->end(); ++iter) {
+		if (iter->first & CHECKPOINT_SKIP_BUFFERS)
+			continue;
+		const char *name = iter->second->get_buffer_name();
+		const uint namelen = strlen(name);
+		const uint elsize = iter->second->get_element_size();
+		write_or_throw(&namelen, sizeof(namelen), fp, tmpname);
+		write_or_throw(name, namelen, fp, tmpname);
+		write_or_throw(&elsize, sizeof(elsize), fp, tmpname);
+		if (m_numParts)
+			write_or_throw(iter->second->get_buffer(), (size_t)m_numParts*elsize, fp, tmpname);
+	}
+
+	// the data must be on disk before the rank reports the save as complete
+	if (fflush(fp) || fsync(fileno(fp))) {
+		fclose(fp);
+		throw runtime_error("cannot write checkpoint file " + tmpname);
+	}
+	fclose(fp);
+
+	if (rename(tmpname.c_str(), fname.c_str()))
+		throw runtime_error("cannot rename " + tmpname + " to " + fname);
+	sync_dir(m_savedir);
+}
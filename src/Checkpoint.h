@@ -0,0 +1,147 @@
+/*  Copyright 2013 Alexis Herault, Giuseppe Bilotta, Robert A. Dalrymple, Eugenio Rustico, Ciro Del Negro
+
+    Istituto Nazionale di Geofisica e Vulcanologia
+        Sezione di Catania, Catania, Italy
+
+    Università di Catania, Catania, Italy
+
+    Johns Hopkins University, Baltimore, MD
+
+    This file is part of GPUSPH.
+
+    GPUSPH is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GPUSPH is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GPUSPH.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _CHECKPOINT_H
+#define _CHECKPOINT_H
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+#include "GlobalData.h"
+// WriterStateList
+#include "Writer.h"
+
+// buffers that are not saved in checkpoints: they are computed from the others
+// (POS_GLOBAL) or only produced for the output (NORMALS, VORTICITY), as in the upload
+#define CHECKPOINT_SKIP_BUFFERS (BUFFER_POS_GLOBAL | BUFFER_NORMALS | BUFFER_VORTICITY)
+
+// Everything in a checkpoint but the particles
+struct CheckpointState {
+	uint			numRanks;
+	uint			totParticles;
+	float			t;
+	float			dt;
+	unsigned long	iterations;
+	WriterStateList	writers;
+	// ODE_BODY_STATE_SIZE values per body
+	std::vector<double>	bodies;
+	// callback data and last uploaded data of each moving boundary
+	std::vector<MbCallBack>	mbcallbacks;
+	std::vector<float4>		mbdata;
+};
+
+/* A checkpoint is a directory with one binary file per rank, holding the particles
+ * of the rank and (in each file) the state of the simulation. The particles are
+ * written in no particular order, so that a simulation can be restarted with a
+ * different number of devices or ranks: the particles of all the files are loaded
+ * by each rank and then split again with fillDeviceMap() and sortParticlesByHash().
+ *
+ * Each checkpoint goes in a new checkpoint/<iteration>/ directory, written by a
+ * background thread of each rank. It is only used after commit(), when all the
+ * ranks have reported their files as complete and synced: rank 0 then atomically
+ * replaces the checkpoint/latest file with the name of the new directory, and
+ * only after that removes the previous checkpoint. A crash at any point thus
+ * leaves the latest pointer on a complete checkpoint, which is the one loaded by
+ * --restart on the checkpoint/ directory. The files are in the native byte order.
+ *
+ * The buffers are identified by name, so that the files do not depend on the values
+ * of the buffer flags. All the buffers saved by the current run must be found in a
+ * checkpoint to restart from it.
+ */
+class Checkpoint {
+private:
+	const GlobalData	*gdata;
+	std::string			m_dirname;
+	// directory of the checkpoint being saved, and of the last committed one
+	std::string			m_savedir;
+	std::string			m_lastdir;
+	float				m_interval;
+	float				m_last_save_time;
+
+	// copy of the particles of this rank, and the state, being saved
+	BufferList			*m_buffers;
+	uint				m_numParts;
+	CheckpointState		m_state;
+
+	// background thread writing the file, and the error it ran into, if any
+	pthread_t			m_thread;
+	bool				m_saving;
+	std::string			m_error;
+	// saved, but not committed yet
+	bool				m_pending;
+
+	static void *saveThread(void *arg);
+	void writeFile();
+
+public:
+	// file of the given rank in a checkpoint directory
+	static std::string fileName(std::string const& dirname, int rank);
+
+	// directory of the checkpoint to restart from: the one the latest pointer
+	// in dirname refers to, or dirname itself if it has no latest pointer
+	static std::string resolve(std::string const& dirname);
+
+	// read the state of the simulation from the checkpoint in dirname
+	static void readState(std::string const& dirname, CheckpointState &state);
+
+	// read the particles of all the ranks of the checkpoint into buffers, which
+	// must be allocated for state.totParticles particles
+	static void readParticles(std::string const& dirname, CheckpointState const& state,
+		BufferList &buffers);
+
+	// checkpoints are saved in the checkpoint/ subdirectory of the problem directory,
+	// every interval (simulated) seconds. The buffers (not allocated) of the given
+	// list, but the CHECKPOINT_SKIP_BUFFERS, are saved; the list is owned by the Checkpoint
+	Checkpoint(const GlobalData *_gdata, float interval, BufferList *buffers);
+	~Checkpoint();
+
+	// is a checkpoint due at time t?
+	bool need_save(float t) const;
+
+	// flags of the buffers to DUMP before save()
+	flag_t buffersToDump() const;
+
+	// start saving the DUMPed particles of this rank and the given state in a new
+	// directory, after committing the previous save
+	void save(CheckpointState const& state);
+
+	// wait for the save in progress, if any, throwing its error
+	void wait();
+
+	// wait for the pending save, if any, and publish it as the latest checkpoint
+	// if all the ranks saved their files. In multi-node simulations all the ranks
+	// must call this at the same point of the simulation
+	void commit();
+
+	inline std::string const& get_dirname() const
+	{ return m_dirname; }
+
+	// directory of the checkpoint being saved, for other per-rank files
+	inline std::string const& get_savedir() const
+	{ return m_savedir; }
+};
+
+#endif
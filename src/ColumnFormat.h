@@ -0,0 +1,187 @@
+/*  Copyright 2013 Alexis Herault, Giuseppe Bilotta, Robert A. Dalrymple, Eugenio Rustico, Ciro Del Negro
+
+    Istituto Nazionale di Geofisica e Vulcanologia
+        Sezione di Catania, Catania, Italy
+
+    Università di Catania, Catania, Italy
+
+    Johns Hopkins University, Baltimore, MD
+
+    This file is part of GPUSPH.
+
+    GPUSPH is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GPUSPH is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GPUSPH.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _COLUMNFORMAT_H
+#define _COLUMNFORMAT_H
+
+/* Layout of the single-file columnar output of the ColumnWriter (.gpc files).
+ * This header is shared by the writer and the reader library (ColumnReader),
+ * and must not depend on the rest of GPUSPH.
+ *
+ * A file is a ColumnFileHeader, followed by the frames, each one being the
+ * chunks of all of its columns followed by the frame directory describing them:
+ *
+ *   ColumnFrameHeader, numColumns ColumnEntry,
+ *   numColumns*numChunks ColumnChunk (all the chunks of the first column, then
+ *   all the chunks of the second column, etc)
+ *
+ * Each column holds one buffer (position, velocity, info, ...) of the frame,
+ * split in chunks of chunkParts particles, each compressed on its own with zlib
+ * if the file is compressed, so that a single field of a frame, or a range
+ * of particles of it, can be read without touching the rest of the file.
+ *
+ * Each frame directory points to the previous one, and the file header to the
+ * last one: the header is updated after each frame is complete, so that a file
+ * can be read while it is being written, or after a crash. When the writer is
+ * closed, the index of the frames by time (numFrames ColumnTimeEntry) and a
+ * ColumnTrailer pointing to it are appended, so that readers don't have to walk
+ * the frame directories.
+ *
+ * With keyframes (see --column-keyframes), the particles of all the frames are
+ * stored in the order of their id, and the columns of the frames between two
+ * keyframes can hold the differences from the previous frame (COLUMN_FLAG_DELTA)
+ * instead of the values. The chunks of such a column hold, for each component,
+ * the differences of the particles of the chunk, each as a zigzag-encoded
+ * variable-length integer (7 bits per byte, least significant first). The
+ * differences of floating-point components are in units of the quantum of the
+ * component: the values are reconstructed, within half a quantum, by rounding
+ * the values of the last frame that holds them to multiples of the quanta of
+ * the following delta frame, and adding the differences of the delta frames.
+ * The differences of the integer components are exact (modulo their size).
+ *
+ * All the values are in the native byte order of the machine that wrote the file;
+ * the byteOrder field of the header allows readers to detect a mismatch.
+ * Version 1 files have no keyframes, and no quantum in their ColumnEntry.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define COLUMN_FILE_MAGIC		"GPUSPHCF"
+#define COLUMN_FILE_VERSION		2
+#define COLUMN_BYTE_ORDER		0x01020304U
+
+// length of the (NUL-terminated) column names
+#define COLUMN_NAME_LEN			48
+// largest number of components of the delta-coded columns
+#define COLUMN_MAX_QUANTA		4
+
+// type of the components of the elements of a column
+enum ColumnType {
+	COLUMN_UINT8,
+	COLUMN_UINT16,
+	COLUMN_UINT32,
+	COLUMN_UINT64,
+	COLUMN_FLOAT32,
+	COLUMN_FLOAT64
+};
+
+// the column holds the positions of the particles (the first three components
+// of its elements)
+#define COLUMN_FLAG_POINTS		(1U << 0)
+// the column holds the differences from the previous frame
+#define COLUMN_FLAG_DELTA		(1U << 1)
+
+struct ColumnFileHeader {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	byteOrder;
+	// number of particles in each chunk (but the last one of each column)
+	uint32_t	chunkParts;
+	// zlib compression level of the chunks, 0 if they are stored as is
+	int32_t		compression;
+	uint32_t	numFrames;
+	uint32_t	reserved;
+	// offset of the directory of the last frame, 0 if there are no frames
+	uint64_t	lastFrame;
+};
+
+struct ColumnFrameHeader {
+	double		t;
+	// offset of the directory of the previous frame, 0 for the first frame
+	uint64_t	prevFrame;
+	uint32_t	numParts;
+	uint32_t	numColumns;
+};
+
+struct ColumnEntry {
+	// key of the buffer (BUFFER_POS_GLOBAL etc) and its printable name
+	uint64_t	key;
+	char		name[COLUMN_NAME_LEN];
+	uint32_t	type;		// ColumnType
+	uint32_t	components;
+	uint32_t	elsize;		// bytes per particle
+	uint32_t	flags;		// COLUMN_FLAG_*
+	// quantum of each floating-point component of delta-coded columns (version 2)
+	double		quantum[COLUMN_MAX_QUANTA];
+};
+
+// size of a ColumnEntry in files of the given version
+static inline uint32_t
+column_entry_size(uint32_t version)
+{
+	return version < 2 ? offsetof(ColumnEntry, quantum) : sizeof(ColumnEntry);
+}
+
+// size in bytes of each component of the given ColumnType
+static inline uint32_t
+column_type_size(uint32_t type)
+{
+	static const uint32_t type_size[] = { 1, 2, 4, 8, 4, 8 };
+	return type < sizeof(type_size)/sizeof(*type_size) ? type_size[type] : 1;
+}
+
+// the zigzag encoding maps small differences of either sign to small unsigned values
+static inline uint64_t
+column_zigzag(int64_t val)
+{
+	return ((uint64_t)val << 1) ^ (uint64_t)(val >> 63);
+}
+
+static inline int64_t
+column_unzigzag(uint64_t val)
+{
+	return (int64_t)(val >> 1) ^ -(int64_t)(val & 1);
+}
+
+struct ColumnChunk {
+	uint64_t	offset;
+	// bytes stored in the file, equal to rawSize for uncompressed files
+	uint32_t	size;
+	uint32_t	rawSize;
+};
+
+struct ColumnTimeEntry {
+	double		t;
+	// offset of the frame directory
+	uint64_t	offset;
+};
+
+struct ColumnTrailer {
+	// offset of the time index
+	uint64_t	indexOffset;
+	uint32_t	numFrames;
+	uint32_t	reserved;
+	char		magic[8];
+};
+
+// number of chunks of a column of numParts particles
+static inline uint32_t
+column_chunks(uint32_t numParts, uint32_t chunkParts)
+{
+	return (numParts + chunkParts - 1)/chunkParts;
+}
+
+#endif
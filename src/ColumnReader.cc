@@ -0,0 +1,395 @@
+/*  Copyright 2013 Alexis Herault, Giuseppe Bilotta, Robert A. Dalrymple, Eugenio Rustico, Ciro Del Negro
+
+    Istituto Nazionale di Geofisica e Vulcanologia
+        Sezione di Catania, Catania, Italy
+
+    Università di Catania, Catania, Italy
+
+    Johns Hopkins University, Baltimore, MD
+
+    This file is part of GPUSPH.
+
+    GPUSPH is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GPUSPH is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GPUSPH.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <sys/types.h>
+#include <zlib.h>
+
+#include "ColumnReader.h"
+
+using namespace std;
+
+ColumnReader::ColumnReader(string const& fname) :
+	m_fname(fname),
+	m_fp(NULL)
+{
+	m_fp = fopen(fname.c_str(), "rb");
+	if (!m_fp)
+		throw runtime_error("cannot open " + fname);
+
+	try {
+		read_at(0, &m_header, sizeof(m_header));
+		if (memcmp(m_header.magic, COLUMN_FILE_MAGIC, sizeof(m_header.magic)) ||
+			!m_header.version || m_header.version > COLUMN_FILE_VERSION)
+			throw runtime_error(fname + " is not a GPUSPH columnar file of a supported version");
+		if (m_header.byteOrder != COLUMN_BYTE_ORDER)
+			throw runtime_error(fname + " was written on a machine with a different byte order");
+		if (!m_header.chunkParts)
+			throw runtime_error(fname + " is corrupted");
+
+		// a trailer is only present if the writer was closed cleanly
+		ColumnTrailer trailer;
+		bool indexed = false;
+		if (!fseeko(m_fp, -(off_t)sizeof(ColumnTrailer), SEEK_END) &&
+			(uint64_t)ftello(m_fp) >= sizeof(m_header)) {
+			read_at(ftello(m_fp), &trailer, sizeof(trailer));
+			indexed = !memcmp(trailer.magic, COLUMN_FILE_MAGIC, sizeof(trailer.magic)) &&
+				trailer.numFrames == m_header.numFrames;
+		}
+
+		m_frames.resize(m_header.numFrames);
+		if (indexed) {
+			vector<ColumnTimeEntry> index(m_header.numFrames);
+			if (!index.empty())
+				read_at(trailer.indexOffset, &index[0], index.size()*sizeof(ColumnTimeEntry));
+			for (uint32_t f = 0; f < m_header.numFrames; ++f) {
+				m_frames[f].t = index[f].t;
+				m_frames[f].offset = index[f].offset;
+				m_frames[f].loaded = false;
+			}
+		} else {
+			// walk the frame directories back from the last one
+			uint64_t offset = m_header.lastFrame;
+			for (uint32_t f = m_header.numFrames; f > 0; --f) {
+				if (!offset)
+					throw runtime_error(fname + " is corrupted");
+				ColumnFrameHeader fh;
+				read_at(offset, &fh, sizeof(fh));
+				m_frames[f - 1].t = fh.t;
+				m_frames[f - 1].offset = offset;
+				m_frames[f - 1].loaded = false;
+				offset = fh.prevFrame;
+			}
+		}
+	} catch (...) {
+		fclose(m_fp);
+		throw;
+	}
+}
+
+ColumnReader::~ColumnReader()
+{
+	fclose(m_fp);
+}
+
+void
+ColumnReader::read_at(uint64_t offset, void *ptr, size_t size)
+{
+	if (fseeko(m_fp, offset, SEEK_SET) || fread(ptr, size, 1, m_fp) != 1)
+		throw runtime_error(m_fname + " is truncated");
+}
+
+ColumnReader::Frame &
+ColumnReader::frame(uint32_t f)
+{
+	if (f >= m_frames.size()) {
+		stringstream ss;
+		ss << m_fname << " has no frame " << f;
+		throw runtime_error(ss.str());
+	}
+
+	Frame &fr = m_frames[f];
+	if (fr.loaded)
+		return fr;
+
+	ColumnFrameHeader fh;
+	read_at(fr.offset, &fh, sizeof(fh));
+	fr.numParts = fh.numParts;
+
+	const uint32_t numChunks = column_chunks(fh.numParts, m_header.chunkParts);
+	fr.columns.resize(fh.numColumns);
+	fr.chunks.resize((size_t)fh.numColumns*numChunks);
+	uint64_t offset = fr.offset + sizeof(fh);
+	const uint32_t entrySize = column_entry_size(m_header.version);
+	for (size_t c = 0; c < fr.columns.size(); ++c) {
+		memset(&fr.columns[c], 0, sizeof(ColumnEntry));
+		read_at(offset, &fr.columns[c], entrySize);
+		offset += entrySize;
+	}
+	if (!fr.chunks.empty())
+		read_at(offset, &fr.chunks[0], fr.chunks.size()*sizeof(ColumnChunk));
+
+	// names are NUL-terminated by the writer, but don't trust the file
+	for (size_t c = 0; c < fr.columns.size(); ++c)
+		fr.columns[c].name[COLUMN_NAME_LEN - 1] = '\0';
+
+	fr.loaded = true;
+	return fr;
+}
+
+uint32_t
+ColumnReader::findFrame(double t) const
+{
+	if (m_frames.empty())
+		throw runtime_error(m_fname + " has no frames");
+
+	// first frame after t
+	uint32_t lo = 0, hi = m_frames.size();
+	while (lo < hi) {
+		const uint32_t mid = (lo + hi)/2;
+		if (m_frames[mid].t <= t)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo ? lo - 1 : 0;
+}
+
+uint32_t
+ColumnReader::numParts(uint32_t f)
+{
+	return frame(f).numParts;
+}
+
+vector<ColumnEntry> const&
+ColumnReader::columns(uint32_t f)
+{
+	return frame(f).columns;
+}
+
+int
+ColumnReader::findColumn(uint32_t f, uint64_t key)
+{
+	Frame const& fr = frame(f);
+	for (size_t c = 0; c < fr.columns.size(); ++c)
+		if (fr.columns[c].key == key)
+			return c;
+	return -1;
+}
+
+int
+ColumnReader::findColumn(uint32_t f, string const& name)
+{
+	Frame const& fr = frame(f);
+	for (size_t c = 0; c < fr.columns.size(); ++c)
+		if (name == fr.columns[c].name)
+			return c;
+	return -1;
+}
+
+ColumnChunk const&
+ColumnReader::chunk(Frame const& fr, uint32_t column, uint32_t c) const
+{
+	const uint32_t numChunks = column_chunks(fr.numParts, m_header.chunkParts);
+	return fr.chunks[(size_t)column*numChunks + c];
+}
+
+// read a whole chunk, uncompressing it if needed; dst must hold ck.rawSize bytes
+void
+ColumnReader::read_chunk(ColumnChunk const& ck, void *dst)
+{
+	if (!ck.rawSize)
+		return;
+
+	if (!m_header.compression) {
+		read_at(ck.offset, dst, ck.rawSize);
+		return;
+	}
+
+	m_compressed.resize(ck.size);
+	read_at(ck.offset, &m_compressed[0], ck.size);
+	uLongf rawSize = ck.rawSize;
+	if (uncompress((Bytef*)dst, &rawSize, (const Bytef*)&m_compressed[0], ck.size) != Z_OK ||
+		rawSize != ck.rawSize)
+		throw runtime_error(m_fname + " has a corrupted chunk");
+}
+
+void
+ColumnReader::readColumn(uint32_t f, uint32_t column, uint32_t from, uint32_t to, void *dst)
+{
+	Frame const& fr = frame(f);
+	if (column >= fr.columns.size() || from > to || to > fr.numParts) {
+		stringstream ss;
+		ss << "invalid read of column " << column << ", particles " << from << " to " << to
+			<< " of frame " << f << " of " << m_fname;
+		throw runtime_error(ss.str());
+	}
+	if (from == to)
+		return;
+
+	if (fr.columns[column].flags & COLUMN_FLAG_DELTA) {
+		read_delta(f, fr.columns[column], from, to, dst);
+		return;
+	}
+
+	const uint32_t elsize = fr.columns[column].elsize;
+	const uint32_t chunkParts = m_header.chunkParts;
+	char *out = (char*)dst;
+	vector<char> partial;
+
+	for (uint32_t c = from/chunkParts; c*chunkParts < to; ++c) {
+		ColumnChunk const& ck = chunk(fr, column, c);
+		const uint32_t chunkFrom = c*chunkParts;
+		const uint32_t chunkTo = min(chunkFrom + chunkParts, fr.numParts);
+		if ((uint64_t)(chunkTo - chunkFrom)*elsize != ck.rawSize)
+			throw runtime_error(m_fname + " has a corrupted chunk");
+
+		const uint32_t readFrom = max(from, chunkFrom);
+		const uint32_t readTo = min(to, chunkTo);
+		const size_t size = (size_t)(readTo - readFrom)*elsize;
+
+		if (readFrom == chunkFrom && readTo == chunkTo) {
+			read_chunk(ck, out);
+		} else if (!m_header.compression) {
+			read_at(ck.offset + (uint64_t)(readFrom - chunkFrom)*elsize, out, size);
+		} else {
+			partial.resize(ck.rawSize);
+			read_chunk(ck, &partial[0]);
+			memcpy(out, &partial[(size_t)(readFrom - chunkFrom)*elsize], size);
+		}
+		out += size;
+	}
+}
+
+// state of the column key for the particles [from, to) at frame f: from the cache
+// if it holds an earlier frame of the same chain of delta frames, or from the
+// values of the last frame before f that holds them
+ColumnReader::DeltaState &
+ColumnReader::delta_state(uint32_t f, ColumnEntry const& col, uint32_t from, uint32_t to)
+{
+	// the frame holding the values
+	uint32_t base = f;
+	while (true) {
+		if (!base)
+			throw runtime_error(m_fname + " has a delta frame with no keyframe");
+		--base;
+		const int c = findColumn(base, col.key);
+		if (c < 0 || frame(base).numParts != frame(f).numParts)
+			throw runtime_error(m_fname + " has a delta frame with no keyframe");
+		if (!(frame(base).columns[c].flags & COLUMN_FLAG_DELTA))
+			break;
+	}
+
+	DeltaState &state = m_deltaStates[col.key];
+	if (state.from == from && state.to == to && state.frame >= base && state.frame <= f &&
+		state.values.size() == (size_t)(to - from)*col.components)
+		return state;
+
+	// the values of the base frame, rounded to the quanta of the frame after it
+	const int c = findColumn(base, col.key);
+	ColumnEntry const& raw = frame(base).columns[c];
+	ColumnEntry const& quantized = frame(base + 1).columns[findColumn(base + 1, col.key)];
+	if (raw.type != col.type || raw.components != col.components || raw.elsize != col.elsize)
+		throw runtime_error(m_fname + " has a delta column not matching its keyframe");
+
+	vector<char> values((size_t)(to - from)*raw.elsize);
+	readColumn(base, c, from, to, &values[0]);
+
+	const uint32_t comps = col.components;
+	state.values.resize((size_t)(to - from)*comps);
+	for (size_t i = 0; i < state.values.size(); ++i) {
+		const char *src = &values[i*column_type_size(col.type)];
+		int64_t &dst = state.values[i];
+		switch (col.type) {
+		case COLUMN_UINT8: dst = *(const uint8_t*)src; break;
+		case COLUMN_UINT16: dst = *(const uint16_t*)src; break;
+		case COLUMN_UINT32: dst = *(const uint32_t*)src; break;
+		case COLUMN_UINT64: dst = *(const int64_t*)src; break;
+		case COLUMN_FLOAT32: dst = llround(*(const float*)src/quantized.quantum[i % comps]); break;
+		case COLUMN_FLOAT64: dst = llround(*(const double*)src/quantized.quantum[i % comps]); break;
+		}
+	}
+	state.frame = base;
+	state.from = from;
+	state.to = to;
+	return state;
+}
+
+static inline uint64_t
+read_varint(const unsigned char *&ptr, const unsigned char *end)
+{
+	uint64_t val = 0;
+	for (int shift = 0; ptr < end && shift < 64; shift += 7) {
+		const unsigned char byte = *ptr++;
+		val |= (uint64_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+			return val;
+	}
+	throw runtime_error("truncated difference in a delta column");
+}
+
+void
+ColumnReader::read_delta(uint32_t f, ColumnEntry const& col, uint32_t from, uint32_t to, void *dst)
+{
+	const uint32_t comps = col.components;
+	if (comps > COLUMN_MAX_QUANTA || col.elsize != comps*column_type_size(col.type))
+		throw runtime_error(m_fname + " has a corrupted delta column");
+
+	DeltaState &state = delta_state(f, col, from, to);
+	const uint32_t chunkParts = m_header.chunkParts;
+	vector<char> raw;
+
+	// apply the differences of the frames after the one in the state
+	for (uint32_t g = state.frame + 1; g <= f; ++g) {
+		Frame const& fr = frame(g);
+		const int column = findColumn(g, col.key);
+		for (uint32_t c = from/chunkParts; c*chunkParts < to; ++c) {
+			ColumnChunk const& ck = chunk(fr, column, c);
+			const uint32_t chunkFrom = c*chunkParts;
+			const uint32_t chunkTo = min(chunkFrom + chunkParts, fr.numParts);
+
+			raw.resize(ck.rawSize);
+			read_chunk(ck, raw.empty() ? NULL : &raw[0]);
+			const unsigned char *ptr = (const unsigned char*)(raw.empty() ? NULL : &raw[0]);
+			const unsigned char *end = ptr + raw.size();
+
+			try {
+				for (uint32_t k = 0; k < comps; ++k) {
+					for (uint32_t p = chunkFrom; p < chunkTo; ++p) {
+						const int64_t diff = column_unzigzag(read_varint(ptr, end));
+						if (p >= from && p < to) {
+							// modular, as in the writer
+							int64_t &val = state.values[(size_t)(p - from)*comps + k];
+							val = (int64_t)((uint64_t)val + (uint64_t)diff);
+						}
+					}
+				}
+			} catch (runtime_error &) {
+				state.values.clear();
+				throw runtime_error(m_fname + " has a corrupted chunk");
+			}
+		}
+		state.frame = g;
+	}
+
+	// the reconstructed values
+	const double *quantum = col.quantum;
+	char *out = (char*)dst;
+	for (size_t i = 0; i < state.values.size(); ++i) {
+		const int64_t val = state.values[i];
+		switch (col.type) {
+		case COLUMN_UINT8: ((uint8_t*)out)[i] = val; break;
+		case COLUMN_UINT16: ((uint16_t*)out)[i] = val; break;
+		case COLUMN_UINT32: ((uint32_t*)out)[i] = val; break;
+		case COLUMN_UINT64: ((uint64_t*)out)[i] = val; break;
+		case COLUMN_FLOAT32: ((float*)out)[i] = val*quantum[i % comps]; break;
+		case COLUMN_FLOAT64: ((double*)out)[i] = val*quantum[i % comps]; break;
+		}
+	}
+}
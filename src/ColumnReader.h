@@ -0,0 +1,118 @@
+/*  Copyright 2013 Alexis Herault, Giuseppe Bilotta, Robert A. Dalrymple, Eugenio Rustico, Ciro Del Negro
+
+    Istituto Nazionale di Geofisica e Vulcanologia
+        Sezione di Catania, Catania, Italy
+
+    Università di Catania, Catania, Italy
+
+    Johns Hopkins University, Baltimore, MD
+
+    This file is part of GPUSPH.
+
+    GPUSPH is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GPUSPH is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GPUSPH.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _COLUMNREADER_H
+#define _COLUMNREADER_H
+
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "ColumnFormat.h"
+
+/* Reader for the single-file columnar output of the ColumnWriter (see ColumnFormat.h).
+ * It only depends on the standard library and zlib, so that it can be used by
+ * post-processing tools (e.g. scripts/gpc2vtu) without the rest of GPUSPH.
+ *
+ * Frames are identified by their index, in the order they were written (which is
+ * also the order of their times). The frame directories are read when first needed,
+ * and the columns are read chunk by chunk, so reading a field of a frame only
+ * touches that field. Errors are reported by throwing std::runtime_error.
+ *
+ * Delta-coded columns are reconstructed from the last frame before them holding
+ * the values: the reconstructed particles of each column are kept, so that reading
+ * the frames in order only decodes the differences of each frame once.
+ */
+class ColumnReader
+{
+	struct Frame {
+		double						t;
+		uint64_t					offset;
+		// the directory of the frame, read on first access
+		bool						loaded;
+		uint32_t					numParts;
+		std::vector<ColumnEntry>	columns;
+		std::vector<ColumnChunk>	chunks;
+	};
+
+	// reconstructed particles [from, to) of a delta-coded column at a frame: the
+	// values of the integer components, and the quantized floating-point ones
+	struct DeltaState {
+		uint32_t					frame;
+		uint32_t					from;
+		uint32_t					to;
+		std::vector<int64_t>		values;
+		DeltaState() : frame(0), from(0), to(0) {}
+	};
+
+	std::string					m_fname;
+	FILE						*m_fp;
+	ColumnFileHeader			m_header;
+	std::vector<Frame>			m_frames;
+	// scratch space for compressed chunks
+	std::vector<char>			m_compressed;
+	// last reconstructed frame of each delta-coded column, by key
+	std::map<uint64_t, DeltaState>	m_deltaStates;
+
+	void read_at(uint64_t offset, void *ptr, size_t size);
+	Frame &frame(uint32_t f);
+	ColumnChunk const& chunk(Frame const& fr, uint32_t column, uint32_t c) const;
+	void read_chunk(ColumnChunk const& ck, void *dst);
+	DeltaState &delta_state(uint32_t f, ColumnEntry const& col, uint32_t from, uint32_t to);
+	void read_delta(uint32_t f, ColumnEntry const& col, uint32_t from, uint32_t to, void *dst);
+
+public:
+	ColumnReader(std::string const& fname);
+	~ColumnReader();
+
+	inline uint32_t numFrames() const
+	{ return m_frames.size(); }
+
+	inline double frameTime(uint32_t f) const
+	{ return m_frames.at(f).t; }
+
+	// the last frame with time not after t (the first frame if t is before all of them)
+	uint32_t findFrame(double t) const;
+
+	uint32_t numParts(uint32_t f);
+
+	// description of the columns of a frame
+	std::vector<ColumnEntry> const& columns(uint32_t f);
+
+	// index of the column with the given key or name in frame f, -1 if there is none
+	int findColumn(uint32_t f, uint64_t key);
+	int findColumn(uint32_t f, std::string const& name);
+
+	// read the particles [from, to) of a column of frame f into dst, which
+	// must hold (to - from)*elsize bytes
+	void readColumn(uint32_t f, uint32_t column, uint32_t from, uint32_t to, void *dst);
+
+	// read a whole column of frame f into dst, which must hold numParts*elsize bytes
+	inline void readColumn(uint32_t f, uint32_t column, void *dst)
+	{ readColumn(f, column, 0, numParts(f), dst); }
+};
+
+#endif
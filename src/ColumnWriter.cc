@@ -0,0 +1,494 @@
+/*  Copyright 2013 Alexis Herault, Giuseppe Bilotta, Robert A. Dalrymple, Eugenio Rustico, Ciro Del Negro
+
+    Istituto Nazionale di Geofisica e Vulcanologia
+        Sezione di Catania, Catania, Italy
+
+    Università di Catania, Catania, Italy
+
+    Johns Hopkins University, Baltimore, MD
+
+    This file is part of GPUSPH.
+
+    GPUSPH is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GPUSPH is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GPUSPH.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <pthread.h>
+// sysconf
+#include <unistd.h>
+#include <zlib.h>
+
+#include "ColumnWriter.h"
+#include "GlobalData.h"
+
+using namespace std;
+
+// number of particles in each chunk of a column
+#define COLUMN_CHUNK_PARTS	65536U
+
+ColumnWriter::ColumnWriter(const GlobalData *_gdata)
+  : Writer(_gdata),
+	m_end(0),
+	m_sinceKey(0)
+{
+	m_fname_sfx = ".gpc";
+
+	m_compression = gdata->clOptions->column_compression;
+	m_keyframes = gdata->clOptions->column_keyframes;
+	m_tolerance = gdata->clOptions->column_tolerance;
+	m_numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (m_numThreads < 1)
+		m_numThreads = 1;
+
+	open_data_file(m_file, "PART", "");
+
+	memset(&m_header, 0, sizeof(m_header));
+	memcpy(m_header.magic, COLUMN_FILE_MAGIC, sizeof(m_header.magic));
+	m_header.version = COLUMN_FILE_VERSION;
+	m_header.byteOrder = COLUMN_BYTE_ORDER;
+	m_header.chunkParts = COLUMN_CHUNK_PARTS;
+	m_header.compression = m_compression;
+
+	m_file.write(reinterpret_cast<const char*>(&m_header), sizeof(m_header));
+	m_file.flush();
+	m_end = sizeof(m_header);
+}
+
+ColumnWriter::~ColumnWriter()
+{
+	// append the time index, so that readers don't need to walk the frames
+	try {
+		ColumnTrailer trailer;
+		memset(&trailer, 0, sizeof(trailer));
+		trailer.indexOffset = m_end;
+		trailer.numFrames = m_index.size();
+		memcpy(trailer.magic, COLUMN_FILE_MAGIC, sizeof(trailer.magic));
+
+		m_file.seek(m_end);
+		if (!m_index.empty())
+			m_file.write(reinterpret_cast<const char*>(&m_index[0]),
+				m_index.size()*sizeof(ColumnTimeEntry));
+		m_file.write(reinterpret_cast<const char*>(&trailer), sizeof(trailer));
+		m_file.close();
+	} catch (exception &e) {
+		fprintf(stderr, "cannot write the index of the columnar output: %s\n", e.what());
+	}
+}
+
+// fill in the type and number of components of the column of the given buffer.
+// Unknown buffers are described as arrays of bytes
+void
+describe_column(flag_t key, size_t elsize, ColumnEntry &col)
+{
+	col.flags = 0;
+	switch (key) {
+	case BUFFER_POS_GLOBAL:
+		col.type = COLUMN_FLOAT64;
+		col.flags = COLUMN_FLAG_POINTS;
+		break;
+	case BUFFER_POS:
+	case BUFFER_VEL:
+	case BUFFER_FORCES:
+	case BUFFER_XSPH:
+	case BUFFER_VORTICITY:
+	case BUFFER_NORMALS:
+	case BUFFER_BOUNDELEMENTS:
+	case BUFFER_GRADGAMMA:
+	case BUFFER_TKE:
+	case BUFFER_EPSILON:
+	case BUFFER_TURBVISC:
+	case BUFFER_PRIVATE:
+		col.type = COLUMN_FLOAT32;
+		break;
+	case BUFFER_INFO:
+		col.type = COLUMN_UINT16;
+		break;
+	case BUFFER_HASH:
+		col.type = (sizeof(hashKey) == 8 ? COLUMN_UINT64 : COLUMN_UINT32);
+		break;
+	case BUFFER_VERTICES:
+		col.type = COLUMN_UINT32;
+		break;
+	default:
+		col.type = COLUMN_UINT8;
+	}
+
+	col.components = elsize/column_type_size(col.type);
+}
+
+// A chunk to be written: its data in the buffer, and its compressed version.
+// The chunks of the columns with a ColumnDelta update its state for the particles
+// [from, to) of the chunk and, if encode is set, are replaced by their differences
+// from the state
+struct ColumnChunkJob {
+	const char		*data;
+	size_t			rawSize;
+	ColumnDelta		*delta;
+	bool			encode;
+	uint			from;
+	uint			to;
+	vector<char>	encoded;
+	vector<char>	out;
+};
+
+// value of component k of particle p of data, quantized if it's a floating-point one
+static inline int64_t
+delta_value(ColumnEntry const& col, const char *data, uint p, uint k)
+{
+	const char *src = data + ((size_t)p*col.components + k)*column_type_size(col.type);
+	switch (col.type) {
+	case COLUMN_UINT8: return *(const uint8_t*)src;
+	case COLUMN_UINT16: return *(const uint16_t*)src;
+	case COLUMN_UINT32: return *(const uint32_t*)src;
+	case COLUMN_UINT64: return *(const int64_t*)src;
+	case COLUMN_FLOAT32: return llround(*(const float*)src/col.quantum[k]);
+	case COLUMN_FLOAT64: return llround(*(const double*)src/col.quantum[k]);
+	}
+	return 0;
+}
+
+// update the delta coding state with a chunk, encoding its differences if needed
+static void
+delta_chunk(ColumnChunkJob &chunk)
+{
+	ColumnDelta &delta = *chunk.delta;
+	ColumnEntry const& col = delta.entry;
+	const uint comps = col.components;
+	const uint count = chunk.to - chunk.from;
+	int64_t *state = delta.state.empty() ? NULL : &delta.state[(size_t)chunk.from*comps];
+
+	if (!chunk.encode) {
+		for (uint p = 0; p < count; ++p)
+			for (uint k = 0; k < comps; ++k)
+				state[(size_t)p*comps + k] = delta_value(col, chunk.data, p, k);
+		return;
+	}
+
+	// the differences of each component, as zigzag varints
+	chunk.encoded.clear();
+	chunk.encoded.reserve((size_t)count*comps*2);
+	for (uint k = 0; k < comps; ++k) {
+		for (uint p = 0; p < count; ++p) {
+			const int64_t val = delta_value(col, chunk.data, p, k);
+			int64_t &prev = state[(size_t)p*comps + k];
+			uint64_t diff = column_zigzag((int64_t)((uint64_t)val - (uint64_t)prev));
+			prev = val;
+			while (diff >= 0x80) {
+				chunk.encoded.push_back((char)(diff | 0x80));
+				diff >>= 7;
+			}
+			chunk.encoded.push_back((char)diff);
+		}
+	}
+	chunk.data = chunk.encoded.empty() ? NULL : &chunk.encoded[0];
+	chunk.rawSize = chunk.encoded.size();
+}
+
+// Chunks to be compressed by a group of threads, each grabbing the next chunk until none are left
+struct ColumnCompressJobs {
+	ColumnChunkJob	*chunks;
+	uint			numChunks;
+	int				compression;
+	volatile uint	nextChunk;
+	volatile bool	failed;
+};
+
+static void *
+column_compress_thread(void *arg)
+{
+	ColumnCompressJobs *jobs = (ColumnCompressJobs*)arg;
+
+	while (true) {
+		const uint c = __sync_fetch_and_add(&jobs->nextChunk, 1);
+		if (c >= jobs->numChunks)
+			break;
+
+		ColumnChunkJob &chunk = jobs->chunks[c];
+		if (chunk.delta)
+			delta_chunk(chunk);
+		if (!jobs->compression)
+			continue;
+
+		uLongf complen = compressBound(chunk.rawSize);
+		chunk.out.resize(complen);
+		if (compress2((Bytef*)&chunk.out[0], &complen, (const Bytef*)chunk.data, chunk.rawSize,
+				jobs->compression) != Z_OK) {
+			jobs->failed = true;
+			break;
+		}
+		chunk.out.resize(complen);
+	}
+	return NULL;
+}
+
+// delta-code and compress (if compression is not 0) the given chunks with up to numThreads threads
+static void
+encode_chunks(ColumnChunkJob *chunks, uint numChunks, int compression, uint numThreads)
+{
+	ColumnCompressJobs jobs;
+	jobs.chunks = chunks;
+	jobs.numChunks = numChunks;
+	jobs.compression = compression;
+	jobs.nextChunk = 0;
+	jobs.failed = false;
+
+	// the calling thread works too
+	const uint helpers = min(numThreads, numChunks) - (numChunks ? 1 : 0);
+	vector<pthread_t> threads(helpers);
+	for (uint t = 0; t < helpers; ++t)
+		if (pthread_create(&threads[t], NULL, column_compress_thread, &jobs))
+			throw runtime_error("cannot create compression thread");
+	column_compress_thread(&jobs);
+	for (uint t = 0; t < helpers; ++t)
+		pthread_join(threads[t], NULL);
+
+	if (jobs.failed)
+		throw runtime_error("zlib compression of the columnar output failed");
+}
+
+// sort the particles by id in m_order, telling if they are the same as in the last frame
+void
+ColumnWriter::sort_by_id(uint numParts, const particleinfo *info, uint node_offset, bool &same_ids)
+{
+	vector< pair<uint, uint> > ids(numParts);
+	for (uint i = 0; i < numParts; ++i)
+		ids[i] = make_pair(id(info[node_offset + i]), i);
+	sort(ids.begin(), ids.end());
+
+	same_ids = (m_ids.size() == numParts);
+	m_ids.resize(numParts);
+	m_order.resize(numParts);
+	for (uint i = 0; i < numParts; ++i) {
+		if (same_ids && m_ids[i] != ids[i].first)
+			same_ids = false;
+		m_ids[i] = ids[i].first;
+		m_order[i] = ids[i].second;
+	}
+}
+
+// quantum of component k of a floating-point column: twice the maximum error, which is
+// the tolerance times the particle spacing for positions, and times the range of the
+// values of the component (or its value, if it's the same for all the particles) for the
+// rest. 0 if the component has no finite values
+double
+ColumnWriter::quantum(flag_t key, ColumnEntry const& col, uint k, const char *data, uint numParts) const
+{
+	if (key == BUFFER_POS_GLOBAL && k < 3)
+		return 2*m_tolerance*m_problem->m_deltap;
+
+	double lo = HUGE_VAL, hi = -HUGE_VAL;
+	for (uint p = 0; p < numParts; ++p) {
+		const size_t i = (size_t)p*col.components + k;
+		const double val = (col.type == COLUMN_FLOAT32 ?
+			((const float*)data)[i] : ((const double*)data)[i]);
+		if (!isfinite(val))
+			continue;
+		lo = min(lo, val);
+		hi = max(hi, val);
+	}
+	if (lo > hi)
+		return 0;
+	const double scale = (hi > lo ? hi - lo : fabs(hi));
+	return 2*m_tolerance*scale;
+}
+
+// can the floating-point values of a column be quantized with the quanta of delta?
+bool
+ColumnWriter::can_quantize(ColumnDelta const& delta, const char *data, uint numParts) const
+{
+	ColumnEntry const& col = delta.entry;
+	if (col.type != COLUMN_FLOAT32 && col.type != COLUMN_FLOAT64)
+		return true;
+
+	// the quantized values must be exact integers in a double
+	const double limit = 4.0e15;
+	for (uint p = 0; p < numParts; ++p) {
+		for (uint k = 0; k < col.components; ++k) {
+			const size_t i = (size_t)p*col.components + k;
+			const double val = (col.type == COLUMN_FLOAT32 ?
+				((const float*)data)[i] : ((const double*)data)[i]);
+			if (!(fabs(val/col.quantum[k]) < limit))
+				return false;
+		}
+	}
+	return true;
+}
+
+void
+ColumnWriter::write(uint numParts, BufferList const& buffers, uint node_offset, float t, const bool testpoints)
+{
+	const uint numChunks = column_chunks(numParts, COLUMN_CHUNK_PARTS);
+
+	// with delta coding, the particles are written in id order, and the columns of
+	// the frames between the keyframes are delta-coded when possible
+	const particleinfo *info = buffers.getData<BUFFER_INFO>();
+	const bool delta_coding = m_keyframes && info;
+	bool keyframe = true;
+	if (delta_coding) {
+		bool same_ids;
+		sort_by_id(numParts, info, node_offset, same_ids);
+		keyframe = !same_ids || m_index.empty() || m_sinceKey + 1 >= m_keyframes;
+		// the quanta are chosen again at each keyframe
+		if (keyframe)
+			m_deltas.clear();
+	}
+
+	// one column per buffer, but the local positions, which are redundant with the global ones
+	vector<ColumnEntry> columns;
+	vector<ColumnChunkJob> jobs;
+	BufferList::const_iterator iter = buffers.begin();
+	for ( ; iter != buffers.end(); ++iter) {
+		if (iter->first == BUFFER_POS)
+			continue;
+
+		const AbstractBuffer *buf = iter->second;
+		ColumnEntry col;
+		memset(&col, 0, sizeof(col));
+		col.key = iter->first;
+		strncpy(col.name, buf->get_buffer_name(), COLUMN_NAME_LEN - 1);
+		col.elsize = buf->get_element_size();
+		describe_column(iter->first, col.elsize, col);
+
+		const char *data = (const char*)buf->get_offset_buffer(0, node_offset);
+		ColumnDelta *delta = NULL;
+		bool encode = false;
+
+		if (delta_coding) {
+			vector<char> &sorted = m_sorted[col.key];
+			sorted.resize((size_t)numParts*col.elsize);
+			for (uint i = 0; i < numParts; ++i)
+				memcpy(&sorted[(size_t)i*col.elsize], data + (size_t)m_order[i]*col.elsize, col.elsize);
+			data = sorted.empty() ? NULL : &sorted[0];
+
+			if (col.components <= COLUMN_MAX_QUANTA &&
+				col.elsize == col.components*column_type_size(col.type)) {
+				map<flag_t, ColumnDelta>::iterator found = m_deltas.find(col.key);
+				if (found == m_deltas.end() || found->second.entry.elsize != col.elsize) {
+					ColumnDelta &added = m_deltas[col.key];
+					added.entry = col;
+					added.quantized = true;
+					added.valid = false;
+					if (col.type == COLUMN_FLOAT32 || col.type == COLUMN_FLOAT64) {
+						for (uint k = 0; k < col.components; ++k) {
+							const double q = quantum(col.key, col, k, data, numParts);
+							added.entry.quantum[k] = q;
+							if (!(q > 0 && isfinite(q)))
+								added.quantized = false;
+						}
+					}
+					found = m_deltas.find(col.key);
+				}
+
+				delta = &found->second;
+				if (delta->quantized && can_quantize(*delta, data, numParts)) {
+					memcpy(col.quantum, delta->entry.quantum, sizeof(col.quantum));
+					encode = delta->valid;
+					delta->valid = true;
+					delta->state.resize((size_t)numParts*col.components);
+				} else {
+					// stored whole, and not a base for the next frame
+					delta->valid = false;
+					delta = NULL;
+				}
+			}
+			if (encode)
+				col.flags |= COLUMN_FLAG_DELTA;
+		}
+		columns.push_back(col);
+
+		for (uint c = 0; c < numChunks; ++c) {
+			const uint from = c*COLUMN_CHUNK_PARTS;
+			const uint to = min(from + COLUMN_CHUNK_PARTS, numParts);
+			ColumnChunkJob job;
+			job.data = data + (size_t)from*col.elsize;
+			job.rawSize = (size_t)(to - from)*col.elsize;
+			job.delta = delta;
+			job.encode = encode;
+			job.from = from;
+			job.to = to;
+			jobs.push_back(job);
+		}
+	}
+
+	// the columns missing from this frame can't be the base of the next one
+	if (delta_coding) {
+		map<flag_t, ColumnDelta>::iterator delta = m_deltas.begin();
+		for ( ; delta != m_deltas.end(); ++delta)
+			if (!buffers.count(delta->first))
+				delta->second.valid = false;
+		m_sinceKey = keyframe ? 0 : m_sinceKey + 1;
+	}
+
+	if ((m_compression || delta_coding) && !jobs.empty())
+		encode_chunks(&jobs[0], jobs.size(), m_compression, m_numThreads);
+
+	m_file.seek(m_end);
+
+	uint64_t pos = m_end;
+	vector<ColumnChunk> chunks(jobs.size());
+	for (size_t c = 0; c < jobs.size(); ++c) {
+		ColumnChunkJob const& job = jobs[c];
+		chunks[c].offset = pos;
+		chunks[c].rawSize = job.rawSize;
+		if (m_compression) {
+			chunks[c].size = job.out.size();
+			m_file.write(&job.out[0], job.out.size());
+		} else {
+			chunks[c].size = job.rawSize;
+			if (job.rawSize)
+				m_file.write(job.data, job.rawSize);
+		}
+		pos += chunks[c].size;
+	}
+
+	ColumnFrameHeader fh;
+	memset(&fh, 0, sizeof(fh));
+	fh.t = t;
+	fh.prevFrame = m_header.lastFrame;
+	fh.numParts = numParts;
+	fh.numColumns = columns.size();
+
+	const uint64_t frameOffset = pos;
+	m_file.write(reinterpret_cast<const char*>(&fh), sizeof(fh));
+	pos += sizeof(fh);
+	if (!columns.empty()) {
+		m_file.write(reinterpret_cast<const char*>(&columns[0]), columns.size()*sizeof(ColumnEntry));
+		pos += columns.size()*sizeof(ColumnEntry);
+	}
+	if (!chunks.empty()) {
+		m_file.write(reinterpret_cast<const char*>(&chunks[0]), chunks.size()*sizeof(ColumnChunk));
+		pos += chunks.size()*sizeof(ColumnChunk);
+	}
+
+	// only point the header to the new frame once the frame is in the file
+	m_file.flush();
+	m_header.numFrames++;
+	m_header.lastFrame = frameOffset;
+	m_file.seek(0);
+	m_file.write(reinterpret_cast<const char*>(&m_header), sizeof(m_header));
+	m_file.flush();
+
+	m_end = pos;
+	ColumnTimeEntry entry;
+	entry.t = t;
+	entry.offset = frameOffset;
+	m_index.push_back(entry);
+
+	// no file limit: the counter only counts the frames, e.g. for checkpoints
+	m_FileCounter++;
+}
@@ -0,0 +1,105 @@
+/*  Copyright 2013 Alexis Herault, Giuseppe Bilotta, Robert A. Dalrymple, Eugenio Rustico, Ciro Del Negro
+
+    Istituto Nazionale di Geofisica e Vulcanologia
+        Sezione di Catania, Catania, Italy
+
+    Università di Catania, Catania, Italy
+
+    Johns Hopkins University, Baltimore, MD
+
+    This file is part of GPUSPH.
+
+    GPUSPH is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GPUSPH is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GPUSPH.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _COLUMNWRITER_H
+#define _COLUMNWRITER_H
+
+#include <map>
+#include <vector>
+
+#include "Writer.h"
+#include "ColumnFormat.h"
+
+using namespace std;
+
+/* Writer appending all the frames to a single columnar file, PART.gpc
+ * (one per rank in multi-node simulations), instead of one file per frame.
+ * Each buffer is stored as a column split in chunks, optionally compressed
+ * (see --column-compress); the file layout is described in ColumnFormat.h,
+ * and the files can be read with the ColumnReader or converted to VTU with
+ * scripts/gpc2vtu.
+ *
+ * With --column-keyframes N, only one frame every N (or after the set of particles
+ * changes) is stored whole: the columns of the other frames hold the differences
+ * from the previous frame, quantized to --column-tolerance for floating-point values.
+ */
+
+// fill in the type and number of components of the column of the given buffer
+// (also used by the ShmWriter to describe its arrays)
+void describe_column(flag_t key, size_t elsize, ColumnEntry &col);
+
+// state of a column for the delta coding: the quanta of its components, and its
+// values in the last frame, quantized (for floating-point components) or not
+struct ColumnDelta {
+	ColumnEntry			entry;
+	// the floating-point components have a quantum, so the column can be delta-coded
+	bool				quantized;
+	// the state holds the last frame
+	bool				valid;
+	// components of each particle, in id order
+	vector<int64_t>		state;
+};
+
+class ColumnWriter : public Writer
+{
+	// zlib compression level of the chunks, 0 for uncompressed (see --column-compress)
+	int				m_compression;
+	// number of threads compressing the chunks
+	uint			m_numThreads;
+
+	DirectFile		m_file;
+	// header of the file, rewritten after each frame
+	ColumnFileHeader	m_header;
+	// end of the directory of the last frame, where the next frame goes
+	uint64_t		m_end;
+	// time index of the frames written so far
+	vector<ColumnTimeEntry>	m_index;
+
+	// delta coding: a keyframe every m_keyframes frames (0 for no delta coding), with
+	// maximum errors relative to m_tolerance (see --column-keyframes and --column-tolerance)
+	uint			m_keyframes;
+	float			m_tolerance;
+	// frames written since the last keyframe
+	uint			m_sinceKey;
+	// ids of the particles of the last frame, in order, and the indices of the
+	// particles of the current frame in id order
+	vector<uint>	m_ids;
+	vector<uint>	m_order;
+	// the columns of the current frame in id order, and their delta coding state
+	map<flag_t, vector<char> >	m_sorted;
+	map<flag_t, ColumnDelta>	m_deltas;
+
+	void sort_by_id(uint numParts, const particleinfo *info, uint node_offset, bool &same_ids);
+	double quantum(flag_t key, ColumnEntry const& col, uint k, const char *data, uint numParts) const;
+	bool can_quantize(ColumnDelta const& delta, const char *data, uint numParts) const;
+
+public:
+	ColumnWriter(const GlobalData *_gdata);
+	~ColumnWriter();
+
+	virtual void write(uint numParts, BufferList const& buffers, uint node_offset, float t, const bool testpoints);
+};
+
+#endif
@@ -0,0 +1,254 @@
+/*  Copyright 2013 Alexis Herault, Giuseppe Bilotta, Robert A. Dalrymple, Eugenio Rustico, Ciro Del Negro
+
+    Istituto Nazionale di Geofisica e Vulcanologia
+        Sezione di Catania, Catania, Italy
+
+    Università di Catania, Catania, Italy
+
+    Johns Hopkins University, Baltimore, MD
+
+    This file is part of GPUSPH.
+
+    GPUSPH is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GPUSPH is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GPUSPH.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// sort, nth_element
+#include <algorithm>
+
+#include <cstdlib>
+// FLT_MAX
+#include <cfloat>
+
+#include "CommandProfiler.h"
+#include "NetworkManager.h"
+
+static const char* commandNames[NUM_COMMAND_TYPES] = {
+	"IDLE",
+	"CALCHASH",
+	"SORT",
+	"INVINDEX",
+	"CROP",
+	"REORDER",
+	"BUILDNEIBS",
+	"FORCES_SYNC",
+	"FORCES_ENQUEUE",
+	"FORCES_COMPLETE",
+	"EULER",
+	"DUMP",
+	"DUMP_CELLS",
+	"UPDATE_SEGMENTS",
+	"APPEND_EXTERNAL",
+	"UPDATE_EXTERNAL",
+	"MLS",
+	"SHEPARD",
+	"VORTICITY",
+	"SURFACE_PARTICLES",
+	"SA_CALC_BOUND_CONDITIONS",
+	"SA_UPDATE_BOUND_VALUES",
+	"SPS",
+	"REDUCE_BODIES_FORCES",
+	"UPLOAD_MBDATA",
+	"UPLOAD_GRAVITY",
+	"UPLOAD_PLANES",
+	"UPLOAD_OBJECTS_CG",
+	"UPLOAD_OBJECTS_MATRICES",
+	"CALC_PRIVATE",
+	"COMPUTE_TESTPOINTS",
+	"ACCUMULATE_STATS",
+	"DUMP_STATS",
+	"TRACK_TRACERS",
+	"LOCATE_TRACERS",
+	"GATHER_TRACERS",
+	"REDUCE_LOADS",
+	"RUN_SEQUENCE",
+	"QUIT"
+};
+
+const char* getCommandName(CommandType cmd)
+{
+	return commandNames[cmd];
+}
+
+CommandProfiler::CommandProfiler() :
+	m_timing(false),
+	m_tracing(false)
+{}
+
+void CommandProfiler::enable(bool timing, bool tracing)
+{
+	m_timing = timing || tracing;
+	m_tracing = tracing;
+}
+
+unsigned long long CommandProfiler::now()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+void CommandProfiler::recordCommand(CommandType cmd, unsigned long long start, unsigned long long end)
+{
+	const double us = (end - start)/1.0e3;
+
+	CommandTimes &times = m_times[cmd];
+	if (times.calls == 0 || us < times.min)
+		times.min = us;
+	if (times.calls == 0 || us > times.max)
+		times.max = us;
+	times.calls++;
+	times.total += us;
+	times.samples.push_back(us);
+
+	if (m_tracing)
+		recordEvent(commandNames[cmd], start, end);
+}
+
+void CommandProfiler::recordEvent(const char *name, unsigned long long start, unsigned long long end)
+{
+	TraceEvent ev;
+	ev.name = name;
+	ev.start = start;
+	ev.end = end;
+	m_trace.push_back(ev);
+}
+
+void CommandProfiler::barrier(Synchronizer *sync)
+{
+	if (!m_tracing) {
+		sync->barrier();
+		return;
+	}
+	const unsigned long long start = now();
+	sync->barrier();
+	recordEvent("barrier", start, now());
+}
+
+void CommandProfiler::resetTimes()
+{
+	for (uint c = 0; c < NUM_COMMAND_TYPES; c++) {
+		CommandTimes &times = m_times[c];
+		times.calls = 0;
+		times.total = times.min = times.max = 0;
+		times.samples.clear();
+	}
+}
+
+void CommandProfiler::flushTrace(FILE *fp, uint pid, uint tid, unsigned long long epoch)
+{
+	for (size_t i = 0; i < m_trace.size(); i++) {
+		const TraceEvent &ev = m_trace[i];
+		// complete events, timestamps in microseconds
+		fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+			ev.name, pid, tid, (ev.start - epoch)/1.0e3, (ev.end - ev.start)/1.0e3);
+	}
+	m_trace.clear();
+	fflush(fp);
+}
+
+// the p-th percentile of the samples, which get partially reordered
+static float percentile(std::vector<float> &samples, double p)
+{
+	const size_t n = samples.size();
+	size_t k = (size_t)(p*(n - 1) + 0.5);
+	std::nth_element(samples.begin(), samples.begin() + k, samples.end());
+	return samples[k];
+}
+
+void CommandProfiler::printStats(CommandProfiler * const *profilers, uint count,
+	NetworkManager *network, uint rank)
+{
+	// per command: calls and total time, summed over the devices; minimum and maximum
+	// time; total time of the slowest device
+	float sums[2*NUM_COMMAND_TYPES + 1];
+	float mins[NUM_COMMAND_TYPES];
+	float maxs[2*NUM_COMMAND_TYPES];
+	std::vector<float> samples[NUM_COMMAND_TYPES];
+
+	for (uint c = 0; c < NUM_COMMAND_TYPES; c++) {
+		float &calls = sums[2*c];
+		float &total = sums[2*c + 1];
+		calls = total = 0;
+		mins[c] = FLT_MAX;
+		maxs[2*c] = maxs[2*c + 1] = 0;
+		for (uint d = 0; d < count; d++) {
+			const CommandTimes &times = profilers[d]->m_times[c];
+			if (times.calls == 0)
+				continue;
+			mins[c] = std::min(mins[c], (float)times.min);
+			maxs[2*c] = std::max(maxs[2*c], (float)times.max);
+			calls += times.calls;
+			total += times.total;
+			maxs[2*c + 1] = std::max(maxs[2*c + 1], (float)times.total);
+			samples[c].insert(samples[c].end(), times.samples.begin(), times.samples.end());
+		}
+	}
+	sums[2*NUM_COMMAND_TYPES] = count;
+
+	// the imbalance is between all the devices of all the ranks; the percentiles
+	// would need all the samples, so they are those of the devices of rank 0
+	if (network) {
+		network->networkFloatReduction(sums, 2*NUM_COMMAND_TYPES + 1, SUM_REDUCTION);
+		network->networkFloatReduction(mins, NUM_COMMAND_TYPES, MIN_REDUCTION);
+		network->networkFloatReduction(maxs, 2*NUM_COMMAND_TYPES, MAX_REDUCTION);
+		if (rank != 0)
+			return;
+	}
+	const float numDevices = sums[2*NUM_COMMAND_TYPES];
+
+	bool header = false;
+	for (uint c = 0; c < NUM_COMMAND_TYPES; c++) {
+		const float calls = sums[2*c];
+		const float total = sums[2*c + 1];
+		const float maxDevTotal = maxs[2*c + 1];
+		if (calls == 0)
+			continue;
+		if (!header) {
+			printf("%-24s %8s %10s %10s %10s %10s %10s %10s %9s\n", "Command (times in us)",
+				"calls", "mean", "min", "max", "p50", "p95", "p99", "max/mean");
+			header = true;
+		}
+		// load imbalance: slowest device w.r.t. the mean over the devices
+		const double imbalance = (total > 0 ? maxDevTotal*numDevices/total : 1.0);
+		const float p50 = percentile(samples[c], 0.50);
+		const float p95 = percentile(samples[c], 0.95);
+		const float p99 = percentile(samples[c], 0.99);
+		printf("%-24s %8lu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %9.2f\n",
+			commandNames[c], (unsigned long)calls, total/calls, mins[c], maxs[2*c], p50, p95, p99, imbalance);
+	}
+	if (header && network)
+		printf("(all ranks; percentiles of rank 0 only)\n");
+	fflush(stdout);
+}
+
+FILE* CommandProfiler::openTrace(const char *filename, uint pid, uint numWorkers)
+{
+	FILE *fp = fopen(filename, "w");
+	if (!fp) {
+		fprintf(stderr, "FATAL: cannot open trace file %s\n", filename);
+		exit(1);
+	}
+	fprintf(fp, "[");
+	fprintf(fp, "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":0,\"args\":{\"name\":\"Main\"}}", pid);
+	for (uint d = 0; d < numWorkers; d++)
+		fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":%u,\"args\":{\"name\":\"Device %u\"}}",
+			pid, d + 1, d);
+	return fp;
+}
+
+void CommandProfiler::closeTrace(FILE *fp)
+{
+	fprintf(fp, "\n]\n");
+	fclose(fp);
+}
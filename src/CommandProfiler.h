@@ -0,0 +1,112 @@
+/*  Copyright 2013 Alexis Herault, Giuseppe Bilotta, Robert A. Dalrymple, Eugenio Rustico, Ciro Del Negro
+
+    Istituto Nazionale di Geofisica e Vulcanologia
+        Sezione di Catania, Catania, Italy
+
+    Università di Catania, Catania, Italy
+
+    Johns Hopkins University, Baltimore, MD
+
+    This file is part of GPUSPH.
+
+    GPUSPH is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GPUSPH is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GPUSPH.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _COMMANDPROFILER_H
+#define _COMMANDPROFILER_H
+
+#include <cstdio>
+#include <vector>
+
+// CommandType
+#include "GlobalData.h"
+
+#define NUM_COMMAND_TYPES	(QUIT + 1)
+
+class NetworkManager;
+
+// name of a command, for the statistics and the trace
+const char* getCommandName(CommandType cmd);
+
+// Execution times of a command in the current printStatus interval, in microseconds
+struct CommandTimes {
+	unsigned long calls;
+	double total;
+	double min;
+	double max;
+	// all the times of the interval, for the percentiles
+	std::vector<float> samples;
+
+	CommandTimes() : calls(0), total(0), min(0), max(0) {}
+};
+
+// A span of the timeline of a thread: a command, a barrier or a write.
+// Times are CLOCK_MONOTONIC nanoseconds
+struct TraceEvent {
+	const char *name;
+	unsigned long long start;
+	unsigned long long end;
+};
+
+// Each thread (the main one and the workers) has its own CommandProfiler, so no
+// locking is needed; the main thread reads the ones of the workers only while they
+// wait for the next command
+class CommandProfiler {
+private:
+	bool m_timing;
+	bool m_tracing;
+
+	CommandTimes m_times[NUM_COMMAND_TYPES];
+	std::vector<TraceEvent> m_trace;
+
+public:
+	CommandProfiler();
+
+	// timing collects the per-command statistics, tracing the timeline
+	void enable(bool timing, bool tracing);
+	bool timing() const { return m_timing; }
+	bool tracing() const { return m_tracing; }
+
+	// monotonic clock, in nanoseconds
+	static unsigned long long now();
+
+	// record the execution of a command
+	void recordCommand(CommandType cmd, unsigned long long start, unsigned long long end);
+	// record a span in the timeline only
+	void recordEvent(const char *name, unsigned long long start, unsigned long long end);
+	// wait on the synchronizer, recording the wait in the timeline
+	void barrier(Synchronizer *sync);
+
+	const CommandTimes& getTimes(CommandType cmd) const { return m_times[cmd]; }
+	// start a new interval
+	void resetTimes();
+
+	// append the recorded events to a trace file opened with openTrace() and forget them.
+	// Timestamps are relative to epoch
+	void flushTrace(FILE *fp, uint pid, uint tid, unsigned long long epoch);
+
+	// print the per-command statistics of the workers' profilers, with the ratio
+	// between the maximum and the mean time per device. With a network, the
+	// statistics are reduced over the devices of all the ranks (so all of them
+	// must call this) and only printed by rank 0
+	static void printStats(CommandProfiler * const *profilers, uint count,
+		NetworkManager *network = NULL, uint rank = 0);
+
+	// open a trace-event file (JSON array format), naming the threads: the main one
+	// is tid 0, the workers 1 .. numWorkers
+	static FILE* openTrace(const char *filename, uint pid, uint numWorkers);
+	static void closeTrace(FILE *fp);
+};
+
+#endif
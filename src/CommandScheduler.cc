@@ -0,0 +1,237 @@
+/*  Copyright 2013 Alexis Herault, Giuseppe Bilotta, Robert A. Dalrymple, Eugenio Rustico, Ciro Del Negro
+
+    Istituto Nazionale di Geofisica e Vulcanologia
+        Sezione di Catania, Catania, Italy
+
+    Università di Catania, Catania, Italy
+
+    Johns Hopkins University, Baltimore, MD
+
+    This file is part of GPUSPH.
+
+    GPUSPH is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GPUSPH is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GPUSPH.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// stable_sort
+#include <algorithm>
+
+#include "CommandScheduler.h"
+
+// buffers read by all the kernels which traverse the neighbor list
+#define NEIBS_TRAVERSAL	(BUFFER_POS | BUFFER_INFO | BUFFER_HASH | BUFFER_NEIBSLIST | BUFFERS_CELL)
+
+// split the buffers selected by the flags of DUMP or UPDATE_EXTERNAL
+// between the READ and the WRITE copies
+static void selectedBuffers(flag_t flags, flag_t &readCopies, flag_t &writeCopies)
+{
+	const flag_t buffers = flags & ALL_DEFINED_BUFFERS;
+	readCopies = buffers & ~BUFFERS_ALL_DBL;
+	writeCopies = NO_FLAGS;
+	if (flags & DBLBUFFER_WRITE)
+		writeCopies = buffers & BUFFERS_ALL_DBL;
+	else
+		readCopies |= buffers & BUFFERS_ALL_DBL;
+}
+
+CommandDependencies CommandScheduler::getDependencies(CommandType cmd, flag_t flags)
+{
+	CommandDependencies deps;
+	deps.reads = deps.writes = deps.readsWriteCopy = deps.writesWriteCopy = NO_FLAGS;
+
+	switch (cmd) {
+		case IDLE:
+			break;
+		case CALCHASH:
+			deps.reads = BUFFER_POS | BUFFER_INFO | BUFFER_HASH;
+			// calcHash also moves the particles to their new cell, in place
+			deps.writes = BUFFER_POS | BUFFER_HASH | BUFFER_PARTINDEX;
+			break;
+		case SORT:
+			deps.reads = deps.writes = BUFFER_HASH | BUFFER_PARTINDEX;
+			break;
+		case INVINDEX:
+			deps.reads = BUFFER_PARTINDEX;
+			deps.writes = BUFFER_INVINDEX;
+			break;
+		case BUILDNEIBS:
+			deps.reads = BUFFER_POS | BUFFER_INFO | BUFFER_HASH | BUFFERS_CELL |
+				BUFFER_VERTICES | BUFFER_BOUNDELEMENTS | BUFFER_VERTPOS;
+			deps.writes = BUFFER_NEIBSLIST | BUFFER_VERTPOS;
+			break;
+		case FORCES_SYNC:
+		case FORCES_ENQUEUE:
+		case FORCES_COMPLETE:
+			deps.reads = NEIBS_TRAVERSAL | BUFFER_VEL | BUFFER_TAU |
+				BUFFER_VERTPOS | BUFFER_GRADGAMMA | BUFFER_BOUNDELEMENTS |
+				BUFFER_TKE | BUFFER_EPSILON | BUFFER_TURBVISC |
+				RESOURCE_GRAVITY | RESOURCE_PLANES | RESOURCE_OBJECTS;
+			// k-epsilon updates the eddy viscosity in place
+			deps.writes = BUFFER_FORCES | BUFFER_XSPH | BUFFER_DKDE | BUFFER_TURBVISC |
+				BUFFERS_CFL | RESOURCE_RBFORCES | RESOURCE_LOADS | RESOURCE_DT;
+			deps.writesWriteCopy = BUFFER_GRADGAMMA;
+			break;
+		case EULER:
+			deps.reads = BUFFER_POS | BUFFER_VEL | BUFFER_INFO | BUFFER_HASH |
+				BUFFER_FORCES | BUFFER_XSPH | BUFFER_DKDE | BUFFER_TKE | BUFFER_EPSILON |
+				RESOURCE_MBDATA | RESOURCE_OBJECTS;
+			// the maximum displacement (see SimParams::adaptiveneibsfreq)
+			deps.writes = RESOURCE_DT;
+			deps.writesWriteCopy = BUFFER_POS | BUFFER_VEL | BUFFER_TKE | BUFFER_EPSILON;
+			break;
+		case DUMP:
+			selectedBuffers(flags, deps.reads, deps.readsWriteCopy);
+			deps.writes = RESOURCE_HOST;
+			break;
+		case DUMP_CELLS:
+			deps.reads = BUFFERS_CELL;
+			deps.writes = RESOURCE_HOST;
+			break;
+		case UPDATE_EXTERNAL:
+			// reads the copies on the peers, writes the local ones
+			selectedBuffers(flags, deps.reads, deps.readsWriteCopy);
+			deps.writes = deps.reads;
+			deps.writesWriteCopy = deps.readsWriteCopy;
+			break;
+		case MLS:
+		case SHEPARD:
+			deps.reads = NEIBS_TRAVERSAL | BUFFER_VEL;
+			deps.writesWriteCopy = BUFFER_VEL;
+			break;
+		case VORTICITY:
+			deps.reads = NEIBS_TRAVERSAL | BUFFER_VEL;
+			deps.writes = BUFFER_VORTICITY;
+			break;
+		case SURFACE_PARTICLES:
+			deps.reads = NEIBS_TRAVERSAL | BUFFER_VEL | RESOURCE_PLANES;
+			deps.writes = BUFFER_NORMALS;
+			deps.writesWriteCopy = BUFFER_INFO;
+			break;
+		case SPS:
+			deps.reads = NEIBS_TRAVERSAL | BUFFER_VEL;
+			deps.writes = BUFFER_TAU;
+			break;
+		case REDUCE_BODIES_FORCES:
+			deps.reads = RESOURCE_RBFORCES;
+			deps.writes = RESOURCE_HOST;
+			break;
+		case UPLOAD_MBDATA:
+			deps.writes = RESOURCE_MBDATA;
+			break;
+		case UPLOAD_GRAVITY:
+			deps.writes = RESOURCE_GRAVITY;
+			break;
+		case UPLOAD_PLANES:
+			deps.writes = RESOURCE_PLANES;
+			break;
+		case UPLOAD_OBJECTS_CG:
+		case UPLOAD_OBJECTS_MATRICES:
+			deps.writes = RESOURCE_OBJECTS;
+			break;
+		case CALC_PRIVATE:
+			deps.reads = NEIBS_TRAVERSAL | BUFFER_VEL;
+			deps.writes = BUFFER_PRIVATE;
+			break;
+		case COMPUTE_TESTPOINTS:
+			// the velocity of the testpoints is updated in place
+			deps.reads = NEIBS_TRAVERSAL | BUFFER_VEL;
+			deps.writes = BUFFER_VEL;
+			break;
+		case ACCUMULATE_STATS:
+			deps.reads = BUFFER_POS | BUFFER_VEL | BUFFER_INFO | BUFFER_HASH | BUFFERS_CELL |
+				BUFFER_TKE | BUFFER_EPSILON;
+			deps.writes = RESOURCE_STATS;
+			break;
+		case DUMP_STATS:
+			deps.reads = RESOURCE_STATS;
+			deps.writes = RESOURCE_STATS | RESOURCE_HOST;
+			break;
+		case TRACK_TRACERS:
+			deps.reads = BUFFER_INVINDEX | RESOURCE_TRACERS;
+			deps.writes = RESOURCE_TRACERS;
+			break;
+		case LOCATE_TRACERS:
+			deps.reads = BUFFER_INFO;
+			deps.writes = RESOURCE_TRACERS;
+			break;
+		case GATHER_TRACERS:
+			deps.reads = BUFFER_POS | BUFFER_VEL | BUFFER_INFO | BUFFER_HASH | RESOURCE_TRACERS;
+			// tracers found in the wrong place are forgotten
+			deps.writes = RESOURCE_TRACERS | RESOURCE_HOST;
+			break;
+		case REDUCE_LOADS:
+			deps.reads = RESOURCE_LOADS;
+			deps.writes = RESOURCE_HOST;
+			break;
+		// commands which change the number or the order of the particles, and
+		// the semi-analytical boundary commands, depend on (and block) everything
+		case CROP:
+		case REORDER:
+		case UPDATE_SEGMENTS:
+		case APPEND_EXTERNAL:
+		case SA_CALC_BOUND_CONDITIONS:
+		case SA_UPDATE_BOUND_VALUES:
+		case RUN_SEQUENCE:
+		case QUIT:
+			deps.reads = deps.writes = ALL_RESOURCES;
+			deps.readsWriteCopy = deps.writesWriteCopy = ALL_RESOURCES;
+			break;
+	}
+
+	return deps;
+}
+
+// sort by level only, keeping the recorded order within each level
+static bool lowerLevel(CommandStep const& a, CommandStep const& b)
+{
+	return a.level < b.level;
+}
+
+uint CommandScheduler::schedule(CommandSequence &sequence)
+{
+	const size_t numSteps = sequence.size();
+
+	std::vector<CommandDependencies> deps(numSteps);
+	std::vector<flag_t> touched(numSteps);
+
+	uint numLevels = 0;
+
+	for (size_t i = 0; i < numSteps; ++i) {
+		CommandStep &step = sequence[i];
+		deps[i] = getDependencies(step.command, step.flags);
+		touched[i] = deps[i].reads | deps[i].writes |
+			deps[i].readsWriteCopy | deps[i].writesWriteCopy | step.swapBuffers;
+
+		step.level = 0;
+		for (size_t j = 0; j < i; ++j) {
+			const CommandStep &prev = sequence[j];
+			uint minLevel = 0;
+			// RAW, WAR or WAW dependencies, and buffers swapped by the previous step:
+			// the swaps are only done at the end of a level, so this step has to come later
+			if (deps[i].dependsOn(deps[j]) || (prev.swapBuffers & touched[i]))
+				minLevel = prev.level + 1;
+			// swapping buffers used by a previous step: it's enough to be in the same level
+			else if (step.swapBuffers & touched[j])
+				minLevel = prev.level;
+			if (minLevel > step.level)
+				step.level = minLevel;
+		}
+
+		if (step.level + 1 > numLevels)
+			numLevels = step.level + 1;
+	}
+
+	std::stable_sort(sequence.begin(), sequence.end(), lowerLevel);
+
+	return numLevels;
+}
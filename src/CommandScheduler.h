@@ -0,0 +1,82 @@
+/*  Copyright 2013 Alexis Herault, Giuseppe Bilotta, Robert A. Dalrymple, Eugenio Rustico, Ciro Del Negro
+
+    Istituto Nazionale di Geofisica e Vulcanologia
+        Sezione di Catania, Catania, Italy
+
+    Università di Catania, Catania, Italy
+
+    Johns Hopkins University, Baltimore, MD
+
+    This file is part of GPUSPH.
+
+    GPUSPH is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GPUSPH is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GPUSPH.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _COMMANDSCHEDULER_H
+#define _COMMANDSCHEDULER_H
+
+#include "GlobalData.h"
+
+// Besides the buffers, commands access some state which is not stored in
+// buffers: the device copies of constants, the shared host arrays in GlobalData,
+// the per-device dt. These flags take the bits after the last defined buffer,
+// and are only used to compute the dependencies between commands
+#define RESOURCE_GRAVITY	(LAST_DEFINED_BUFFER << 1)
+#define RESOURCE_MBDATA		(RESOURCE_GRAVITY << 1)
+#define RESOURCE_PLANES		(RESOURCE_MBDATA << 1)
+#define RESOURCE_OBJECTS	(RESOURCE_PLANES << 1)	// centers of gravity, translations and rotations
+#define RESOURCE_RBFORCES	(RESOURCE_OBJECTS << 1)	// per-particle forces and torques on rigid bodies
+#define RESOURCE_DT			(RESOURCE_RBFORCES << 1)	// per-device dt and maximum displacement
+#define RESOURCE_HOST		(RESOURCE_DT << 1)		// shared host arrays in GlobalData
+#define RESOURCE_STATS		(RESOURCE_HOST << 1)	// accumulators of the running statistics
+#define RESOURCE_TRACERS	(RESOURCE_STATS << 1)	// indices of the tracer particles
+#define RESOURCE_LOADS		(RESOURCE_TRACERS << 1)	// per-particle forces and moments on the loaded objects
+#define LAST_DEFINED_RESOURCE	RESOURCE_LOADS
+
+// everything: used for commands which change the number or order of particles
+#define ALL_RESOURCES	(ALL_DEFINED_BUFFERS | (((LAST_DEFINED_BUFFER << 1) - 1) ^ ((LAST_DEFINED_RESOURCE << 1) - 1)))
+
+// Buffers and resources accessed by a command. Single buffers and resources are
+// in reads and writes, as are the READ copies of double-buffered arrays, whose WRITE
+// copies are tracked separately: a command reading the READ copy of a buffer does not
+// depend on a command writing the WRITE copy of the same buffer
+struct CommandDependencies {
+	flag_t	reads;
+	flag_t	writes;
+	flag_t	readsWriteCopy;
+	flag_t	writesWriteCopy;
+
+	// does a command with these dependencies have to run after one with the other ones?
+	bool dependsOn(CommandDependencies const& other) const {
+		return (other.writes & (reads | writes)) || (other.reads & writes) ||
+			(other.writesWriteCopy & (readsWriteCopy | writesWriteCopy)) ||
+			(other.readsWriteCopy & writesWriteCopy);
+	}
+};
+
+// The CommandScheduler turns a linear CommandSequence into a DAG, using the
+// buffers and resources each command reads and writes, and sorts its steps
+// into levels: all the steps in a level only depend on steps in previous levels,
+// so the workers can run them without waiting for each other.
+class CommandScheduler {
+public:
+	// buffers and resources accessed by a command with the given flags
+	static CommandDependencies getDependencies(CommandType cmd, flag_t flags);
+
+	// assign a level to each step and stable-sort the sequence by level.
+	// Returns the number of levels
+	static uint schedule(CommandSequence &sequence);
+};
+
+#endif
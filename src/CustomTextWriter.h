@@ -32,6 +32,9 @@ using namespace std;
 
 class CustomTextWriter : public Writer
 {
+	// number of threads formatting the particles
+	uint	m_numThreads;
+
 public:
 	CustomTextWriter(const GlobalData *_gdata);
 	~CustomTextWriter();
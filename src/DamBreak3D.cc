@@ -81,6 +81,11 @@ DamBreak3D::DamBreak3D(const GlobalData *_gdata) : Problem(_gdata)
 	// We have no moving boundary
 	m_simparams.mbcallback = false;
 
+	// Running statistics of the fluid fields, on the cells and on the
+	// probes at the test points (see fill_parts)
+	//m_simparams.statsfreq = 10;
+	//m_simparams.testpoints = true;
+
 	// Physical parameters
 	H = 0.4f;
 	m_physparams.gravity = make_float3(0.0, 0.0, -9.81f);
@@ -106,6 +111,13 @@ DamBreak3D::DamBreak3D(const GlobalData *_gdata) : Problem(_gdata)
 	set_timer_tick(0.01f);
 	add_writer(VTKWRITER, 5);
 
+	// Trajectories of the fluid particles starting in a slab of the water column
+	//add_tracers(m_origin + make_double3(0.1, 0.2, 0.1), m_origin + make_double3(0.14, 0.3, 0.2));
+
+	// Force of the water on the obstacle (object 1), and its moment about the
+	// center of the base
+	//add_load(1, m_origin + make_double3(0.96, 0.30, 0.0));
+
 	// Name of problem used for directory creation
 	m_name = "DamBreak3D";
 }
@@ -121,6 +133,7 @@ void DamBreak3D::release_memory(void)
 {
 	parts.clear();
 	obstacle_parts.clear();
+	test_points.clear();
 	boundary_parts.clear();
 }
 
@@ -164,7 +177,13 @@ int DamBreak3D::fill_parts()
 		obstacle.Unfill(parts, r0);
 	}
 
-	return parts.size() + boundary_parts.size() + obstacle_parts.size();
+	// Probes in the water column and upstream of the obstacle
+	if (m_simparams.testpoints) {
+		test_points.push_back(m_origin + make_double3(0.2, 0.33, 0.1));
+		test_points.push_back(m_origin + make_double3(0.6, 0.33, 0.02));
+	}
+
+	return parts.size() + boundary_parts.size() + obstacle_parts.size() + test_points.size();
 }
 
 uint DamBreak3D::fill_planes()
@@ -217,10 +236,10 @@ void DamBreak3D::copy_to_array(BufferList &buffers)
 	//Testpoints
 	if (test_points.size()) {
 		std::cout << "\nTest points: " << test_points.size() << "\n";
-		for (uint i = 0; i < test_points.size(); i++) {
+		for (uint i = j; i < j + test_points.size(); i++) {
 			vel[i] = make_float4(0, 0, 0, m_physparams.rho0[0]);
 			info[i]= make_particleinfo(TESTPOINTSPART, 0, i);
-			calc_localpos_and_hash(test_points[i], info[i], pos[i], hash[i]);
+			calc_localpos_and_hash(test_points[i-j], info[i], pos[i], hash[i]);
 		}
 		j += test_points.size();
 		std::cout << "Test point mass:" << pos[j-1].w << "\n";
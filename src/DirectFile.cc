@@ -0,0 +1,622 @@
+/*  Copyright 2013 Alexis Herault, Giuseppe Bilotta, Robert A. Dalrymple, Eugenio Rustico, Ciro Del Negro
+
+    Istituto Nazionale di Geofisica e Vulcanologia
+        Sezione di Catania, Catania, Italy
+
+    Università di Catania, Catania, Italy
+
+    Johns Hopkins University, Baltimore, MD
+
+    This file is part of GPUSPH.
+
+    GPUSPH is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GPUSPH is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GPUSPH.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// io_uring is available since Linux 5.1; we use the system calls directly,
+// so that liburing is not needed
+#ifdef __linux__
+#include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,1,0)
+#define HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+#include "DirectFile.h"
+// clock_gettime
+#include "timing.h"
+
+// alignment of the offsets and sizes of the O_DIRECT writes, enough for the
+// logical block size of any device
+#define DIRECT_ALIGN		4096
+// size of the staging buffers
+#define DIRECT_SLOT_SIZE	(1U << 20)
+// number of staging buffers, with and without io_uring
+#define DIRECT_SLOTS		8
+#define SYNC_SLOTS			1
+
+static double
+now_seconds()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec*1.0e-9;
+}
+
+static runtime_error
+errno_error(const char *what, string const& fname, int err)
+{
+	return runtime_error(string(what) + " " + fname + ": " + strerror(err));
+}
+
+IOStats::IOStats() :
+	m_bytes(0),
+	m_seconds(0),
+	m_files(0)
+{
+	pthread_mutex_init(&m_mutex, NULL);
+}
+
+IOStats::~IOStats()
+{
+	pthread_mutex_destroy(&m_mutex);
+}
+
+void
+IOStats::add(uint64_t bytes, double seconds)
+{
+	pthread_mutex_lock(&m_mutex);
+	m_bytes += bytes;
+	m_seconds += seconds;
+	m_files++;
+	pthread_mutex_unlock(&m_mutex);
+}
+
+uint64_t
+IOStats::bytes() const
+{
+	pthread_mutex_lock(const_cast<pthread_mutex_t*>(&m_mutex));
+	const uint64_t ret = m_bytes;
+	pthread_mutex_unlock(const_cast<pthread_mutex_t*>(&m_mutex));
+	return ret;
+}
+
+double
+IOStats::seconds() const
+{
+	pthread_mutex_lock(const_cast<pthread_mutex_t*>(&m_mutex));
+	const double ret = m_seconds;
+	pthread_mutex_unlock(const_cast<pthread_mutex_t*>(&m_mutex));
+	return ret;
+}
+
+uint
+IOStats::files() const
+{
+	pthread_mutex_lock(const_cast<pthread_mutex_t*>(&m_mutex));
+	const uint ret = m_files;
+	pthread_mutex_unlock(const_cast<pthread_mutex_t*>(&m_mutex));
+	return ret;
+}
+
+#if HAVE_IO_URING
+
+// the rings shared with the kernel, mapped in our memory
+struct DirectRing {
+	int					fd;
+	void				*sq_ptr;
+	void				*cq_ptr;
+	size_t				sq_size;
+	size_t				cq_size;
+	io_uring_sqe		*sqes;
+	size_t				sqes_size;
+	unsigned			*sq_tail;
+	unsigned			*sq_mask;
+	unsigned			*sq_array;
+	unsigned			*cq_head;
+	unsigned			*cq_tail;
+	unsigned			*cq_mask;
+	io_uring_cqe		*cqes;
+};
+
+static void
+ring_destroy(DirectRing *ring)
+{
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_size);
+	if (ring->sq_ptr)
+		munmap(ring->sq_ptr, ring->sq_size);
+	close(ring->fd);
+	delete ring;
+}
+
+static void *
+ring_map(int fd, size_t size, off_t what)
+{
+	void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, what);
+	return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+// set up an io_uring with the given number of entries; returns NULL if the
+// kernel does not support io_uring, or we are not allowed to use it
+static DirectRing *
+ring_create(unsigned entries)
+{
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	const int fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (fd < 0)
+		return NULL;
+
+	DirectRing *ring = new DirectRing;
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = fd;
+	ring->sq_size = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+	ring->cq_size = params.cq_off.cqes + params.cq_entries*sizeof(io_uring_cqe);
+	ring->sqes_size = params.sq_entries*sizeof(io_uring_sqe);
+
+	bool single_mmap = false;
+#ifdef IORING_FEAT_SINGLE_MMAP
+	// both rings in a single mapping
+	single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+	if (single_mmap)
+		ring->sq_size = ring->cq_size = max(ring->sq_size, ring->cq_size);
+#endif
+
+	ring->sq_ptr = ring_map(fd, ring->sq_size, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr)
+		ring->cq_ptr = single_mmap ? ring->sq_ptr : ring_map(fd, ring->cq_size, IORING_OFF_CQ_RING);
+	if (ring->cq_ptr)
+		ring->sqes = (io_uring_sqe*)ring_map(fd, ring->sqes_size, IORING_OFF_SQES);
+	if (!ring->sqes) {
+		ring_destroy(ring);
+		return NULL;
+	}
+
+	char *sq = (char*)ring->sq_ptr;
+	char *cq = (char*)ring->cq_ptr;
+	ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+	ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+	ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+	ring->cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+
+	return ring;
+}
+
+static int
+ring_enter(DirectRing *ring, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	int ret;
+	do {
+		ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete, flags, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+	return ret < 0 ? errno : 0;
+}
+
+// queue and submit the write of iov at the given offset; returns 0 or the error
+static int
+ring_writev(DirectRing *ring, int fd, struct iovec *iov, uint64_t offset, uint64_t user_data)
+{
+	const unsigned tail = *(volatile unsigned*)ring->sq_tail;
+	const unsigned idx = tail & *ring->sq_mask;
+
+	io_uring_sqe *sqe = ring->sqes + idx;
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)iov;
+	sqe->len = 1;
+	sqe->off = offset;
+	sqe->user_data = user_data;
+	ring->sq_array[idx] = idx;
+
+	// the kernel must see the entry before the new tail
+	__sync_synchronize();
+	*(volatile unsigned*)ring->sq_tail = tail + 1;
+	__sync_synchronize();
+
+	return ring_enter(ring, 1, 0, 0);
+}
+
+#else
+
+struct DirectRing {};
+
+static void
+ring_destroy(DirectRing *ring)
+{ delete ring; }
+
+#endif
+
+DirectFile::DirectFile() :
+	m_fd(-1),
+	m_ring(NULL),
+	m_direct(false),
+	m_align(1),
+	m_slotSize(0),
+	m_cur(0),
+	m_staging(false),
+	m_inFlight(0),
+	m_block(NULL),
+	m_pos(0),
+	m_size(0),
+	m_stats(NULL),
+	m_bytes(0),
+	m_seconds(0),
+	m_busy(false),
+	m_busySince(0)
+{}
+
+DirectFile::~DirectFile()
+{
+	try {
+		close();
+	} catch (exception &e) {
+		fprintf(stderr, "%s\n", e.what());
+	}
+	release();
+}
+
+void
+DirectFile::open(string const& fname, bool direct, IOStats *stats)
+{
+	if (is_open())
+		close();
+
+	m_fname = fname;
+	m_stats = stats;
+	m_direct = false;
+
+	const int flags = O_RDWR | O_CREAT | O_TRUNC;
+#ifdef O_DIRECT
+	// fails e.g. on tmpfs, in which case we go through the page cache
+	if (direct) {
+		m_fd = ::open(fname.c_str(), flags | O_DIRECT, 0666);
+		m_direct = (m_fd >= 0);
+	}
+#endif
+	if (m_fd < 0)
+		m_fd = ::open(fname.c_str(), flags, 0666);
+	if (m_fd < 0)
+		throw errno_error("Cannot open data file", fname, errno);
+
+	m_align = m_direct ? DIRECT_ALIGN : 1;
+#if HAVE_IO_URING
+	if (direct)
+		m_ring = ring_create(DIRECT_SLOTS);
+#endif
+
+	m_slotSize = DIRECT_SLOT_SIZE;
+	m_slots.resize(m_ring ? DIRECT_SLOTS : SYNC_SLOTS);
+	bool allocated = !posix_memalign((void**)&m_block, DIRECT_ALIGN, DIRECT_ALIGN);
+	for (size_t s = 0; s < m_slots.size(); ++s) {
+		Slot &slot = m_slots[s];
+		slot.len = 0;
+		slot.offset = 0;
+		slot.busy = false;
+		if (posix_memalign((void**)&slot.buf, DIRECT_ALIGN, m_slotSize)) {
+			slot.buf = NULL;
+			allocated = false;
+		}
+	}
+	if (!allocated) {
+		release();
+		throw runtime_error("cannot allocate the staging buffers of " + fname);
+	}
+
+	m_cur = 0;
+	m_staging = false;
+	m_inFlight = 0;
+	m_pos = m_size = 0;
+	m_bytes = 0;
+	m_seconds = 0;
+	m_busy = false;
+	m_error.clear();
+}
+
+// free the resources of the file, closing it if it's open
+void
+DirectFile::release()
+{
+	// the buffers can't be freed while the kernel is writing them: in the unlikely
+	// case we can't wait for the writes in flight, we leak them
+	bool drained = true;
+	try {
+		drain();
+	} catch (exception &e) {
+		drained = false;
+	}
+
+	if (m_ring) {
+		ring_destroy(m_ring);
+		m_ring = NULL;
+	}
+	if (m_fd >= 0) {
+		::close(m_fd);
+		m_fd = -1;
+	}
+
+	if (drained) {
+		for (size_t s = 0; s < m_slots.size(); ++s)
+			free(m_slots[s].buf);
+		free(m_block);
+	}
+	m_slots.clear();
+	m_block = NULL;
+	m_inFlight = 0;
+	m_staging = false;
+}
+
+// read the bytes from `from` to `to` of the (aligned) block at offset of the file
+// into the same bytes of dst; the bytes past the end of the file are zeroed
+void
+DirectFile::read_block(uint64_t offset, char *dst, size_t from, size_t to)
+{
+	// with O_DIRECT, only whole blocks can be read, into aligned memory
+	ssize_t got;
+	do {
+		got = pread(m_fd, m_block, m_align, offset);
+	} while (got < 0 && errno == EINTR);
+	if (got < 0)
+		throw errno_error("cannot read back", m_fname, errno);
+	if ((size_t)got < m_align)
+		memset(m_block + got, 0, m_align - got);
+	memcpy(dst + from, m_block + from, to - from);
+}
+
+// start staging the data at the current position into the current slot
+void
+DirectFile::start_run()
+{
+	Slot &slot = m_slots[m_cur];
+	while (slot.busy)
+		wait_one();
+	check_error();
+
+	slot.offset = m_pos - m_pos % m_align;
+	slot.len = m_pos - slot.offset;
+	// with O_DIRECT, the beginning of the first block must be rewritten as it is
+	// in the file, once the writes in flight are done
+	if (slot.len) {
+		drain();
+		read_block(slot.offset, slot.buf, 0, slot.len);
+	}
+	m_staging = true;
+}
+
+// write the given slot, asynchronously if possible
+void
+DirectFile::submit(uint s)
+{
+	Slot &slot = m_slots[s];
+
+	size_t len = slot.len;
+	const size_t tail = len % m_align;
+	if (tail) {
+		// with O_DIRECT, the last block is written whole: the part after the
+		// current position is what was written there before, if anything
+		const size_t block = len - tail;
+		memset(slot.buf + len, 0, m_align - tail);
+		if (slot.offset + len < m_size)
+			read_block(slot.offset + block, slot.buf + block, tail, m_align);
+		len = block + m_align;
+	}
+
+	slot.iov.iov_base = slot.buf;
+	slot.iov.iov_len = len;
+
+#if HAVE_IO_URING
+	if (m_ring) {
+		const int err = ring_writev(m_ring, m_fd, &slot.iov, slot.offset, s);
+		if (err)
+			throw errno_error("cannot queue the writes of", m_fname, err);
+		slot.busy = true;
+		m_inFlight++;
+		return;
+	}
+#endif
+
+	write_sync(slot, 0);
+}
+
+// write what's left of the slot after the first done bytes, synchronously
+void
+DirectFile::write_sync(Slot &slot, size_t done)
+{
+	const char *buf = (const char*)slot.iov.iov_base;
+	const size_t len = slot.iov.iov_len;
+	while (done < len) {
+		const ssize_t ret = pwrite(m_fd, buf + done, len - done, slot.offset + done);
+		if (ret >= 0) {
+			done += ret;
+			continue;
+		}
+		if (errno == EINTR)
+			continue;
+#ifdef O_DIRECT
+		// some filesystems accept O_DIRECT when opening, but not when writing
+		if (errno == EINVAL && m_direct) {
+			fcntl(m_fd, F_SETFL, fcntl(m_fd, F_GETFL) & ~O_DIRECT);
+			m_direct = false;
+			continue;
+		}
+#endif
+		throw errno_error("cannot write", m_fname, errno);
+	}
+}
+
+// a write in flight completed, with result res
+void
+DirectFile::complete(uint s, int res)
+{
+	Slot &slot = m_slots[s];
+	slot.busy = false;
+	m_inFlight--;
+
+	try {
+		if (res < 0) {
+			// see write_sync() for EINVAL with O_DIRECT
+			if (res != -EINVAL || !m_direct)
+				throw errno_error("cannot write", m_fname, -res);
+			write_sync(slot, 0);
+		} else if ((size_t)res < slot.iov.iov_len) {
+			write_sync(slot, res);
+		}
+	} catch (exception &e) {
+		if (m_error.empty())
+			m_error = e.what();
+	}
+}
+
+// wait for at least one of the writes in flight to complete
+void
+DirectFile::wait_one()
+{
+#if HAVE_IO_URING
+	const int err = ring_enter(m_ring, 0, 1, IORING_ENTER_GETEVENTS);
+	if (err)
+		throw errno_error("cannot wait for the writes of", m_fname, err);
+
+	unsigned head = *(volatile unsigned*)m_ring->cq_head;
+	const unsigned tail = *(volatile unsigned*)m_ring->cq_tail;
+	// read the entries after the tail
+	__sync_synchronize();
+	for ( ; head != tail; ++head) {
+		const io_uring_cqe *cqe = m_ring->cqes + (head & *m_ring->cq_mask);
+		complete(cqe->user_data, cqe->res);
+	}
+	// and release them after reading them
+	__sync_synchronize();
+	*(volatile unsigned*)m_ring->cq_head = head;
+#endif
+}
+
+void
+DirectFile::drain()
+{
+	while (m_inFlight > 0)
+		wait_one();
+}
+
+void
+DirectFile::check_error()
+{
+	if (!m_error.empty())
+		throw runtime_error(m_error);
+}
+
+void
+DirectFile::write(const void *data, size_t size)
+{
+	if (!m_busy) {
+		m_busy = true;
+		m_busySince = now_seconds();
+	}
+	m_bytes += size;
+
+	const char *src = (const char*)data;
+	while (size > 0) {
+		if (!m_staging)
+			start_run();
+
+		Slot &slot = m_slots[m_cur];
+		const size_t n = min(size, m_slotSize - slot.len);
+		memcpy(slot.buf + slot.len, src, n);
+		slot.len += n;
+		src += n;
+		size -= n;
+		m_pos += n;
+		if (m_pos > m_size)
+			m_size = m_pos;
+
+		// the slots are aligned, so the next one starts at a block boundary
+		if (slot.len == m_slotSize) {
+			submit(m_cur);
+			m_cur = (m_cur + 1) % m_slots.size();
+			m_staging = false;
+		}
+	}
+
+	check_error();
+}
+
+void
+DirectFile::seek(uint64_t pos)
+{
+	if (pos == m_pos)
+		return;
+	flush();
+	m_pos = pos;
+}
+
+void
+DirectFile::flush()
+{
+	if (m_staging) {
+		if (m_slots[m_cur].len > 0)
+			submit(m_cur);
+		m_cur = (m_cur + 1) % m_slots.size();
+		m_staging = false;
+	}
+	drain();
+
+	if (m_busy) {
+		m_seconds += now_seconds() - m_busySince;
+		m_busy = false;
+	}
+
+	check_error();
+}
+
+void
+DirectFile::close()
+{
+	if (!is_open())
+		return;
+
+	try {
+		flush();
+		// drop the padding of the last block
+		if (m_align > 1 && ftruncate(m_fd, m_size))
+			throw errno_error("cannot truncate", m_fname, errno);
+	} catch (...) {
+		release();
+		throw;
+	}
+
+	const int err = ::close(m_fd) ? errno : 0;
+	m_fd = -1;
+	release();
+	if (err)
+		throw errno_error("cannot close", m_fname, err);
+
+	if (m_stats)
+		m_stats->add(m_bytes, m_seconds);
+}
@@ -0,0 +1,169 @@
+/*  Copyright 2013 Alexis Herault, Giuseppe Bilotta, Robert A. Dalrymple, Eugenio Rustico, Ciro Del Negro
+
+    Istituto Nazionale di Geofisica e Vulcanologia
+        Sezione di Catania, Catania, Italy
+
+    Università di Catania, Catania, Italy
+
+    Johns Hopkins University, Baltimore, MD
+
+    This file is part of GPUSPH.
+
+    GPUSPH is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GPUSPH is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GPUSPH.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _DIRECTFILE_H
+#define _DIRECTFILE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <sys/uio.h>
+
+using namespace std;
+
+// bytes written by the DirectFiles of a writer, and the time spent writing them;
+// shared by the threads writing the pieces of a writer
+class IOStats {
+	pthread_mutex_t	m_mutex;
+	uint64_t		m_bytes;
+	double			m_seconds;
+	uint			m_files;
+
+	// not copyable
+	IOStats(IOStats const&);
+	IOStats& operator=(IOStats const&);
+
+public:
+	IOStats();
+	~IOStats();
+
+	void add(uint64_t bytes, double seconds);
+
+	uint64_t bytes() const;
+	double seconds() const;
+	uint files() const;
+};
+
+// io_uring instance of a DirectFile, see DirectFile.cc
+struct DirectRing;
+
+/* Output file for large binary payloads, written sequentially from the current
+ * position (see seek()).
+ *
+ * With direct I/O the data is staged in aligned buffers which are submitted
+ * through io_uring as soon as they are full, so that the writer can fill the
+ * next one while the previous ones are written, and the file is opened with
+ * O_DIRECT so that it doesn't go through (and evict) the page cache. When the
+ * filesystem does not support O_DIRECT (e.g. tmpfs) the file is written through
+ * the page cache, and when the kernel has no io_uring (or it's forbidden, as in
+ * some containers) the buffers are written synchronously.
+ * Without direct I/O the buffers are written synchronously through the page
+ * cache, as an ofstream would.
+ *
+ * With O_DIRECT, the partial blocks at the ends of a run of writes are read back
+ * and rewritten whole, and the file is truncated to its size by close().
+ */
+class DirectFile {
+	int					m_fd;
+	string				m_fname;
+	DirectRing			*m_ring;
+	bool				m_direct;
+	// alignment of the offsets and sizes of the writes (1 without O_DIRECT)
+	size_t				m_align;
+
+	// staging buffers: the current one holds the data from its offset to the
+	// current position; the others are free or being written
+	struct Slot {
+		char			*buf;
+		size_t			len;
+		uint64_t		offset;
+		bool			busy;
+		struct iovec	iov;
+	};
+	vector<Slot>		m_slots;
+	size_t				m_slotSize;
+	uint				m_cur;
+	// the current slot holds (or will hold) the data at the current position
+	bool				m_staging;
+	uint				m_inFlight;
+	// aligned scratch block for the read-back of partial blocks
+	char				*m_block;
+
+	uint64_t			m_pos;
+	uint64_t			m_size;
+
+	// statistics: bytes written, time spent with data to write
+	IOStats				*m_stats;
+	uint64_t			m_bytes;
+	double				m_seconds;
+	bool				m_busy;
+	double				m_busySince;
+
+	// first error met by a write in flight
+	string				m_error;
+
+	void start_run();
+	void read_block(uint64_t offset, char *dst, size_t from, size_t to);
+	void submit(uint s);
+	void write_sync(Slot &slot, size_t done);
+	void complete(uint s, int res);
+	void wait_one();
+	void drain();
+	void check_error();
+	void release();
+
+	// not copyable
+	DirectFile(DirectFile const&);
+	DirectFile& operator=(DirectFile const&);
+
+public:
+	DirectFile();
+	// closes the file, only reporting errors on stderr: call close() to handle them
+	~DirectFile();
+
+	// create (or truncate) the file, with direct I/O or not; the bytes written and
+	// the time spent writing them are added to stats (if any) by close()
+	void open(string const& fname, bool direct, IOStats *stats = NULL);
+
+	inline bool is_open() const
+	{ return m_fd >= 0; }
+
+	// is the file written with O_DIRECT, through io_uring?
+	inline bool direct() const
+	{ return m_direct; }
+	inline bool async() const
+	{ return m_ring != NULL; }
+
+	void write(const void *data, size_t size);
+
+	inline void write(string const& str)
+	{ write(str.data(), str.size()); }
+
+	// current position, where the next write goes
+	inline uint64_t tell() const
+	{ return m_pos; }
+
+	// move the current position, after writing what was written so far
+	void seek(uint64_t pos);
+
+	// wait for the data written so far to be in the file
+	void flush();
+
+	void close();
+};
+
+#endif
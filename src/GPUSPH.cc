@@ -24,6 +24,7 @@
 */
 
 #include <float.h> // FLT_EPSILON
+#include <stdexcept> // checkpoint errors
 
 #define GPUSPH_MAIN
 #include "particledefine.h"
@@ -38,6 +39,13 @@
 
 // GPUWorker
 #include "GPUWorker.h"
+// CPUWorker
+#include "CPUWorker.h"
+// CommandScheduler
+#include "CommandScheduler.h"
+#include "RunningStats.h"
+#include "Tracers.h"
+#include "Loads.h"
 
 /* Include only the problem selected at compile time */
 #include "problem_select.opt"
@@ -60,6 +68,23 @@ GPUSPH::GPUSPH() {
 	clOptions = NULL;
 	gdata = NULL;
 	problem = NULL;
+	m_integrator = NULL;
+	m_recordingCommands = false;
+	m_mainBarriers = 0;
+	m_traceFile = NULL;
+	m_traceEpoch = 0;
+	m_callbackSync = NULL;
+	m_callbackKeepGoing = false;
+	m_callbackBusy = false;
+	m_cbTime = m_cbDt = 0;
+	m_cbForceUpdate = false;
+	m_accumulatedDisp = m_lastStepDisp = m_lastStepDt = 0;
+	m_neibListBuilds = 0;
+	m_firstIteration = 0;
+	m_checkpoint = NULL;
+	m_cbCalls = m_cbCallsDone = 0;
+	m_cbMbData = NULL;
+	m_cbMbUpdated = false;
 	initialized = false;
 }
 
@@ -87,6 +112,7 @@ bool GPUSPH::initialize(GlobalData *_gdata) {
 
 	m_totalPerformanceCounter = new IPPSCounter();
 	m_intervalPerformanceCounter = new IPPSCounter();
+	m_profiler.enable(clOptions->profile, !clOptions->trace_file.empty());
 	// only init if MULTI_NODE
 	m_multiNodePerformanceCounter = NULL;
 	if (MULTI_NODE)
@@ -154,6 +180,16 @@ bool GPUSPH::initialize(GlobalData *_gdata) {
 		return false;
 	}
 
+	// the neighbor list must be built with an expanded radius for adaptive rebuilds
+	if (problem->get_simparams()->adaptiveneibsfreq &&
+		problem->get_simparams()->nlexpansionfactor <= 1.0f) {
+		printf("WARNING: adaptiveneibsfreq needs nlexpansionfactor > 1, the neighbor list will be rebuilt at every iteration\n");
+	}
+	if (problem->get_simparams()->adaptiveneibsfreq &&
+		problem->get_simparams()->boundarytype == SA_BOUNDARY) {
+		printf("WARNING: with SA_BOUNDARY and adaptiveneibsfreq, the boundary elements interacting with a particle depend on the neighbor list rebuilds\n");
+	}
+
 	// compute mbdata size
 	gdata->mbDataSize = problem->m_mbnumber * sizeof(float4);
 
@@ -181,6 +217,43 @@ bool GPUSPH::initialize(GlobalData *_gdata) {
 	// generate planes, will be allocated in allocateGlobalHostBuffers()
 	gdata->numPlanes = problem->fill_planes();
 
+	// when restarting, the particles come from the checkpoint. fill_parts() is still
+	// needed, since it creates the objects and the ODE bodies
+	CheckpointState restart_state;
+	const bool restarting = !clOptions->restart_dir.empty();
+	string restart_dir;
+	if (restarting) {
+		restart_dir = Checkpoint::resolve(clOptions->restart_dir);
+		printf("Restarting from checkpoint %s...\n", restart_dir.c_str());
+		try {
+			Checkpoint::readState(restart_dir, restart_state);
+		} catch (exception &e) {
+			fprintf(stderr, "FATAL: %s\n", e.what());
+			return false;
+		}
+		if (restart_state.bodies.size() != problem->get_simparams()->numODEbodies*ODE_BODY_STATE_SIZE) {
+			fprintf(stderr, "FATAL: checkpoint has %zu ODE bodies, problem has %u\n",
+				restart_state.bodies.size()/ODE_BODY_STATE_SIZE, problem->get_simparams()->numODEbodies);
+			return false;
+		}
+		if (!restart_state.bodies.empty())
+			problem->set_ODE_bodies_state(&restart_state.bodies[0]);
+		// the callbacks may accumulate their state over the steps (e.g. displacements)
+		if (restart_state.mbcallbacks.size() != (size_t)problem->m_mbnumber) {
+			fprintf(stderr, "FATAL: checkpoint has %zu moving boundaries, problem has %d\n",
+				restart_state.mbcallbacks.size(), problem->m_mbnumber);
+			return false;
+		}
+		for (int i = 0; i < problem->m_mbnumber; i++) {
+			problem->m_mbcallbackdata[i] = restart_state.mbcallbacks[i];
+			problem->m_mbdata[i] = restart_state.mbdata[i];
+		}
+		gdata->totParticles = restart_state.totParticles;
+		printf("  %s particles saved by %u ranks at t=%g, iteration %lu\n",
+			gdata->addSeparators(gdata->totParticles).c_str(), restart_state.numRanks,
+			restart_state.t, restart_state.iterations);
+	}
+
 	// initialize CGs (or, the problem could directly write on gdata)
 	initializeObjectsCGs();
 
@@ -243,18 +316,73 @@ bool GPUSPH::initialize(GlobalData *_gdata) {
 	// TODO FIXME copying data from the problem doubles the host memory requirements
 	// find some smart way to have the host fill the shared buffer directly.
 
-	problem->copy_to_array(gdata->s_hBuffers);
+	if (restarting) {
+		try {
+			Checkpoint::readParticles(restart_dir, restart_state, gdata->s_hBuffers);
+		} catch (exception &e) {
+			fprintf(stderr, "FATAL: %s\n", e.what());
+			return false;
+		}
+
+		gdata->t = restart_state.t;
+		gdata->dt = restart_state.dt;
+		gdata->iterations = restart_state.iterations;
+		m_firstIteration = gdata->iterations;
+		Writer::SetState(restart_state.writers);
+	} else {
+		problem->copy_to_array(gdata->s_hBuffers);
+	}
 
 	printf("---\n");
 
 	// initialize values of k and e for k-e model
-	if (_sp->visctype == KEPSVISC)
+	if (_sp->visctype == KEPSVISC && !restarting)
 		problem->init_keps(
 			gdata->s_hBuffers.getData<BUFFER_TKE>(),
 			gdata->s_hBuffers.getData<BUFFER_EPSILON>(),
 			gdata->totParticles,
 			gdata->s_hBuffers.getData<BUFFER_INFO>());
 
+	// before sorting: the probes are found among all the particles
+	if (_sp->statsfreq) {
+		gdata->runningStats = new RunningStats(gdata);
+		// the statistics are per rank, they can only be restored on as many ranks
+		if (restarting && restart_state.numRanks == gdata->mpi_nodes) {
+			const string fname = RunningStats::fileName(restart_dir, gdata->mpi_rank);
+			if (gdata->runningStats->load(fname))
+				printf("Restored the running statistics from %s\n", fname.c_str());
+		} else if (restarting)
+			fprintf(stderr, "WARNING: checkpoint taken on %u ranks, running statistics restart from scratch\n",
+				restart_state.numRanks);
+		printf("Accumulating running statistics every %u iterations on %s cells and %u probes\n",
+			_sp->statsfreq, gdata->addSeparators(gdata->runningStats->numCells()).c_str(),
+			gdata->runningStats->numProbes());
+	}
+
+	// the tracers starting in a region are also found among all the particles
+	if (!problem->get_tracers().empty()) {
+		gdata->tracers = new Tracers(gdata, restarting);
+		if (gdata->tracers->numTracers())
+			printf("Tracing the trajectories of %u particles at every iteration\n",
+				gdata->tracers->numTracers());
+		else {
+			fprintf(stderr, "WARNING: no tracer particles found\n");
+			delete gdata->tracers;
+			gdata->tracers = NULL;
+		}
+	}
+
+	// the particles of the objects are found among all the particles
+	if (!problem->get_loads().empty()) {
+		// the boundary of the fluid is not made of particles
+		if (_sp->boundarytype == SA_BOUNDARY) {
+			fprintf(stderr, "FATAL: loads on objects are not supported with SA_BOUNDARY\n");
+			return false;
+		}
+		gdata->loads = new Loads(gdata, restarting);
+		printf("Computing the loads on %u objects at every iteration\n", gdata->loads->numLoads());
+	}
+
 	if (MULTI_DEVICE) {
 		printf("Sorting the particles per device...\n");
 		sortParticlesByHash();
@@ -269,20 +397,27 @@ bool GPUSPH::initialize(GlobalData *_gdata) {
 		printf(" - device at index %u has %s particles assigned and offset %s\n",
 			d, gdata->addSeparators(gdata->s_hPartsPerDevice[d]).c_str(), gdata->addSeparators(gdata->s_hStartPerDevice[d]).c_str());
 
-	// TODO
-	//		// > new Integrator
+	m_integrator = Integrator::create(this, gdata);
+	printf("Integrator: %s (%u forces computations per step)\n",
+		m_integrator->getName(), m_integrator->forcesPerStep());
 
 	// TODO: read DEM file. setDemTexture() will be called from the GPUWokers instead
 
 	// new Synchronizer; it will be waiting on #devices+1 threads (GPUWorkers + main)
 	gdata->threadSynchronizer = new Synchronizer(gdata->devices + 1);
+	// workers running a command sequence only need to wait for each other if there is more than one
+	if (MULTI_DEVICE)
+		gdata->sequenceSynchronizer = new Synchronizer(gdata->devices);
 
 	printf("Starting workers...\n");
 
 	// allocate workers
-	gdata->GPUWORKERS = (GPUWorker**)calloc(gdata->devices, sizeof(GPUWorker*));
+	gdata->GPUWORKERS = (AbstractWorker**)calloc(gdata->devices, sizeof(AbstractWorker*));
 	for (uint d=0; d < gdata->devices; d++)
-		gdata->GPUWORKERS[d] = new GPUWorker(gdata, d);
+		if (clOptions->cpu)
+			gdata->GPUWORKERS[d] = new CPUWorker(gdata, d);
+		else
+			gdata->GPUWORKERS[d] = new GPUWorker(gdata, d);
 
 	gdata->keep_going = true;
 
@@ -302,11 +437,11 @@ bool GPUSPH::initialize(GlobalData *_gdata) {
 }
 
 bool GPUSPH::finalize() {
-	// TODO here, when there will be the Integrator
-	// delete Integrator
-
 	printf("Deallocating...\n");
 
+	delete m_integrator;
+	m_integrator = NULL;
+
 	// stuff for rollCallParticles()
 	free(m_rcBitmap);
 	free(m_rcNotified);
@@ -320,10 +455,28 @@ bool GPUSPH::finalize() {
 
 	// Synchronizer
 	delete gdata->threadSynchronizer;
+	delete gdata->sequenceSynchronizer;
 
 	// host buffers
 	deallocateGlobalHostBuffers();
 
+	// waits for the checkpoint being saved, if any
+	delete m_checkpoint;
+	m_checkpoint = NULL;
+
+	delete gdata->runningStats;
+	gdata->runningStats = NULL;
+
+	delete gdata->tracers;
+	gdata->tracers = NULL;
+
+	delete gdata->loads;
+	gdata->loads = NULL;
+
+	// snapshots left over if the simulation was interrupted
+	if (!m_writeSnapshots.empty())
+		stopAsyncWrites();
+
 	Writer::Destroy();
 
 	// ...anything else?
@@ -341,6 +494,26 @@ bool GPUSPH::finalize() {
 bool GPUSPH::runSimulation() {
 	if (!initialized) return false;
 
+	if (m_profiler.tracing()) {
+		// one file per rank, since the ranks may not share a file system
+		string traceFile = clOptions->trace_file;
+		if (MULTI_NODE)
+			traceFile += ".rank" + gdata->to_string(gdata->mpi_rank);
+		m_traceFile = CommandProfiler::openTrace(traceFile.c_str(), gdata->mpi_rank, gdata->devices);
+		m_traceEpoch = CommandProfiler::now();
+	}
+
+	if (clOptions->async_writes)
+		startAsyncWrites();
+
+	if (isfinite(clOptions->checkpoint_interval)) {
+		BufferList *checkpointBuffers = new BufferList();
+		defineHostBuffers(*checkpointBuffers);
+		m_checkpoint = new Checkpoint(gdata, clOptions->checkpoint_interval, checkpointBuffers);
+		printf("Saving checkpoints in %s every %gs\n", m_checkpoint->get_dirname().c_str(),
+			clOptions->checkpoint_interval);
+	}
+
 	// doing first write
 	printf("Performing first write...\n");
 	doWrite(true);
@@ -370,6 +543,10 @@ bool GPUSPH::runSimulation() {
 
 	}
 
+	// the trajectories start from the initial positions
+	if (gdata->tracers)
+		traceTracers();
+
 	printf("Entering the main simulation cycle\n");
 
 	//  IPPS counter does not take the initial uploads into consideration
@@ -381,15 +558,23 @@ bool GPUSPH::runSimulation() {
 	// write some info. This could replace "Entering the main simulation cycle"
 	printStatus();
 
-	while (gdata->keep_going) {
-		// when there will be an Integrator class, here (or after bneibs?) we will
-		// call Integrator -> setNextStep
+	if (problem->get_simparams()->mbcallback || problem->get_simparams()->gcallback)
+		startCallBackThread();
 
+	while (gdata->keep_going) {
 		// build neighbors list
-		if (gdata->iterations % problem->get_simparams()->buildneibsfreq == 0) {
+		if (needsNeibList()) {
 			buildNeibList();
 		}
 
+		// with --autonomous, the rest of the step is run by the workers on their own,
+		// returning to the main thread only for rigid bodies and dt
+		beginCommandSequence();
+
+		// moving boundaries and variable gravity, computed by the helper thread
+		if (problem->get_simparams()->mbcallback || problem->get_simparams()->gcallback)
+			startCallBacks();
+
 		uint shepardfreq = problem->get_simparams()->shepardfreq;
 		if (shepardfreq > 0 && gdata->iterations > 0 && (gdata->iterations % shepardfreq == 0)) {
 			gdata->only_internal = true;
@@ -397,7 +582,9 @@ bool GPUSPH::runSimulation() {
 			// update before swapping, since UPDATE_EXTERNAL works on write buffers
 			if (MULTI_DEVICE)
 				doCommand(UPDATE_EXTERNAL, BUFFER_VEL | DBLBUFFER_WRITE);
-			gdata->swapDeviceBuffers(BUFFER_VEL);
+			swapDeviceBuffers(BUFFER_VEL);
+			// the forces of the last step were computed with the old velocities
+			m_integrator->invalidateForces();
 		}
 
 		uint mlsfreq = problem->get_simparams()->mlsfreq;
@@ -407,171 +594,22 @@ bool GPUSPH::runSimulation() {
 			// update before swapping, since UPDATE_EXTERNAL works on write buffers
 			if (MULTI_DEVICE)
 				doCommand(UPDATE_EXTERNAL, BUFFER_VEL | DBLBUFFER_WRITE);
-			gdata->swapDeviceBuffers(BUFFER_VEL);
-		}
-
-		//			//(init bodies)
-
-		// moving boundaries
-		if (problem->get_simparams()->mbcallback) {
-			// ask the Problem to update mbData, one per process
-			gdata->commandFlags = INTEGRATOR_STEP_1;
-			doCallBacks();
-			// upload on the GPU, one per device
-			doCommand(UPLOAD_MBDATA);
-		}
-
-		// variable gravity
-		if (problem->get_simparams()->gcallback) {
-			// ask the Problem to update gravity, one per process
-			doCallBacks();
-			// upload on the GPU, one per device
-			doCommand(UPLOAD_GRAVITY);
-		}
-
-		// for SPS viscosity, compute first array of tau and exchange with neighbors
-		if (problem->get_simparams()->visctype == SPSVISC) {
-			gdata->only_internal = true;
-			doCommand(SPS, INTEGRATOR_STEP_1);
-			if (MULTI_DEVICE)
-				doCommand(UPDATE_EXTERNAL, BUFFER_TAU);
-		}
-
-		// compute forces only on internal particles
-		gdata->only_internal = true;
-		if (gdata->clOptions->striping && MULTI_DEVICE)
-			doCommand(FORCES_ENQUEUE, INTEGRATOR_STEP_1);
-		else
-			doCommand(FORCES_SYNC, INTEGRATOR_STEP_1);
-
-		// update forces of external particles
-		if (MULTI_DEVICE)
-			doCommand(UPDATE_EXTERNAL, BUFFER_FORCES | BUFFER_GRADGAMMA | BUFFER_XSPH | DBLBUFFER_WRITE);
-		gdata->swapDeviceBuffers(BUFFER_GRADGAMMA);
-
-		// if striping was active, now we want the kernels to complete
-		if (gdata->clOptions->striping && MULTI_DEVICE)
-			doCommand(FORCES_COMPLETE, INTEGRATOR_STEP_1);
-
-		//MM		fetch/update forces on neighbors in other GPUs/nodes
-		//				initially done trivial and slow: stop and read
-		//			//reduce bodies
-
-		// integrate also the externals
-		gdata->only_internal = false;
-		doCommand(EULER, INTEGRATOR_STEP_1);
-
-		gdata->swapDeviceBuffers(BUFFER_POS);
-
-		//			//reduce bodies
-		//MM		fetch/update forces on neighbors in other GPUs/nodes
-		//				initially done trivial and slow: stop and read
-
-		// variable gravity
-		if (problem->get_simparams()->gcallback) {
-			// ask the Problem to update gravity, one per process
-			doCallBacks();
-			// upload on the GPU, one per device
-			doCommand(UPLOAD_GRAVITY);
-		}
-
-		// semi-analytical boundary update
-		if (problem->get_simparams()->boundarytype == SA_BOUNDARY) {
-			gdata->only_internal = true;
-
-			doCommand(SA_CALC_BOUND_CONDITIONS, INTEGRATOR_STEP_1);
-			if (MULTI_DEVICE)
-				doCommand(UPDATE_EXTERNAL, BUFFER_VEL | BUFFER_TKE | BUFFER_EPSILON | DBLBUFFER_WRITE);
-			doCommand(SA_UPDATE_BOUND_VALUES, INTEGRATOR_STEP_1);
-			if (MULTI_DEVICE)
-				doCommand(UPDATE_EXTERNAL, BUFFER_VEL | BUFFER_TKE | BUFFER_EPSILON | DBLBUFFER_WRITE);
+			swapDeviceBuffers(BUFFER_VEL);
+			// the forces of the last step were computed with the old velocities
+			m_integrator->invalidateForces();
 		}
 
-		gdata->swapDeviceBuffers(BUFFER_VEL | BUFFER_TKE | BUFFER_EPSILON);
-
-		// for SPS viscosity, compute first array of tau and exchange with neighbors
-		if (problem->get_simparams()->visctype == SPSVISC) {
-			gdata->only_internal = true;
-			doCommand(SPS, INTEGRATOR_STEP_2);
-			if (MULTI_DEVICE)
-				doCommand(UPDATE_EXTERNAL, BUFFER_TAU);
-		}
-
-		gdata->only_internal = true;
-		if (gdata->clOptions->striping && MULTI_DEVICE)
-			doCommand(FORCES_ENQUEUE, INTEGRATOR_STEP_2);
-		else
-			doCommand(FORCES_SYNC, INTEGRATOR_STEP_2);
-
-		// update forces of external particles
-		if (MULTI_DEVICE)
-			doCommand(UPDATE_EXTERNAL, BUFFER_FORCES | BUFFER_GRADGAMMA | BUFFER_XSPH | DBLBUFFER_WRITE);
-		gdata->swapDeviceBuffers(BUFFER_GRADGAMMA);
-
-		// if striping was active, now we want the kernels to complete
-		if (gdata->clOptions->striping && MULTI_DEVICE)
-			doCommand(FORCES_COMPLETE, INTEGRATOR_STEP_2);
-
-		// reduce bodies
-		if (problem->get_simparams()->numODEbodies > 0) {
-			doCommand(REDUCE_BODIES_FORCES);
-
-			float3* totForce = new float3[problem->get_simparams()->numODEbodies];
-			float3* totTorque = new float3[problem->get_simparams()->numODEbodies];
-
-			// now sum up the partial forces and momenta computed in each gpu
-			for (uint ob = 0; ob < problem->get_simparams()->numODEbodies; ob ++) {
-
-				totForce[ob] = make_float3( 0.0F );
-				totTorque[ob] = make_float3( 0.0F );
-
-				for (uint d = 0; d < gdata->devices; d++) {
-					totForce[ob] += gdata->s_hRbTotalForce[d][ob];
-					totTorque[ob] += gdata->s_hRbTotalTorque[d][ob];
-				} // iterate on devices
-			} // iterate on objects
-
-			// if running multinode, also reduce across nodes
-			if (MULTI_NODE) {
-				// to minimize the overhead, we reduce the whole arrays of forces and torques in one command
-				gdata->networkManager->networkFloatReduction((float*)totForce, 3 * problem->get_simparams()->numODEbodies, SUM_REDUCTION);
-				gdata->networkManager->networkFloatReduction((float*)totTorque, 3 * problem->get_simparams()->numODEbodies, SUM_REDUCTION);
-			}
-
-			problem->ODE_bodies_timestep(totForce, totTorque, 2, gdata->dt, gdata->s_hRbGravityCenters, gdata->s_hRbTranslations, gdata->s_hRbRotationMatrices);
-
-			// upload translation vectors and rotation matrices; will upload CGs after euler
-			doCommand(UPLOAD_OBJECTS_MATRICES);
-		} // if there are objects
-
-		// swap read and writes again because the write contains the variables at time n
-		gdata->swapDeviceBuffers(BUFFER_POS | BUFFER_VEL | BUFFER_TKE | BUFFER_EPSILON);
-
-		// integrate also the externals
-		gdata->only_internal = false;
-		doCommand(EULER, INTEGRATOR_STEP_2);
-
-		// euler needs the previous centers of gravity, so we upload CGs only here
-		if (problem->get_simparams()->numODEbodies > 0)
-			doCommand(UPLOAD_OBJECTS_CG);
+		// variable gravity: upload on the GPU, one per device
+		uploadCallBackGravity(0);
 
-		//			//reduce bodies
+		// forces and integration
+		m_integrator->step();
 
-		gdata->swapDeviceBuffers(BUFFER_POS);
-
-		// semi-analytical boundary update
-		if (problem->get_simparams()->boundarytype == SA_BOUNDARY) {
-			gdata->only_internal = true;
-
-			doCommand(SA_CALC_BOUND_CONDITIONS, INTEGRATOR_STEP_2);
-			if (MULTI_DEVICE)
-				doCommand(UPDATE_EXTERNAL, BUFFER_VEL | BUFFER_TKE | BUFFER_EPSILON | DBLBUFFER_WRITE);
-			doCommand(SA_UPDATE_BOUND_VALUES, INTEGRATOR_STEP_2);
-			if (MULTI_DEVICE)
-				doCommand(UPDATE_EXTERNAL, BUFFER_VEL | BUFFER_TKE | BUFFER_EPSILON | DBLBUFFER_WRITE);
-		}
+		// dt reduction needs the results of the whole step
+		endCommandSequence();
 
-		gdata->swapDeviceBuffers(BUFFER_VEL | BUFFER_TKE | BUFFER_EPSILON);
+		if (problem->get_simparams()->adaptiveneibsfreq)
+			accumulateDisplacement();
 
 		// increase counters
 		gdata->iterations++;
@@ -610,6 +648,15 @@ bool GPUSPH::runSimulation() {
 
 		//printf("Finished iteration %lu, time %g, dt %g\n", gdata->iterations, gdata->t, gdata->dt);
 
+		if (gdata->runningStats && gdata->iterations % problem->get_simparams()->statsfreq == 0)
+			accumulateStats();
+
+		if (gdata->tracers)
+			traceTracers();
+
+		if (gdata->loads)
+			recordLoads();
+
 		bool finished = gdata->problem->finished(gdata->t);
 		bool need_write = Writer::NeedWrite(gdata->t);
 		bool force_write = gdata->problem->need_write(gdata->t) || finished || gdata->quit_request;
@@ -627,6 +674,15 @@ bool GPUSPH::runSimulation() {
 			//if (final_save)
 			//	printf("Issuing final save...\n");
 
+			// the buffers and the cells the writers need: when they all write a region
+			// of the domain, only the particles of its cells are dumped
+			const flag_t needed_buffers = Writer::NeededBuffers(gdata->t, force_write);
+			const bool dump_region = Writer::NeededCells(gdata->t, force_write, gdata->dumpCellRuns);
+
+			// the post-processing kernels and the dump are independent of each other
+			// but for the buffers they share, let the workers schedule them
+			beginCommandSequence();
+
 			// set the buffers to be dumped
 			flag_t which_buffers = BUFFER_POS | BUFFER_VEL | BUFFER_INFO | BUFFER_HASH;
 
@@ -634,7 +690,7 @@ bool GPUSPH::runSimulation() {
 			which_buffers |= DBLBUFFER_READ;
 
 			// compute and dump vorticity if set
-			if (gdata->problem->get_simparams()->vorticity) {
+			if (gdata->problem->get_simparams()->vorticity && (needed_buffers & BUFFER_VORTICITY)) {
 				gdata->only_internal = true;
 				doCommand(VORTICITY);
 				which_buffers |= BUFFER_VORTICITY;
@@ -642,7 +698,7 @@ bool GPUSPH::runSimulation() {
 
 			// get GradGamma
 			if (gdata->problem->get_simparams()->boundarytype == SA_BOUNDARY)
-				which_buffers |= BUFFER_GRADGAMMA;
+				which_buffers |= BUFFER_GRADGAMMA & needed_buffers;
 
 			// compute and dump normals if set
 			// Warning: in the original code, buildneibs is called before surfaceParticle(). However, here should be safe
@@ -656,16 +712,16 @@ bool GPUSPH::runSimulation() {
 				// to know the surface flag for the external particles (in case we will ever care).
 				if (MULTI_DEVICE)
 					doCommand(UPDATE_EXTERNAL, BUFFER_INFO | DBLBUFFER_WRITE);
-				gdata->swapDeviceBuffers(BUFFER_INFO);
-				which_buffers |= BUFFER_NORMALS;
+				swapDeviceBuffers(BUFFER_INFO);
+				which_buffers |= BUFFER_NORMALS & needed_buffers;
 			}
 
 			// get k and epsilon
 			if (gdata->problem->get_simparams()->visctype == KEPSVISC)
-				which_buffers |= BUFFER_TKE | BUFFER_EPSILON | BUFFER_TURBVISC;
+				which_buffers |= (BUFFER_TKE | BUFFER_EPSILON | BUFFER_TURBVISC) & needed_buffers;
 
 			// get private array
-			if (gdata->problem->get_simparams()->calcPrivate) {
+			if (gdata->problem->get_simparams()->calcPrivate && (needed_buffers & BUFFER_PRIVATE)) {
 				// by default, we want to run kernels on internal particles only
 				gdata->only_internal = true;
 				doCommand(CALC_PRIVATE);
@@ -676,23 +732,56 @@ bool GPUSPH::runSimulation() {
 				// TODO: the performanceCounter could be "paused" here
 				// dump what we want to save
 				doCommand(DUMP, which_buffers);
+				endCommandSequence();
+				if (dump_region)
+					compactDumpedParticles(which_buffers);
 				// triggers Writer->write()
-				doWrite(force_write);
-			} else
+				doWrite(force_write, which_buffers, dump_region);
+			} else {
+				endCommandSequence();
 				// --nosave enabled, not final: just pretend we actually saved
 				Writer::MarkWritten(gdata->t, true);
+			}
+
+			gdata->dumpCellRuns.clear();
 
 			printStatus();
 			m_intervalPerformanceCounter->restart();
+
+			// publish the checkpoint saved since the last write, if any
+			if (m_checkpoint)
+				m_checkpoint->commit();
 		}
 
-		if (finished || gdata->quit_request)
+		// not on quit requests, which may come from a failing simulation
+		if (m_checkpoint && m_checkpoint->need_save(gdata->t) && !gdata->quit_request)
+			saveCheckpoint();
+
+		if (finished || gdata->quit_request) {
+			if (gdata->runningStats)
+				writeStats();
 			// NO doCommand() after keep_going has been unset!
 			gdata->keep_going = false;
+		}
 	}
 
+	if (m_callbackSync)
+		stopCallBackThread();
+
+	// all the ranks get here
+	if (m_checkpoint)
+		m_checkpoint->commit();
+
+	if (Writer::IsAsync())
+		stopAsyncWrites();
+
 	// elapsed time, excluding the initialization
 	printf("Elapsed time of simulation cycle: %.2gs\n", m_totalPerformanceCounter->getElapsedSeconds());
+	if (gdata->iterations > 0)
+		printf("Main thread barriers: %lu (%.2f per iteration)\n", m_mainBarriers, (double)m_mainBarriers/gdata->iterations);
+	if (problem->get_simparams()->adaptiveneibsfreq && gdata->iterations > 0)
+		printf("Neighbor list rebuilds: %lu (every %.2f iterations)\n", m_neibListBuilds,
+			(double)gdata->iterations/(m_neibListBuilds ? m_neibListBuilds : 1));
 
 	// In multinode simulations we also print the global performance. To make only rank 0 print it, add
 	// the condition (gdata->mpi_rank == 0)
@@ -717,6 +806,19 @@ bool GPUSPH::runSimulation() {
 	for (uint d = 0; d < gdata->devices; d++)
 		gdata->GPUWORKERS[d]->join_worker();
 
+	if (m_traceFile) {
+		flushTrace();
+		CommandProfiler::closeTrace(m_traceFile);
+		m_traceFile = NULL;
+	}
+
+	// time lost waiting for the other threads, w.r.t. the simulation cycle
+	// (threads are numbered in order of their first barrier)
+	const double elapsed = m_totalPerformanceCounter->getElapsedSeconds();
+	gdata->threadSynchronizer->printWaitStats("Main barrier", elapsed);
+	if (gdata->sequenceSynchronizer)
+		gdata->sequenceSynchronizer->printWaitStats("Sequence barrier", elapsed);
+
 	return true;
 }
 
@@ -727,35 +829,7 @@ size_t GPUSPH::allocateGlobalHostBuffers()
 {
 
 	// define host buffers
-	gdata->s_hBuffers << new HostBuffer<BUFFER_POS_GLOBAL>();
-	gdata->s_hBuffers << new HostBuffer<BUFFER_POS>();
-	gdata->s_hBuffers << new HostBuffer<BUFFER_HASH>();
-	gdata->s_hBuffers << new HostBuffer<BUFFER_VEL>();
-	gdata->s_hBuffers << new HostBuffer<BUFFER_INFO>();
-
-#if _DEBUG_
-	gdata->s_hBuffers << new HostBuffer<BUFFER_FORCES>();
-#endif
-
-	if (problem->m_simparams.savenormals)
-		gdata->s_hBuffers << new HostBuffer<BUFFER_NORMALS>();
-	if (problem->m_simparams.vorticity)
-		gdata->s_hBuffers << new HostBuffer<BUFFER_VORTICITY>();
-
-	if (problem->m_simparams.boundarytype == SA_BOUNDARY) {
-		gdata->s_hBuffers << new HostBuffer<BUFFER_BOUNDELEMENTS>();
-		gdata->s_hBuffers << new HostBuffer<BUFFER_VERTICES>();
-		gdata->s_hBuffers << new HostBuffer<BUFFER_GRADGAMMA>();
-	}
-
-	if (problem->m_simparams.visctype == KEPSVISC) {
-		gdata->s_hBuffers << new HostBuffer<BUFFER_TKE>();
-		gdata->s_hBuffers << new HostBuffer<BUFFER_EPSILON>();
-		gdata->s_hBuffers << new HostBuffer<BUFFER_TURBVISC>();
-	}
-
-	if (problem->m_simparams.calcPrivate)
-		gdata->s_hBuffers << new HostBuffer<BUFFER_PRIVATE>();
+	defineHostBuffers(gdata->s_hBuffers);
 
 	// number of elements to allocate
 	const size_t numparts = gdata->totParticles;
@@ -834,6 +908,41 @@ size_t GPUSPH::allocateGlobalHostBuffers()
 	return totCPUbytes;
 }
 
+// Add the host buffers needed by the simulation to the given list.
+// Used for the shared buffers and for the snapshots of the asynchronous writes
+void GPUSPH::defineHostBuffers(BufferList &buffers)
+{
+	buffers << new HostBuffer<BUFFER_POS_GLOBAL>();
+	buffers << new HostBuffer<BUFFER_POS>();
+	buffers << new HostBuffer<BUFFER_HASH>();
+	buffers << new HostBuffer<BUFFER_VEL>();
+	buffers << new HostBuffer<BUFFER_INFO>();
+
+#if _DEBUG_
+	buffers << new HostBuffer<BUFFER_FORCES>();
+#endif
+
+	if (problem->m_simparams.savenormals)
+		buffers << new HostBuffer<BUFFER_NORMALS>();
+	if (problem->m_simparams.vorticity)
+		buffers << new HostBuffer<BUFFER_VORTICITY>();
+
+	if (problem->m_simparams.boundarytype == SA_BOUNDARY) {
+		buffers << new HostBuffer<BUFFER_BOUNDELEMENTS>();
+		buffers << new HostBuffer<BUFFER_VERTICES>();
+		buffers << new HostBuffer<BUFFER_GRADGAMMA>();
+	}
+
+	if (problem->m_simparams.visctype == KEPSVISC) {
+		buffers << new HostBuffer<BUFFER_TKE>();
+		buffers << new HostBuffer<BUFFER_EPSILON>();
+		buffers << new HostBuffer<BUFFER_TURBVISC>();
+	}
+
+	if (problem->m_simparams.calcPrivate)
+		buffers << new HostBuffer<BUFFER_PRIVATE>();
+}
+
 // Deallocate the shared buffers, i.e. those accessed by all workers
 void GPUSPH::deallocateGlobalHostBuffers() {
 	gdata->s_hBuffers.clear();
@@ -1049,11 +1158,66 @@ void GPUSPH::doCommand(CommandType cmd, flag_t flags, float arg)
 	 memset(gdata->s_hVel, 0, float4Size);
 	 memset(gdata->s_hInfo, 0, infoSize);
 	 } */
+	if (m_recordingCommands && cmd != RUN_SEQUENCE) {
+		CommandStep step;
+		step.command = cmd;
+		step.flags = flags;
+		step.only_internal = gdata->only_internal;
+		step.swapBuffers = NO_FLAGS;
+		step.level = 0;
+		gdata->commandSequence.push_back(step);
+		return;
+	}
 	gdata->nextCommand = cmd;
 	gdata->commandFlags = flags;
 	gdata->extraCommandArg = arg;
-	gdata->threadSynchronizer->barrier(); // unlock CYCLE BARRIER 2
-	gdata->threadSynchronizer->barrier(); // wait for completion of last command and unlock CYCLE BARRIER 1
+	m_profiler.barrier(gdata->threadSynchronizer); // unlock CYCLE BARRIER 2
+	m_profiler.barrier(gdata->threadSynchronizer); // wait for completion of last command and unlock CYCLE BARRIER 1
+	m_mainBarriers += 2;
+}
+
+void GPUSPH::beginCommandSequence()
+{
+	m_recordingCommands = clOptions->autonomous;
+}
+
+void GPUSPH::flushCommandSequence()
+{
+	if (gdata->commandSequence.empty())
+		return;
+	CommandScheduler::schedule(gdata->commandSequence);
+	doCommand(RUN_SEQUENCE);
+	gdata->commandSequence.clear();
+}
+
+void GPUSPH::endCommandSequence()
+{
+	flushCommandSequence();
+	m_recordingCommands = false;
+}
+
+// When recording, the swap is attached to the last recorded step, so that the
+// workers apply it as soon as that step is complete
+void GPUSPH::swapDeviceBuffers(flag_t buffers)
+{
+	if (!m_recordingCommands) {
+		gdata->swapDeviceBuffers(buffers);
+		return;
+	}
+
+	CommandSequence &sequence = gdata->commandSequence;
+	// swapping the same buffer twice is not the same as swapping it once,
+	// so overlapping swaps get a step of their own
+	if (sequence.empty() || (sequence.back().swapBuffers & buffers)) {
+		CommandStep step;
+		step.command = IDLE;
+		step.flags = NO_FLAGS;
+		step.only_internal = gdata->only_internal;
+		step.swapBuffers = NO_FLAGS;
+		step.level = 0;
+		sequence.push_back(step);
+	}
+	sequence.back().swapBuffers |= buffers;
 }
 
 void GPUSPH::setViscosityCoefficient()
@@ -1087,14 +1251,53 @@ void GPUSPH::createWriter()
 	Writer::Create(gdata);
 }
 
-void GPUSPH::doWrite(bool force)
+// After a DUMP of gdata->dumpCellRuns, device d has left its s_hDumpPartsPerDevice[d]
+// particles at s_hStartPerDevice[d]: move them next to those of the previous devices,
+// so that the dumped particles of the node are contiguous from s_hStartPerDevice[0]
+uint GPUSPH::compactDumpedParticles(flag_t dumped)
+{
+	uint dst = gdata->s_hStartPerDevice[0] + gdata->s_hDumpPartsPerDevice[0];
+
+	for (uint d = 1; d < gdata->devices; ++d) {
+		const uint src = gdata->s_hStartPerDevice[d];
+		const uint count = gdata->s_hDumpPartsPerDevice[d];
+		if (count && src != dst) {
+			BufferList::iterator iter = gdata->s_hBuffers.begin();
+			for ( ; iter != gdata->s_hBuffers.end(); ++iter) {
+				if (!(iter->first & dumped))
+					continue;
+				AbstractBuffer *buf = iter->second;
+				memmove(buf->get_offset_buffer(0, dst), buf->get_offset_buffer(0, src),
+					(size_t)count*buf->get_element_size());
+			}
+		}
+		dst += count;
+	}
+
+	return dst - gdata->s_hStartPerDevice[0];
+}
+
+void GPUSPH::doWrite(bool force, flag_t dumped, bool region)
 {
+	const unsigned long long write_start = m_profiler.tracing() ? CommandProfiler::now() : 0;
+
 	uint node_offset = gdata->s_hStartPerDevice[0];
 
+	// when only a region was dumped, its particles are compacted at node_offset
+	uint numParts = gdata->processParticles[gdata->mpi_rank];
+	const uint *partsPerDevice = gdata->s_hPartsPerDevice;
+	if (region) {
+		numParts = 0;
+		for (uint d = 0; d < gdata->devices; ++d)
+			numParts += gdata->s_hDumpPartsPerDevice[d];
+		partsPerDevice = gdata->s_hDumpPartsPerDevice;
+	}
+
 	// WaveGages work by looking at neighboring SURFACE particles and averaging their z coordinates
 	// NOTE: it's a standard average, not an SPH smoothing, so the neighborhood is arbitrarily fixed
 	// at gage (x,y) ± 2 smoothing lengths
 	// TODO should it be an SPH smoothing instead?
+	// NOTE: when only a region was dumped, only the surface particles in it are considered
 
 	GageList &gages = problem->get_simparams()->gage;
 	double slength = problem->get_simparams()->slength;
@@ -1121,7 +1324,7 @@ void GPUSPH::doWrite(bool force)
 
 	bool warned_nan_pos = false;
 
-	for (uint i = node_offset; i < node_offset + gdata->processParticles[gdata->mpi_rank]; i++) {
+	for (uint i = node_offset; i < node_offset + numParts; i++) {
 		const float4 pos = lpos[i];
 		double4 dpos;
 		uint3 gridPos = gdata->calcGridPosFromCellHash( cellHashFromParticleHash(gdata->s_hBuffers.getData<BUFFER_HASH>()[i]) );
@@ -1156,12 +1359,8 @@ void GPUSPH::doWrite(bool force)
 
 	Writer::SetForced(force);
 
-	if (numgages) {
-		for (uint g = 0 ; g < numgages; ++g) {
-			gages[g].z /= gage_parts[g];
-		}
-		//Write WaveGage information on one text file
-		Writer::WriteWaveGage(gdata->t, gages);
+	for (uint g = 0 ; g < numgages; ++g) {
+		gages[g].z /= gage_parts[g];
 	}
 
 	//Testpoints
@@ -1170,11 +1369,27 @@ void GPUSPH::doWrite(bool force)
 		doCommand(COMPUTE_TESTPOINTS);
 	}
 
-	Writer::Write(
-		gdata->processParticles[gdata->mpi_rank],
-		gdata->s_hBuffers,
-		node_offset,
-		gdata->t, gdata->problem->get_simparams()->testpoints);
+	if (Writer::IsAsync()) {
+		// hand the dumped particles over to the writer threads; s_hBuffers
+		// gets the buffers of an already written snapshot in exchange
+		Writer::WriteAsync(
+			numParts,
+			gdata->s_hBuffers,
+			node_offset,
+			gdata->t, gdata->problem->get_simparams()->testpoints,
+			dumped | BUFFER_POS_GLOBAL, gages, partsPerDevice);
+	} else {
+		//Write WaveGage information on one text file
+		if (numgages)
+			Writer::WriteWaveGage(gdata->t, gages);
+
+		Writer::Write(
+			numParts,
+			gdata->s_hBuffers,
+			node_offset,
+			gdata->t, gdata->problem->get_simparams()->testpoints,
+			dumped | BUFFER_POS_GLOBAL, partsPerDevice);
+	}
 	Writer::MarkWritten(gdata->t);
 
 	// TODO: enable energy computation and dump
@@ -1189,6 +1404,162 @@ void GPUSPH::doWrite(bool force)
 	// always reset force-saving
 	if (force)
 		Writer::SetForced(false);
+
+	if (m_profiler.tracing())
+		m_profiler.recordEvent("write", write_start, CommandProfiler::now());
+}
+
+// With --async-write, the dumped particles are not written by the main thread:
+// doWrite() swaps s_hBuffers with one of a ring of host snapshots, and each
+// Writer processes the snapshots on its own thread. The buffers that are not
+// dumped at every write (e.g. BUFFER_VERTICES) are never refreshed in s_hBuffers
+// either, so each snapshot starts as a copy of the shared buffers.
+void GPUSPH::startAsyncWrites()
+{
+	const size_t numparts = gdata->totParticles;
+	size_t totCPUbytes = 0;
+
+	for (uint s = 0; s < clOptions->async_writes; ++s) {
+		BufferList *snapshot = new BufferList();
+		defineHostBuffers(*snapshot);
+
+		BufferList::iterator iter = snapshot->begin();
+		while (iter != snapshot->end()) {
+			AbstractBuffer *buf = iter->second;
+			totCPUbytes += buf->alloc(numparts);
+			memcpy(buf->get_buffer(), gdata->s_hBuffers[iter->first]->get_buffer(),
+				numparts*buf->get_element_size());
+			++iter;
+		}
+		m_writeSnapshots.push_back(snapshot);
+	}
+
+	printf("Asynchronous writes: %u snapshots (%s), %s when full\n",
+		clOptions->async_writes, gdata->memString(totCPUbytes).c_str(),
+		clOptions->drop_writes ? "dropping writes" : "waiting");
+
+	Writer::StartAsync(m_writeSnapshots, clOptions->drop_writes);
+}
+
+void GPUSPH::stopAsyncWrites()
+{
+	printf("Waiting for the pending writes...\n");
+	Writer::StopAsync();
+
+	for (uint s = 0; s < m_writeSnapshots.size(); ++s) {
+		m_writeSnapshots[s]->clear();
+		delete m_writeSnapshots[s];
+	}
+	m_writeSnapshots.clear();
+}
+
+// Dump all the particle arrays and save them, with the state of the simulation,
+// on the background thread of the Checkpoint
+void GPUSPH::saveCheckpoint()
+{
+	doCommand(DUMP, m_checkpoint->buffersToDump() | DBLBUFFER_READ);
+
+	CheckpointState state;
+	state.numRanks = gdata->mpi_nodes;
+	state.totParticles = gdata->totParticles;
+	state.t = gdata->t;
+	state.dt = gdata->dt;
+	state.iterations = gdata->iterations;
+	state.writers = Writer::GetState();
+	state.bodies.resize(problem->get_simparams()->numODEbodies*ODE_BODY_STATE_SIZE);
+	if (!state.bodies.empty())
+		problem->get_ODE_bodies_state(&state.bodies[0]);
+	// the helper may still be running the last callbacks of the step
+	waitCallBacks();
+	state.mbcallbacks.assign(problem->m_mbcallbackdata, problem->m_mbcallbackdata + problem->m_mbnumber);
+	state.mbdata.assign(problem->m_mbdata, problem->m_mbdata + problem->m_mbnumber);
+
+	m_checkpoint->save(state);
+
+	if (gdata->runningStats) {
+		writeStats();
+		gdata->runningStats->save(RunningStats::fileName(m_checkpoint->get_savedir(), gdata->mpi_rank));
+	}
+
+	if (gdata->tracers)
+		gdata->tracers->flush();
+
+	if (gdata->loads)
+		gdata->loads->flush();
+}
+
+// The probes sample the velocity and pressure interpolated at the testpoints,
+// so these are computed first
+void GPUSPH::accumulateStats()
+{
+	gdata->only_internal = true;
+	if (gdata->runningStats->numProbes())
+		doCommand(COMPUTE_TESTPOINTS);
+	doCommand(ACCUMULATE_STATS);
+}
+
+// Merge the statistics accumulated by the workers and write them
+void GPUSPH::writeStats()
+{
+	doCommand(DUMP_STATS);
+	gdata->runningStats->write();
+}
+
+// Number of tracers found by all the ranks in the current iteration
+uint GPUSPH::locatedTracers()
+{
+	uint located = gdata->tracers->located();
+	if (MULTI_NODE) {
+		vector<uint> perRank(gdata->mpi_nodes);
+		gdata->networkManager->allGatherUints(&located, &perRank[0]);
+		located = 0;
+		for (uint n = 0; n < gdata->mpi_nodes; n++)
+			located += perRank[n];
+	}
+	return located;
+}
+
+// Append the positions and velocities of the tracers to their trajectories.
+// The devices only look at the tracers they already hold, so when some of them
+// went missing (because they moved to another device or rank, or before the
+// first iteration) they are looked for among all the particles
+void GPUSPH::traceTracers()
+{
+	Tracers *tracers = gdata->tracers;
+
+	gdata->only_internal = true;
+	doCommand(GATHER_TRACERS);
+
+	if (locatedTracers() < tracers->expected()) {
+		tracers->reset();
+		doCommand(LOCATE_TRACERS);
+		doCommand(GATHER_TRACERS);
+		// tracers that are still missing have left the domain
+		tracers->set_expected(locatedTracers());
+	}
+
+	tracers->write(gdata->t);
+}
+
+// Append the forces and moments on the loaded objects, computed by the forces
+// kernel at the last step of the integrator. Those on the floating bodies were
+// set, already reduced, when moving them
+void GPUSPH::recordLoads()
+{
+	Loads *loads = gdata->loads;
+	if (!loads->numWallLoads()) {
+		loads->write(gdata->t);
+		return;
+	}
+
+	doCommand(REDUCE_LOADS);
+	loads->sum();
+
+	// if running multinode, also reduce across nodes
+	if (MULTI_NODE)
+		gdata->networkManager->networkFloatReduction(loads->total(), loads->totalSize(), SUM_REDUCTION);
+
+	loads->write(gdata->t);
 }
 
 void GPUSPH::buildNeibList()
@@ -1198,12 +1569,15 @@ void GPUSPH::buildNeibList()
 
 	doCommand(CALCHASH);
 	doCommand(SORT);
-	if (problem->get_simparams()->boundarytype == SA_BOUNDARY)
+	if (problem->get_simparams()->boundarytype == SA_BOUNDARY || gdata->tracers)
 		doCommand(INVINDEX);
+	// the tracers follow their particles through the sort
+	if (gdata->tracers)
+		doCommand(TRACK_TRACERS);
 	doCommand(REORDER);
 
 	// swap pos, vel and info double buffers
-	gdata->swapDeviceBuffers(BUFFERS_ALL_DBL);
+	swapDeviceBuffers(BUFFERS_ALL_DBL);
 
 	// if running on multiple GPUs, update the external cells
 	if (MULTI_DEVICE) {
@@ -1242,26 +1616,223 @@ void GPUSPH::buildNeibList()
 
 		gdata->lastGlobalNumInteractions += gdata->timingInfo[d].numInteractions;
 	}
+
+	// the particles have been reordered
+	if (m_integrator)
+		m_integrator->invalidateForces();
+
+	// the particles are at distance 0 from where the list was built
+	m_accumulatedDisp = 0;
+	m_neibListBuilds++;
+}
+
+// With a fixed frequency, the list is rebuilt every buildneibsfreq iterations.
+// With adaptiveneibsfreq, the list built with radius nlInfluenceRadius holds all the
+// neighbors within influenceRadius as long as no two particles got closer by more than
+// the skin nlInfluenceRadius - influenceRadius, i.e. as long as no particle moved more
+// than half the skin. We rebuild before the next step could exceed it, predicting the
+// displacement of the next step from the last one, scaled by the new dt.
+bool GPUSPH::needsNeibList()
+{
+	const SimParams *simparams = problem->get_simparams();
+
+	// first iteration, possibly of a restarted simulation
+	if (m_neibListBuilds == 0)
+		return true;
+
+	if (!simparams->adaptiveneibsfreq)
+		return gdata->iterations % simparams->buildneibsfreq == 0;
+
+	float predictedDisp = m_lastStepDisp;
+	if (m_lastStepDt > 0)
+		predictedDisp *= gdata->dt/m_lastStepDt;
+
+	const float skin = simparams->nlInfluenceRadius - simparams->influenceRadius;
+	return 2*(m_accumulatedDisp + predictedDisp) > skin;
+}
+
+// The maximum displacement of the particles in each step is computed by EULER:
+// the sum over the steps bounds the displacement of every particle since the
+// last rebuild, without keeping a copy of the positions at the last rebuild.
+void GPUSPH::accumulateDisplacement()
+{
+	float maxDisp = gdata->maxDisplacements[0];
+	for (uint d = 1; d < gdata->devices; d++)
+		maxDisp = max(maxDisp, gdata->maxDisplacements[d]);
+	if (MULTI_NODE)
+		gdata->networkManager->networkFloatReduction(&maxDisp, 1, MAX_REDUCTION);
+
+	m_accumulatedDisp += maxDisp;
+	m_lastStepDisp = maxDisp;
+	m_lastStepDt = gdata->dt;
+}
+
+// The Problem callbacks only depend on t, dt and the iteration number, so they can
+// run on a helper thread while the workers compute. At the beginning of each step,
+// startCallBacks() hands the helper the rounds of callbacks the main thread used to
+// run in the step: one for the moving boundaries and one for the gravity of each
+// computation of the forces of the integrator, each calling get_mbdata(t, dt, ...)
+// and g_callback(t). The rounds are run in the same order and with the same
+// arguments, so the results are the same even if the callbacks have side effects.
+// The main thread only waits for a round when its results are uploaded: the moving
+// boundary data of the first round before EULER, the gravity of the others before
+// each computation of the forces.
+void GPUSPH::startCallBackThread()
+{
+	m_cbMbData = new float4[problem->m_mbnumber];
+	m_callbackSync = new Synchronizer(2);
+	m_callbackKeepGoing = true;
+	pthread_mutex_init(&m_callbackMutex, NULL);
+	pthread_cond_init(&m_callbackCond, NULL);
+	pthread_create(&m_callbackThread, NULL, callBackThread, (void*)this);
+}
+
+void GPUSPH::stopCallBackThread()
+{
+	waitCallBacks();
+	// wake up the helper with no job: it will see m_callbackKeepGoing and exit
+	m_callbackKeepGoing = false;
+	m_callbackSync->barrier();
+	pthread_join(m_callbackThread, NULL);
+
+	pthread_cond_destroy(&m_callbackCond);
+	pthread_mutex_destroy(&m_callbackMutex);
+	delete m_callbackSync;
+	m_callbackSync = NULL;
+	delete [] m_cbMbData;
+	m_cbMbData = NULL;
+}
+
+void* GPUSPH::callBackThread(void *ptr)
+{
+	GPUSPH *instance = (GPUSPH*)ptr;
+
+	while (true) {
+		instance->m_callbackSync->barrier(); // job start
+		if (!instance->m_callbackKeepGoing)
+			break;
+		instance->runCallBacks();
+		instance->m_callbackSync->barrier(); // job end
+	}
+
+	pthread_exit(NULL);
 }
 
-void GPUSPH::doCallBacks()
+// run by the helper thread
+void GPUSPH::runCallBacks()
 {
 	Problem *pb = gdata->problem;
 
-	if (pb->m_simparams.mbcallback)
-		gdata->s_mbData = pb->get_mbdata(
-			gdata->t,
-			gdata->dt,
-			gdata->iterations == 0);
+	m_cbMbUpdated = false;
+	for (uint i = 0; i < m_cbCalls; i++) {
+		if (pb->m_simparams.mbcallback) {
+			const float4 *mbData = pb->get_mbdata(m_cbTime, m_cbDt, m_cbForceUpdate);
+			// the data to upload is the one of the first round
+			if (i == 0 && mbData) {
+				memcpy(m_cbMbData, mbData, gdata->mbDataSize);
+				m_cbMbUpdated = true;
+			}
+		}
+
+		if (pb->m_simparams.gcallback)
+			m_cbGravity[i] = pb->g_callback(m_cbTime);
+
+		pthread_mutex_lock(&m_callbackMutex);
+		m_cbCallsDone = i + 1;
+		pthread_cond_broadcast(&m_callbackCond);
+		pthread_mutex_unlock(&m_callbackMutex);
+	}
+}
+
+// let the helper run the callbacks of the current step
+void GPUSPH::startCallBacks()
+{
+	const SimParams *simparams = problem->get_simparams();
+
+	waitCallBacks();
+
+	m_cbTime = gdata->t;
+	m_cbDt = gdata->dt;
+	// the device has no moving boundary data before the first step of the run,
+	// even when restarting
+	m_cbForceUpdate = (gdata->iterations == m_firstIteration);
+	m_cbCalls = (simparams->mbcallback ? 1 : 0) +
+		(simparams->gcallback ? m_integrator->forcesPerStep() : 0);
+	m_cbCallsDone = 0;
+
+	m_callbackSync->barrier(); // job start
+	m_callbackBusy = true;
+}
+
+void GPUSPH::waitCallBacks()
+{
+	if (!m_callbackBusy)
+		return;
+	m_callbackSync->barrier(); // job end
+	m_callbackBusy = false;
+}
+
+// When recording, the commands recorded so far do not need the results, so they
+// are run while the helper completes the rounds
+void GPUSPH::waitCallBackCalls(uint calls)
+{
+	if (!m_callbackBusy)
+		return;
+
+	pthread_mutex_lock(&m_callbackMutex);
+	const bool ready = (m_cbCallsDone >= calls);
+	pthread_mutex_unlock(&m_callbackMutex);
+	if (ready)
+		return;
+
+	if (m_recordingCommands)
+		flushCommandSequence();
+
+	pthread_mutex_lock(&m_callbackMutex);
+	while (m_cbCallsDone < calls)
+		pthread_cond_wait(&m_callbackCond, &m_callbackMutex);
+	pthread_mutex_unlock(&m_callbackMutex);
+}
+
+void GPUSPH::uploadCallBackMbData()
+{
+	if (!problem->get_simparams()->mbcallback)
+		return;
+
+	waitCallBackCalls(1);
+	gdata->s_mbData = m_cbMbUpdated ? m_cbMbData : NULL;
+	doCommand(UPLOAD_MBDATA);
+}
 
-	if (pb->m_simparams.gcallback)
-		gdata->s_varGravity = pb->g_callback(gdata->t);
+void GPUSPH::uploadCallBackGravity(uint upload)
+{
+	const SimParams *simparams = problem->get_simparams();
+	if (!simparams->gcallback)
+		return;
+
+	// the rounds for gravity follow the one for the moving boundaries
+	const uint call = (simparams->mbcallback ? 1 : 0) + upload;
+	waitCallBackCalls(call + 1);
+
+	// the workers read s_varGravity when they run the upload: if a recorded
+	// upload still needs the current value, run it before changing it
+	if (m_recordingCommands && memcmp(&gdata->s_varGravity, &m_cbGravity[call], sizeof(float3))) {
+		CommandSequence::const_iterator step = gdata->commandSequence.begin();
+		for (; step != gdata->commandSequence.end(); ++step)
+			if (step->command == UPLOAD_GRAVITY) {
+				flushCommandSequence();
+				break;
+			}
+	}
+
+	gdata->s_varGravity = m_cbGravity[call];
+	doCommand(UPLOAD_GRAVITY);
 }
 
 void GPUSPH::initializeBoundaryConditions()
 {
 	// initially data is in read so swap to write
-	gdata->swapDeviceBuffers(BUFFER_VEL | BUFFER_TKE | BUFFER_EPSILON);
+	swapDeviceBuffers(BUFFER_VEL | BUFFER_TKE | BUFFER_EPSILON);
 
 	gdata->only_internal = true;
 	// compute values for vertices plus initial estimate for gradgamma direction
@@ -1275,7 +1846,7 @@ void GPUSPH::initializeBoundaryConditions()
 		doCommand(UPDATE_EXTERNAL, BUFFER_VEL | BUFFER_TKE | BUFFER_EPSILON | DBLBUFFER_WRITE);
 
 	// swap changed buffers back so that read contains the new data
-	gdata->swapDeviceBuffers(BUFFER_VEL | BUFFER_TKE | BUFFER_EPSILON | BUFFER_GRADGAMMA);
+	swapDeviceBuffers(BUFFER_VEL | BUFFER_TKE | BUFFER_EPSILON | BUFFER_GRADGAMMA);
 }
 
 void GPUSPH::printStatus()
@@ -1296,6 +1867,33 @@ void GPUSPH::printStatus()
 			);
 	fflush(stdout);
 //#undef ti
+
+	if (m_profiler.timing())
+		printCommandTimes();
+	if (m_traceFile)
+		flushTrace();
+}
+
+// Only called by the main thread between commands, while the workers wait
+// for the next one, so their profilers can be accessed safely
+void GPUSPH::printCommandTimes()
+{
+	CommandProfiler *profilers[MAX_DEVICES_PER_NODE];
+	for (uint d = 0; d < gdata->devices; d++)
+		profilers[d] = gdata->GPUWORKERS[d]->getProfiler();
+
+	CommandProfiler::printStats(profilers, gdata->devices,
+		MULTI_NODE ? gdata->networkManager : NULL, gdata->mpi_rank);
+
+	for (uint d = 0; d < gdata->devices; d++)
+		profilers[d]->resetTimes();
+}
+
+void GPUSPH::flushTrace()
+{
+	m_profiler.flushTrace(m_traceFile, gdata->mpi_rank, 0, m_traceEpoch);
+	for (uint d = 0; d < gdata->devices; d++)
+		gdata->GPUWORKERS[d]->getProfiler()->flushTrace(m_traceFile, gdata->mpi_rank, d + 1, m_traceEpoch);
 }
 
 void GPUSPH::printParticleDistribution()
@@ -33,6 +33,15 @@
 // IPPSCounter
 #include "timing.h"
 
+// per-command timing
+#include "CommandProfiler.h"
+
+// commands of a simulation step
+#include "Integrator.h"
+
+// checkpoint/restart
+#include "Checkpoint.h"
+
 // The GPUSPH class is singleton. Wise tips about a correct singleton implementation are give here:
 // http://stackoverflow.com/questions/1008019/c-singleton-design-pattern
 
@@ -40,11 +49,15 @@
 // But we aren't that paranoid, are we?
 
 class GPUSPH {
+	// the integrator issues the commands of each step
+	friend class Integrator;
+
 private:
 	// some pointers
 	Options* clOptions;
 	GlobalData* gdata;
 	Problem* problem;
+	Integrator* m_integrator;
 
 	// performance counters (in MIPPS)
 	IPPSCounter *m_totalPerformanceCounter;
@@ -56,6 +69,59 @@ private:
 	bool *m_rcNotified;
 	uint *m_rcAddrs;
 
+	// command sequences (see --autonomous): when recording, doCommand() and
+	// swapDeviceBuffers() append to gdata->commandSequence instead of running
+	bool m_recordingCommands;
+	// number of barriers the main thread went through in the simulation cycle
+	unsigned long m_mainBarriers;
+
+	// barriers and writes of the main thread (see --profile and --trace)
+	CommandProfiler m_profiler;
+	// trace-event file, if --trace was given, and the origin of its timestamps
+	FILE *m_traceFile;
+	unsigned long long m_traceEpoch;
+
+	// helper thread running the Problem callbacks while the workers compute
+	// (see startCallBacks()); the main thread and the helper sync on m_callbackSync
+	// at the start and at the end of each job
+	pthread_t m_callbackThread;
+	Synchronizer *m_callbackSync;
+	bool m_callbackKeepGoing;
+	bool m_callbackBusy;
+	// job parameters: time, dt and forced update of the step, and number of rounds
+	// of callbacks. Each round calls get_mbdata and g_callback, as the main thread
+	// used to do once for the moving boundaries and once for the gravity of each
+	// computation of the forces (Integrator::forcesPerStep(), at most 2)
+	float m_cbTime;
+	float m_cbDt;
+	bool m_cbForceUpdate;
+	// iteration the run started from (nonzero when restarting)
+	unsigned long m_firstIteration;
+	uint m_cbCalls;
+	// job results: copy of the moving boundary data of the first round (valid if
+	// m_cbMbUpdated) and gravity of each round
+	float4 *m_cbMbData;
+	bool m_cbMbUpdated;
+	float3 m_cbGravity[3];
+	// rounds completed so far, signaled on m_callbackCond
+	uint m_cbCallsDone;
+	pthread_mutex_t m_callbackMutex;
+	pthread_cond_t m_callbackCond;
+
+	// adaptive neighbor list rebuilds (see SimParams::adaptiveneibsfreq): upper bound
+	// of the displacement of any particle since the last rebuild, displacement and
+	// dt of the last step (to predict the next one), number of rebuilds
+	float m_accumulatedDisp;
+	float m_lastStepDisp;
+	float m_lastStepDt;
+	ulong m_neibListBuilds;
+
+	// host snapshots handed over to the writer threads (see --async-write)
+	vector<BufferList*> m_writeSnapshots;
+
+	// periodic checkpoints (see --checkpoint), NULL if disabled
+	Checkpoint *m_checkpoint;
+
 	// other vars
 	bool initialized;
 
@@ -67,6 +133,13 @@ private:
 	// (de)allocation of shared host buffers
 	size_t allocateGlobalHostBuffers();
 	void deallocateGlobalHostBuffers();
+	// add to the list the host buffers needed by the simulation
+	void defineHostBuffers(BufferList &buffers);
+
+	// allocate the snapshots for asynchronous writing and start the writer threads
+	void startAsyncWrites();
+	// wait for the pending writes, stop the writer threads and free the snapshots
+	void stopAsyncWrites();
 
 	// sort particles by device before uploading
 	void sortParticlesByHash();
@@ -79,6 +152,16 @@ private:
 	// set nextCommand, unlock the threads and wait for them to complete
 	void doCommand(CommandType cmd, flag_t flags=NO_FLAGS, float arg=NAN);
 
+	// start recording commands, if --autonomous was given
+	void beginCommandSequence();
+	// run the recorded commands, if any, and keep recording
+	void flushCommandSequence();
+	// run the recorded commands, if any, and stop recording
+	void endCommandSequence();
+
+	// swap the double-buffered device arrays, or record the swap in the current sequence
+	void swapDeviceBuffers(flag_t buffers);
+
 	// sets the correct viscosity coefficient according to the one set in SimParams
 	void setViscosityCoefficient();
 
@@ -86,14 +169,46 @@ private:
 	void createWriter();
 
 	// use the writer (optionally let writer know if
-	// writing was forced)
-	void doWrite(bool force);
+	// writing was forced); dumped are the buffers refreshed by the last DUMP, and
+	// region tells if only the particles of gdata->dumpCellRuns were dumped
+	void doWrite(bool force, flag_t dumped = ALL_PARTICLE_BUFFERS, bool region = false);
+
+	// after a DUMP of a region, move the particles dumped by each device right after
+	// those of the previous device, returning the number of particles dumped
+	uint compactDumpedParticles(flag_t dumped);
+
+	// dump the particles and save a checkpoint
+	void saveCheckpoint();
+	// accumulate the running statistics of the current state, and write them
+	void accumulateStats();
+	void writeStats();
+	// sample the trajectories of the tracers
+	uint locatedTracers();
+	void traceTracers();
+	// write the loads on the objects of the Problem
+	void recordLoads();
 
 	// callbacks for moving boundaries and variable gravity
-	void doCallBacks();
+	void startCallBackThread();
+	void stopCallBackThread();
+	static void* callBackThread(void *ptr);
+	void runCallBacks();
+	void startCallBacks();
+	void waitCallBacks();
+	// wait for the first calls rounds of callbacks of the step, running the
+	// recorded commands meanwhile
+	void waitCallBackCalls(uint calls);
+	// upload the moving boundary data of the step, and the gravity used by
+	// the upload-th computation of the forces in the step (0 or 1)
+	void uploadCallBackMbData();
+	void uploadCallBackGravity(uint upload);
 
 	// rebuild the neighbor list
 	void buildNeibList();
+	// should the neighbor list be rebuilt at the beginning of this iteration?
+	bool needsNeibList();
+	// add the maximum displacement of the particles in the last step to the accumulated one
+	void accumulateDisplacement();
 
 	// initialization of semi-analytic boundary arrays
 	void initializeBoundaryConditions();
@@ -101,6 +216,11 @@ private:
 	// print information about the status of the simulation
 	void printStatus();
 
+	// print the statistics of the commands run since the last call, and reset them
+	void printCommandTimes();
+	// append the events recorded by all threads to the trace file
+	void flushTrace();
+
 	// print information about the status of the simulation
 	void printParticleDistribution();
 
@@ -25,6 +25,8 @@
 
 // ostringstream
 #include <sstream>
+// fill
+#include <algorithm>
 // FLT_MAX
 #include <float.h>
 
@@ -34,6 +36,9 @@
 #include "euler.cuh"
 
 #include "cudabuffer.h"
+#include "RunningStats.h"
+#include "Tracers.h"
+#include "Loads.h"
 
 // round_up
 #include "utils.h"
@@ -58,6 +63,10 @@ GPUWorker::GPUWorker(GlobalData* _gdata, unsigned int _deviceIndex) {
 	m_particleRangeBegin = 0;
 	m_particleRangeEnd = m_numInternalParticles;
 
+	m_commandFlags = NO_FLAGS;
+	m_onlyInternal = false;
+	m_profiler.enable(gdata->clOptions->profile, !gdata->clOptions->trace_file.empty());
+
 	m_numAllocatedParticles = 0;
 	m_nGridCells = gdata->nGridCells;
 
@@ -76,6 +85,19 @@ GPUWorker::GPUWorker(GlobalData* _gdata, unsigned int _deviceIndex) {
 	m_hCompactDeviceMap = NULL;
 	m_dSegmentStart = NULL;
 
+	m_dStatsCount = NULL;
+	m_dStats = NULL;
+	m_dProbeIds = NULL;
+	m_dProbeCount = NULL;
+	m_dProbeStats = NULL;
+
+	m_dTracerIds = m_dTracerIndex = NULL;
+	m_dTracerPos = m_dTracerVel = NULL;
+	m_dTracerHash = NULL;
+
+	m_dLoads = m_dLoadTotals = NULL;
+	m_dLoadKeys = m_dLoadTotalKeys = NULL;
+
 	m_forcesKernelTotalNumBlocks = 0;
 
 	m_dBuffers << new CUDABuffer<BUFFER_POS>();
@@ -105,8 +127,11 @@ GPUWorker::GPUWorker(GlobalData* _gdata, unsigned int _deviceIndex) {
 			m_dBuffers << new CUDABuffer<BUFFER_CFL_KEPS>();
 	}
 
-	if (m_simparams->boundarytype == SA_BOUNDARY) {
+	// the tracers are moved with the inverse particle index after each sort
+	if (m_simparams->boundarytype == SA_BOUNDARY || gdata->tracers)
 		m_dBuffers << new CUDABuffer<BUFFER_INVINDEX>();
+
+	if (m_simparams->boundarytype == SA_BOUNDARY) {
 		m_dBuffers << new CUDABuffer<BUFFER_GRADGAMMA>();
 		m_dBuffers << new CUDABuffer<BUFFER_BOUNDELEMENTS>();
 		m_dBuffers << new CUDABuffer<BUFFER_VERTICES>();
@@ -659,7 +684,7 @@ void GPUWorker::transferBurstsSizes()
 // Iterate on the list and send/receive bursts of particles across different nodes
 void GPUWorker::transferBursts()
 {
-	bool dbl_buffer_specified = ( (gdata->commandFlags & DBLBUFFER_READ ) || (gdata->commandFlags & DBLBUFFER_WRITE) );
+	bool dbl_buffer_specified = ( (m_commandFlags & DBLBUFFER_READ ) || (m_commandFlags & DBLBUFFER_WRITE) );
 	uint dbl_buf_idx;
 
 	// burst id counter, needed to correctly pair asynchronous network messages
@@ -699,7 +724,7 @@ void GPUWorker::transferBursts()
 			const BufferList::iterator stop = m_dBuffers.end();
 			for ( ; bufset != stop ; ++bufset) {
 				flag_t bufkey = bufset->first;
-				if (!(gdata->commandFlags & bufkey))
+				if (!(m_commandFlags & bufkey))
 					continue; // skip unwanted buffers
 
 				AbstractBuffer *buf = bufset->second;
@@ -716,7 +741,7 @@ void GPUWorker::transferBursts()
 						throw runtime_error(err_msg.str());
 					}
 
-					if (gdata->commandFlags & DBLBUFFER_READ)
+					if (m_commandFlags & DBLBUFFER_READ)
 						dbl_buf_idx = gdata->currentRead[bufkey];
 					else
 						dbl_buf_idx = gdata->currentWrite[bufkey];
@@ -915,6 +940,82 @@ size_t GPUWorker::allocateDeviceBuffers() {
 		delete[] rbnum;
 	}
 
+	if (gdata->runningStats) {
+		const RunningStats *stats = gdata->runningStats;
+		const size_t countSize = m_nGridCells*sizeof(uint);
+		const size_t statsSize = (size_t)m_nGridCells*stats->numFields()*sizeof(float4);
+
+		CUDA_SAFE_CALL(cudaMalloc(&m_dStatsCount, countSize));
+		CUDA_SAFE_CALL(cudaMemset(m_dStatsCount, 0, countSize));
+		CUDA_SAFE_CALL(cudaMalloc(&m_dStats, statsSize));
+		CUDA_SAFE_CALL(cudaMemset(m_dStats, 0, statsSize));
+		allocated += countSize + statsSize;
+
+		const uint numProbes = stats->numProbes();
+		if (numProbes) {
+			const size_t probeCountSize = numProbes*sizeof(uint);
+			const size_t probeStatsSize = (size_t)numProbes*stats->numFields()*sizeof(float4);
+
+			CUDA_SAFE_CALL(cudaMalloc(&m_dProbeIds, probeCountSize));
+			CUDA_SAFE_CALL(cudaMemcpy(m_dProbeIds, stats->probeIds(), probeCountSize, cudaMemcpyHostToDevice));
+			CUDA_SAFE_CALL(cudaMalloc(&m_dProbeCount, probeCountSize));
+			CUDA_SAFE_CALL(cudaMemset(m_dProbeCount, 0, probeCountSize));
+			CUDA_SAFE_CALL(cudaMalloc(&m_dProbeStats, probeStatsSize));
+			CUDA_SAFE_CALL(cudaMemset(m_dProbeStats, 0, probeStatsSize));
+			allocated += 2*probeCountSize + probeStatsSize;
+		}
+	}
+
+	if (gdata->tracers) {
+		const uint numTracers = gdata->tracers->numTracers();
+		const size_t uintSize = numTracers*sizeof(uint);
+		const size_t float4Size = numTracers*sizeof(float4);
+		const size_t hashSize = numTracers*sizeof(hashKey);
+
+		CUDA_SAFE_CALL(cudaMalloc(&m_dTracerIds, uintSize));
+		CUDA_SAFE_CALL(cudaMemcpy(m_dTracerIds, gdata->tracers->ids(), uintSize, cudaMemcpyHostToDevice));
+		// no tracer is known to be on the device until they are located
+		CUDA_SAFE_CALL(cudaMalloc(&m_dTracerIndex, uintSize));
+		CUDA_SAFE_CALL(cudaMemset(m_dTracerIndex, 0xff, uintSize));
+		CUDA_SAFE_CALL(cudaMalloc(&m_dTracerPos, float4Size));
+		CUDA_SAFE_CALL(cudaMalloc(&m_dTracerHash, hashSize));
+		CUDA_SAFE_CALL(cudaMalloc(&m_dTracerVel, float4Size));
+		allocated += 2*uintSize + 2*float4Size + hashSize;
+
+		m_hTracerIndex.resize(numTracers);
+		m_hTracerPos.resize(numTracers);
+		m_hTracerHash.resize(numTracers);
+		m_hTracerVel.resize(numTracers);
+	}
+
+	if (gdata->loads) {
+		const Loads *loads = gdata->loads;
+		const uint numLoads = loads->numWallLoads();
+		const uint numSlots = loads->numSlots();
+		const size_t loadsSize = numSlots*sizeof(float4);
+		const size_t keysSize = numSlots*sizeof(uint);
+
+		// the slots of the particles the device doesn't hold stay empty
+		CUDA_SAFE_CALL(cudaMalloc(&m_dLoads, loadsSize));
+		CUDA_SAFE_CALL(cudaMemset(m_dLoads, 0, loadsSize));
+		CUDA_SAFE_CALL(cudaMalloc(&m_dLoadTotals, 2*numLoads*sizeof(float4)));
+		CUDA_SAFE_CALL(cudaMalloc(&m_dLoadTotalKeys, 2*numLoads*sizeof(uint)));
+		allocated += loadsSize + 2*numLoads*(sizeof(float4) + sizeof(uint));
+
+		// the forces of each object are followed by its moments
+		uint* loadkeys = new uint[numSlots];
+		for (uint l = 0; l < numLoads; l++) {
+			uint *keys = loadkeys + loads->firstSlot(l);
+			std::fill(keys, keys + loads->numIds(l), 2*l);
+			std::fill(keys + loads->numIds(l), keys + 2*loads->numIds(l), 2*l + 1);
+		}
+		CUDA_SAFE_CALL(cudaMalloc(&m_dLoadKeys, keysSize));
+		CUDA_SAFE_CALL(cudaMemcpy(m_dLoadKeys, loadkeys, keysSize, cudaMemcpyHostToDevice));
+		allocated += keysSize;
+
+		delete[] loadkeys;
+	}
+
 	if (m_simparams->usedem) {
 		int nrows = gdata->problem->get_dem_nrows();
 		int ncols = gdata->problem->get_dem_ncols();
@@ -962,6 +1063,30 @@ void GPUWorker::deallocateDeviceBuffers() {
 		// delete [] m_hRbTorques;
 	}
 
+	if (gdata->runningStats) {
+		CUDA_SAFE_CALL(cudaFree(m_dStatsCount));
+		CUDA_SAFE_CALL(cudaFree(m_dStats));
+		if (m_dProbeIds) {
+			CUDA_SAFE_CALL(cudaFree(m_dProbeIds));
+			CUDA_SAFE_CALL(cudaFree(m_dProbeCount));
+			CUDA_SAFE_CALL(cudaFree(m_dProbeStats));
+		}
+	}
+
+	if (gdata->tracers) {
+		CUDA_SAFE_CALL(cudaFree(m_dTracerIds));
+		CUDA_SAFE_CALL(cudaFree(m_dTracerIndex));
+		CUDA_SAFE_CALL(cudaFree(m_dTracerPos));
+		CUDA_SAFE_CALL(cudaFree(m_dTracerHash));
+		CUDA_SAFE_CALL(cudaFree(m_dTracerVel));
+	}
+
+	if (gdata->loads) {
+		CUDA_SAFE_CALL(cudaFree(m_dLoads));
+		CUDA_SAFE_CALL(cudaFree(m_dLoadKeys));
+		CUDA_SAFE_CALL(cudaFree(m_dLoadTotals));
+		CUDA_SAFE_CALL(cudaFree(m_dLoadTotalKeys));
+	}
 
 	// here: dem device buffers?
 }
@@ -981,6 +1106,13 @@ void GPUWorker::createEventsAndStreams()
 #endif
 	// init events
 	cudaEventCreate(&m_halfForcesEvent);
+
+	// the level streams are blocking: the synchronous copies and the thrust calls
+	// some commands do on the default stream wait for the kernels of all of them
+	for (uint s = 0; s < MAX_LEVEL_STREAMS; s++) {
+		cudaStreamCreate(&m_levelStreams[s]);
+		cudaEventCreateWithFlags(&m_levelEvents[s], cudaEventDisableTiming);
+	}
 }
 
 void GPUWorker::destroyEventsAndStreams()
@@ -991,6 +1123,11 @@ void GPUWorker::destroyEventsAndStreams()
 	cudaStreamDestroy(m_asyncPeerCopiesStream);
 	// destroy events
 	cudaEventDestroy(m_halfForcesEvent);
+
+	for (uint s = 0; s < MAX_LEVEL_STREAMS; s++) {
+		cudaStreamDestroy(m_levelStreams[s]);
+		cudaEventDestroy(m_levelEvents[s]);
+	}
 }
 
 void GPUWorker::printAllocatedMemory()
@@ -1049,10 +1186,38 @@ void GPUWorker::dumpBuffers() {
 	uint firstInnerParticle	= gdata->s_hStartPerDevice[m_deviceIndex];
 	uint howManyParticles	= gdata->s_hPartsPerDevice[m_deviceIndex];
 
+	gdata->s_hDumpPartsPerDevice[m_deviceIndex] = 0;
+
 	// is the device empty? (unlikely but possible before LB kicks in)
 	if (howManyParticles == 0) return;
 
-	const flag_t flags = gdata->commandFlags;
+	// particles to download: all of them, or those of the dumpCellRuns, found from the
+	// cellStart and cellEnd of the cells (valid until the next reorder)
+	ParticleRanges ranges;
+	if (gdata->dumpCellRuns.empty()) {
+		ranges.push_back(make_pair(0U, howManyParticles));
+	} else {
+		vector<uint> cellStart, cellEnd;
+		CellRuns::const_iterator run = gdata->dumpCellRuns.begin();
+		for ( ; run != gdata->dumpCellRuns.end(); ++run) {
+			const uint numCells = run->second - run->first;
+			cellStart.resize(numCells);
+			cellEnd.resize(numCells);
+			CUDA_SAFE_CALL(cudaMemcpy(&cellStart[0], m_dCellStart + run->first,
+				numCells*sizeof(uint), cudaMemcpyDeviceToHost));
+			CUDA_SAFE_CALL(cudaMemcpy(&cellEnd[0], m_dCellEnd + run->first,
+				numCells*sizeof(uint), cudaMemcpyDeviceToHost));
+			append_particle_ranges(&cellStart[0], &cellEnd[0], numCells, howManyParticles, ranges);
+		}
+	}
+
+	uint dumped = 0;
+	ParticleRanges::const_iterator range = ranges.begin();
+	for ( ; range != ranges.end(); ++range)
+		dumped += range->second - range->first;
+	gdata->s_hDumpPartsPerDevice[m_deviceIndex] = dumped;
+
+	const flag_t flags = m_commandFlags;
 
 	// iterate over each array in the _host_ buffer list, and download data
 	// if it was requested
@@ -1064,15 +1229,21 @@ void GPUWorker::dumpBuffers() {
 			continue;
 
 		const AbstractBuffer *buf = m_dBuffers[buf_to_get];
-		size_t _size = howManyParticles * buf->get_element_size();
+		const size_t elsize = buf->get_element_size();
 
 		uint which_buffer = 0;
 		if (flags & DBLBUFFER_READ) which_buffer = gdata->currentRead[buf_to_get];
 		if (flags & DBLBUFFER_WRITE) which_buffer = gdata->currentWrite[buf_to_get];
 
-		const void *srcptr = buf->get_buffer(which_buffer);
-		void *dstptr = onhost->second->get_offset_buffer(0, firstInnerParticle);
-		CUDA_SAFE_CALL(cudaMemcpy(dstptr, srcptr, _size, cudaMemcpyDeviceToHost));
+		// the ranges are stored one after the other
+		uint offset = firstInnerParticle;
+		for (range = ranges.begin(); range != ranges.end(); ++range) {
+			const uint count = range->second - range->first;
+			const void *srcptr = buf->get_offset_buffer(which_buffer, range->first);
+			void *dstptr = onhost->second->get_offset_buffer(0, offset);
+			CUDA_SAFE_CALL(cudaMemcpy(dstptr, srcptr, count*elsize, cudaMemcpyDeviceToHost));
+			offset += count;
+		}
 	}
 }
 
@@ -1383,6 +1554,11 @@ const AbstractBuffer* GPUWorker::getBuffer(flag_t key) const
 	return m_dBuffers[key];
 }
 
+CommandProfiler* GPUWorker::getProfiler()
+{
+	return &m_profiler;
+}
+
 void GPUWorker::setDeviceProperties(cudaDeviceProp _m_deviceProperties) {
 	m_deviceProperties = _m_deviceProperties;
 }
@@ -1477,144 +1653,19 @@ void* GPUWorker::simulationThread(void *ptr) {
 
 	gdata->threadSynchronizer->barrier();  // end of UPLOAD, begins SIMULATION ***
 
-	const bool dbg_step_printf = false;
-
 	// TODO
 	// Here is a copy-paste from the CPU thread worker of branch cpusph, as a canvas
 	while (gdata->keep_going) {
-		switch (gdata->nextCommand) {
-			// logging here?
-			case IDLE:
-				break;
-			case CALCHASH:
-				if (dbg_step_printf) printf(" T %d issuing HASH\n", deviceIndex);
-				instance->kernel_calcHash();
-				break;
-			case SORT:
-				if (dbg_step_printf) printf(" T %d issuing SORT\n", deviceIndex);
-				instance->kernel_sort();
-				break;
-			case INVINDEX:
-				if (dbg_step_printf) printf(" T %d issuing INVINDEX\n", deviceIndex);
-				instance->kernel_inverseParticleIndex();
-				break;
-			case CROP:
-				if (dbg_step_printf) printf(" T %d issuing CROP\n", deviceIndex);
-				instance->dropExternalParticles();
-				break;
-			case REORDER:
-				if (dbg_step_printf) printf(" T %d issuing REORDER\n", deviceIndex);
-				instance->kernel_reorderDataAndFindCellStart();
-				break;
-			case BUILDNEIBS:
-				if (dbg_step_printf) printf(" T %d issuing BUILDNEIBS\n", deviceIndex);
-				instance->kernel_buildNeibsList();
-				break;
-			case FORCES_SYNC:
-				if (dbg_step_printf) printf(" T %d issuing FORCES_SYNC\n", deviceIndex);
-				instance->kernel_forces();
-				break;
-			case FORCES_ENQUEUE:
-				if (dbg_step_printf) printf(" T %d issuing FORCES_ENQUEUE\n", deviceIndex);
-				instance->kernel_forces_async_enqueue();
-				break;
-			case FORCES_COMPLETE:
-				if (dbg_step_printf) printf(" T %d issuing FORCES_COMPLETE\n", deviceIndex);
-				instance->kernel_forces_async_complete();
-				break;
-			case EULER:
-				if (dbg_step_printf) printf(" T %d issuing EULER\n", deviceIndex);
-				instance->kernel_euler();
-				break;
-			case DUMP:
-				if (dbg_step_printf) printf(" T %d issuing DUMP\n", deviceIndex);
-				instance->dumpBuffers();
-				break;
-			case DUMP_CELLS:
-				if (dbg_step_printf) printf(" T %d issuing DUMP_CELLS\n", deviceIndex);
-				instance->downloadCellsIndices();
-				break;
-			case UPDATE_SEGMENTS:
-				if (dbg_step_printf) printf(" T %d issuing UPDATE_SEGMENTS\n", deviceIndex);
-				instance->updateSegments();
-				break;
-			case APPEND_EXTERNAL:
-				if (dbg_step_printf) printf(" T %d issuing APPEND_EXTERNAL\n", deviceIndex);
-				instance->importExternalCells();
-				break;
-			case UPDATE_EXTERNAL:
-				if (dbg_step_printf) printf(" T %d issuing UPDATE_EXTERNAL\n", deviceIndex);
-				instance->importExternalCells();
-				break;
-			case MLS:
-				if (dbg_step_printf) printf(" T %d issuing MLS\n", deviceIndex);
-				instance->kernel_mls();
-				break;
-			case SHEPARD:
-				if (dbg_step_printf) printf(" T %d issuing SHEPARD\n", deviceIndex);
-				instance->kernel_shepard();
-				break;
-			case VORTICITY:
-				if (dbg_step_printf) printf(" T %d issuing VORTICITY\n", deviceIndex);
-				instance->kernel_vorticity();
-				break;
-			case SURFACE_PARTICLES:
-				if (dbg_step_printf) printf(" T %d issuing SURFACE_PARTICLES\n", deviceIndex);
-				instance->kernel_surfaceParticles();
-				break;
-			case SA_CALC_BOUND_CONDITIONS:
-				if (dbg_step_printf) printf(" T %d issuing SA_CALC_BOUND_CONDITIONS\n", deviceIndex);
-				instance->kernel_dynamicBoundaryConditions();
-				break;
-			case SA_UPDATE_BOUND_VALUES:
-				if (dbg_step_printf) printf(" T %d issuing SA_UPDATE_BOUND_VALUES\n", deviceIndex);
-				instance->kernel_updateValuesAtBoundaryElements();
-				break;
-			case SPS:
-				if (dbg_step_printf) printf(" T %d issuing SPS\n", deviceIndex);
-				instance->kernel_sps();
-				break;
-			case REDUCE_BODIES_FORCES:
-				if (dbg_step_printf) printf(" T %d issuing REDUCE_BODIES_FORCES\n", deviceIndex);
-				instance->kernel_reduceRBForces();
-				break;
-			case UPLOAD_MBDATA:
-				if (dbg_step_printf) printf(" T %d issuing UPLOAD_MBDATA\n", deviceIndex);
-				instance->uploadMBData();
-				break;
-			case UPLOAD_GRAVITY:
-				if (dbg_step_printf) printf(" T %d issuing UPLOAD_GRAVITY\n", deviceIndex);
-				instance->uploadGravity();
-				break;
-			case UPLOAD_PLANES:
-				if (dbg_step_printf) printf(" T %d issuing UPLOAD_PLANES\n", deviceIndex);
-				instance->uploadPlanes();
-				break;
-			case UPLOAD_OBJECTS_CG:
-				if (dbg_step_printf) printf(" T %d issuing UPLOAD_OBJECTS_CG\n", deviceIndex);
-				instance->uploadBodiesCentersOfGravity();
-				break;
-			case UPLOAD_OBJECTS_MATRICES:
-				if (dbg_step_printf) printf(" T %d issuing UPLOAD_OBJECTS_CG\n", deviceIndex);
-				instance->uploadBodiesTransRotMatrices();
-				break;
-			case CALC_PRIVATE:
-				if (dbg_step_printf) printf(" T %d issuing CALC_PRIVATE\n", deviceIndex);
-				instance->kernel_calcPrivate();
-				break;
-			case COMPUTE_TESTPOINTS:
-				if (dbg_step_printf) printf(" T %d issuing COMPUTE_TESTPOINTS\n", deviceIndex);
-				instance->kernel_testpoints();
-				break;
-			case QUIT:
-				if (dbg_step_printf) printf(" T %d issuing QUIT\n", deviceIndex);
-				// actually, setting keep_going to false and unlocking the barrier should be enough to quit the cycle
-				break;
-		}
+		instance->runCommand(gdata->nextCommand, gdata->commandFlags, gdata->only_internal);
 		if (gdata->keep_going) {
+			const bool tracing = instance->m_profiler.tracing();
+			const unsigned long long wait_start = tracing ? CommandProfiler::now() : 0;
 			// the first barrier waits for the main thread to set the next command; the second is to unlock
 			gdata->threadSynchronizer->barrier();  // CYCLE BARRIER 1
 			gdata->threadSynchronizer->barrier();  // CYCLE BARRIER 2
+			// recorded after both barriers: between the two the main thread may be reading the profiler
+			if (tracing)
+				instance->m_profiler.recordEvent("barrier", wait_start, CommandProfiler::now());
 		}
 	}
 
@@ -1633,6 +1684,238 @@ void* GPUWorker::simulationThread(void *ptr) {
 	pthread_exit(NULL);
 }
 
+// Run a single command, with the given parameters
+void GPUWorker::runCommand(CommandType cmd, flag_t flags, bool only_internal)
+{
+	const bool dbg_step_printf = false;
+
+	m_commandFlags = flags;
+	m_onlyInternal = only_internal;
+
+	const unsigned long long start = m_profiler.timing() ? CommandProfiler::now() : 0;
+
+	switch (cmd) {
+		// logging here?
+		case IDLE:
+			break;
+		case CALCHASH:
+			if (dbg_step_printf) printf(" T %d issuing HASH\n", m_deviceIndex);
+			kernel_calcHash();
+			break;
+		case SORT:
+			if (dbg_step_printf) printf(" T %d issuing SORT\n", m_deviceIndex);
+			kernel_sort();
+			break;
+		case INVINDEX:
+			if (dbg_step_printf) printf(" T %d issuing INVINDEX\n", m_deviceIndex);
+			kernel_inverseParticleIndex();
+			break;
+		case CROP:
+			if (dbg_step_printf) printf(" T %d issuing CROP\n", m_deviceIndex);
+			dropExternalParticles();
+			break;
+		case REORDER:
+			if (dbg_step_printf) printf(" T %d issuing REORDER\n", m_deviceIndex);
+			kernel_reorderDataAndFindCellStart();
+			break;
+		case BUILDNEIBS:
+			if (dbg_step_printf) printf(" T %d issuing BUILDNEIBS\n", m_deviceIndex);
+			kernel_buildNeibsList();
+			break;
+		case FORCES_SYNC:
+			if (dbg_step_printf) printf(" T %d issuing FORCES_SYNC\n", m_deviceIndex);
+			kernel_forces();
+			break;
+		case FORCES_ENQUEUE:
+			if (dbg_step_printf) printf(" T %d issuing FORCES_ENQUEUE\n", m_deviceIndex);
+			kernel_forces_async_enqueue();
+			break;
+		case FORCES_COMPLETE:
+			if (dbg_step_printf) printf(" T %d issuing FORCES_COMPLETE\n", m_deviceIndex);
+			kernel_forces_async_complete();
+			break;
+		case EULER:
+			if (dbg_step_printf) printf(" T %d issuing EULER\n", m_deviceIndex);
+			kernel_euler();
+			break;
+		case DUMP:
+			if (dbg_step_printf) printf(" T %d issuing DUMP\n", m_deviceIndex);
+			dumpBuffers();
+			break;
+		case DUMP_CELLS:
+			if (dbg_step_printf) printf(" T %d issuing DUMP_CELLS\n", m_deviceIndex);
+			downloadCellsIndices();
+			break;
+		case UPDATE_SEGMENTS:
+			if (dbg_step_printf) printf(" T %d issuing UPDATE_SEGMENTS\n", m_deviceIndex);
+			updateSegments();
+			break;
+		case APPEND_EXTERNAL:
+			if (dbg_step_printf) printf(" T %d issuing APPEND_EXTERNAL\n", m_deviceIndex);
+			importExternalCells();
+			break;
+		case UPDATE_EXTERNAL:
+			if (dbg_step_printf) printf(" T %d issuing UPDATE_EXTERNAL\n", m_deviceIndex);
+			importExternalCells();
+			break;
+		case MLS:
+			if (dbg_step_printf) printf(" T %d issuing MLS\n", m_deviceIndex);
+			kernel_mls();
+			break;
+		case SHEPARD:
+			if (dbg_step_printf) printf(" T %d issuing SHEPARD\n", m_deviceIndex);
+			kernel_shepard();
+			break;
+		case VORTICITY:
+			if (dbg_step_printf) printf(" T %d issuing VORTICITY\n", m_deviceIndex);
+			kernel_vorticity();
+			break;
+		case SURFACE_PARTICLES:
+			if (dbg_step_printf) printf(" T %d issuing SURFACE_PARTICLES\n", m_deviceIndex);
+			kernel_surfaceParticles();
+			break;
+		case SA_CALC_BOUND_CONDITIONS:
+			if (dbg_step_printf) printf(" T %d issuing SA_CALC_BOUND_CONDITIONS\n", m_deviceIndex);
+			kernel_dynamicBoundaryConditions();
+			break;
+		case SA_UPDATE_BOUND_VALUES:
+			if (dbg_step_printf) printf(" T %d issuing SA_UPDATE_BOUND_VALUES\n", m_deviceIndex);
+			kernel_updateValuesAtBoundaryElements();
+			break;
+		case SPS:
+			if (dbg_step_printf) printf(" T %d issuing SPS\n", m_deviceIndex);
+			kernel_sps();
+			break;
+		case REDUCE_BODIES_FORCES:
+			if (dbg_step_printf) printf(" T %d issuing REDUCE_BODIES_FORCES\n", m_deviceIndex);
+			kernel_reduceRBForces();
+			break;
+		case UPLOAD_MBDATA:
+			if (dbg_step_printf) printf(" T %d issuing UPLOAD_MBDATA\n", m_deviceIndex);
+			uploadMBData();
+			break;
+		case UPLOAD_GRAVITY:
+			if (dbg_step_printf) printf(" T %d issuing UPLOAD_GRAVITY\n", m_deviceIndex);
+			uploadGravity();
+			break;
+		case UPLOAD_PLANES:
+			if (dbg_step_printf) printf(" T %d issuing UPLOAD_PLANES\n", m_deviceIndex);
+			uploadPlanes();
+			break;
+		case UPLOAD_OBJECTS_CG:
+			if (dbg_step_printf) printf(" T %d issuing UPLOAD_OBJECTS_CG\n", m_deviceIndex);
+			uploadBodiesCentersOfGravity();
+			break;
+		case UPLOAD_OBJECTS_MATRICES:
+			if (dbg_step_printf) printf(" T %d issuing UPLOAD_OBJECTS_CG\n", m_deviceIndex);
+			uploadBodiesTransRotMatrices();
+			break;
+		case CALC_PRIVATE:
+			if (dbg_step_printf) printf(" T %d issuing CALC_PRIVATE\n", m_deviceIndex);
+			kernel_calcPrivate();
+			break;
+		case COMPUTE_TESTPOINTS:
+			if (dbg_step_printf) printf(" T %d issuing COMPUTE_TESTPOINTS\n", m_deviceIndex);
+			kernel_testpoints();
+			break;
+		case ACCUMULATE_STATS:
+			if (dbg_step_printf) printf(" T %d issuing ACCUMULATE_STATS\n", m_deviceIndex);
+			kernel_accumulateStats();
+			break;
+		case DUMP_STATS:
+			if (dbg_step_printf) printf(" T %d issuing DUMP_STATS\n", m_deviceIndex);
+			downloadStats();
+			break;
+		case TRACK_TRACERS:
+			if (dbg_step_printf) printf(" T %d issuing TRACK_TRACERS\n", m_deviceIndex);
+			kernel_trackTracers();
+			break;
+		case LOCATE_TRACERS:
+			if (dbg_step_printf) printf(" T %d issuing LOCATE_TRACERS\n", m_deviceIndex);
+			kernel_locateTracers();
+			break;
+		case GATHER_TRACERS:
+			if (dbg_step_printf) printf(" T %d issuing GATHER_TRACERS\n", m_deviceIndex);
+			downloadTracers();
+			break;
+		case REDUCE_LOADS:
+			if (dbg_step_printf) printf(" T %d issuing REDUCE_LOADS\n", m_deviceIndex);
+			kernel_reduceLoads();
+			break;
+		case RUN_SEQUENCE:
+			if (dbg_step_printf) printf(" T %d issuing RUN_SEQUENCE\n", m_deviceIndex);
+			runCommandSequence();
+			break;
+		case QUIT:
+			if (dbg_step_printf) printf(" T %d issuing QUIT\n", m_deviceIndex);
+			// actually, setting keep_going to false and unlocking the barrier should be enough to quit the cycle
+			break;
+	}
+
+	if (m_profiler.timing()) {
+		// kernels are asynchronous: wait for the command to complete before stopping the clock.
+		// Only its own stream in a concurrent level, so that the other steps keep running
+		if (kernelStream())
+			cudaStreamSynchronize(kernelStream());
+		else
+			cudaDeviceSynchronize();
+		m_profiler.recordCommand(cmd, start, CommandProfiler::now());
+	}
+}
+
+// Run all the steps recorded by the main thread in gdata->commandSequence.
+// The sequence has been sorted by CommandScheduler into levels of independent
+// steps: the steps of a level are launched on separate streams, which are
+// joined with events at the end of the level, and the workers only synchronize
+// with each other at the end of each level. Buffer swaps are applied by the
+// first worker between levels. With a single device no synchronization is
+// needed at all.
+void GPUWorker::runCommandSequence()
+{
+	Synchronizer *sync = gdata->sequenceSynchronizer;
+	const CommandSequence &sequence = gdata->commandSequence;
+
+	CommandSequence::const_iterator level_begin = sequence.begin();
+	while (level_begin != sequence.end()) {
+		CommandSequence::const_iterator step = level_begin;
+		flag_t swaps = NO_FLAGS;
+		uint numSteps = 0;
+		for (; step != sequence.end() && step->level == level_begin->level; ++step)
+			++numSteps;
+
+		if (numSteps == 1) {
+			runCommand(level_begin->command, level_begin->flags, level_begin->only_internal);
+			swaps = level_begin->swapBuffers;
+		} else {
+			uint s = 0;
+			for (step = level_begin; step != sequence.end() && step->level == level_begin->level; ++step) {
+				setKernelStream(m_levelStreams[s]);
+				runCommand(step->command, step->flags, step->only_internal);
+				swaps |= step->swapBuffers;
+				s = (s + 1) % MAX_LEVEL_STREAMS;
+			}
+			setKernelStream(0);
+
+			// join: the next level and the other workers need all the results
+			const uint usedStreams = std::min(numSteps, (uint)MAX_LEVEL_STREAMS);
+			for (s = 0; s < usedStreams; s++)
+				CUDA_SAFE_CALL_NOSYNC(cudaEventRecord(m_levelEvents[s], m_levelStreams[s]));
+			for (s = 0; s < usedStreams; s++)
+				CUDA_SAFE_CALL_NOSYNC(cudaEventSynchronize(m_levelEvents[s]));
+			CUDA_SAFE_CALL_NOSYNC(cudaGetLastError());
+		}
+
+		if (sync) m_profiler.barrier(sync);
+		if (swaps) {
+			if (m_deviceIndex == 0)
+				gdata->swapDeviceBuffers(swaps);
+			if (sync) m_profiler.barrier(sync);
+		}
+
+		level_begin = step;
+	}
+}
+
 void GPUWorker::kernel_calcHash()
 {
 	// is the device empty? (unlikely but possible before LB kicks in)
@@ -1663,7 +1946,7 @@ void GPUWorker::kernel_calcHash()
 
 void GPUWorker::kernel_sort()
 {
-	uint numPartsToElaborate = (gdata->only_internal ? m_numInternalParticles : m_numParticles);
+	uint numPartsToElaborate = (m_onlyInternal ? m_numInternalParticles : m_numParticles);
 
 	// is the device empty? (unlikely but possible before LB kicks in)
 	if (numPartsToElaborate == 0) return;
@@ -1675,7 +1958,7 @@ void GPUWorker::kernel_sort()
 
 void GPUWorker::kernel_inverseParticleIndex()
 {
-	uint numPartsToElaborate = (gdata->only_internal ? m_numInternalParticles : m_numParticles);
+	uint numPartsToElaborate = (m_onlyInternal ? m_numInternalParticles : m_numParticles);
 
 	// is the device empty? (unlikely but possible before LB kicks in)
 	if (numPartsToElaborate == 0) return;
@@ -1733,7 +2016,7 @@ void GPUWorker::kernel_buildNeibsList()
 {
 	resetneibsinfo();
 
-	uint numPartsToElaborate = (gdata->only_internal ? m_particleRangeEnd : m_numParticles);
+	uint numPartsToElaborate = (m_onlyInternal ? m_particleRangeEnd : m_numParticles);
 
 	// is the device empty? (unlikely but possible before LB kicks in)
 	if (numPartsToElaborate == 0) return;
@@ -1776,6 +2059,7 @@ uint GPUWorker::enqueueForcesOnRange(uint fromParticle, uint toParticle, uint cf
 			m_dBuffers.getData<BUFFER_BOUNDELEMENTS>(gdata->currentRead[BUFFER_BOUNDELEMENTS]),
 			m_dRbForces,
 			m_dRbTorques,
+			m_dLoads,
 			m_dBuffers.getData<BUFFER_XSPH>(),
 			m_dBuffers.getData<BUFFER_INFO>(gdata->currentRead[BUFFER_INFO]),
 			m_dBuffers.getData<BUFFER_HASH>(),
@@ -1852,7 +2136,7 @@ float GPUWorker::forces_dt_reduce()
 
 void GPUWorker::kernel_forces_async_enqueue()
 {
-	if (!gdata->only_internal)
+	if (!m_onlyInternal)
 		printf("WARNING: forces kernel called with only_internal == true, ignoring flag!\n");
 
 	uint numPartsToElaborate = m_particleRangeEnd;
@@ -1867,6 +2151,10 @@ void GPUWorker::kernel_forces_async_enqueue()
 		CUDA_SAFE_CALL(cudaMemset(m_dRbTorques, 0.0F, bodiesPartsSize));
 	}
 
+	// ditto for the particles of the loaded objects
+	if (gdata->loads && MULTI_DEVICE)
+		CUDA_SAFE_CALL(cudaMemset(m_dLoads, 0, gdata->loads->numSlots()*sizeof(float4)));
+
 	// NOTE: the stripe containing the internal edge particles must be run first, so that the
 	// transfers can be performed in parallel with the second stripe. The size of the first
 	// stripe, S1, should be:
@@ -1928,12 +2216,12 @@ void GPUWorker::kernel_forces_async_enqueue()
 
 void GPUWorker::kernel_forces_async_complete()
 {
-	uint numPartsToElaborate = (gdata->only_internal ? m_particleRangeEnd : m_numParticles);
+	uint numPartsToElaborate = (m_onlyInternal ? m_particleRangeEnd : m_numParticles);
 
 	// FLOAT_MAX is returned if kernels are not run (e.g. numPartsToElaborate == 0)
 	float returned_dt = FLT_MAX;
 
-	bool firstStep = (gdata->commandFlags == INTEGRATOR_STEP_1);
+	bool firstStep = (m_commandFlags == INTEGRATOR_STEP_1);
 
 	if (numPartsToElaborate > 0 ) {
 		// wait for the completion of the kernel
@@ -1958,7 +2246,7 @@ void GPUWorker::kernel_forces_async_complete()
 
 void GPUWorker::kernel_forces()
 {
-	if (!gdata->only_internal)
+	if (!m_onlyInternal)
 		printf("WARNING: forces kernel called with only_internal == true, ignoring flag!\n");
 
 	uint numPartsToElaborate = m_particleRangeEnd;
@@ -1968,7 +2256,7 @@ void GPUWorker::kernel_forces()
 	// FLOAT_MAX is returned if kernels are not run (e.g. numPartsToElaborate == 0)
 	float returned_dt = FLT_MAX;
 
-	bool firstStep = (gdata->commandFlags == INTEGRATOR_STEP_1);
+	bool firstStep = (m_commandFlags == INTEGRATOR_STEP_1);
 
 	// if we have objects potentially shared across different devices, must reset their forces
 	// and torques to avoid spurious contributions
@@ -1978,6 +2266,10 @@ void GPUWorker::kernel_forces()
 		CUDA_SAFE_CALL(cudaMemset(m_dRbTorques, 0.0F, bodiesPartsSize));
 	}
 
+	// ditto for the particles of the loaded objects
+	if (gdata->loads && MULTI_DEVICE)
+		CUDA_SAFE_CALL(cudaMemset(m_dLoads, 0, gdata->loads->numSlots()*sizeof(float4)));
+
 	const uint fromParticle = 0;
 	const uint toParticle = numPartsToElaborate;
 
@@ -2008,14 +2300,17 @@ void GPUWorker::kernel_forces()
 
 void GPUWorker::kernel_euler()
 {
-	uint numPartsToElaborate = (gdata->only_internal ? m_particleRangeEnd : m_numParticles);
+	uint numPartsToElaborate = (m_onlyInternal ? m_particleRangeEnd : m_numParticles);
 
 	// is the device empty? (unlikely but possible before LB kicks in)
 	if (numPartsToElaborate == 0) return;
 
-	bool firstStep = (gdata->commandFlags == INTEGRATOR_STEP_1);
+	const int step = eulerStep(m_commandFlags);
+	// the displacement over the whole step is only known after the second step
+	// of the predictor-corrector, while kick-drift-kick moves the particles once
+	const bool trackDisplacement = m_simparams->adaptiveneibsfreq && (step == 2 || step == 3);
 
-		euler(
+	const float maxDisp = euler(
 			// previous pos, vel, k, e, info
 			m_dBuffers.getData<BUFFER_POS>(gdata->currentRead[BUFFER_POS]),
 			m_dBuffers.getData<BUFFER_HASH>(),
@@ -2037,14 +2332,18 @@ void GPUWorker::kernel_euler()
 			numPartsToElaborate,
 			gdata->dt, // m_dt,
 			gdata->dt/2.0f, // m_dt/2.0,
-			firstStep ? 1 : 2,
-			gdata->t + (firstStep ? gdata->dt / 2.0f : gdata->dt),
-			m_simparams->xsph);
+			step,
+			gdata->t + (step == 1 ? gdata->dt / 2.0f : gdata->dt),
+			m_simparams->xsph,
+			trackDisplacement);
+
+	if (trackDisplacement)
+		gdata->maxDisplacements[m_deviceIndex] = maxDisp;
 }
 
 void GPUWorker::kernel_mls()
 {
-	uint numPartsToElaborate = (gdata->only_internal ? m_particleRangeEnd : m_numParticles);
+	uint numPartsToElaborate = (m_onlyInternal ? m_particleRangeEnd : m_numParticles);
 
 	// is the device empty? (unlikely but possible before LB kicks in)
 	if (numPartsToElaborate == 0) return;
@@ -2065,7 +2364,7 @@ void GPUWorker::kernel_mls()
 
 void GPUWorker::kernel_shepard()
 {
-	uint numPartsToElaborate = (gdata->only_internal ? m_particleRangeEnd : m_numParticles);
+	uint numPartsToElaborate = (m_onlyInternal ? m_particleRangeEnd : m_numParticles);
 
 	// is the device empty? (unlikely but possible before LB kicks in)
 	if (numPartsToElaborate == 0) return;
@@ -2086,7 +2385,7 @@ void GPUWorker::kernel_shepard()
 
 void GPUWorker::kernel_vorticity()
 {
-	uint numPartsToElaborate = (gdata->only_internal ? m_particleRangeEnd : m_numParticles);
+	uint numPartsToElaborate = (m_onlyInternal ? m_particleRangeEnd : m_numParticles);
 
 	// is the device empty? (unlikely but possible before LB kicks in)
 	if (numPartsToElaborate == 0) return;
@@ -2108,7 +2407,7 @@ void GPUWorker::kernel_vorticity()
 
 void GPUWorker::kernel_surfaceParticles()
 {
-	uint numPartsToElaborate = (gdata->only_internal ? m_particleRangeEnd : m_numParticles);
+	uint numPartsToElaborate = (m_onlyInternal ? m_particleRangeEnd : m_numParticles);
 
 	// is the device empty? (unlikely but possible before LB kicks in)
 	if (numPartsToElaborate == 0) return;
@@ -2131,7 +2430,7 @@ void GPUWorker::kernel_surfaceParticles()
 
 void GPUWorker::kernel_sps()
 {
-	uint numPartsToElaborate = (gdata->only_internal ? m_particleRangeEnd : m_numParticles);
+	uint numPartsToElaborate = (m_onlyInternal ? m_particleRangeEnd : m_numParticles);
 
 	// is the device empty? (unlikely but possible before LB kicks in)
 	if (numPartsToElaborate == 0) return;
@@ -2167,16 +2466,24 @@ void GPUWorker::kernel_reduceRBForces()
 					gdata->s_hRbTotalTorque[m_deviceIndex], m_simparams->numODEbodies, m_numBodiesParticles);
 }
 
+// sum the forces and moments on each loaded object into the shared Loads
+void GPUWorker::kernel_reduceLoads()
+{
+	Loads *loads = gdata->loads;
+	reduceLoads(m_dLoads, m_dLoadKeys, m_dLoadTotals, m_dLoadTotalKeys,
+		loads->partial(m_deviceIndex), loads->numWallLoads(), loads->numSlots());
+}
+
 void GPUWorker::kernel_updateValuesAtBoundaryElements()
 {
-	uint numPartsToElaborate = (gdata->only_internal ? m_particleRangeEnd : m_numParticles);
+	uint numPartsToElaborate = (m_onlyInternal ? m_particleRangeEnd : m_numParticles);
 
 	// is the device empty? (unlikely but possible before LB kicks in)
 	if (numPartsToElaborate == 0) return;
 
 	// vel, tke, eps are read from current*Read, except
 	// on the second step, whe they are read from current*Write
-	bool initStep = (gdata->commandFlags & INITIALIZATION_STEP);
+	bool initStep = (m_commandFlags & INITIALIZATION_STEP);
 
 	updateBoundValues(
 				m_dBuffers.getData<BUFFER_VEL>(gdata->currentWrite[BUFFER_VEL]),
@@ -2191,14 +2498,14 @@ void GPUWorker::kernel_updateValuesAtBoundaryElements()
 
 void GPUWorker::kernel_dynamicBoundaryConditions()
 {
-	uint numPartsToElaborate = (gdata->only_internal ? m_particleRangeEnd : m_numParticles);
+	uint numPartsToElaborate = (m_onlyInternal ? m_particleRangeEnd : m_numParticles);
 
 	// is the device empty? (unlikely but possible before LB kicks in)
 	if (numPartsToElaborate == 0) return;
 
 	// pos, vel, tke, eps are read from current*Read, except
 	// on the second step, whe they are read from current*Write
-	bool initStep = (gdata->commandFlags & INITIALIZATION_STEP);
+	bool initStep = (m_commandFlags & INITIALIZATION_STEP);
 
 	dynamicBoundConditions(
 				m_dBuffers.getData<BUFFER_POS>(gdata->currentRead[BUFFER_POS]),
@@ -2222,7 +2529,7 @@ void GPUWorker::kernel_dynamicBoundaryConditions()
 
 void GPUWorker::kernel_calcPrivate()
 {
-	uint numPartsToElaborate = (gdata->only_internal ? m_particleRangeEnd : m_numParticles);
+	uint numPartsToElaborate = (m_onlyInternal ? m_particleRangeEnd : m_numParticles);
 
 	// is the device empty? (unlikely but possible before LB kicks in)
 	if (numPartsToElaborate == 0) return;
@@ -2242,7 +2549,7 @@ void GPUWorker::kernel_calcPrivate()
 
 void GPUWorker::kernel_testpoints()
 {
-	uint numPartsToElaborate = (gdata->only_internal ? m_particleRangeEnd : m_numParticles);
+	uint numPartsToElaborate = (m_onlyInternal ? m_particleRangeEnd : m_numParticles);
 
 	// is the device empty? (unlikely but possible before LB kicks in)
 	if (numPartsToElaborate == 0) return;
@@ -2260,6 +2567,121 @@ void GPUWorker::kernel_testpoints()
 				m_simparams->influenceRadius);
 }
 
+void GPUWorker::kernel_accumulateStats()
+{
+	const RunningStats *stats = gdata->runningStats;
+	if (!stats) return;
+
+	uint numPartsToElaborate = (m_onlyInternal ? m_particleRangeEnd : m_numParticles);
+
+	// the k-epsilon buffers only exist with KEPSVISC
+	const bool keps = (m_simparams->visctype == KEPSVISC);
+
+	accumulateStats(m_dBuffers.getData<BUFFER_VEL>(gdata->currentRead[BUFFER_VEL]),
+					m_dBuffers.getData<BUFFER_INFO>(gdata->currentRead[BUFFER_INFO]),
+					keps ? m_dBuffers.getData<BUFFER_TKE>(gdata->currentRead[BUFFER_TKE]) : NULL,
+					keps ? m_dBuffers.getData<BUFFER_EPSILON>(gdata->currentRead[BUFFER_EPSILON]) : NULL,
+					m_dCellStart,
+					m_dCellEnd,
+					m_dStatsCount,
+					m_dStats,
+					m_nGridCells,
+					m_dProbeIds,
+					m_dProbeCount,
+					m_dProbeStats,
+					stats->numProbes(),
+					numPartsToElaborate);
+}
+
+// merge the statistics accumulated by the device and restart accumulating
+void GPUWorker::downloadStats()
+{
+	RunningStats *stats = gdata->runningStats;
+	if (!stats) return;
+
+	const uint numFields = stats->numFields();
+	const size_t countSize = m_nGridCells*sizeof(uint);
+	const size_t statsSize = (size_t)m_nGridCells*numFields*sizeof(float4);
+
+	vector<uint> count(m_nGridCells);
+	vector<float4> acc((size_t)m_nGridCells*numFields);
+
+	CUDA_SAFE_CALL(cudaMemcpy(&count[0], m_dStatsCount, countSize, cudaMemcpyDeviceToHost));
+	CUDA_SAFE_CALL(cudaMemcpy(&acc[0], m_dStats, statsSize, cudaMemcpyDeviceToHost));
+	stats->merge(0, m_nGridCells, &count[0], &acc[0]);
+	CUDA_SAFE_CALL(cudaMemset(m_dStatsCount, 0, countSize));
+	CUDA_SAFE_CALL(cudaMemset(m_dStats, 0, statsSize));
+
+	const uint numProbes = stats->numProbes();
+	if (!numProbes) return;
+
+	const size_t probeCountSize = numProbes*sizeof(uint);
+	const size_t probeStatsSize = (size_t)numProbes*numFields*sizeof(float4);
+
+	count.resize(numProbes);
+	acc.resize((size_t)numProbes*numFields);
+
+	CUDA_SAFE_CALL(cudaMemcpy(&count[0], m_dProbeCount, probeCountSize, cudaMemcpyDeviceToHost));
+	CUDA_SAFE_CALL(cudaMemcpy(&acc[0], m_dProbeStats, probeStatsSize, cudaMemcpyDeviceToHost));
+	stats->merge(m_nGridCells, numProbes, &count[0], &acc[0]);
+	CUDA_SAFE_CALL(cudaMemset(m_dProbeCount, 0, probeCountSize));
+	CUDA_SAFE_CALL(cudaMemset(m_dProbeStats, 0, probeStatsSize));
+}
+
+// move the indices of the tracers with the inverse index of the last sort
+void GPUWorker::kernel_trackTracers()
+{
+	if (!gdata->tracers) return;
+
+	uint numPartsToElaborate = (m_onlyInternal ? m_numInternalParticles : m_numParticles);
+
+	trackTracers(	m_dTracerIndex,
+					m_dBuffers.getData<BUFFER_INVINDEX>(),
+					gdata->tracers->numTracers(),
+					numPartsToElaborate);
+}
+
+// look for the tracers among the internal particles of the device
+void GPUWorker::kernel_locateTracers()
+{
+	if (!gdata->tracers) return;
+
+	locateTracers(	m_dTracerIndex,
+					m_dTracerIds,
+					m_dBuffers.getData<BUFFER_INFO>(gdata->currentRead[BUFFER_INFO]),
+					gdata->tracers->numTracers(),
+					m_numInternalParticles);
+}
+
+// gather the tracers held by the device and merge them into the shared Tracers;
+// only the internal particles are considered, so each tracer is found on one device
+void GPUWorker::downloadTracers()
+{
+	Tracers *tracers = gdata->tracers;
+	if (!tracers) return;
+
+	const uint numTracers = tracers->numTracers();
+
+	gatherTracers(	m_dTracerIndex,
+					m_dTracerIds,
+					m_dTracerPos,
+					m_dTracerHash,
+					m_dTracerVel,
+					m_dBuffers.getData<BUFFER_POS>(gdata->currentRead[BUFFER_POS]),
+					m_dBuffers.getData<BUFFER_HASH>(),
+					m_dBuffers.getData<BUFFER_VEL>(gdata->currentRead[BUFFER_VEL]),
+					m_dBuffers.getData<BUFFER_INFO>(gdata->currentRead[BUFFER_INFO]),
+					numTracers,
+					m_numInternalParticles);
+
+	CUDA_SAFE_CALL(cudaMemcpy(&m_hTracerIndex[0], m_dTracerIndex, numTracers*sizeof(uint), cudaMemcpyDeviceToHost));
+	CUDA_SAFE_CALL(cudaMemcpy(&m_hTracerPos[0], m_dTracerPos, numTracers*sizeof(float4), cudaMemcpyDeviceToHost));
+	CUDA_SAFE_CALL(cudaMemcpy(&m_hTracerHash[0], m_dTracerHash, numTracers*sizeof(hashKey), cudaMemcpyDeviceToHost));
+	CUDA_SAFE_CALL(cudaMemcpy(&m_hTracerVel[0], m_dTracerVel, numTracers*sizeof(float4), cudaMemcpyDeviceToHost));
+
+	tracers->merge(&m_hTracerIndex[0], &m_hTracerPos[0], &m_hTracerHash[0], &m_hTracerVel[0]);
+}
+
 void GPUWorker::uploadConstants()
 {
 	// NOTE: visccoeff must be set before uploading the constants. This is done in GPUSPH main cycle
@@ -2270,6 +2692,22 @@ void GPUWorker::uploadConstants()
 	seteulerconstants(m_physparams, gdata->worldOrigin, gdata->gridSize, gdata->cellSize);
 	setneibsconstants(m_simparams, m_physparams, gdata->worldOrigin, gdata->gridSize, gdata->cellSize,
 		m_numAllocatedParticles);
+
+	if (gdata->loads) {
+		const Loads *loads = gdata->loads;
+		const uint numLoads = loads->numWallLoads();
+		uint object[MAXLOADS], firstid[MAXLOADS], numids[MAXLOADS], firstslot[MAXLOADS];
+		float3 center[MAXLOADS];
+		for (uint l = 0; l < numLoads; l++) {
+			object[l] = loads->object(l);
+			firstid[l] = loads->firstId(l);
+			numids[l] = loads->numIds(l);
+			firstslot[l] = loads->firstSlot(l);
+			center[l] = loads->center(l);
+		}
+		setforcesloads(numLoads, object, firstid, numids, firstslot, center);
+		setneibsloads(numLoads, object);
+	}
 }
 
 void GPUWorker::uploadBodiesCentersOfGravity()
@@ -46,14 +46,34 @@
 // Bursts handling
 #include "bursts.h"
 
+// common worker interface
+#include "AbstractWorker.h"
+
+// per-command timing
+#include "CommandProfiler.h"
+
+// streams the independent steps of a level of a command sequence are spread over
+#define MAX_LEVEL_STREAMS	4
+
 // In GPUWoker we implement as "private" all functions which are meant to be called only by the simulationThread().
 // Only the methods which need to be called by GPUSPH are declared public.
-class GPUWorker {
+class GPUWorker : public AbstractWorker {
 private:
 	pthread_t pthread_id;
 	static void* simulationThread(void *ptr);
 	GlobalData* gdata;
 
+	// parameters of the command being run, from GlobalData or from the command sequence
+	flag_t	m_commandFlags;
+	bool	m_onlyInternal;
+
+	// execute a command, or all the steps of gdata->commandSequence
+	void runCommand(CommandType cmd, flag_t flags, bool only_internal);
+	void runCommandSequence();
+
+	// command times and timeline (see --profile and --trace)
+	CommandProfiler m_profiler;
+
 	unsigned int m_cudaDeviceNumber;
 	unsigned int m_deviceIndex;
 	unsigned int m_globalDeviceIdx;
@@ -140,6 +160,35 @@ private:
 	// where sequences of cells of the same type begin
 	uint*		m_dSegmentStart;
 
+	// running statistics accumulated on the device since the last DUMP_STATS:
+	// number of samples and accumulators of the cells and of the probes
+	// (see RunningStats.h for the layout)
+	uint*		m_dStatsCount;
+	float4*		m_dStats;
+	uint*		m_dProbeIds;
+	uint*		m_dProbeCount;
+	float4*		m_dProbeStats;
+
+	// tracers (see Tracers.h): their sorted ids, the index of those held by the
+	// device (UINT_MAX for the others), and their gathered positions, hashes and
+	// velocities, on the device and on the host
+	uint*		m_dTracerIds;
+	uint*		m_dTracerIndex;
+	float4*		m_dTracerPos;
+	hashKey*	m_dTracerHash;
+	float4*		m_dTracerVel;
+	std::vector<uint>		m_hTracerIndex;
+	std::vector<float4>		m_hTracerPos;
+	std::vector<hashKey>	m_hTracerHash;
+	std::vector<float4>		m_hTracerVel;
+
+	// loads on the objects (see Loads.h): the forces and moments of their
+	// particles, the keys they are reduced by, and the reduced forces and moments
+	float4*		m_dLoads;
+	uint*		m_dLoadKeys;
+	float4*		m_dLoadTotals;
+	uint*		m_dLoadTotalKeys;
+
 	// number of blocks used in forces kernel runs (for delayed cfl reduction)
 	uint		m_forcesKernelTotalNumBlocks;
 
@@ -151,6 +200,11 @@ private:
 	// event to synchronize striping
 	cudaEvent_t m_halfForcesEvent;
 
+	// streams running the steps of a level of a command sequence concurrently,
+	// and the events marking the end of the level on each of them
+	cudaStream_t m_levelStreams[MAX_LEVEL_STREAMS];
+	cudaEvent_t m_levelEvents[MAX_LEVEL_STREAMS];
+
 	// cuts all external particles
 	void dropExternalParticles();
 
@@ -224,6 +278,12 @@ private:
 	void kernel_updatePositions();
 	void kernel_calcPrivate();
 	void kernel_testpoints();
+	void kernel_accumulateStats();
+	void downloadStats();
+	void kernel_trackTracers();
+	void kernel_locateTracers();
+	void downloadTracers();
+	void kernel_reduceLoads();
 	/*void uploadMbData();
 	void uploadGravity();*/
 
@@ -262,6 +322,7 @@ public:
 	size_t getDeviceMemory();
 	// for peer transfers
 	const AbstractBuffer* getBuffer(flag_t) const;
+	CommandProfiler* getProfiler();
 };
 
 #endif /* GPUWORKER_H_ */
@@ -31,6 +31,8 @@
 
 // std::map
 #include <map>
+// std::vector
+#include <vector>
 
 // MAX_DEVICES et al.
 #include "multi_gpu_defines.h"
@@ -51,11 +53,14 @@
 // COORD1, COORD2, COORD3
 #include "linearization.h"
 
-// GPUWorker
+// CellRuns
+#include "cellruns.h"
+
+// AbstractWorker (GPUWorker, CPUWorker)
 // no need for a complete definition, a simple declaration will do
-// and since GPUWorker.h needs to include GlobalData.h, it solves
+// and since the worker headers need to include GlobalData.h, it solves
 // the problem of recursive inclusions
-class GPUWorker;
+class AbstractWorker;
 
 // Synchronizer
 #include "Synchronizer.h"
@@ -100,9 +105,30 @@ enum CommandType {
 	UPLOAD_OBJECTS_MATRICES, // upload translation vector and rotation matrices for objects
 	CALC_PRIVATE,		// compute a private variable for debugging or additional passive values
 	COMPUTE_TESTPOINTS,	// compute velocities on testpoints
+	ACCUMULATE_STATS,	// accumulate the running statistics of the fluid (see RunningStats)
+	DUMP_STATS,			// merge the running statistics into the shared RunningStats and reset them
+	TRACK_TRACERS,		// move the indices of the tracers after a sort (see Tracers)
+	LOCATE_TRACERS,		// look for the tracers among all the particles
+	GATHER_TRACERS,		// download the positions and velocities of the tracers into the shared Tracers
+	REDUCE_LOADS,		// sum the loads on the objects and download them into the shared Loads
+	RUN_SEQUENCE,		// run all the steps in commandSequence without returning to the main thread
 	QUIT				// quits the simulation cycle
 };
 
+// A step of a command sequence (see RUN_SEQUENCE): the command with the parameters
+// the main thread would have set in GlobalData before issuing it, and the double-buffered
+// arrays to swap after it has been completed. Steps with the same level do not depend
+// on each other (see CommandScheduler)
+struct CommandStep {
+	CommandType	command;
+	flag_t		flags;
+	bool		only_internal;
+	flag_t		swapBuffers;
+	uint		level;
+};
+
+typedef std::vector<CommandStep> CommandSequence;
+
 // 0 reserved as "no flags"
 #define NO_FLAGS	((flag_t)0)
 
@@ -113,8 +139,22 @@ enum CommandType {
 #define INITIALIZATION_STEP	((flag_t)1)
 #define INTEGRATOR_STEP_1	(INITIALIZATION_STEP << 1)
 #define INTEGRATOR_STEP_2	(INTEGRATOR_STEP_1 << 1)
-#define	LAST_DEFINED_STEP	INTEGRATOR_STEP_2
-// if new steps are added after INTEGRATOR_STEP_2, remember to update LAST_DEFINED_STEP
+// steps of the kick-drift-kick integrator (see Integrator.h): kick and drift, closing kick
+#define INTEGRATOR_KICK_DRIFT	(INTEGRATOR_STEP_2 << 1)
+#define INTEGRATOR_KICK		(INTEGRATOR_KICK_DRIFT << 1)
+#define	LAST_DEFINED_STEP	INTEGRATOR_KICK
+// if new steps are added after INTEGRATOR_KICK, remember to update LAST_DEFINED_STEP
+
+// step of the euler kernel for the given integrator step: 1 and 2 for the steps of the
+// predictor-corrector, 3 for the kick and drift and 4 for the closing kick
+inline int eulerStep(flag_t flags)
+{
+	if (flags & INTEGRATOR_KICK_DRIFT)
+		return 3;
+	if (flags & INTEGRATOR_KICK)
+		return 4;
+	return (flags & INTEGRATOR_STEP_1) ? 1 : 2;
+}
 
 // flags to select which buffer to access, in case of double-buffered arrays
 // these grow from the top
@@ -136,6 +176,12 @@ class Writer;
 
 class Problem;
 
+class RunningStats;
+
+class Tracers;
+
+class Loads;
+
 // maps buffer keys to indices. used for currentRead and currentWrite:
 // currentRead[BUFFER_SOMETHING] is the current array to be read in the double-buffered
 // set BUFFER_SOMETHING
@@ -159,14 +205,16 @@ struct GlobalData {
 	// total number of devices. Same as "devices" if single-node
 	unsigned int totDevices;
 
-	// array of GPUWorkers, one per GPU
-	GPUWorker** GPUWORKERS;
+	// array of workers, one per GPU (or a single CPUWorker with --cpu)
+	AbstractWorker** GPUWORKERS;
 
 	Problem* problem;
 
 	Options* clOptions;
 
 	Synchronizer* threadSynchronizer;
+	// synchronizes only the workers within a command sequence (NULL if single device)
+	Synchronizer* sequenceSynchronizer;
 
 	NetworkManager* networkManager;
 
@@ -204,6 +252,12 @@ struct GlobalData {
 	uint s_hPartsPerDevice[MAX_DEVICES_PER_NODE]; // TODO: can change to PER_NODE if not compiling for multinode
 	uint s_hStartPerDevice[MAX_DEVICES_PER_NODE]; // ditto
 
+	// cells whose particles are DUMPed; empty to DUMP all the particles. Each device
+	// stores the particles it dumps from s_hStartPerDevice on, and their number in
+	// s_hDumpPartsPerDevice
+	CellRuns	dumpCellRuns;
+	uint s_hDumpPartsPerDevice[MAX_DEVICES_PER_NODE];
+
 	// cellStart, cellEnd, segmentStart (limits of cells of the sam type) for each device.
 	// Note the s(shared)_d(device) prefix, since they're device pointers
 	uint** s_dCellStarts;
@@ -212,6 +266,9 @@ struct GlobalData {
 
 	// last dt for each PS
 	float dts[MAX_DEVICES_PER_NODE];
+	// maximum displacement of the particles of each device in the last step
+	// (only computed with SimParams::adaptiveneibsfreq)
+	float maxDisplacements[MAX_DEVICES_PER_NODE];
 
 	// indices for double-buffered device arrays (0 or 1)
 
@@ -253,6 +310,8 @@ struct GlobalData {
 	// set to true if next kernel has to be run only on internal particles
 	// (need support of the worker and/or the kernel)
 	bool only_internal;
+	// commands recorded by the main thread, run by RUN_SEQUENCE
+	CommandSequence commandSequence;
 
 	// disable saving (for timing, or only for the last)
 	bool nosave;
@@ -266,6 +325,15 @@ struct GlobalData {
 	float3* s_hRbTranslations;
 	float* s_hRbRotationMatrices;
 
+	// running statistics of the fluid, NULL unless SimParams::statsfreq is set
+	RunningStats* runningStats;
+
+	// trajectories of the tracer particles, NULL unless the Problem has some
+	Tracers* tracers;
+
+	// forces and moments on the objects, NULL unless the Problem wants some
+	Loads* loads;
+
 	// peer accessibility table (indexed with device indices, not CUDA dev nums)
 	bool s_hDeviceCanAccessPeer[MAX_DEVICES_PER_NODE][MAX_DEVICES_PER_NODE];
 
@@ -277,6 +345,7 @@ struct GlobalData {
 		problem(NULL),
 		clOptions(NULL),
 		threadSynchronizer(NULL),
+		sequenceSynchronizer(NULL),
 		networkManager(NULL),
 		totParticles(0),
 		nGridCells(0),
@@ -304,12 +373,21 @@ struct GlobalData {
 		nosave(false),
 		s_hRbGravityCenters(NULL),
 		s_hRbTranslations(NULL),
-		s_hRbRotationMatrices(NULL)
+		s_hRbRotationMatrices(NULL),
+		runningStats(NULL),
+		tracers(NULL),
+		loads(NULL)
 	{
 		// init dts
 		for (uint d=0; d < MAX_DEVICES_PER_NODE; d++)
 			dts[d] = 0.0F;
 
+		for (uint d=0; d < MAX_DEVICES_PER_NODE; d++)
+			maxDisplacements[d] = 0.0F;
+
+		for (uint d=0; d < MAX_DEVICES_PER_NODE; d++)
+			s_hDumpPartsPerDevice[d] = 0;
+
 		// init partial forces and torques
 		for (uint d=0; d < MAX_DEVICES_PER_NODE; d++)
 			for (uint ob=0; ob < MAXBODIES; ob++) {
@@ -0,0 +1,396 @@
+/*  Copyright 2013 Alexis Herault, Giuseppe Bilotta, Robert A. Dalrymple, Eugenio Rustico, Ciro Del Negro
+
+    Istituto Nazionale di Geofisica e Vulcanologia
+        Sezione di Catania, Catania, Italy
+
+    Università di Catania, Catania, Italy
+
+    Johns Hopkins University, Baltimore, MD
+
+    This file is part of GPUSPH.
+
+    GPUSPH is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GPUSPH is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GPUSPH.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <sstream>
+#include <fstream>
+#include <stdexcept>
+#include <algorithm>
+#include <limits>
+#include <climits>
+#include <cmath>
+#include <pthread.h>
+// sysconf
+#include <unistd.h>
+
+#include "GridWriter.h"
+#include "GlobalData.h"
+// kernel_shape
+#include "sph_kernels.h"
+
+using namespace std;
+
+// buffers that can be resampled besides position, velocity and density
+#define GRID_FIELD_BUFFERS	(BUFFER_VORTICITY | BUFFER_TKE | BUFFER_EPSILON | BUFFER_TURBVISC)
+
+// upper bound to the number of components of all the fields
+#define GRID_MAX_VALUES		16
+
+// number of grid points interpolated by a thread at a time
+#define GRID_CHUNK_POINTS	4096
+
+/* Endianness check: (char*)&endian_int reads the first byte of the int,
+ * which is 0 on big-endian machines, and 1 in little-endian machines */
+static int endian_int=1;
+static const char* endianness[2] = { "BigEndian", "LittleEndian" };
+
+GridWriter::GridWriter(const GlobalData *_gdata, ResampleGridList const& grids) :
+	Writer(_gdata),
+	m_grids(grids),
+	m_numValues(0)
+{
+	if (m_grids.empty())
+		throw runtime_error("GridWriter needs at least one grid");
+	for (size_t g = 0; g < m_grids.size(); ++g) {
+		const uint3 size = m_grids[g].size;
+		if (!size.x || !size.y || !size.z)
+			throw runtime_error("grid " + m_grids[g].name + " has no points");
+		if ((double)size.x*size.y*size.z > UINT_MAX)
+			throw runtime_error("grid " + m_grids[g].name + " has too many points");
+	}
+
+	m_fname_sfx = ".vti";
+
+	m_numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (m_numThreads < 1)
+		m_numThreads = 1;
+
+	string time_fname = open_data_file(m_timefile, "GRIDinp", "", ".pvd");
+
+	if (m_timefile) {
+		m_timefile << "<?xml version='1.0'?>\n";
+		m_timefile << "<VTKFile type='Collection' version='0.1'>\n";
+		m_timefile << " <Collection>\n";
+	}
+}
+
+GridWriter::~GridWriter()
+{
+	mark_timefile();
+	m_timefile.close();
+}
+
+void
+GridWriter::set_filter(WriterFilter const& filter)
+{
+	Writer::set_filter(filter);
+
+	// all the fields we can resample, instead of all the buffers
+	if (!m_filter.fields)
+		m_filter.fields = GRID_FIELD_BUFFERS;
+	// only the fluid contributes to the interpolation
+	if (!m_filter.partTypes)
+		m_filter.partTypes = 1 << PT_FLUID;
+
+	if (m_filter.spatial())
+		return;
+
+	// the particles that can reach a grid point
+	double3 bmin = m_grids[0].origin;
+	double3 bmax = bmin;
+	for (size_t g = 0; g < m_grids.size(); ++g) {
+		const double3 a = m_grids[g].origin;
+		const double3 b = m_grids[g].corner();
+		bmin = make_double3(min(bmin.x, min(a.x, b.x)), min(bmin.y, min(a.y, b.y)), min(bmin.z, min(a.z, b.z)));
+		bmax = make_double3(max(bmax.x, max(a.x, b.x)), max(bmax.y, max(a.y, b.y)), max(bmax.z, max(a.z, b.z)));
+	}
+	const double radius = m_problem->get_simparams()->influenceRadius;
+	m_filter.box(
+		make_double3(bmin.x - radius, bmin.y - radius, bmin.z - radius),
+		make_double3(bmax.x + radius, bmax.y + radius, bmax.z + radius));
+}
+
+static inline void
+add_field(vector<GridField> &fields, uint &numValues, const char *name, uint dim)
+{
+	GridField field;
+	field.name = name;
+	field.dim = dim;
+	field.offset = numValues;
+	fields.push_back(field);
+	numValues += dim;
+}
+
+void
+GridWriter::sort_particles(uint numParts, BufferList const& buffers, uint node_offset)
+{
+	const double4 *pos = buffers.getData<BUFFER_POS_GLOBAL>();
+	const float4 *vel = buffers.getData<BUFFER_VEL>();
+	const particleinfo *info = buffers.getData<BUFFER_INFO>();
+	const float3 *vort = buffers.getData<BUFFER_VORTICITY>();
+	const float *tke = buffers.getData<BUFFER_TKE>();
+	const float *eps = buffers.getData<BUFFER_EPSILON>();
+	const float *turbvisc = buffers.getData<BUFFER_TURBVISC>();
+
+	m_fields.clear();
+	m_numValues = 0;
+	add_field(m_fields, m_numValues, "Velocity", 3);
+	add_field(m_fields, m_numValues, "Density", 1);
+	add_field(m_fields, m_numValues, "Pressure", 1);
+	if (vort)
+		add_field(m_fields, m_numValues, "Vorticity", 3);
+	if (tke)
+		add_field(m_fields, m_numValues, "TKE", 1);
+	if (eps)
+		add_field(m_fields, m_numValues, "Epsilon", 1);
+	if (turbvisc)
+		add_field(m_fields, m_numValues, "Eddy viscosity", 1);
+
+	// counting sort of the fluid particles by the cell of their global position
+	const uint nCells = gdata->nGridCells;
+	m_cell.resize(numParts);
+	m_cellStart.assign(nCells + 1, 0);
+	uint numFluid = 0;
+	for (uint p = 0; p < numParts; ++p) {
+		const uint i = node_offset + p;
+		if (NOT_FLUID(info[i])) {
+			m_cell[p] = UINT_MAX;
+			continue;
+		}
+		m_cell[p] = gdata->calcGridHashHost(gdata->calcGridPosHost(pos[i].x, pos[i].y, pos[i].z));
+		m_cellStart[m_cell[p] + 1]++;
+		numFluid++;
+	}
+	for (uint c = 0; c < nCells; ++c)
+		m_cellStart[c + 1] += m_cellStart[c];
+
+	m_pos.resize(numFluid);
+	m_volume.resize(numFluid);
+	m_values.resize((size_t)numFluid*m_numValues);
+
+	vector<uint> next(m_cellStart.begin(), m_cellStart.end() - 1);
+	for (uint p = 0; p < numParts; ++p) {
+		if (m_cell[p] == UINT_MAX)
+			continue;
+		const uint i = node_offset + p;
+		const uint j = next[m_cell[p]]++;
+		m_pos[j] = make_double3(pos[i].x, pos[i].y, pos[i].z);
+		m_volume[j] = pos[i].w/vel[i].w;
+
+		float *val = &m_values[(size_t)j*m_numValues];
+		*val++ = vel[i].x;
+		*val++ = vel[i].y;
+		*val++ = vel[i].z;
+		*val++ = vel[i].w;
+		*val++ = m_problem->pressure(vel[i].w, PART_FLUID_NUM(info[i]));
+		if (vort) {
+			*val++ = vort[i].x;
+			*val++ = vort[i].y;
+			*val++ = vort[i].z;
+		}
+		if (tke)
+			*val++ = tke[i];
+		if (eps)
+			*val++ = eps[i];
+		if (turbvisc)
+			*val++ = turbvisc[i];
+	}
+}
+
+void
+GridWriter::interpolate(ResampleGrid const& grid, uint from, uint to, vector<float> *out) const
+{
+	const SimParams *simparams = m_problem->get_simparams();
+	const KernelType kernel = simparams->kerneltype;
+	const double slength = simparams->slength;
+	const double radius = simparams->influenceRadius;
+	const int3 gridSize = make_int3(gdata->gridSize.x, gdata->gridSize.y, gdata->gridSize.z);
+	const float nan = numeric_limits<float>::quiet_NaN();
+
+	float acc[GRID_MAX_VALUES];
+
+	for (uint p = from; p < to; ++p) {
+		const uint ix = p % grid.size.x;
+		const uint iy = (p / grid.size.x) % grid.size.y;
+		const uint iz = p / (grid.size.x*grid.size.y);
+		const double3 x = make_double3(
+			grid.origin.x + ix*grid.spacing.x,
+			grid.origin.y + iy*grid.spacing.y,
+			grid.origin.z + iz*grid.spacing.z);
+
+		for (uint v = 0; v < m_numValues; ++v)
+			acc[v] = 0;
+		float sum = 0;
+
+		// the cells are at least as large as the influence radius
+		const int3 cell = gdata->calcGridPosHost(x.x, x.y, x.z);
+		for (int cz = max(cell.z - 1, 0); cz <= min(cell.z + 1, gridSize.z - 1); ++cz)
+		for (int cy = max(cell.y - 1, 0); cy <= min(cell.y + 1, gridSize.y - 1); ++cy)
+		for (int cx = max(cell.x - 1, 0); cx <= min(cell.x + 1, gridSize.x - 1); ++cx) {
+			const uint hash = gdata->calcGridHashHost(cx, cy, cz);
+			for (uint j = m_cellStart[hash]; j < m_cellStart[hash + 1]; ++j) {
+				const double dx = x.x - m_pos[j].x;
+				const double dy = x.y - m_pos[j].y;
+				const double dz = x.z - m_pos[j].z;
+				const double r = sqrt(dx*dx + dy*dy + dz*dz);
+				if (r >= radius)
+					continue;
+				// the normalization coefficient of the kernel cancels out
+				const float w = kernel_shape(kernel, r/slength)*m_volume[j];
+				const float *val = &m_values[(size_t)j*m_numValues];
+				for (uint v = 0; v < m_numValues; ++v)
+					acc[v] += w*val[v];
+				sum += w;
+			}
+		}
+
+		for (size_t f = 0; f < m_fields.size(); ++f) {
+			GridField const& field = m_fields[f];
+			float *dst = &out[f][(size_t)p*field.dim];
+			for (uint c = 0; c < field.dim; ++c)
+				dst[c] = sum > 0 ? acc[field.offset + c]/sum : nan;
+		}
+	}
+}
+
+// Grid points to be interpolated by a group of threads, each grabbing
+// the next chunk of points until none are left
+struct GridJobs {
+	const GridWriter	*writer;
+	const ResampleGrid	*grid;
+	vector<float>		*out;
+	uint				numPoints;
+	volatile uint		nextChunk;
+};
+
+static void *
+grid_interpolate_thread(void *arg)
+{
+	GridJobs *jobs = (GridJobs*)arg;
+
+	while (true) {
+		const uint from = __sync_fetch_and_add(&jobs->nextChunk, 1)*GRID_CHUNK_POINTS;
+		if (from >= jobs->numPoints)
+			break;
+		jobs->writer->interpolate(*jobs->grid, from,
+			min(from + GRID_CHUNK_POINTS, jobs->numPoints), jobs->out);
+	}
+
+	return NULL;
+}
+
+void
+GridWriter::write_grid(ResampleGrid const& grid, string const& filenum, float t, uint part)
+{
+	const uint numPoints = grid.size.x*grid.size.y*grid.size.z;
+
+	vector< vector<float> > out(m_fields.size());
+	for (size_t f = 0; f < m_fields.size(); ++f)
+		out[f].resize((size_t)numPoints*m_fields[f].dim);
+
+	GridJobs jobs;
+	jobs.writer = this;
+	jobs.grid = &grid;
+	jobs.out = &out[0];
+	jobs.numPoints = numPoints;
+	jobs.nextChunk = 0;
+
+	const uint numChunks = (numPoints + GRID_CHUNK_POINTS - 1)/GRID_CHUNK_POINTS;
+	const uint helpers = min(m_numThreads, numChunks) - 1;
+	vector<pthread_t> threads(helpers);
+	for (uint th = 0; th < helpers; ++th)
+		if (pthread_create(&threads[th], NULL, grid_interpolate_thread, &jobs))
+			throw runtime_error("cannot create grid interpolation thread");
+	grid_interpolate_thread(&jobs);
+	for (uint th = 0; th < helpers; ++th)
+		pthread_join(threads[th], NULL);
+
+	DirectFile fid;
+	const string base = "GRID_" + grid.name;
+	string filename = open_data_file(fid, base.c_str(), filenum);
+
+	// the spacing along the axes with a single point is irrelevant, but it must not be 0
+	const double3 spacing = make_double3(
+		grid.size.x > 1 || grid.spacing.x ? grid.spacing.x : 1,
+		grid.size.y > 1 || grid.spacing.y ? grid.spacing.y : 1,
+		grid.size.z > 1 || grid.spacing.z ? grid.spacing.z : 1);
+
+	stringstream extent;
+	extent << "0 " << grid.size.x - 1 << " 0 " << grid.size.y - 1 << " 0 " << grid.size.z - 1;
+
+	// the header is assembled in memory and written with the data
+	stringstream head;
+	head.precision(numeric_limits<double>::digits10);
+	head << "<?xml version='1.0'?>" << endl;
+	head << "<VTKFile type='ImageData'  version='0.1'  byte_order='" <<
+		endianness[*(char*)&endian_int & 1] << "'>" << endl;
+	head << " <ImageData WholeExtent='" << extent.str() << "' Origin='"
+		<< grid.origin.x << " " << grid.origin.y << " " << grid.origin.z << "' Spacing='"
+		<< spacing.x << " " << spacing.y << " " << spacing.z << "'>" << endl;
+	head << "  <Piece Extent='" << extent.str() << "'>" << endl;
+	head << "   <PointData Scalars='Pressure' Vectors='Velocity'>" << endl;
+	size_t offset = 0;
+	for (size_t f = 0; f < m_fields.size(); ++f) {
+		head << "	<DataArray type='Float32' Name='" << m_fields[f].name << "'";
+		if (m_fields[f].dim > 1)
+			head << " NumberOfComponents='" << m_fields[f].dim << "'";
+		head << " format='appended' offset='" << offset << "'/>" << endl;
+		offset += out[f].size()*sizeof(float) + sizeof(int);
+	}
+	head << "   </PointData>" << endl;
+	head << "  </Piece>" << endl;
+	head << " </ImageData>" << endl;
+	head << " <AppendedData encoding='raw'>\n_";
+	fid.write(head.str());
+	for (size_t f = 0; f < m_fields.size(); ++f) {
+		const int numbytes = out[f].size()*sizeof(float);
+		fid.write(&numbytes, sizeof(numbytes));
+		fid.write(&out[f][0], numbytes);
+	}
+	fid.write(string(" </AppendedData>\n</VTKFile>\n"));
+
+	fid.close();
+
+	if (m_timefile) {
+		m_timefile << "<DataSet timestep='" << t << "' group='' part='" << part << "' "
+			<< "file='" << filename << "'/>" << endl;
+	}
+}
+
+void
+GridWriter::write(uint numParts, BufferList const& buffers, uint node_offset, float t, const bool testpoints)
+{
+	sort_particles(numParts, buffers, node_offset);
+	if (m_numValues > GRID_MAX_VALUES)
+		throw runtime_error("too many fields to resample");
+
+	const string filenum = next_filenum();
+	for (size_t g = 0; g < m_grids.size(); ++g)
+		write_grid(m_grids[g], filenum, t, g);
+
+	mark_timefile();
+}
+
+void
+GridWriter::mark_timefile()
+{
+	if (!m_timefile)
+		return;
+	// Mark the current position, close the XML, go back
+	// to the marked position
+	ofstream::pos_type mark = m_timefile.tellp();
+	m_timefile << " </Collection>\n";
+	m_timefile << "</VTKFile>" << endl;
+	m_timefile.seekp(mark);
+}
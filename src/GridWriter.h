@@ -0,0 +1,102 @@
+/*  Copyright 2013 Alexis Herault, Giuseppe Bilotta, Robert A. Dalrymple, Eugenio Rustico, Ciro Del Negro
+
+    Istituto Nazionale di Geofisica e Vulcanologia
+        Sezione di Catania, Catania, Italy
+
+    Università di Catania, Catania, Italy
+
+    Johns Hopkins University, Baltimore, MD
+
+    This file is part of GPUSPH.
+
+    GPUSPH is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GPUSPH is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GPUSPH.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _GRIDWRITER_H
+#define	_GRIDWRITER_H
+
+#include <vector>
+
+#include "Writer.h"
+
+using namespace std;
+
+// a field resampled onto the grids
+struct GridField {
+	const char	*name;
+	uint		dim;
+	// offset of the field in the values of each particle
+	uint		offset;
+};
+
+/* The GridWriter interpolates the particle fields onto regular grids (or slices,
+ * see ResampleGrid) and writes only the grids, one VTK ImageData (.vti) file per
+ * grid, collected in GRIDinp.pvd.
+ *
+ * The value at each grid point is the Shepard-normalized SPH interpolation
+ *
+ *   f(x) = sum_j f_j V_j W(|x - x_j|) / sum_j V_j W(|x - x_j|),  V_j = m_j/rho_j
+ *
+ * over the fluid particles within the influence radius, found scanning the
+ * neighboring cells of the grid point; points without fluid particles around
+ * them are NaN. Velocity, density and pressure are always resampled, vorticity
+ * and the k-epsilon fields when the filter of the writer selects them.
+ *
+ * The writer only needs the particles around the grids: unless its filter
+ * already restricts them, it selects the bounding box of the grids widened by
+ * the influence radius, so that only the cells around the grids are DUMPed.
+ * In multi-node simulations each node resamples its own particles only.
+ */
+class GridWriter : public Writer
+{
+	ResampleGridList	m_grids;
+	// number of threads interpolating the grid points
+	uint				m_numThreads;
+
+	// particles of the current write, sorted by cell: the cell of each one,
+	// the start of each cell in the sorted list, and the global position,
+	// volume and values of the sorted particles
+	vector<uint>		m_cell;
+	vector<uint>		m_cellStart;
+	vector<double3>		m_pos;
+	vector<float>		m_volume;
+	vector<float>		m_values;
+
+	// fields of the current write, with the total number of components
+	vector<GridField>	m_fields;
+	uint				m_numValues;
+
+	// sort the fluid particles by cell, gathering the values of the fields
+	void sort_particles(uint numParts, BufferList const& buffers, uint node_offset);
+
+	void write_grid(ResampleGrid const& grid, string const& filenum, float t, uint part);
+
+public:
+	GridWriter(const GlobalData *_gdata, ResampleGridList const& grids);
+	~GridWriter();
+
+	virtual void set_filter(WriterFilter const& filter);
+
+	virtual void write(uint numParts, BufferList const& buffers, uint node_offset, float t, const bool testpoints);
+
+	// interpolate the fields at grid points [from, to) of grid into the
+	// per-field arrays out (public for the interpolation threads)
+	void interpolate(ResampleGrid const& grid, uint from, uint to, vector<float> *out) const;
+
+	// close the XML in the timefile and seek back before the closing tags,
+	// as in VTKWriter
+	void mark_timefile();
+};
+
+#endif	/* _GRIDWRITER_H */
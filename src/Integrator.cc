@@ -0,0 +1,251 @@
+/*  Copyright 2013 Alexis Herault, Giuseppe Bilotta, Robert A. Dalrymple, Eugenio Rustico, Ciro Del Negro
+
+    Istituto Nazionale di Geofisica e Vulcanologia
+        Sezione di Catania, Catania, Italy
+
+    Università di Catania, Catania, Italy
+
+    Johns Hopkins University, Baltimore, MD
+
+    This file is part of GPUSPH.
+
+    GPUSPH is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GPUSPH is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GPUSPH.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdexcept>
+
+#include "Integrator.h"
+#include "GPUSPH.h"
+// loads on the floating bodies
+#include "Loads.h"
+
+using namespace std;
+
+Integrator::Integrator(GPUSPH *gpusph, GlobalData *_gdata) :
+	m_gpusph(gpusph),
+	gdata(_gdata),
+	m_simparams(_gdata->problem->get_simparams())
+{}
+
+Integrator* Integrator::create(GPUSPH *gpusph, GlobalData *_gdata)
+{
+	switch (_gdata->problem->get_simparams()->integratortype) {
+	case PREDICTOR_CORRECTOR:
+		return new PredictorCorrector(gpusph, _gdata);
+	case KICK_DRIFT_KICK:
+		return new KickDriftKick(gpusph, _gdata);
+	default:
+		throw runtime_error("unknown integrator type");
+	}
+}
+
+void Integrator::doCommand(CommandType cmd, flag_t flags)
+{
+	m_gpusph->doCommand(cmd, flags);
+}
+
+void Integrator::swapDeviceBuffers(flag_t buffers)
+{
+	m_gpusph->swapDeviceBuffers(buffers);
+}
+
+void Integrator::flushCommandSequence()
+{
+	m_gpusph->flushCommandSequence();
+}
+
+void Integrator::computeForces(flag_t step)
+{
+	// for SPS viscosity, compute first array of tau and exchange with neighbors
+	if (m_simparams->visctype == SPSVISC) {
+		gdata->only_internal = true;
+		doCommand(SPS, step);
+		if (MULTI_DEVICE)
+			doCommand(UPDATE_EXTERNAL, BUFFER_TAU);
+	}
+
+	// compute forces only on internal particles
+	gdata->only_internal = true;
+	if (gdata->clOptions->striping && MULTI_DEVICE)
+		doCommand(FORCES_ENQUEUE, step);
+	else
+		doCommand(FORCES_SYNC, step);
+
+	// update forces of external particles
+	if (MULTI_DEVICE)
+		doCommand(UPDATE_EXTERNAL, BUFFER_FORCES | BUFFER_GRADGAMMA | BUFFER_XSPH | DBLBUFFER_WRITE);
+	swapDeviceBuffers(BUFFER_GRADGAMMA);
+
+	// if striping was active, now we want the kernels to complete
+	if (gdata->clOptions->striping && MULTI_DEVICE)
+		doCommand(FORCES_COMPLETE, step);
+}
+
+void Integrator::uploadMovingBoundaries()
+{
+	// wait for the helper thread (which may have been working while forces
+	// were computed) and upload on the GPU, one per device
+	m_gpusph->uploadCallBackMbData();
+}
+
+void Integrator::uploadGravity(uint upload)
+{
+	m_gpusph->uploadCallBackGravity(upload);
+}
+
+void Integrator::moveBodies(int step)
+{
+	const uint numBodies = m_simparams->numODEbodies;
+	if (numBodies == 0)
+		return;
+
+	doCommand(REDUCE_BODIES_FORCES);
+	// the partial totals are needed on host
+	flushCommandSequence();
+
+	float3* totForce = new float3[numBodies];
+	float3* totTorque = new float3[numBodies];
+
+	// now sum up the partial forces and momenta computed in each gpu
+	for (uint ob = 0; ob < numBodies; ob ++) {
+
+		totForce[ob] = make_float3( 0.0F );
+		totTorque[ob] = make_float3( 0.0F );
+
+		for (uint d = 0; d < gdata->devices; d++) {
+			totForce[ob] += gdata->s_hRbTotalForce[d][ob];
+			totTorque[ob] += gdata->s_hRbTotalTorque[d][ob];
+		} // iterate on devices
+	} // iterate on objects
+
+	// if running multinode, also reduce across nodes
+	if (MULTI_NODE) {
+		// to minimize the overhead, we reduce the whole arrays of forces and torques in one command
+		gdata->networkManager->networkFloatReduction((float*)totForce, 3 * numBodies, SUM_REDUCTION);
+		gdata->networkManager->networkFloatReduction((float*)totTorque, 3 * numBodies, SUM_REDUCTION);
+	}
+
+	// the loads on the floating bodies are those of the last step, about the
+	// centers of gravity the forces were computed with
+	if (gdata->loads)
+		gdata->loads->setBodies(totForce, totTorque, gdata->s_hRbGravityCenters);
+
+	gdata->problem->ODE_bodies_timestep(totForce, totTorque, step, gdata->dt, gdata->s_hRbGravityCenters, gdata->s_hRbTranslations, gdata->s_hRbRotationMatrices);
+
+	// upload translation vectors and rotation matrices; will upload CGs after euler
+	doCommand(UPLOAD_OBJECTS_MATRICES);
+}
+
+void Integrator::updateBoundaryConditions(flag_t step)
+{
+	// semi-analytical boundary update
+	if (m_simparams->boundarytype == SA_BOUNDARY) {
+		gdata->only_internal = true;
+
+		doCommand(SA_CALC_BOUND_CONDITIONS, step);
+		if (MULTI_DEVICE)
+			doCommand(UPDATE_EXTERNAL, BUFFER_VEL | BUFFER_TKE | BUFFER_EPSILON | DBLBUFFER_WRITE);
+		doCommand(SA_UPDATE_BOUND_VALUES, step);
+		if (MULTI_DEVICE)
+			doCommand(UPDATE_EXTERNAL, BUFFER_VEL | BUFFER_TKE | BUFFER_EPSILON | DBLBUFFER_WRITE);
+	}
+}
+
+void PredictorCorrector::step()
+{
+	computeForces(INTEGRATOR_STEP_1);
+
+	// moving boundaries are only needed by euler
+	uploadMovingBoundaries();
+
+	// integrate also the externals
+	gdata->only_internal = false;
+	doCommand(EULER, INTEGRATOR_STEP_1);
+
+	swapDeviceBuffers(BUFFER_POS);
+
+	// gravity for the second computation of the forces
+	uploadGravity(1);
+
+	updateBoundaryConditions(INTEGRATOR_STEP_1);
+
+	swapDeviceBuffers(BUFFER_VEL | BUFFER_TKE | BUFFER_EPSILON);
+
+	computeForces(INTEGRATOR_STEP_2);
+
+	moveBodies(2);
+
+	// swap read and writes again because the write contains the variables at time n
+	swapDeviceBuffers(BUFFER_POS | BUFFER_VEL | BUFFER_TKE | BUFFER_EPSILON);
+
+	// integrate also the externals
+	gdata->only_internal = false;
+	doCommand(EULER, INTEGRATOR_STEP_2);
+
+	// euler needs the previous centers of gravity, so we upload CGs only here
+	if (m_simparams->numODEbodies > 0)
+		doCommand(UPLOAD_OBJECTS_CG);
+
+	swapDeviceBuffers(BUFFER_POS);
+
+	updateBoundaryConditions(INTEGRATOR_STEP_2);
+
+	swapDeviceBuffers(BUFFER_VEL | BUFFER_TKE | BUFFER_EPSILON);
+}
+
+// The forces computed at the end of a step are used for the first kick of the next
+// one. Since the drift uses the full dt while the kicks use half of it, the dt
+// computed from f(n+1) is also the one the next step needs. Velocity-dependent
+// terms (viscosity) of f(n+1) are computed with v(n+1/2). Gravity is uploaded at
+// the beginning of the step, and is the same for both kicks.
+void KickDriftKick::step()
+{
+	// f(n) is lost when the particles are reordered
+	if (!m_forcesValid)
+		computeForces(INTEGRATOR_STEP_1);
+
+	moveBodies(2);
+
+	uploadMovingBoundaries();
+
+	// v(n+1/2) = v(n) + f(n)*dt/2, pos(n+1) = pos(n) + v(n+1/2)*dt,
+	// integrating also the externals
+	gdata->only_internal = false;
+	doCommand(EULER, INTEGRATOR_KICK_DRIFT);
+
+	// euler needs the previous centers of gravity, so we upload CGs only here
+	if (m_simparams->numODEbodies > 0)
+		doCommand(UPLOAD_OBJECTS_CG);
+
+	swapDeviceBuffers(BUFFER_POS);
+
+	updateBoundaryConditions(INTEGRATOR_KICK_DRIFT);
+
+	swapDeviceBuffers(BUFFER_VEL | BUFFER_TKE | BUFFER_EPSILON);
+
+	// f(n+1); as a first step, so that dt only depends on these forces
+	computeForces(INTEGRATOR_STEP_1);
+
+	// v(n+1) = v(n+1/2) + f(n+1)*dt/2
+	gdata->only_internal = false;
+	doCommand(EULER, INTEGRATOR_KICK);
+
+	swapDeviceBuffers(BUFFER_POS);
+
+	updateBoundaryConditions(INTEGRATOR_KICK);
+
+	swapDeviceBuffers(BUFFER_VEL | BUFFER_TKE | BUFFER_EPSILON);
+
+	m_forcesValid = true;
+}
@@ -0,0 +1,114 @@
+/*  Copyright 2013 Alexis Herault, Giuseppe Bilotta, Robert A. Dalrymple, Eugenio Rustico, Ciro Del Negro
+
+    Istituto Nazionale di Geofisica e Vulcanologia
+        Sezione di Catania, Catania, Italy
+
+    Università di Catania, Catania, Italy
+
+    Johns Hopkins University, Baltimore, MD
+
+    This file is part of GPUSPH.
+
+    GPUSPH is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GPUSPH is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GPUSPH.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _INTEGRATOR_H
+#define _INTEGRATOR_H
+
+#include "GlobalData.h"
+
+class GPUSPH;
+
+// An Integrator issues the commands of a simulation step, from the computation of
+// the forces to the integration of positions and velocities. Neighbor list rebuilds,
+// Shepard and MLS filters, callbacks and the dt reduction are left to the main loop.
+// The commands are issued through GPUSPH, so they can be recorded (see --autonomous).
+class Integrator {
+protected:
+	GPUSPH *m_gpusph;
+	GlobalData *gdata;
+	const SimParams *m_simparams;
+
+	// forward to GPUSPH
+	void doCommand(CommandType cmd, flag_t flags=NO_FLAGS);
+	void swapDeviceBuffers(flag_t buffers);
+	void flushCommandSequence();
+
+	// compute the forces on the internal particles (including SPS stresses),
+	// and update the external ones
+	void computeForces(flag_t step);
+	// wait for the moving boundary data and upload them
+	void uploadMovingBoundaries();
+	// wait for the gravity of the upload-th computation of the forces (less than
+	// forcesPerStep(), see GPUSPH::startCallBacks()) and upload it
+	void uploadGravity(uint upload);
+	// reduce the forces on the rigid bodies, integrate their motion and
+	// upload the translations and rotations
+	void moveBodies(int step);
+	// update the semi-analytical boundary conditions after the integration
+	void updateBoundaryConditions(flag_t step);
+
+public:
+	Integrator(GPUSPH *gpusph, GlobalData *_gdata);
+	virtual ~Integrator() {}
+
+	// create the integrator selected by SimParams::integratortype
+	static Integrator* create(GPUSPH *gpusph, GlobalData *_gdata);
+
+	virtual const char* getName() const = 0;
+
+	// number of forces computations in a step without rebuilds, each with
+	// its own upload of the gravity
+	virtual uint forcesPerStep() const = 0;
+
+	// the forces of the last step are no longer valid for the current particles:
+	// the neighbor list was rebuilt (reordering the particles) or the velocities
+	// were changed by a filter
+	virtual void invalidateForces() {}
+
+	// issue the commands of a step
+	virtual void step() = 0;
+};
+
+// Two-stage predictor-corrector: forces at pos(n), half step,
+// forces at pos(n+1/2), full step from pos(n)
+class PredictorCorrector : public Integrator {
+public:
+	PredictorCorrector(GPUSPH *gpusph, GlobalData *_gdata) :
+		Integrator(gpusph, _gdata) {}
+
+	const char* getName() const { return IntegratorName[PREDICTOR_CORRECTOR]; }
+	uint forcesPerStep() const { return 2; }
+	void step();
+};
+
+// Symplectic kick-drift-kick (velocity Verlet): half kick with f(n), drift
+// to pos(n+1), forces at pos(n+1), half kick with f(n+1). The forces at the
+// end of a step are those of the next one, so they are computed once per step,
+// except after a neighbor list rebuild or a filter
+class KickDriftKick : public Integrator {
+	// the forces buffer holds f(n) for the current particles
+	bool m_forcesValid;
+public:
+	KickDriftKick(GPUSPH *gpusph, GlobalData *_gdata) :
+		Integrator(gpusph, _gdata),
+		m_forcesValid(false) {}
+
+	const char* getName() const { return IntegratorName[KICK_DRIFT_KICK]; }
+	uint forcesPerStep() const { return 1; }
+	void invalidateForces() { m_forcesValid = false; }
+	void step();
+};
+
+#endif
@@ -0,0 +1,245 @@
+/*  Copyright 2013 Alexis Herault, Giuseppe Bilotta, Robert A. Dalrymple, Eugenio Rustico, Ciro Del Negro
+
+    Istituto Nazionale di Geofisica e Vulcanologia
+        Sezione di Catania, Catania, Italy
+
+    Università di Catania, Catania, Italy
+
+    Johns Hopkins University, Baltimore, MD
+
+    This file is part of GPUSPH.
+
+    GPUSPH is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GPUSPH is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GPUSPH.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cstring>
+#include <limits.h>
+#include <sstream>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "Loads.h"
+#include "GlobalData.h"
+#include "Problem.h"
+
+using namespace std;
+
+#define LOADS_BYTE_ORDER	0x01020304U
+
+Loads::Loads(const GlobalData *_gdata, bool restarting) :
+	gdata(_gdata),
+	m_numWallLoads(0),
+	m_numSlots(0),
+	m_fp(NULL)
+{
+	LoadSpecList const& allSpecs = gdata->problem->get_loads();
+	const uint numLoads = allSpecs.size();
+	const uint numBodies = gdata->problem->get_simparams()->numODEbodies;
+
+	// the wall loads first, then the floating bodies
+	LoadSpecList specs;
+	for (uint l = 0; l < numLoads; ++l)
+		if (!allSpecs[l].floating)
+			specs.push_back(allSpecs[l]);
+	m_numWallLoads = specs.size();
+	for (uint l = 0; l < numLoads; ++l)
+		if (allSpecs[l].floating)
+			specs.push_back(allSpecs[l]);
+
+	m_objects.resize(numLoads);
+	m_firstId.assign(m_numWallLoads, UINT_MAX);
+	m_numIds.assign(m_numWallLoads, 0);
+	m_firstSlot.resize(m_numWallLoads);
+
+	// range of the ids of the particles of each object
+	vector<uint> lastId(m_numWallLoads, 0);
+	const particleinfo *info = gdata->s_hBuffers.getData<BUFFER_INFO>();
+	for (uint i = 0; i < gdata->totParticles; ++i) {
+		if (OBJECT(info[i])) {
+			for (uint l = m_numWallLoads; l < numLoads; ++l)
+				if (::object(info[i]) == specs[l].object)
+					m_objects[l].numParticles++;
+			continue;
+		}
+		if (!WALL(info[i]))
+			continue;
+		for (uint l = 0; l < m_numWallLoads; ++l) {
+			if (::object(info[i]) != specs[l].object)
+				continue;
+			m_firstId[l] = min(m_firstId[l], id(info[i]));
+			lastId[l] = max(lastId[l], id(info[i]));
+			m_objects[l].numParticles++;
+			break;
+		}
+	}
+
+	for (uint l = 0; l < numLoads; ++l) {
+		LoadObject &obj = m_objects[l];
+		obj.object = specs[l].object;
+		obj.floating = specs[l].floating;
+		obj.center[0] = specs[l].center.x;
+		obj.center[1] = specs[l].center.y;
+		obj.center[2] = specs[l].center.z;
+
+		if (obj.floating) {
+			if (obj.object >= numBodies) {
+				stringstream ss;
+				ss << "no floating body " << obj.object << " to compute the loads on";
+				throw runtime_error(ss.str());
+			}
+			continue;
+		}
+
+		if (!obj.numParticles) {
+			stringstream ss;
+			ss << "no boundary particles with object number " << obj.object << " to compute the loads on";
+			throw runtime_error(ss.str());
+		}
+
+		// the slot of a particle is found from its id, so the ids of the particles
+		// of an object must be contiguous (as they are when the Problem creates
+		// the object in one go) and not shared with other particles
+		m_numIds[l] = lastId[l] - m_firstId[l] + 1;
+		if (m_numIds[l] != obj.numParticles) {
+			stringstream ss;
+			ss << "the ids of the " << obj.numParticles << " particles of object " << obj.object
+				<< " to compute the loads on are not contiguous (" << m_firstId[l] << " to " << lastId[l] << ")";
+			throw runtime_error(ss.str());
+		}
+		m_firstSlot[l] = m_numSlots;
+		m_numSlots += 2*m_numIds[l];
+	}
+
+	m_partial.assign(MAX_DEVICES_PER_NODE*2*m_numWallLoads, make_float4(0.0f));
+	m_total.assign(6*numLoads, 0.0f);
+
+	// the totals are the same on all ranks
+	if (gdata->mpi_rank <= 0)
+		open(restarting);
+}
+
+Loads::~Loads()
+{
+	if (m_fp)
+		fclose(m_fp);
+}
+
+void
+Loads::open(bool restarting)
+{
+	const string dirname = gdata->problem->get_dirname() + "/data";
+	mkdir(dirname.c_str(), S_IRWXU | S_IRWXG | S_IRWXO);
+
+	m_fname = dirname + "/LOADS.bin";
+
+	LoadFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, LOADS_MAGIC, sizeof(header.magic));
+	header.version = LOADS_VERSION;
+	header.byteOrder = LOADS_BYTE_ORDER;
+	header.numLoads = m_objects.size();
+
+	const off_t objectsEnd = sizeof(header) + m_objects.size()*sizeof(LoadObject);
+	const off_t recordSize = sizeof(double) + m_objects.size()*sizeof(LoadSample);
+
+	// continue the loads on the same objects, dropping the records written
+	// from the time of the checkpoint we restart from
+	if (restarting && (m_fp = fopen(m_fname.c_str(), "r+b"))) {
+		LoadFileHeader old;
+		vector<LoadObject> objects(m_objects.size());
+		bool same = fread(&old, sizeof(old), 1, m_fp) == 1 &&
+			!memcmp(&old, &header, sizeof(old)) &&
+			fread(&objects[0], sizeof(LoadObject), objects.size(), m_fp) == objects.size() &&
+			!memcmp(&objects[0], &m_objects[0], objects.size()*sizeof(LoadObject));
+
+		off_t end = objectsEnd;
+		double t;
+		while (same && fread(&t, sizeof(t), 1, m_fp) == 1 && t < gdata->t) {
+			if (fseeko(m_fp, end + recordSize, SEEK_SET))
+				break;
+			end += recordSize;
+		}
+
+		if (same) {
+			fflush(m_fp);
+			if (ftruncate(fileno(m_fp), end) || fseeko(m_fp, end, SEEK_SET))
+				throw runtime_error("cannot truncate load file " + m_fname);
+			return;
+		}
+
+		fclose(m_fp);
+		m_fp = NULL;
+		fprintf(stderr, "WARNING: %s holds the loads of different objects, overwriting it\n", m_fname.c_str());
+	}
+
+	m_fp = fopen(m_fname.c_str(), "wb");
+	if (!m_fp)
+		throw runtime_error("cannot create load file " + m_fname);
+
+	if (fwrite(&header, sizeof(header), 1, m_fp) != 1 ||
+		fwrite(&m_objects[0], sizeof(LoadObject), m_objects.size(), m_fp) != m_objects.size())
+		throw runtime_error("cannot write load file " + m_fname);
+}
+
+void
+Loads::sum()
+{
+	const uint numLoads = m_numWallLoads;
+	for (uint l = 0; l < numLoads; ++l) {
+		float3 force = make_float3(0.0f);
+		float3 moment = make_float3(0.0f);
+		for (uint d = 0; d < gdata->devices; ++d) {
+			force += as_float3(m_partial[2*numLoads*d + 2*l]);
+			moment += as_float3(m_partial[2*numLoads*d + 2*l + 1]);
+		}
+		float *total = &m_total[6*l];
+		total[0] = force.x; total[1] = force.y; total[2] = force.z;
+		total[3] = moment.x; total[4] = moment.y; total[5] = moment.z;
+	}
+}
+
+void
+Loads::setBodies(const float3 *force, const float3 *torque, const float3 *cg)
+{
+	for (uint l = m_numWallLoads; l < m_objects.size(); ++l) {
+		const uint body = m_objects[l].object;
+		// the torque is about the center of gravity
+		const float3 moment = torque[body] + cross(cg[body] - center(l), force[body]);
+		float *total = &m_total[6*l];
+		total[0] = force[body].x; total[1] = force[body].y; total[2] = force[body].z;
+		total[3] = moment.x; total[4] = moment.y; total[5] = moment.z;
+	}
+}
+
+void
+Loads::write(double t)
+{
+	if (!m_fp)
+		return;
+
+	// LoadSample is the same sequence of floats as the totals
+	if (fwrite(&t, sizeof(t), 1, m_fp) != 1 ||
+		fwrite(&m_total[0], sizeof(LoadSample), m_objects.size(), m_fp) != m_objects.size())
+		throw runtime_error("cannot write load file " + m_fname);
+}
+
+void
+Loads::flush()
+{
+	if (m_fp && fflush(m_fp))
+		throw runtime_error("cannot write load file " + m_fname);
+}
@@ -0,0 +1,175 @@
+/*  Copyright 2013 Alexis Herault, Giuseppe Bilotta, Robert A. Dalrymple, Eugenio Rustico, Ciro Del Negro
+
+    Istituto Nazionale di Geofisica e Vulcanologia
+        Sezione di Catania, Catania, Italy
+
+    Università di Catania, Catania, Italy
+
+    Johns Hopkins University, Baltimore, MD
+
+    This file is part of GPUSPH.
+
+    GPUSPH is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GPUSPH is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GPUSPH.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _LOADS_H
+#define _LOADS_H
+
+#include <cstdio>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "particledefine.h"
+#include "vector_math.h"
+
+struct GlobalData;
+
+#define LOADS_MAGIC		"GPUSPHLD"
+#define LOADS_VERSION	2
+
+// beginning of the load file, followed by a LoadObject for each of the numLoads
+// objects and, for each iteration, the time (as a double) and numLoads LoadSamples
+struct LoadFileHeader {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	byteOrder;	// 0x01020304 in the byte order of the machine
+	uint32_t	numLoads;
+	uint32_t	reserved;
+};
+
+struct LoadObject {
+	double		center[3];
+	// object number of the boundary particles, or number of the floating body
+	uint32_t	object;
+	uint32_t	numParticles;
+	uint32_t	floating;
+	uint32_t	reserved;
+};
+
+struct LoadSample {
+	float		force[3];
+	// about the center of the object
+	float		moment[3];
+};
+
+/* Force and moment of the fluid on the objects chosen by the Problem (see
+ * Problem::add_load() and Problem::add_body_load()), computed at every iteration.
+ *
+ * For the objects made of boundary particles with a given object number (the
+ * wall loads), the forces kernel computes the reaction of the fluid on each
+ * particle, as it does for the floating bodies, and stores it with its moment
+ * in a per-device array, indexed by the id of the particle: the forces of each
+ * object are followed by its moments, each in a segment spanning the ids of the
+ * object, which must be contiguous. After each iteration, the array is reduced
+ * by segment (REDUCE_LOADS) and only the totals are downloaded.
+ *
+ * The floating bodies already have their total force and torque (about their
+ * center of gravity) reduced at every step to move them: their loads are taken
+ * from the last step, and the torque is moved to the requested center.
+ *
+ * The loads are appended to data/LOADS.bin by the first rank, in the native
+ * byte order: a LoadFileHeader, the LoadObjects and, for each iteration, the
+ * time and the LoadSamples of the objects. The wall loads come first, then the
+ * floating bodies, each in the order they were added. When restarting, the
+ * records from the time of the checkpoint on are dropped and the new ones are
+ * appended.
+ */
+class Loads {
+	const GlobalData	*gdata;
+
+	std::vector<LoadObject>	m_objects;
+	// the first m_numWallLoads objects are made of boundary particles
+	uint					m_numWallLoads;
+	// first id of the particles of each object, and first slot of its forces
+	// in the per-device arrays, which hold numIds forces and numIds moments
+	std::vector<uint>		m_firstId;
+	std::vector<uint>		m_numIds;
+	std::vector<uint>		m_firstSlot;
+	uint					m_numSlots;
+
+	// force and moment of each object, per device, and the total
+	std::vector<float4>		m_partial;
+	std::vector<float>		m_total;
+
+	std::string				m_fname;
+	FILE					*m_fp;
+
+	void open(bool restarting);
+
+public:
+	// the particles of the objects are found among the particles in the shared
+	// host buffers. When restarting, the loads of the previous run are continued
+	Loads(const GlobalData *_gdata, bool restarting);
+	~Loads();
+
+	inline uint numLoads() const
+	{ return m_objects.size(); }
+
+	// the loads computed by the workers, on the boundary particles: the
+	// descriptions and arrays below are only for these
+	inline uint numWallLoads() const
+	{ return m_numWallLoads; }
+
+	// size of the per-device arrays of forces and moments
+	inline uint numSlots() const
+	{ return m_numSlots; }
+
+	// number of particles of the object of load l
+	inline uint numParticles(uint l) const
+	{ return m_objects[l].numParticles; }
+
+	// description of load l for the devices: see setforcesloads()
+	inline uint object(uint l) const
+	{ return m_objects[l].object; }
+
+	inline uint firstId(uint l) const
+	{ return m_firstId[l]; }
+
+	inline uint numIds(uint l) const
+	{ return m_numIds[l]; }
+
+	inline uint firstSlot(uint l) const
+	{ return m_firstSlot[l]; }
+
+	inline float3 center(uint l) const
+	{ return make_float3(m_objects[l].center[0], m_objects[l].center[1], m_objects[l].center[2]); }
+
+	// where the device stores the force and moment of each object
+	inline float4 *partial(uint device)
+	{ return &m_partial[2*m_numWallLoads*device]; }
+
+	// sum the loads found by the devices of this rank
+	void sum();
+
+	// set the loads of the floating bodies from their total force and torque,
+	// with the given centers of gravity, at each step
+	void setBodies(const float3 *force, const float3 *torque, const float3 *cg);
+
+	// the forces and moments of the wall loads, 6 floats each, for the
+	// reduction across ranks; the floating bodies follow, already reduced
+	inline float *total()
+	{ return &m_total[0]; }
+
+	inline uint totalSize() const
+	{ return 6*m_numWallLoads; }
+
+	// append the total loads, at time t
+	void write(double t);
+
+	// make sure the loads written so far are in the file, e.g. at checkpoints
+	void flush();
+};
+
+#endif
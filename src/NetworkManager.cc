@@ -384,7 +384,7 @@ void NetworkManager::receiveShorts(unsigned char src_globalDevIdx, unsigned char
 void NetworkManager::networkFloatReduction(float *buffer, unsigned int bufferElements, ReductionType rtype)
 {
 #if USE_MPI
-	MPI_Op _operator = (rtype == MIN_REDUCTION ? MPI_MIN : MPI_SUM);
+	MPI_Op _operator = (rtype == MIN_REDUCTION ? MPI_MIN : (rtype == MAX_REDUCTION ? MPI_MAX : MPI_SUM));
 
 	int mpi_err = MPI_Allreduce(MPI_IN_PLACE, buffer, bufferElements, MPI_FLOAT, _operator, MPI_COMM_WORLD);
 
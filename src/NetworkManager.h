@@ -13,6 +13,7 @@ typedef unsigned int uint;
 enum ReductionType
 {
 	MIN_REDUCTION,
+	MAX_REDUCTION,
 	SUM_REDUCTION
 };
 
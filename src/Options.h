@@ -44,6 +44,20 @@ struct Options {
 	bool	asyncNetworkTransfers; // enable asynchronous network transfers
 	unsigned int num_hosts; // number of physical hosts to which the processes are being assigned
 	bool byslot_scheduling; // by slot scheduling across MPI nodes (not round robin)
+	bool cpu; // run on the host CPU instead of the GPUs
+	unsigned int num_threads; // number of CPU threads (0: one per online core)
+	bool autonomous; // let the workers run whole command sequences without the main thread
+	bool profile; // time each command, printing statistics with the status
+	string	trace_file; // trace-event file with the timeline of the threads (implies profile)
+	unsigned int async_writes; // number of host snapshots for asynchronous writing (0: write synchronously)
+	bool drop_writes; // drop writes instead of waiting when all snapshots are pending
+	bool direct_io; // write the binary output with O_DIRECT through io_uring, where available
+	float	checkpoint_interval; // simulated time between checkpoints (NAN: no checkpoints)
+	string	restart_dir; // checkpoint directory to restart from
+	int		vtk_compression; // zlib compression level of the VTK files (0: uncompressed)
+	int		column_compression; // zlib compression level of the columnar output (0: uncompressed)
+	unsigned int column_keyframes; // frames between the keyframes of the columnar output (0: no delta coding)
+	float	column_tolerance; // maximum error of the delta-coded frames, relative to deltap for positions
 	Options(void) :
 		problem(),
 		device(-1),
@@ -56,7 +70,21 @@ struct Options {
 		striping(false),
 		asyncNetworkTransfers(false),
 		num_hosts(0),
-		byslot_scheduling(false)
+		byslot_scheduling(false),
+		cpu(false),
+		num_threads(0),
+		autonomous(false),
+		profile(false),
+		trace_file(),
+		async_writes(0),
+		drop_writes(false),
+		direct_io(false),
+		checkpoint_interval(NAN),
+		restart_dir(),
+		vtk_compression(0),
+		column_compression(0),
+		column_keyframes(0),
+		column_tolerance(0.01f)
 	{};
 };
 
@@ -107,8 +107,9 @@ Problem::check_dt(void)
 void
 Problem::check_maxneibsnum(void)
 {
-	// kernel radius times smoothing factor, rounded to the next integer
-	double r = m_simparams.sfactor*m_simparams.kernelradius;
+	// kernel radius times smoothing factor, expanded for the neighbor list
+	// and rounded to the next integer
+	double r = m_simparams.sfactor*m_simparams.kernelradius*m_simparams.nlexpansionfactor;
 	r = ceil(r);
 
 	// volumes are computed using a coefficient which is sligthly more than π
@@ -248,9 +249,69 @@ Problem::set_timer_tick(float t)
 }
 
 void
-Problem::add_writer(WriterType wt, int freq)
+Problem::add_writer(WriterType wt, int freq, WriterFilter const& filter)
 {
-	m_writers.push_back(make_pair(wt, freq));
+	WriterSpec spec;
+	spec.type = wt;
+	spec.freq = freq;
+	spec.filter = filter;
+	m_writers.push_back(spec);
+}
+
+void
+Problem::add_grid_writer(int freq, ResampleGridList const& grids, WriterFilter const& filter)
+{
+	WriterSpec spec;
+	spec.type = GRIDWRITER;
+	spec.freq = freq;
+	spec.filter = filter;
+	spec.grids = grids;
+	m_writers.push_back(spec);
+}
+
+void
+Problem::add_tracers(vector<uint> const& ids)
+{
+	m_tracers.ids.insert(m_tracers.ids.end(), ids.begin(), ids.end());
+}
+
+void
+Problem::add_tracers(double3 const& boxMin, double3 const& boxMax)
+{
+	m_tracers.boxMin.push_back(boxMin);
+	m_tracers.boxMax.push_back(boxMax);
+}
+
+void
+Problem::add_load(uint object, double3 const& center)
+{
+	if (m_loads.size() == MAXLOADS)
+		throw runtime_error("too many objects with loads");
+	for (size_t l = 0; l < m_loads.size(); ++l)
+		if (m_loads[l].object == object && !m_loads[l].floating)
+			throw runtime_error("loads of object already requested");
+
+	LoadSpec spec;
+	spec.object = object;
+	spec.floating = false;
+	spec.center = center;
+	m_loads.push_back(spec);
+}
+
+void
+Problem::add_body_load(uint body, double3 const& center)
+{
+	if (m_loads.size() == MAXLOADS)
+		throw runtime_error("too many objects with loads");
+	for (size_t l = 0; l < m_loads.size(); ++l)
+		if (m_loads[l].object == body && m_loads[l].floating)
+			throw runtime_error("loads of floating body already requested");
+
+	LoadSpec spec;
+	spec.object = body;
+	spec.floating = true;
+	spec.center = center;
+	m_loads.push_back(spec);
 }
 
 // override in problems where you want to save
@@ -555,6 +616,42 @@ Problem::get_ODE_body_numparts(const int i) const
 }
 
 
+void
+Problem::get_ODE_bodies_state(double *state) const
+{
+	for (uint i = 0; i < m_simparams.numODEbodies; i++) {
+		const dBodyID body = m_ODE_bodies[i]->m_ODEBody;
+		double *dst = state + ODE_BODY_STATE_SIZE*i;
+		const dReal *pos = dBodyGetPosition(body);
+		const dReal *quat = dBodyGetQuaternion(body);
+		const dReal *linvel = dBodyGetLinearVel(body);
+		const dReal *angvel = dBodyGetAngularVel(body);
+		for (uint c = 0; c < 3; c++) {
+			dst[c] = pos[c];
+			dst[7 + c] = linvel[c];
+			dst[10 + c] = angvel[c];
+		}
+		for (uint c = 0; c < 4; c++)
+			dst[3 + c] = quat[c];
+	}
+}
+
+
+void
+Problem::set_ODE_bodies_state(const double *state)
+{
+	for (uint i = 0; i < m_simparams.numODEbodies; i++) {
+		const dBodyID body = m_ODE_bodies[i]->m_ODEBody;
+		const double *src = state + ODE_BODY_STATE_SIZE*i;
+		dQuaternion quat = { src[3], src[4], src[5], src[6] };
+		dBodySetPosition(body, src[0], src[1], src[2]);
+		dBodySetQuaternion(body, quat);
+		dBodySetLinearVel(body, src[7], src[8], src[9]);
+		dBodySetAngularVel(body, src[10], src[11], src[12]);
+	}
+}
+
+
 void
 Problem::get_ODE_bodies_data(float3 * & cg, float * & steprot)
 {
@@ -691,10 +788,12 @@ Problem::get_mbdata(const float t, const float dt, const bool forceupdate)
 void
 Problem::set_grid_params(void)
 {
-	double influenceRadius = m_simparams.kernelradius*m_simparams.slength;
+	// problems may change the neib list expansion factor after setting deltap
+	double influenceRadius = m_simparams.set_influenceradius();
+	// the cells must hold all the particles within the neighbor list radius;
 	// with semi-analytical boundaries, we want a cell size which is
-	// deltap/2 + the usual influence radius
-	double cellSide = influenceRadius;
+	// deltap/2 + the usual neighbor list radius
+	double cellSide = m_simparams.nlInfluenceRadius;
 	if (m_simparams.boundarytype == SA_BOUNDARY)
 		cellSide += m_deltap/2.0f;
 
@@ -722,7 +821,8 @@ Problem::set_grid_params(void)
 	printf("set_grid_params\t:\n");
 	printf("Domain size\t: (%f, %f, %f)\n", m_size.x, m_size.y, m_size.z);
 	*/
-	printf("Influence radius / expected cell side\t: %g, %g\n", influenceRadius, cellSide);
+	printf("Influence radius / neib list radius / expected cell side\t: %g, %g, %g\n",
+		influenceRadius, m_simparams.nlInfluenceRadius, cellSide);
 	/*
 	printf("Grid   size\t: (%d, %d, %d)\n", m_gridsize.x, m_gridsize.y, m_gridsize.z);
 	printf("Cell   size\t: (%f, %f, %f)\n", m_cellsize.x, m_cellsize.y, m_cellsize.z);
@@ -47,6 +47,10 @@
 
 #include "ode/ode.h"
 
+// number of values describing the state of an ODE body: position (3),
+// quaternion (4), linear velocity (3), angular velocity (3)
+#define ODE_BODY_STATE_SIZE 13
+
 typedef std::vector<vertexinfo> VertexVect;
 
 // not including GlobalData.h since it needs the complete definition of the Problem class
@@ -54,11 +58,35 @@ struct GlobalData;
 
 using namespace std;
 
+// tracer particles, whose trajectories are written at every iteration (see Tracers.h)
+struct TracerSpec {
+	vector<uint>	ids;
+	// the fluid particles in each of these boxes at the start of the simulation
+	vector<double3>	boxMin, boxMax;
+
+	inline bool empty() const
+	{ return ids.empty() && boxMin.empty(); }
+};
+
+// objects whose fluid loads are written at every iteration (see Loads.h)
+struct LoadSpec {
+	// object number of the boundary particles making up the object, or number
+	// of the floating body
+	uint	object;
+	bool	floating;
+	// point the moments are computed about
+	double3	center;
+};
+
+typedef vector<LoadSpec> LoadSpecList;
+
 class Problem {
 	private:
 		float		m_last_rbdata_write_time;
 		string		m_problem_dir;
 		WriterList	m_writers;
+		TracerSpec	m_tracers;
+		LoadSpecList	m_loads;
 
 		const float	*m_dem;
 		int			m_ncols, m_nrows;
@@ -227,13 +255,47 @@ class Problem {
 		// set the timer tick
 		void set_timer_tick(float t);
 
-		// add a new writer
-		void add_writer(WriterType wt, int freq = 1);
+		// add a new writer, writing the particles and fields selected by filter
+		void add_writer(WriterType wt, int freq = 1, WriterFilter const& filter = WriterFilter());
+
+		// add a GRIDWRITER, resampling the fields selected by filter onto the given
+		// grids (see GridWriter.h)
+		void add_grid_writer(int freq, ResampleGridList const& grids,
+			WriterFilter const& filter = WriterFilter());
+
+		inline
+		void add_grid_writer(int freq, ResampleGrid const& grid,
+			WriterFilter const& filter = WriterFilter())
+		{ add_grid_writer(freq, ResampleGridList(1, grid), filter); }
 
 		// return the list of writers
 		WriterList const& get_writers() const
 		{ return m_writers; }
 
+		// trace the trajectories of the particles with the given ids
+		void add_tracers(vector<uint> const& ids);
+
+		inline
+		void add_tracer(uint id)
+		{ add_tracers(vector<uint>(1, id)); }
+
+		// trace the trajectories of the fluid particles that start in the given box
+		void add_tracers(double3 const& boxMin, double3 const& boxMax);
+
+		TracerSpec const& get_tracers() const
+		{ return m_tracers; }
+
+		// write the force and moment (about center) of the fluid on the boundary
+		// particles with the given object number, fixed or moving
+		void add_load(uint object, double3 const& center = make_double3(0.0));
+
+		// write the force and moment (about center) of the fluid on the given
+		// floating body, as used to move it
+		void add_body_load(uint body, double3 const& center = make_double3(0.0));
+
+		LoadSpecList const& get_loads() const
+		{ return m_loads; }
+
 		// overridden in subclasses if they want explicit writes
 		// beyond those controlled by the writer(s) periodic time
 		virtual bool need_write(float) const;
@@ -274,6 +336,10 @@ class Problem {
 									const double, float3 * &, float3 * &, float * &);
 		int	get_ODE_bodies_numparts(void) const;
 		int	get_ODE_body_numparts(const int) const;
+		// save and restore the position, orientation and velocities of the ODE bodies
+		// (ODE_BODY_STATE_SIZE values per body), e.g. for checkpoints
+		void get_ODE_bodies_state(double *) const;
+		void set_ODE_bodies_state(const double *);
 
 		void init_keps(float*, float*, uint, particleinfo*);
 
@@ -0,0 +1,344 @@
+/*  Copyright 2013 Alexis Herault, Giuseppe Bilotta, Robert A. Dalrymple, Eugenio Rustico, Ciro Del Negro
+
+    Istituto Nazionale di Geofisica e Vulcanologia
+        Sezione di Catania, Catania, Italy
+
+    Università di Catania, Catania, Italy
+
+    Johns Hopkins University, Baltimore, MD
+
+    This file is part of GPUSPH.
+
+    GPUSPH is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GPUSPH is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GPUSPH.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <stdint.h>
+
+#include "RunningStats.h"
+#include "GlobalData.h"
+#include "Problem.h"
+// cellHashFromParticleHash
+#include "hashkey.h"
+
+using namespace std;
+
+#define STATS_MAGIC		"GPUSPHST"
+#define STATS_VERSION	1
+
+// header of the binary files saved in the checkpoints, followed by the number
+// of samples of each bin (as uint64_t) and the accumulators
+struct StatsHeader {
+	char	magic[8];
+	uint	version;
+	uint	numFields;
+	uint	numCells;
+	uint	numProbes;
+};
+
+static const char *stats_field_names[STATS_MAX_FIELDS] = {
+	"VelX", "VelY", "VelZ", "Density", "Pressure", "TKE", "Epsilon"
+};
+
+// the statistics written for each field
+enum StatsValue { STATS_MEAN, STATS_VARIANCE, STATS_MIN, STATS_MAX, STATS_NUM_VALUES };
+
+static const char *stats_value_names[STATS_NUM_VALUES] = {
+	"mean", "variance", "min", "max"
+};
+
+// a statistic of an accumulator with n samples: NaN without samples, and
+// the unbiased variance (0 with a single sample)
+static inline double
+stats_value(StatsAccumulator const& acc, unsigned long n, uint value)
+{
+	if (!n)
+		return numeric_limits<double>::quiet_NaN();
+	switch (value) {
+	case STATS_MEAN:
+		return acc.mean;
+	case STATS_VARIANCE:
+		return n > 1 ? acc.m2/(n - 1) : 0;
+	case STATS_MIN:
+		return acc.min;
+	default:
+		return acc.max;
+	}
+}
+
+/* Endianness check: (char*)&endian_int reads the first byte of the int,
+ * which is 0 on big-endian machines, and 1 in little-endian machines */
+static int endian_int=1;
+static const char* endianness[2] = { "BigEndian", "LittleEndian" };
+
+string
+RunningStats::fileName(string const& dirname, int rank)
+{
+	stringstream ss;
+	ss << dirname << "/stats_rank" << rank << ".bin";
+	return ss.str();
+}
+
+RunningStats::RunningStats(const GlobalData *_gdata) :
+	gdata(_gdata)
+{
+	const SimParams *simparams = gdata->problem->get_simparams();
+
+	m_numFields = (simparams->visctype == KEPSVISC ? STATS_MAX_FIELDS : STATS_TKE);
+	m_numCells = gdata->nGridCells;
+
+	if (simparams->testpoints) {
+		double3 const& wo = gdata->problem->get_worldorigin();
+		const float4 *lpos = gdata->s_hBuffers.getData<BUFFER_POS>();
+		const hashKey *hash = gdata->s_hBuffers.getData<BUFFER_HASH>();
+		const particleinfo *info = gdata->s_hBuffers.getData<BUFFER_INFO>();
+
+		// ids and indices of the testpoints, sorted by id
+		vector< pair<uint, uint> > probes;
+		for (uint i = 0; i < gdata->totParticles; ++i)
+			if (TESTPOINTS(info[i]))
+				probes.push_back(make_pair(id(info[i]), i));
+		sort(probes.begin(), probes.end());
+
+		for (size_t p = 0; p < probes.size(); ++p) {
+			const uint i = probes[p].second;
+			const uint3 gridPos = gdata->calcGridPosFromCellHash(cellHashFromParticleHash(hash[i]));
+			m_probeIds.push_back(probes[p].first);
+			m_probePos.push_back(make_double3(
+				gdata->cellSize.x*(gridPos.x + 0.5) + lpos[i].x + wo.x,
+				gdata->cellSize.y*(gridPos.y + 0.5) + lpos[i].y + wo.y,
+				gdata->cellSize.z*(gridPos.z + 0.5) + lpos[i].z + wo.z));
+		}
+	}
+
+	const size_t numBins = (size_t)m_numCells + m_probeIds.size();
+	m_count.assign(numBins, 0);
+	m_acc.resize(numBins*m_numFields);
+
+	pthread_mutex_init(&m_mutex, NULL);
+}
+
+RunningStats::~RunningStats()
+{
+	pthread_mutex_destroy(&m_mutex);
+}
+
+void
+RunningStats::merge(uint first, uint numBins, const uint *count, const float4 *acc)
+{
+	pthread_mutex_lock(&m_mutex);
+	for (uint b = 0; b < numBins; ++b) {
+		const unsigned long nb = count[b];
+		if (!nb)
+			continue;
+		const size_t bin = (size_t)first + b;
+		const unsigned long na = m_count[bin];
+		const double n = na + nb;
+		for (uint f = 0; f < m_numFields; ++f) {
+			const float4 src = acc[(size_t)f*numBins + b];
+			StatsAccumulator &dst = m_acc[bin*m_numFields + f];
+			if (!na) {
+				dst.mean = src.x;
+				dst.m2 = src.y;
+				dst.min = src.z;
+				dst.max = src.w;
+				continue;
+			}
+			const double delta = src.x - dst.mean;
+			dst.mean += delta*nb/n;
+			dst.m2 += src.y + delta*delta*na*nb/n;
+			dst.min = min(dst.min, (double)src.z);
+			dst.max = max(dst.max, (double)src.w);
+		}
+		m_count[bin] = na + nb;
+	}
+	pthread_mutex_unlock(&m_mutex);
+}
+
+void
+RunningStats::write_cells(string const& fname) const
+{
+	ofstream out(fname.c_str(), ios::binary);
+	if (!out)
+		throw runtime_error("cannot open " + fname);
+	out.exceptions(ofstream::failbit | ofstream::badbit);
+
+	const uint3 gridSize = gdata->gridSize;
+	double3 const& wo = gdata->problem->get_worldorigin();
+
+	// one point per cell, at its center, with x varying fastest
+	vector<uint> cells;
+	cells.reserve(m_numCells);
+	for (uint z = 0; z < gridSize.z; ++z)
+		for (uint y = 0; y < gridSize.y; ++y)
+			for (uint x = 0; x < gridSize.x; ++x)
+				cells.push_back(gdata->calcGridHashHost(x, y, z));
+
+	stringstream extent;
+	extent << "0 " << gridSize.x - 1 << " 0 " << gridSize.y - 1 << " 0 " << gridSize.z - 1;
+
+	out.precision(numeric_limits<double>::digits10);
+	out << "<?xml version='1.0'?>" << endl;
+	out << "<VTKFile type='ImageData'  version='0.1'  byte_order='" <<
+		endianness[*(char*)&endian_int & 1] << "'>" << endl;
+	out << " <ImageData WholeExtent='" << extent.str() << "' Origin='"
+		<< wo.x + gdata->cellSize.x/2.0 << " "
+		<< wo.y + gdata->cellSize.y/2.0 << " "
+		<< wo.z + gdata->cellSize.z/2.0 << "' Spacing='"
+		<< gdata->cellSize.x << " " << gdata->cellSize.y << " " << gdata->cellSize.z << "'>" << endl;
+	out << "  <Piece Extent='" << extent.str() << "'>" << endl;
+	out << "   <PointData>" << endl;
+	size_t offset = 0;
+	out << "	<DataArray type='UInt64' Name='Samples' format='appended' offset='" << offset << "'/>" << endl;
+	offset += m_numCells*sizeof(uint64_t) + sizeof(int);
+	for (uint f = 0; f < m_numFields; ++f)
+		for (uint v = 0; v < STATS_NUM_VALUES; ++v) {
+			out << "	<DataArray type='Float32' Name='" << stats_field_names[f] << " "
+				<< stats_value_names[v] << "' format='appended' offset='" << offset << "'/>" << endl;
+			offset += m_numCells*sizeof(float) + sizeof(int);
+		}
+	out << "   </PointData>" << endl;
+	out << "  </Piece>" << endl;
+	out << " </ImageData>" << endl;
+	out << " <AppendedData encoding='raw'>\n_";
+
+	int numbytes = m_numCells*sizeof(uint64_t);
+	out.write((const char*)&numbytes, sizeof(numbytes));
+	vector<uint64_t> samples(m_numCells);
+	for (uint c = 0; c < m_numCells; ++c)
+		samples[c] = m_count[cells[c]];
+	if (m_numCells)
+		out.write((const char*)&samples[0], numbytes);
+
+	vector<float> values(m_numCells);
+	numbytes = m_numCells*sizeof(float);
+	for (uint f = 0; f < m_numFields; ++f)
+		for (uint v = 0; v < STATS_NUM_VALUES; ++v) {
+			for (uint c = 0; c < m_numCells; ++c)
+				values[c] = stats_value(m_acc[(size_t)cells[c]*m_numFields + f], m_count[cells[c]], v);
+			out.write((const char*)&numbytes, sizeof(numbytes));
+			if (m_numCells)
+				out.write((const char*)&values[0], numbytes);
+		}
+
+	out << " </AppendedData>" << endl;
+	out << "</VTKFile>" << endl;
+}
+
+void
+RunningStats::write_probes(string const& fname) const
+{
+	ofstream out(fname.c_str());
+	if (!out)
+		throw runtime_error("cannot open " + fname);
+	out.exceptions(ofstream::failbit | ofstream::badbit);
+
+	// only velocity and pressure are interpolated at the testpoints
+	const uint probe_fields[] = { STATS_VELX, STATS_VELY, STATS_VELZ, STATS_PRESSURE };
+	const uint num_probe_fields = sizeof(probe_fields)/sizeof(*probe_fields);
+
+	out << "#\tid\tx\ty\tz\tsamples";
+	for (uint pf = 0; pf < num_probe_fields; ++pf)
+		for (uint v = 0; v < STATS_NUM_VALUES; ++v)
+			out << "\t" << stats_field_names[probe_fields[pf]] << "_" << stats_value_names[v];
+	out << endl;
+
+	for (uint p = 0; p < m_probeIds.size(); ++p) {
+		const size_t bin = (size_t)m_numCells + p;
+		out << m_probeIds[p] << "\t" << m_probePos[p].x << "\t" << m_probePos[p].y << "\t"
+			<< m_probePos[p].z << "\t" << m_count[bin];
+		for (uint pf = 0; pf < num_probe_fields; ++pf)
+			for (uint v = 0; v < STATS_NUM_VALUES; ++v)
+				out << "\t" << stats_value(m_acc[bin*m_numFields + probe_fields[pf]], m_count[bin], v);
+		out << endl;
+	}
+}
+
+void
+RunningStats::write() const
+{
+	string base = gdata->problem->get_dirname() + "/data/STATS";
+	if (gdata->mpi_nodes > 1)
+		base += "_n" + gdata->rankString();
+
+	write_cells(base + ".vti");
+	if (!m_probeIds.empty())
+		write_probes(base + "_probes.txt");
+}
+
+void
+RunningStats::save(string const& fname) const
+{
+	const string tmpname = fname + ".tmp";
+
+	StatsHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, STATS_MAGIC, sizeof(header.magic));
+	header.version = STATS_VERSION;
+	header.numFields = m_numFields;
+	header.numCells = m_numCells;
+	header.numProbes = m_probeIds.size();
+
+	vector<uint64_t> count(m_count.begin(), m_count.end());
+
+	FILE *fp = fopen(tmpname.c_str(), "wb");
+	if (!fp)
+		throw runtime_error("cannot create " + tmpname);
+	const bool written = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+		fwrite(&count[0], sizeof(uint64_t), count.size(), fp) == count.size() &&
+		fwrite(&m_acc[0], sizeof(StatsAccumulator), m_acc.size(), fp) == m_acc.size();
+	if (fclose(fp) || !written)
+		throw runtime_error("cannot write " + tmpname);
+
+	if (rename(tmpname.c_str(), fname.c_str()))
+		throw runtime_error("cannot rename " + tmpname + " to " + fname);
+}
+
+bool
+RunningStats::load(string const& fname)
+{
+	FILE *fp = fopen(fname.c_str(), "rb");
+	if (!fp)
+		return false;
+
+	StatsHeader header;
+	if (fread(&header, sizeof(header), 1, fp) != 1 ||
+		memcmp(header.magic, STATS_MAGIC, sizeof(header.magic)) ||
+		header.version != STATS_VERSION) {
+		fclose(fp);
+		throw runtime_error(fname + " is not a statistics file of a supported version");
+	}
+	if (header.numFields != m_numFields || header.numCells != m_numCells ||
+		header.numProbes != m_probeIds.size()) {
+		fclose(fp);
+		throw runtime_error("the statistics in " + fname + " do not match the grid and probes of the problem");
+	}
+
+	vector<uint64_t> count(m_count.size());
+	if (fread(&count[0], sizeof(uint64_t), count.size(), fp) != count.size() ||
+		fread(&m_acc[0], sizeof(StatsAccumulator), m_acc.size(), fp) != m_acc.size()) {
+		fclose(fp);
+		throw runtime_error("statistics file " + fname + " is truncated");
+	}
+	fclose(fp);
+
+	m_count.assign(count.begin(), count.end());
+	return true;
+}
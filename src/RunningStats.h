@@ -0,0 +1,135 @@
+/*  Copyright 2013 Alexis Herault, Giuseppe Bilotta, Robert A. Dalrymple, Eugenio Rustico, Ciro Del Negro
+
+    Istituto Nazionale di Geofisica e Vulcanologia
+        Sezione di Catania, Catania, Italy
+
+    Università di Catania, Catania, Italy
+
+    Johns Hopkins University, Baltimore, MD
+
+    This file is part of GPUSPH.
+
+    GPUSPH is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GPUSPH is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GPUSPH.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _RUNNINGSTATS_H
+#define _RUNNINGSTATS_H
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+#include "particledefine.h"
+
+struct GlobalData;
+
+// fields whose running statistics are accumulated; the k-epsilon ones
+// only with KEPSVISC
+enum StatsField {
+	STATS_VELX,
+	STATS_VELY,
+	STATS_VELZ,
+	STATS_DENSITY,
+	STATS_PRESSURE,
+	STATS_TKE,
+	STATS_EPSILON,
+	STATS_MAX_FIELDS
+};
+
+// running statistics of a field in a bin, merged from the devices
+struct StatsAccumulator {
+	double	mean;
+	// sum of the squared deviations from the mean
+	double	m2;
+	double	min;
+	double	max;
+};
+
+/* Running mean, variance and extrema of the fluid fields (see StatsField),
+ * accumulated every SimParams::statsfreq iterations without dumping the particles.
+ *
+ * The samples are binned onto the cells of the grid (each fluid particle is a sample
+ * of the cell of its hash) and onto the probes, which are the testpoints: their
+ * velocity and pressure, the only fields sampled at the probes, are the SPH
+ * interpolation computed by COMPUTE_TESTPOINTS.
+ *
+ * The devices accumulate the samples with Welford's update in their own arrays:
+ * for each bin, the number of samples and, for each field, a float4 with the mean,
+ * the sum of the squared deviations from the mean, the minimum and the maximum,
+ * stored field by field (the accumulator of field f of bin b is at f*numBins + b).
+ * DUMP_STATS merges them here (with the parallel formula of Chan et al., in double
+ * precision) and resets them, so that a bin can be accumulated by different devices
+ * over time.
+ *
+ * The statistics are written when the simulation ends and at checkpoints, as
+ * STATS.vti (ImageData with a point for each cell) and STATS_probes.txt in the data
+ * directory; the checkpoints also get a binary copy, loaded when restarting.
+ * In multi-node simulations each rank writes the statistics of its own particles.
+ */
+class RunningStats {
+	const GlobalData	*gdata;
+
+	uint				m_numFields;
+	uint				m_numCells;
+
+	// ids of the testpoints (sorted) and their positions
+	std::vector<uint>		m_probeIds;
+	std::vector<double3>	m_probePos;
+
+	// number of samples of each bin (cells first, then probes) and
+	// accumulators of each bin (m_numFields for each)
+	std::vector<unsigned long>		m_count;
+	std::vector<StatsAccumulator>	m_acc;
+
+	// the devices merge their statistics concurrently
+	pthread_mutex_t			m_mutex;
+
+	void write_cells(std::string const& fname) const;
+	void write_probes(std::string const& fname) const;
+
+public:
+	// file of the statistics of the given rank in a checkpoint directory
+	static std::string fileName(std::string const& dirname, int rank);
+
+	// the probes are the testpoints among the particles in the shared host buffers
+	RunningStats(const GlobalData *_gdata);
+	~RunningStats();
+
+	inline uint numFields() const
+	{ return m_numFields; }
+
+	inline uint numCells() const
+	{ return m_numCells; }
+
+	inline uint numProbes() const
+	{ return m_probeIds.size(); }
+
+	// sorted ids of the testpoints, to find the probe of a testpoint
+	inline const uint *probeIds() const
+	{ return m_probeIds.empty() ? NULL : &m_probeIds[0]; }
+
+	// merge numBins bins accumulated by a device, starting from bin first
+	// (cells are bins 0 to numCells() - 1, probes follow), in the device layout
+	void merge(uint first, uint numBins, const uint *count, const float4 *acc);
+
+	// write the statistics in the data directory of the problem
+	void write() const;
+
+	// save the statistics in a binary file, and load them from one;
+	// load() returns false if the file does not exist
+	void save(std::string const& fname) const;
+	bool load(std::string const& fname);
+};
+
+#endif
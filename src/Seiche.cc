@@ -50,6 +50,9 @@ Seiche::Seiche(const GlobalData *_gdata) : Problem(_gdata)
 	m_simparams.dtadapt = true;
 	m_simparams.dtadaptfactor = 0.2;
 	m_simparams.buildneibsfreq = 10;
+	// rebuild the neighbor list when the particles moved more than half the skin
+	m_simparams.adaptiveneibsfreq = true;
+	m_simparams.nlexpansionfactor = 1.1;
 	m_simparams.shepardfreq = 0;
 	m_simparams.mlsfreq = 20;
 	m_simparams.visctype = SPSVISC;
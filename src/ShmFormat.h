@@ -0,0 +1,112 @@
+/*  Copyright 2013 Alexis Herault, Giuseppe Bilotta, Robert A. Dalrymple, Eugenio Rustico, Ciro Del Negro
+
+    Istituto Nazionale di Geofisica e Vulcanologia
+        Sezione di Catania, Catania, Italy
+
+    Università di Catania, Catania, Italy
+
+    Johns Hopkins University, Baltimore, MD
+
+    This file is part of GPUSPH.
+
+    GPUSPH is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GPUSPH is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GPUSPH.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _SHMFORMAT_H
+#define _SHMFORMAT_H
+
+/* Layout of the POSIX shared-memory ring buffer the ShmWriter publishes the
+ * frames in, for co-processing. This header is shared by the writer and the
+ * reader library (ShmReader), and must not depend on the rest of GPUSPH.
+ *
+ * The segment is a ShmRingHeader followed by numSlots slots of slotSize bytes,
+ * starting at slotsOffset. Frame n is written in slot n % numSlots: a slot is
+ * a ShmFrameHeader followed by the arrays of the frame, each holding numParts
+ * elements of one buffer (position, velocity, info, ...) exactly as they are in
+ * the BufferList of the writer, described by a ShmArray (the ColumnEntry of the
+ * buffer, as in the columnar output, and its offset from the start of the slot).
+ * The arrays are aligned to SHM_ALIGN bytes.
+ *
+ * The writer never waits for the readers: it overwrites the oldest slot. The seq
+ * counter of each slot is 2n+1 while frame n is being written in it, and 2n+2 once
+ * the frame is complete; the published counter of the ring is then set to n+1.
+ * A reader consumes frame n in place, checking that the seq of the slot is 2n+2
+ * both before and after using the data: if it's not, the frame was overwritten
+ * (the reader fell behind by more than numSlots frames). See ShmReader.
+ *
+ * If a frame doesn't fit in the slots, the writer marks the ring as replaced,
+ * unlinks it and creates a larger one under the same name, which readers should
+ * map again. When the writer is done, the ring is marked as closed and unlinked.
+ *
+ * All the values are in the native byte order of the machine.
+ */
+
+#include <stdint.h>
+
+#include "ColumnFormat.h"
+
+#define SHM_RING_MAGIC			"GPUSPHSM"
+#define SHM_RING_VERSION		1
+
+// alignment of the slots and of the arrays in them
+#define SHM_ALIGN				64
+// largest number of arrays in a frame
+#define SHM_MAX_ARRAYS			32
+
+enum ShmRingState {
+	SHM_RING_OPEN,
+	// the writer moved to a new segment with the same name
+	SHM_RING_REPLACED,
+	// the writer is done
+	SHM_RING_CLOSED
+};
+
+struct ShmRingHeader {
+	char				magic[8];
+	uint32_t			version;
+	uint32_t			byteOrder;	// COLUMN_BYTE_ORDER
+	// rank of the writer and number of ranks, each publishing its own ring
+	uint32_t			rank;
+	uint32_t			numRanks;
+	uint32_t			numSlots;
+	volatile uint32_t	state;		// ShmRingState
+	uint64_t			slotSize;
+	uint64_t			slotsOffset;
+	// number of frames published so far
+	volatile uint64_t	published;
+};
+
+struct ShmArray {
+	ColumnEntry			column;
+	// offset from the beginning of the slot, and size in bytes
+	uint64_t			offset;
+	uint64_t			size;
+};
+
+struct ShmFrameHeader {
+	volatile uint64_t	seq;
+	uint64_t			frame;
+	double				t;
+	uint32_t			numParts;
+	uint32_t			numArrays;
+	ShmArray			arrays[SHM_MAX_ARRAYS];
+};
+
+static inline uint64_t
+shm_align(uint64_t size)
+{
+	return (size + SHM_ALIGN - 1) & ~(uint64_t)(SHM_ALIGN - 1);
+}
+
+#endif
@@ -0,0 +1,148 @@
+/*  Copyright 2013 Alexis Herault, Giuseppe Bilotta, Robert A. Dalrymple, Eugenio Rustico, Ciro Del Negro
+
+    Istituto Nazionale di Geofisica e Vulcanologia
+        Sezione di Catania, Catania, Italy
+
+    Università di Catania, Catania, Italy
+
+    Johns Hopkins University, Baltimore, MD
+
+    This file is part of GPUSPH.
+
+    GPUSPH is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GPUSPH is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GPUSPH.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ShmReader.h"
+
+using namespace std;
+
+ShmReader::ShmReader(string const& name) :
+	m_name(name),
+	m_base(NULL),
+	m_size(0),
+	m_header(NULL)
+{
+	if (m_name.empty() || m_name[0] != '/')
+		m_name = "/" + m_name;
+	map();
+}
+
+ShmReader::~ShmReader()
+{
+	unmap();
+}
+
+void
+ShmReader::map()
+{
+	int fd = shm_open(m_name.c_str(), O_RDONLY, 0);
+	if (fd < 0)
+		throw runtime_error("cannot open shared memory segment " + m_name + ": " + strerror(errno));
+
+	struct stat st;
+	if (fstat(fd, &st) || (size_t)st.st_size < sizeof(ShmRingHeader)) {
+		close(fd);
+		throw runtime_error(m_name + " is not a GPUSPH shared memory ring");
+	}
+
+	void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	const int err = errno;
+	close(fd);
+	if (base == MAP_FAILED)
+		throw runtime_error("cannot map shared memory segment " + m_name + ": " + strerror(err));
+
+	m_base = (const char*)base;
+	m_size = st.st_size;
+	m_header = (const ShmRingHeader*)m_base;
+
+	if (memcmp(m_header->magic, SHM_RING_MAGIC, sizeof(m_header->magic)) ||
+		m_header->version != SHM_RING_VERSION) {
+		unmap();
+		throw runtime_error(m_name + " is not a GPUSPH shared memory ring of a supported version");
+	}
+	if (m_header->byteOrder != COLUMN_BYTE_ORDER || !m_header->numSlots ||
+		m_header->slotSize < sizeof(ShmFrameHeader) ||
+		m_header->slotsOffset + m_header->slotSize*m_header->numSlots > m_size) {
+		unmap();
+		throw runtime_error(m_name + " is corrupted");
+	}
+}
+
+void
+ShmReader::unmap()
+{
+	if (m_base)
+		munmap((void*)m_base, m_size);
+	m_base = NULL;
+	m_header = NULL;
+	m_size = 0;
+}
+
+void
+ShmReader::reopen()
+{
+	unmap();
+	map();
+}
+
+const ShmFrameHeader *
+ShmReader::frame(uint64_t n) const
+{
+	if (n >= published())
+		return NULL;
+
+	const ShmFrameHeader *fr = (const ShmFrameHeader*)(m_base + m_header->slotsOffset +
+		(n % m_header->numSlots)*m_header->slotSize);
+	if (fr->seq != 2*n + 2)
+		return NULL;
+	// don't read the frame before its seq
+	__sync_synchronize();
+	if (fr->numArrays > SHM_MAX_ARRAYS)
+		return NULL;
+	return fr;
+}
+
+const ShmArray *
+ShmReader::find(const ShmFrameHeader *frame, uint64_t key) const
+{
+	for (uint32_t a = 0; a < frame->numArrays; ++a) {
+		const ShmArray &arr = frame->arrays[a];
+		if (arr.column.key == key && arr.offset + arr.size <= m_header->slotSize)
+			return &arr;
+	}
+	return NULL;
+}
+
+const void *
+ShmReader::array(const ShmFrameHeader *frame, uint64_t key) const
+{
+	const ShmArray *arr = find(frame, key);
+	return arr ? (const char*)frame + arr->offset : NULL;
+}
+
+bool
+ShmReader::intact(const ShmFrameHeader *frame, uint64_t n) const
+{
+	// the data must have been read before the seq is checked again
+	__sync_synchronize();
+	return frame->seq == 2*n + 2;
+}
@@ -0,0 +1,102 @@
+/*  Copyright 2013 Alexis Herault, Giuseppe Bilotta, Robert A. Dalrymple, Eugenio Rustico, Ciro Del Negro
+
+    Istituto Nazionale di Geofisica e Vulcanologia
+        Sezione di Catania, Catania, Italy
+
+    Università di Catania, Catania, Italy
+
+    Johns Hopkins University, Baltimore, MD
+
+    This file is part of GPUSPH.
+
+    GPUSPH is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GPUSPH is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GPUSPH.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _SHMREADER_H
+#define _SHMREADER_H
+
+#include <string>
+
+#include "ShmFormat.h"
+
+/* Reader of the shared-memory ring buffer of the ShmWriter (see ShmFormat.h).
+ * Like the ColumnReader, it only depends on the standard library, so that it
+ * can be used by co-processing tools without the rest of GPUSPH.
+ *
+ * The frames are used in place, without copies: frame(n) returns the header of
+ * frame n if it's available, and array() the data of one of its buffers. Since
+ * the writer never waits, the data may be overwritten while it's being used, so
+ * a consumer should check with intact() that the frame was still there after
+ * using it, and discard its results otherwise:
+ *
+ *   ShmReader reader("/gpusph.1234");
+ *   uint64_t n = reader.published() - 1;
+ *   const ShmFrameHeader *frame = reader.frame(n);
+ *   if (frame) {
+ *     const double4 *pos = (const double4*)reader.array(frame, BUFFER_POS_GLOBAL);
+ *     ... use pos[0] to pos[frame->numParts - 1] ...
+ *     if (!reader.intact(frame, n)) ... overrun: the results are garbage ...
+ *   }
+ *
+ * When state() is SHM_RING_REPLACED, the writer moved to a larger segment, which
+ * can be mapped with reopen(). Errors are reported by throwing std::runtime_error.
+ */
+class ShmReader
+{
+	std::string				m_name;
+	const char				*m_base;
+	size_t					m_size;
+	const ShmRingHeader		*m_header;
+
+	void map();
+	void unmap();
+
+public:
+	ShmReader(std::string const& name);
+	~ShmReader();
+
+	// map the segment with our name again, e.g. after it was replaced
+	void reopen();
+
+	// number of frames published so far: frame published() - 1 is the newest
+	inline uint64_t published() const
+	{ return m_header->published; }
+
+	// oldest frame that may still be in the ring
+	inline uint64_t oldest() const
+	{
+		const uint64_t p = published();
+		return p > m_header->numSlots ? p - m_header->numSlots : 0;
+	}
+
+	inline ShmRingState state() const
+	{ return (ShmRingState)m_header->state; }
+
+	inline ShmRingHeader const& header() const
+	{ return *m_header; }
+
+	// frame n, or NULL if it was not published yet or it was overwritten
+	const ShmFrameHeader *frame(uint64_t n) const;
+
+	// data of the buffer with the given key in a frame, NULL if it's not there
+	const void *array(const ShmFrameHeader *frame, uint64_t key) const;
+
+	// description of the buffer with the given key in a frame, NULL if it's not there
+	const ShmArray *find(const ShmFrameHeader *frame, uint64_t key) const;
+
+	// is frame n still intact? To be called after using its data
+	bool intact(const ShmFrameHeader *frame, uint64_t n) const;
+};
+
+#endif
@@ -0,0 +1,209 @@
+/*  Copyright 2013 Alexis Herault, Giuseppe Bilotta, Robert A. Dalrymple, Eugenio Rustico, Ciro Del Negro
+
+    Istituto Nazionale di Geofisica e Vulcanologia
+        Sezione di Catania, Catania, Italy
+
+    Università di Catania, Catania, Italy
+
+    Johns Hopkins University, Baltimore, MD
+
+    This file is part of GPUSPH.
+
+    GPUSPH is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GPUSPH is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GPUSPH.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "ShmWriter.h"
+// describe_column
+#include "ColumnWriter.h"
+#include "GlobalData.h"
+
+using namespace std;
+
+ShmWriter::ShmWriter(const GlobalData *_gdata)
+  : Writer(_gdata),
+	m_numSlots(4),
+	m_base(NULL),
+	m_size(0),
+	m_header(NULL),
+	m_published(0)
+{
+	char *p = getenv("SHMWRITER_NAME");
+	if (p && *p) {
+		m_name = p;
+		// shm_open() names must begin with a slash
+		if (m_name[0] != '/')
+			m_name = "/" + m_name;
+	} else {
+		m_name = "/gpusph." + gdata->to_string(getpid());
+	}
+	if (gdata->mpi_nodes > 1)
+		m_name += "." + gdata->to_string(gdata->mpi_rank);
+
+	if ((p = getenv("SHMWRITER_FRAMES"))) {
+		m_numSlots = atoi(p);
+		if (m_numSlots < 1)
+			throw runtime_error(string("SHMWRITER_FRAMES must be a positive number: ") + p);
+	}
+
+	// let the co-processing tools find the segment
+	ofstream namefile;
+	open_data_file(namefile, "SHM", "", ".txt");
+	namefile << m_name << endl;
+	namefile.close();
+
+	printf("ShmWriter: publishing the last %u frames in %s\n", m_numSlots, m_name.c_str());
+}
+
+ShmWriter::~ShmWriter()
+{
+	release(SHM_RING_CLOSED);
+}
+
+void
+ShmWriter::release(ShmRingState state)
+{
+	if (!m_base)
+		return;
+
+	m_header->state = state;
+	__sync_synchronize();
+	munmap(m_base, m_size);
+	// readers that mapped the segment keep it until they unmap it
+	shm_unlink(m_name.c_str());
+
+	m_base = NULL;
+	m_header = NULL;
+	m_size = 0;
+}
+
+void
+ShmWriter::create(uint64_t slotSize)
+{
+	release(SHM_RING_REPLACED);
+
+	const uint64_t slotsOffset = shm_align(sizeof(ShmRingHeader));
+	const size_t size = slotsOffset + slotSize*m_numSlots;
+
+	// a segment left behind by a crashed run with the same name
+	shm_unlink(m_name.c_str());
+	int fd = shm_open(m_name.c_str(), O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd < 0)
+		throw runtime_error("cannot create shared memory segment " + m_name + ": " + strerror(errno));
+
+	if (ftruncate(fd, size)) {
+		const int err = errno;
+		close(fd);
+		shm_unlink(m_name.c_str());
+		throw runtime_error("cannot allocate shared memory segment " + m_name + ": " + strerror(err));
+	}
+
+	void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	const int err = errno;
+	close(fd);
+	if (base == MAP_FAILED) {
+		shm_unlink(m_name.c_str());
+		throw runtime_error("cannot map shared memory segment " + m_name + ": " + strerror(err));
+	}
+
+	m_base = (char*)base;
+	m_size = size;
+	m_header = (ShmRingHeader*)m_base;
+
+	// the pages of a new segment are zeroed: all the slots have seq 0 (empty)
+	memcpy(m_header->magic, SHM_RING_MAGIC, sizeof(m_header->magic));
+	m_header->version = SHM_RING_VERSION;
+	m_header->byteOrder = COLUMN_BYTE_ORDER;
+	m_header->rank = gdata->mpi_rank;
+	m_header->numRanks = gdata->mpi_nodes;
+	m_header->numSlots = m_numSlots;
+	m_header->slotSize = slotSize;
+	m_header->slotsOffset = slotsOffset;
+	m_header->published = m_published;
+	__sync_synchronize();
+	m_header->state = SHM_RING_OPEN;
+}
+
+void
+ShmWriter::write(uint numParts, BufferList const& buffers, uint node_offset, float t, const bool testpoints)
+{
+	// size of the frame, as laid out in the slot
+	uint64_t frameSize = shm_align(sizeof(ShmFrameHeader));
+	uint numArrays = 0;
+	BufferList::const_iterator iter = buffers.begin();
+	for ( ; iter != buffers.end(); ++iter) {
+		frameSize += shm_align((uint64_t)numParts*iter->second->get_element_size());
+		++numArrays;
+	}
+	if (numArrays > SHM_MAX_ARRAYS)
+		throw runtime_error("too many buffers for the ShmWriter");
+
+	if (!m_base || frameSize > m_header->slotSize) {
+		// leave room for the number of particles to grow (e.g. with open boundaries)
+		// without replacing the segment at each frame
+		uint64_t slotSize = shm_align(sizeof(ShmFrameHeader));
+		for (iter = buffers.begin(); iter != buffers.end(); ++iter) {
+			const uint64_t elsize = iter->second->get_element_size();
+			slotSize += shm_align(elsize*(numParts + numParts/4));
+		}
+		create(slotSize);
+	}
+
+	const uint64_t n = m_published;
+	ShmFrameHeader *frame = (ShmFrameHeader*)(m_base + m_header->slotsOffset +
+		(n % m_numSlots)*m_header->slotSize);
+
+	// the slot is being written: readers of the frame it held will notice the change
+	frame->seq = 2*n + 1;
+	__sync_synchronize();
+
+	frame->frame = n;
+	frame->t = t;
+	frame->numParts = numParts;
+	frame->numArrays = numArrays;
+
+	uint64_t offset = shm_align(sizeof(ShmFrameHeader));
+	uint a = 0;
+	for (iter = buffers.begin(); iter != buffers.end(); ++iter, ++a) {
+		const AbstractBuffer *buf = iter->second;
+		ShmArray &arr = frame->arrays[a];
+		memset(&arr, 0, sizeof(arr));
+		arr.column.key = iter->first;
+		strncpy(arr.column.name, buf->get_buffer_name(), COLUMN_NAME_LEN - 1);
+		arr.column.elsize = buf->get_element_size();
+		describe_column(iter->first, arr.column.elsize, arr.column);
+		arr.offset = offset;
+		arr.size = (uint64_t)numParts*arr.column.elsize;
+
+		if (arr.size)
+			memcpy((char*)frame + offset, buf->get_offset_buffer(0, node_offset), arr.size);
+		offset += shm_align(arr.size);
+	}
+
+	__sync_synchronize();
+	frame->seq = 2*n + 2;
+	__sync_synchronize();
+	m_header->published = n + 1;
+	m_published = n + 1;
+
+	m_FileCounter++;
+}
@@ -0,0 +1,71 @@
+/*  Copyright 2013 Alexis Herault, Giuseppe Bilotta, Robert A. Dalrymple, Eugenio Rustico, Ciro Del Negro
+
+    Istituto Nazionale di Geofisica e Vulcanologia
+        Sezione di Catania, Catania, Italy
+
+    Università di Catania, Catania, Italy
+
+    Johns Hopkins University, Baltimore, MD
+
+    This file is part of GPUSPH.
+
+    GPUSPH is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GPUSPH is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GPUSPH.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _SHMWRITER_H
+#define _SHMWRITER_H
+
+#include <string>
+
+#include "Writer.h"
+#include "ShmFormat.h"
+
+using namespace std;
+
+/* Writer publishing each frame in a POSIX shared-memory ring buffer, for an
+ * analysis process running beside the simulation, which maps the ring and uses
+ * the arrays in place (see ShmFormat.h for the layout, and ShmReader).
+ * The writer never waits for the readers: it overwrites the oldest frame of the
+ * ring, and the sequence counters of the slots let slow readers detect it.
+ * It is configured with the environment variables:
+ *   SHMWRITER_NAME    name of the segment (default /gpusph.<pid>); in multi-node
+ *                     simulations each rank appends .<rank> to it
+ *   SHMWRITER_FRAMES  number of frames in the ring (default 4)
+ * The name of the segment is also written to SHM.txt in the output directory.
+ */
+class ShmWriter : public Writer
+{
+	string			m_name;
+	uint			m_numSlots;
+
+	// the mapped segment
+	char			*m_base;
+	size_t			m_size;
+	ShmRingHeader	*m_header;
+	// frames published so far, also across replacements of the segment
+	uint64_t		m_published;
+
+	// (re)create the segment with slots of (at least) slotSize bytes
+	void create(uint64_t slotSize);
+	// mark the segment with the given state, unmap and unlink it
+	void release(ShmRingState state);
+
+public:
+	ShmWriter(const GlobalData *_gdata);
+	~ShmWriter();
+
+	virtual void write(uint numParts, BufferList const& buffers, uint node_offset, float t, const bool testpoints);
+};
+
+#endif
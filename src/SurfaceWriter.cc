@@ -0,0 +1,535 @@
+/*  Copyright 2013 Alexis Herault, Giuseppe Bilotta, Robert A. Dalrymple, Eugenio Rustico, Ciro Del Negro
+
+    Istituto Nazionale di Geofisica e Vulcanologia
+        Sezione di Catania, Catania, Italy
+
+    Università di Catania, Catania, Italy
+
+    Johns Hopkins University, Baltimore, MD
+
+    This file is part of GPUSPH.
+
+    GPUSPH is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GPUSPH is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GPUSPH.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <sstream>
+#include <fstream>
+#include <stdexcept>
+#include <algorithm>
+#include <limits>
+#include <climits>
+#include <cmath>
+#include <pthread.h>
+// sysconf
+#include <unistd.h>
+
+#include "SurfaceWriter.h"
+#include "GlobalData.h"
+// kernel_shape, kernel_coeff
+#include "sph_kernels.h"
+
+using namespace std;
+
+// value of the colour field on the surface
+#define SURFACE_ISO_VALUE	0.5f
+
+// number of active cells processed by a thread at a time
+#define SURFACE_CHUNK_CELLS	16
+
+/* Endianness check: (char*)&endian_int reads the first byte of the int,
+ * which is 0 on big-endian machines, and 1 in little-endian machines */
+static int endian_int=1;
+static const char* endianness[2] = { "BigEndian", "LittleEndian" };
+
+/* The corners of a cube are numbered by their offset from the first one:
+ * bit 0 is x, bit 1 is y, bit 2 is z. The six tetrahedra share the diagonal
+ * 0-7, and their other edges join corners whose offsets are one a subset of
+ * the other, so each edge goes from a lower to an upper corner.
+ */
+static const int cube_tetrahedra[6][4] = {
+	{0, 7, 1, 3},
+	{0, 7, 3, 2},
+	{0, 7, 2, 6},
+	{0, 7, 6, 4},
+	{0, 7, 4, 5},
+	{0, 7, 5, 1}
+};
+
+SurfaceWriter::SurfaceWriter(const GlobalData *_gdata) :
+	Writer(_gdata)
+{
+	m_fname_sfx = ".vtp";
+
+	m_numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (m_numThreads < 1)
+		m_numThreads = 1;
+
+	const double3 cellSize = m_problem->get_cellsize();
+	const uint3 gridSize = m_problem->get_gridsize();
+	const double deltap = m_problem->m_deltap;
+	m_subdiv = make_uint3(
+		max(1.0, ceil(cellSize.x/deltap)),
+		max(1.0, ceil(cellSize.y/deltap)),
+		max(1.0, ceil(cellSize.z/deltap)));
+	m_numPoints = make_uint3(
+		gridSize.x*m_subdiv.x + 1,
+		gridSize.y*m_subdiv.y + 1,
+		gridSize.z*m_subdiv.z + 1);
+	m_spacing = make_double3(
+		cellSize.x/m_subdiv.x,
+		cellSize.y/m_subdiv.y,
+		cellSize.z/m_subdiv.z);
+
+	string time_fname = open_data_file(m_timefile, "SURFACEinp", "", ".pvd");
+
+	if (m_timefile) {
+		m_timefile << "<?xml version='1.0'?>\n";
+		m_timefile << "<VTKFile type='Collection' version='0.1'>\n";
+		m_timefile << " <Collection>\n";
+	}
+}
+
+SurfaceWriter::~SurfaceWriter()
+{
+	mark_timefile();
+	m_timefile.close();
+}
+
+void
+SurfaceWriter::set_filter(WriterFilter const& filter)
+{
+	Writer::set_filter(filter);
+
+	// the core buffers (global position, density and info with the surface
+	// flag) are all we need, instead of all the buffers
+	if (!m_filter.fields)
+		m_filter.fields = BUFFER_INFO;
+	// the colour field only counts the fluid
+	if (!m_filter.partTypes)
+		m_filter.partTypes = 1 << PT_FLUID;
+}
+
+void
+SurfaceWriter::sort_particles(uint numParts, BufferList const& buffers, uint node_offset)
+{
+	const double4 *pos = buffers.getData<BUFFER_POS_GLOBAL>();
+	const float4 *vel = buffers.getData<BUFFER_VEL>();
+	const particleinfo *info = buffers.getData<BUFFER_INFO>();
+
+	const uint nCells = gdata->nGridCells;
+	const int3 gridSize = make_int3(gdata->gridSize.x, gdata->gridSize.y, gdata->gridSize.z);
+	const bool flagged = m_problem->get_simparams()->surfaceparticle;
+
+	// cells the surface is near to
+	vector<char> seed(nCells, 0);
+
+	// counting sort of the fluid particles by the cell of their global position
+	vector<uint> cell(numParts);
+	m_cellStart.assign(nCells + 1, 0);
+	uint numFluid = 0;
+	for (uint p = 0; p < numParts; ++p) {
+		const uint i = node_offset + p;
+		if (NOT_FLUID(info[i])) {
+			cell[p] = UINT_MAX;
+			continue;
+		}
+		cell[p] = gdata->calcGridHashHost(gdata->calcGridPosHost(pos[i].x, pos[i].y, pos[i].z));
+		m_cellStart[cell[p] + 1]++;
+		numFluid++;
+		if (flagged && SURFACE(info[i]))
+			seed[cell[p]] = 1;
+	}
+	for (uint c = 0; c < nCells; ++c)
+		m_cellStart[c + 1] += m_cellStart[c];
+
+	m_pos.resize(numFluid);
+	m_volume.resize(numFluid);
+
+	vector<uint> next(m_cellStart.begin(), m_cellStart.end() - 1);
+	for (uint p = 0; p < numParts; ++p) {
+		if (cell[p] == UINT_MAX)
+			continue;
+		const uint i = node_offset + p;
+		const uint j = next[cell[p]]++;
+		m_pos[j] = make_double3(pos[i].x, pos[i].y, pos[i].z);
+		m_volume[j] = pos[i].w/vel[i].w;
+	}
+
+	// without the surface flags, the surface is between the cells with fluid
+	// and their neighbors without (or out of the domain)
+	if (!flagged) {
+		for (uint c = 0; c < nCells; ++c) {
+			if (m_cellStart[c] == m_cellStart[c + 1])
+				continue;
+			const uint3 gp = gdata->calcGridPosFromCellHash(c);
+			for (int dz = -1; dz <= 1 && !seed[c]; ++dz)
+			for (int dy = -1; dy <= 1 && !seed[c]; ++dy)
+			for (int dx = -1; dx <= 1 && !seed[c]; ++dx) {
+				const int3 n = make_int3(gp.x + dx, gp.y + dy, gp.z + dz);
+				if (n.x < 0 || n.y < 0 || n.z < 0 ||
+					n.x >= gridSize.x || n.y >= gridSize.y || n.z >= gridSize.z) {
+					seed[c] = 1;
+					continue;
+				}
+				const uint nc = gdata->calcGridHashHost(n);
+				if (m_cellStart[nc] == m_cellStart[nc + 1])
+					seed[c] = 1;
+			}
+		}
+	}
+
+	// the seeds and the cells around them
+	vector<char> active(nCells, 0);
+	for (uint c = 0; c < nCells; ++c) {
+		if (!seed[c])
+			continue;
+		const uint3 gp = gdata->calcGridPosFromCellHash(c);
+		for (int cz = max((int)gp.z - 1, 0); cz <= min((int)gp.z + 1, gridSize.z - 1); ++cz)
+		for (int cy = max((int)gp.y - 1, 0); cy <= min((int)gp.y + 1, gridSize.y - 1); ++cy)
+		for (int cx = max((int)gp.x - 1, 0); cx <= min((int)gp.x + 1, gridSize.x - 1); ++cx)
+			active[gdata->calcGridHashHost(cx, cy, cz)] = 1;
+	}
+
+	m_activeCells.clear();
+	for (uint c = 0; c < nCells; ++c)
+		if (active[c])
+			m_activeCells.push_back(c);
+}
+
+float
+SurfaceWriter::colour(uint i, uint j, uint k) const
+{
+	const SimParams *simparams = m_problem->get_simparams();
+	const KernelType kernel = simparams->kerneltype;
+	const double slength = simparams->slength;
+	const double radius = simparams->influenceRadius;
+	const int3 gridSize = make_int3(gdata->gridSize.x, gdata->gridSize.y, gdata->gridSize.z);
+	double3 const& origin = m_problem->get_worldorigin();
+
+	const double3 x = make_double3(
+		origin.x + i*m_spacing.x,
+		origin.y + j*m_spacing.y,
+		origin.z + k*m_spacing.z);
+
+	// the points on the faces between cells belong to a single cell, so that
+	// the neighboring cubes see the same values there
+	const int3 cell = make_int3(
+		min(i/m_subdiv.x, (uint)gridSize.x - 1),
+		min(j/m_subdiv.y, (uint)gridSize.y - 1),
+		min(k/m_subdiv.z, (uint)gridSize.z - 1));
+
+	// the cells are at least as large as the influence radius
+	float sum = 0;
+	for (int cz = max(cell.z - 1, 0); cz <= min(cell.z + 1, gridSize.z - 1); ++cz)
+	for (int cy = max(cell.y - 1, 0); cy <= min(cell.y + 1, gridSize.y - 1); ++cy)
+	for (int cx = max(cell.x - 1, 0); cx <= min(cell.x + 1, gridSize.x - 1); ++cx) {
+		const uint hash = gdata->calcGridHashHost(cx, cy, cz);
+		for (uint p = m_cellStart[hash]; p < m_cellStart[hash + 1]; ++p) {
+			const double dx = x.x - m_pos[p].x;
+			const double dy = x.y - m_pos[p].y;
+			const double dz = x.z - m_pos[p].z;
+			const double r = sqrt(dx*dx + dy*dy + dz*dz);
+			if (r < radius)
+				sum += kernel_shape(kernel, r/slength)*m_volume[p];
+		}
+	}
+
+	return sum*kernel_coeff(kernel, slength);
+}
+
+// Vertex on the edge between corners a and b of a cube, one inside the
+// surface and one outside. It is interpolated from the lower corner, so that
+// all the cubes sharing the edge find the same vertex
+static inline MeshCorner
+edge_corner(int a, int b, const float *val, const uint64_t *pt, const double3 *pos)
+{
+	if ((a & b) != a)
+		swap(a, b);
+
+	MeshCorner corner;
+	corner.edge = pt[a]*8 + (a ^ b);
+	const double t = (SURFACE_ISO_VALUE - val[a])/(val[b] - val[a]);
+	corner.pos = make_float3(
+		pos[a].x + t*(pos[b].x - pos[a].x),
+		pos[a].y + t*(pos[b].y - pos[a].y),
+		pos[a].z + t*(pos[b].z - pos[a].z));
+	return corner;
+}
+
+// add a triangle with its normal along out, the direction out of the fluid
+static inline void
+add_triangle(MeshCorner const& c0, MeshCorner const& c1, MeshCorner const& c2,
+	double3 const& out, vector<MeshCorner> &corners)
+{
+	const double3 u = make_double3(c1.pos.x - c0.pos.x, c1.pos.y - c0.pos.y, c1.pos.z - c0.pos.z);
+	const double3 v = make_double3(c2.pos.x - c0.pos.x, c2.pos.y - c0.pos.y, c2.pos.z - c0.pos.z);
+	const double3 n = make_double3(u.y*v.z - u.z*v.y, u.z*v.x - u.x*v.z, u.x*v.y - u.y*v.x);
+
+	corners.push_back(c0);
+	if (n.x*out.x + n.y*out.y + n.z*out.z < 0) {
+		corners.push_back(c2);
+		corners.push_back(c1);
+	} else {
+		corners.push_back(c1);
+		corners.push_back(c2);
+	}
+}
+
+// triangles of the surface in a tetrahedron of a cube
+static void
+march_tetrahedron(const int *tet, const float *val, const uint64_t *pt, const double3 *pos,
+	vector<MeshCorner> &corners)
+{
+	int in[4], out[4];
+	int numIn = 0, numOut = 0;
+	for (int c = 0; c < 4; ++c) {
+		if (val[tet[c]] > SURFACE_ISO_VALUE)
+			in[numIn++] = tet[c];
+		else
+			out[numOut++] = tet[c];
+	}
+	if (!numIn || !numOut)
+		return;
+
+	// from the centroid of the corners inside to the centroid of those outside
+	double3 dir = make_double3(0, 0, 0);
+	for (int c = 0; c < numIn; ++c) {
+		dir.x -= pos[in[c]].x/numIn;
+		dir.y -= pos[in[c]].y/numIn;
+		dir.z -= pos[in[c]].z/numIn;
+	}
+	for (int c = 0; c < numOut; ++c) {
+		dir.x += pos[out[c]].x/numOut;
+		dir.y += pos[out[c]].y/numOut;
+		dir.z += pos[out[c]].z/numOut;
+	}
+
+	switch (numIn) {
+	case 1:
+		add_triangle(
+			edge_corner(in[0], out[0], val, pt, pos),
+			edge_corner(in[0], out[1], val, pt, pos),
+			edge_corner(in[0], out[2], val, pt, pos), dir, corners);
+		break;
+	case 3:
+		add_triangle(
+			edge_corner(out[0], in[0], val, pt, pos),
+			edge_corner(out[0], in[1], val, pt, pos),
+			edge_corner(out[0], in[2], val, pt, pos), dir, corners);
+		break;
+	case 2: {
+		// a quadrilateral, split in two triangles
+		const MeshCorner ac = edge_corner(in[0], out[0], val, pt, pos);
+		const MeshCorner ad = edge_corner(in[0], out[1], val, pt, pos);
+		const MeshCorner bd = edge_corner(in[1], out[1], val, pt, pos);
+		const MeshCorner bc = edge_corner(in[1], out[0], val, pt, pos);
+		add_triangle(ac, ad, bd, dir, corners);
+		add_triangle(ac, bd, bc, dir, corners);
+		}
+		break;
+	}
+}
+
+void
+SurfaceWriter::extract(uint from, uint to, vector<MeshCorner> &corners) const
+{
+	double3 const& origin = m_problem->get_worldorigin();
+	const uint3 s = m_subdiv;
+	const uint nx = s.x + 1, ny = s.y + 1, nz = s.z + 1;
+
+	// colour field at the points of a cell
+	vector<float> field(nx*ny*nz);
+
+	float val[8];
+	uint64_t pt[8];
+	double3 pos[8];
+
+	for (uint a = from; a < to; ++a) {
+		const uint3 cell = gdata->calcGridPosFromCellHash(m_activeCells[a]);
+		const uint i0 = cell.x*s.x, j0 = cell.y*s.y, k0 = cell.z*s.z;
+
+		for (uint k = 0; k < nz; ++k)
+		for (uint j = 0; j < ny; ++j)
+		for (uint i = 0; i < nx; ++i)
+			field[i + nx*(j + ny*k)] = colour(i0 + i, j0 + j, k0 + k);
+
+		for (uint k = 0; k < s.z; ++k)
+		for (uint j = 0; j < s.y; ++j)
+		for (uint i = 0; i < s.x; ++i) {
+			uint inside = 0;
+			for (int c = 0; c < 8; ++c) {
+				val[c] = field[(i + (c & 1)) + nx*((j + ((c >> 1) & 1)) + ny*(k + (c >> 2)))];
+				if (val[c] > SURFACE_ISO_VALUE)
+					inside |= 1 << c;
+			}
+			// the surface does not cross the cube
+			if (!inside || inside == 0xff)
+				continue;
+
+			for (int c = 0; c < 8; ++c) {
+				const uint gi = i0 + i + (c & 1);
+				const uint gj = j0 + j + ((c >> 1) & 1);
+				const uint gk = k0 + k + (c >> 2);
+				pt[c] = gi + (uint64_t)m_numPoints.x*(gj + (uint64_t)m_numPoints.y*gk);
+				pos[c] = make_double3(
+					origin.x + gi*m_spacing.x,
+					origin.y + gj*m_spacing.y,
+					origin.z + gk*m_spacing.z);
+			}
+
+			for (int t = 0; t < 6; ++t)
+				march_tetrahedron(cube_tetrahedra[t], val, pt, pos, corners);
+		}
+	}
+}
+
+// Active cells to be processed by a group of threads, each grabbing
+// the next chunk of cells until none are left
+struct SurfaceJobs {
+	const SurfaceWriter	*writer;
+	uint				numCells;
+	volatile uint		nextChunk;
+};
+
+// an extraction thread, with the triangles it found
+struct SurfaceThread {
+	SurfaceJobs			*jobs;
+	vector<MeshCorner>	corners;
+};
+
+static void *
+surface_extract_thread(void *arg)
+{
+	SurfaceThread *thread = (SurfaceThread*)arg;
+	SurfaceJobs *jobs = thread->jobs;
+
+	while (true) {
+		const uint from = __sync_fetch_and_add(&jobs->nextChunk, 1)*SURFACE_CHUNK_CELLS;
+		if (from >= jobs->numCells)
+			break;
+		jobs->writer->extract(from, min(from + SURFACE_CHUNK_CELLS, jobs->numCells),
+			thread->corners);
+	}
+
+	return NULL;
+}
+
+void
+SurfaceWriter::write(uint numParts, BufferList const& buffers, uint node_offset, float t, const bool testpoints)
+{
+	sort_particles(numParts, buffers, node_offset);
+
+	SurfaceJobs jobs;
+	jobs.writer = this;
+	jobs.numCells = m_activeCells.size();
+	jobs.nextChunk = 0;
+
+	const uint numChunks = (jobs.numCells + SURFACE_CHUNK_CELLS - 1)/SURFACE_CHUNK_CELLS;
+	const uint numThreads = max(min(m_numThreads, numChunks), 1U);
+	vector<SurfaceThread> threads(numThreads);
+	vector<pthread_t> helpers(numThreads - 1);
+	for (uint th = 0; th < numThreads; ++th)
+		threads[th].jobs = &jobs;
+	for (uint th = 1; th < numThreads; ++th)
+		if (pthread_create(&helpers[th - 1], NULL, surface_extract_thread, &threads[th]))
+			throw runtime_error("cannot create surface extraction thread");
+	surface_extract_thread(&threads[0]);
+	for (uint th = 1; th < numThreads; ++th)
+		pthread_join(helpers[th - 1], NULL);
+
+	vector<MeshCorner> &corners = threads[0].corners;
+	for (uint th = 1; th < numThreads; ++th) {
+		corners.insert(corners.end(), threads[th].corners.begin(), threads[th].corners.end());
+		vector<MeshCorner>().swap(threads[th].corners);
+	}
+
+	// the corners on the same edge are the same vertex
+	const size_t numCorners = corners.size();
+	vector< pair<uint64_t, uint> > edges(numCorners);
+	for (size_t c = 0; c < numCorners; ++c)
+		edges[c] = make_pair(corners[c].edge, (uint)c);
+	sort(edges.begin(), edges.end());
+
+	vector<float3> points;
+	vector<int> connectivity(numCorners);
+	for (size_t e = 0; e < numCorners; ++e) {
+		if (!e || edges[e].first != edges[e - 1].first)
+			points.push_back(corners[edges[e].second].pos);
+		connectivity[edges[e].second] = points.size() - 1;
+	}
+
+	const size_t numTriangles = numCorners/3;
+	vector<int> offsets(numTriangles);
+	for (size_t tr = 0; tr < numTriangles; ++tr)
+		offsets[tr] = 3*(tr + 1);
+
+	ofstream fid;
+	string filename = open_data_file(fid, "SURFACE", next_filenum());
+
+	const int pointsBytes = points.size()*sizeof(float3);
+	const int connectivityBytes = connectivity.size()*sizeof(int);
+	const int offsetsBytes = offsets.size()*sizeof(int);
+
+	fid << "<?xml version='1.0'?>" << endl;
+	fid << "<VTKFile type='PolyData'  version='0.1'  byte_order='" <<
+		endianness[*(char*)&endian_int & 1] << "'>" << endl;
+	fid << " <PolyData>" << endl;
+	fid << "  <Piece NumberOfPoints='" << points.size() << "' NumberOfVerts='0' NumberOfLines='0'"
+		<< " NumberOfStrips='0' NumberOfPolys='" << numTriangles << "'>" << endl;
+	fid << "   <Points>" << endl;
+	fid << "	<DataArray type='Float32' NumberOfComponents='3' format='appended' offset='0'/>" << endl;
+	fid << "   </Points>" << endl;
+	fid << "   <Polys>" << endl;
+	fid << "	<DataArray type='Int32' Name='connectivity' format='appended' offset='"
+		<< pointsBytes + sizeof(int) << "'/>" << endl;
+	fid << "	<DataArray type='Int32' Name='offsets' format='appended' offset='"
+		<< pointsBytes + connectivityBytes + 2*sizeof(int) << "'/>" << endl;
+	fid << "   </Polys>" << endl;
+	fid << "  </Piece>" << endl;
+	fid << " </PolyData>" << endl;
+	fid << " <AppendedData encoding='raw'>\n_";
+	fid.write((const char*)&pointsBytes, sizeof(pointsBytes));
+	if (pointsBytes)
+		fid.write((const char*)&points[0], pointsBytes);
+	fid.write((const char*)&connectivityBytes, sizeof(connectivityBytes));
+	if (connectivityBytes)
+		fid.write((const char*)&connectivity[0], connectivityBytes);
+	fid.write((const char*)&offsetsBytes, sizeof(offsetsBytes));
+	if (offsetsBytes)
+		fid.write((const char*)&offsets[0], offsetsBytes);
+	fid << " </AppendedData>" << endl;
+	fid << "</VTKFile>" << endl;
+
+	fid.close();
+
+	if (m_timefile) {
+		m_timefile << "<DataSet timestep='" << t << "' group='' part='0' "
+			<< "file='" << filename << "'/>" << endl;
+	}
+
+	mark_timefile();
+}
+
+void
+SurfaceWriter::mark_timefile()
+{
+	if (!m_timefile)
+		return;
+	// Mark the current position, close the XML, go back
+	// to the marked position
+	ofstream::pos_type mark = m_timefile.tellp();
+	m_timefile << " </Collection>\n";
+	m_timefile << "</VTKFile>" << endl;
+	m_timefile.seekp(mark);
+}
@@ -0,0 +1,108 @@
+/*  Copyright 2013 Alexis Herault, Giuseppe Bilotta, Robert A. Dalrymple, Eugenio Rustico, Ciro Del Negro
+
+    Istituto Nazionale di Geofisica e Vulcanologia
+        Sezione di Catania, Catania, Italy
+
+    Università di Catania, Catania, Italy
+
+    Johns Hopkins University, Baltimore, MD
+
+    This file is part of GPUSPH.
+
+    GPUSPH is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GPUSPH is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GPUSPH.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _SURFACEWRITER_H
+#define	_SURFACEWRITER_H
+
+#include <vector>
+#include <stdint.h>
+
+#include "Writer.h"
+
+using namespace std;
+
+// a corner of a triangle of the surface: the edge of the fine grid it lies on
+// (shared by the triangles of the neighboring cubes) and its position
+struct MeshCorner {
+	uint64_t	edge;
+	float3		pos;
+};
+
+/* The SurfaceWriter extracts the free surface of the fluid and writes only its
+ * triangle mesh, as VTK PolyData (.vtp), collected in SURFACEinp.pvd.
+ *
+ * The surface is the isosurface at 1/2 of the colour field (the SPH interpolation
+ * of the fluid fraction)
+ *
+ *   c(x) = sum_j V_j W(|x - x_j|),  V_j = m_j/rho_j
+ *
+ * over the fluid particles, sampled on a fine grid which subdivides the cells of the
+ * simulation grid with a spacing close to the particle spacing (deltap), and
+ * extracted by marching tetrahedra: each cube of the fine grid is split into six
+ * tetrahedra around its diagonal, which is consistent across neighboring cubes and
+ * avoids the ambiguous cases of marching cubes, so that the mesh has no cracks.
+ * The triangles are oriented with their normal pointing out of the fluid.
+ *
+ * Only the cells near the surface are processed: the cells with particles flagged
+ * by SURFACE_PARTICLES, when surfaceparticle is enabled, or else the cells with
+ * fluid particles next to cells without fluid, and the cells around them. The cells
+ * are processed in parallel.
+ *
+ * In multi-node simulations each node extracts the surface of its own particles.
+ */
+class SurfaceWriter : public Writer
+{
+	// number of threads extracting the surface
+	uint				m_numThreads;
+
+	// the fine grid: subdivisions of each cell, number of points and spacing
+	uint3				m_subdiv;
+	uint3				m_numPoints;
+	double3				m_spacing;
+
+	// fluid particles of the current write, sorted by cell: the start of each
+	// cell in the sorted list, and the global position and volume of the
+	// sorted particles
+	vector<uint>		m_cellStart;
+	vector<double3>		m_pos;
+	vector<float>		m_volume;
+
+	// cells of the current write near the surface
+	vector<uint>		m_activeCells;
+
+	// sort the fluid particles by cell and find the cells near the surface
+	void sort_particles(uint numParts, BufferList const& buffers, uint node_offset);
+
+	// colour field at a point of the fine grid
+	float colour(uint i, uint j, uint k) const;
+
+public:
+	SurfaceWriter(const GlobalData *_gdata);
+	~SurfaceWriter();
+
+	virtual void set_filter(WriterFilter const& filter);
+
+	virtual void write(uint numParts, BufferList const& buffers, uint node_offset, float t, const bool testpoints);
+
+	// append to corners the triangles of the surface in the active cells
+	// [from, to) (public for the extraction threads)
+	void extract(uint from, uint to, vector<MeshCorner> &corners) const;
+
+	// close the XML in the timefile and seek back before the closing tags,
+	// as in VTKWriter
+	void mark_timefile();
+};
+
+#endif	/* _SURFACEWRITER_H */
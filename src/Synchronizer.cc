@@ -5,45 +5,172 @@
  *      Author: rustico
  */
 
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#else
+#include <sched.h>
+#endif
+
+// clock_gettime
+#include "timing.h"
+
 #include "Synchronizer.h"
 
+// spins before sleeping: a few microseconds, which covers most barriers of a
+// simulation step without paying for a syscall
+#define BARRIER_SPIN_COUNT 1000
+
+static inline void cpu_relax()
+{
+#if defined(__i386__) || defined(__x86_64__)
+	__builtin_ia32_pause();
+#else
+	__sync_synchronize();
+#endif
+}
+
+// sleep while *addr == val; spurious wakeups are handled by the caller
+static inline void futex_wait(volatile int *addr, int val)
+{
+#ifdef __linux__
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+#else
+	if (*addr == val)
+		sched_yield();
+#endif
+}
+
+static inline void futex_wake_all(volatile int *addr)
+{
+#ifdef __linux__
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 0x7fffffff, NULL, NULL, 0);
+#endif
+}
+
+static inline unsigned long long now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
 Synchronizer::Synchronizer(unsigned int numThreads)
 {
 	m_nThreads = numThreads;
 	m_reached = 0;
-	m_forcesUnlockOccurred = false;
-	pthread_mutex_init(&m_syncMutex, NULL);
-	pthread_cond_init(&m_syncCondition, NULL);
+	m_phase = 0;
+	m_sleeping = 0;
+	m_forcesUnlockOccurred = 0;
+
+	// spinning only makes sense if all the threads can run at the same time
+	const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	m_spinCount = (cpus > 0 && numThreads > (unsigned long)cpus) ? 0 : BARRIER_SPIN_COUNT;
+
+	m_threads = new pthread_t[numThreads];
+	m_registeredThreads = 0;
+	pthread_mutex_init(&m_registerMutex, NULL);
+	m_waitStats = new BarrierWaitStats[numThreads];
+	memset(m_waitStats, 0, numThreads*sizeof(BarrierWaitStats));
 }
 
 Synchronizer::~Synchronizer()
 {
-	pthread_mutex_destroy(&m_syncMutex);
-	pthread_cond_destroy(&m_syncCondition);
+	pthread_mutex_destroy(&m_registerMutex);
+	delete [] m_threads;
+	delete [] m_waitStats;
 }
 
-// optimized for speed: barriers are awaken only when numThreads is reached, not at any increment
+unsigned int Synchronizer::threadSlot()
+{
+	const pthread_t self = pthread_self();
+
+	unsigned int registered = m_registeredThreads;
+	for (unsigned int i = 0; i < registered; i++)
+		if (pthread_equal(m_threads[i], self))
+			return i;
+
+	// first barrier of this thread
+	pthread_mutex_lock(&m_registerMutex);
+	unsigned int slot = m_registeredThreads;
+	for (unsigned int i = registered; i < slot; i++)
+		if (pthread_equal(m_threads[i], self)) {
+			pthread_mutex_unlock(&m_registerMutex);
+			return i;
+		}
+	if (slot < m_nThreads) {
+		m_threads[slot] = self;
+		// make the thread id visible before the slot
+		__sync_synchronize();
+		m_registeredThreads = slot + 1;
+	}
+	pthread_mutex_unlock(&m_registerMutex);
+
+	return slot;
+}
+
+// Threads read the phase before arriving: it cannot change until all of them have
+// arrived. The last one resets the counter before advancing the phase, so threads
+// leaving the barrier can enter the next one right away. The others spin waiting for
+// the phase to change, and then sleep on it. Counting the sleeping threads lets the
+// last thread skip the wake-up syscall when nobody is sleeping: since both sides
+// use full memory barriers, either the sleeper sees the new phase or the waker
+// sees the sleeper.
 void Synchronizer::barrier() {
-	pthread_mutex_lock(&m_syncMutex);
-	m_reached++;
-	if (m_reached < m_nThreads && !m_forcesUnlockOccurred)
-		pthread_cond_wait(&m_syncCondition, &m_syncMutex);
-	else {
+	if (m_forcesUnlockOccurred)
+		return;
+
+	const unsigned int slot = threadSlot();
+	const int phase = m_phase;
+
+	if (__sync_add_and_fetch(&m_reached, 1) == m_nThreads) {
 		m_reached = 0;
-		pthread_cond_broadcast(&m_syncCondition);
+		__sync_fetch_and_add(&m_phase, 1);
+		if (m_sleeping)
+			futex_wake_all(&m_phase);
+		if (slot < m_nThreads)
+			m_waitStats[slot].barriers++;
+		return;
+	}
+
+	const unsigned long long start = now_ns();
+
+	unsigned int spins = 0;
+	while (m_phase == phase && !m_forcesUnlockOccurred && spins < m_spinCount) {
+		cpu_relax();
+		spins++;
+	}
+
+	if (m_phase == phase && !m_forcesUnlockOccurred) {
+		__sync_fetch_and_add(&m_sleeping, 1);
+		while (m_phase == phase && !m_forcesUnlockOccurred)
+			futex_wait(&m_phase, phase);
+		__sync_fetch_and_sub(&m_sleeping, 1);
+	}
+
+	if (slot < m_nThreads) {
+		const unsigned long long waited = now_ns() - start;
+		BarrierWaitStats &stats = m_waitStats[slot];
+		stats.barriers++;
+		stats.totalNs += waited;
+		if (waited > stats.maxNs)
+			stats.maxNs = waited;
 	}
-	pthread_mutex_unlock(&m_syncMutex);
 }
 
-// Emergency stop: broadcast signal to awake everyone and reset reached
+// Emergency stop: advance the phase to awake everyone and reset reached
 // To avoid race conditions, after calling forceUnlock the synchronizer does not work
 // (if a barrier is called again, it does not block anymore)
+// Only uses atomics and the futex syscall, so it can be called from a signal handler
 void Synchronizer::forceUnlock() {
-	pthread_mutex_lock(&m_syncMutex);
+	m_forcesUnlockOccurred = 1;
 	m_reached = 0;
-	m_forcesUnlockOccurred = true;
-	pthread_cond_broadcast(&m_syncCondition);
-	pthread_mutex_unlock(&m_syncMutex);
+	__sync_fetch_and_add(&m_phase, 1);
+	futex_wake_all(&m_phase);
 }
 
 // thread-unsafe; use only for debugging or to double check after barrier was reached
@@ -62,3 +189,29 @@ bool Synchronizer::didForceUnlockOccurr()
 {
 	return m_forcesUnlockOccurred;
 }
+
+// thread-unsafe as queryReachedThreads(): the stats of a thread are only
+// consistent while it is not in a barrier
+const BarrierWaitStats* Synchronizer::getWaitStats(unsigned int i)
+{
+	if (i >= m_registeredThreads)
+		return NULL;
+	return m_waitStats + i;
+}
+
+// print the wait statistics of all threads; if elapsed (in seconds) is given,
+// also print the fraction of it spent waiting
+void Synchronizer::printWaitStats(const char *name, double elapsed)
+{
+	for (unsigned int i = 0; i < m_registeredThreads; i++) {
+		const BarrierWaitStats &stats = m_waitStats[i];
+		const double total = stats.totalNs/1.0e9;
+		printf("%s thread %u: %lu barriers, waited %.3gs", name, i, stats.barriers, total);
+		if (elapsed > 0)
+			printf(" (%.1f%%)", 100*total/elapsed);
+		if (stats.barriers > 0)
+			printf(", mean %.3gus, max %.3gus",
+				stats.totalNs/(1.0e3*stats.barriers), stats.maxNs/1.0e3);
+		printf("\n");
+	}
+}
@@ -10,13 +10,41 @@
 
 #include <pthread.h>
 
+// Per-thread statistics about the time spent waiting in barrier()
+struct BarrierWaitStats {
+	unsigned long barriers;		// number of barriers crossed
+	unsigned long long totalNs;	// total time spent waiting, in nanoseconds
+	unsigned long long maxNs;	// longest wait
+	// pad to a cache line, each thread updates its own stats
+	char padding[64 - sizeof(unsigned long) - 2*sizeof(unsigned long long)];
+};
+
+// Sense-reversing barrier: threads spin for a while waiting for the barrier phase
+// to change, and then sleep on a futex. The last thread to reach the barrier resets
+// the counter and advances the phase, so the barrier can be reused immediately.
 class Synchronizer {
 private:
 	unsigned int m_nThreads;
-	unsigned int m_reached;
-	pthread_mutex_t m_syncMutex;
-	pthread_cond_t m_syncCondition;
-	bool m_forcesUnlockOccurred;
+	// number of threads which reached the current barrier
+	volatile unsigned int m_reached;
+	// barrier phase: advanced when the barrier opens (or is forcedly unlocked); the
+	// threads waiting in a barrier use it as their sense, and as futex word
+	volatile int m_phase;
+	// number of threads sleeping on the futex
+	volatile unsigned int m_sleeping;
+	volatile int m_forcesUnlockOccurred;
+	// number of spins before sleeping on the futex
+	unsigned int m_spinCount;
+
+	// threads using this synchronizer, in order of first use, and their stats
+	pthread_t *m_threads;
+	volatile unsigned int m_registeredThreads;
+	pthread_mutex_t m_registerMutex;
+	BarrierWaitStats *m_waitStats;
+
+	// index of the calling thread in m_threads (registering it if needed),
+	// or m_nThreads if no slot is available
+	unsigned int threadSlot();
 public:
 	Synchronizer(unsigned int numThreads);
 	~Synchronizer();
@@ -25,6 +53,11 @@ public:
 	unsigned int queryReachedThreads();
 	unsigned int getNumThreads();
 	bool didForceUnlockOccurr();
+
+	// wait statistics of the i-th thread to use the synchronizer; NULL if there is no such thread
+	const BarrierWaitStats* getWaitStats(unsigned int i);
+	// print the wait statistics of all threads
+	void printWaitStats(const char *name, double elapsed = 0);
 };
 
 #endif /* SYNCHRONIZER_H_ */
@@ -0,0 +1,148 @@
+/*  Copyright 2013 Alexis Herault, Giuseppe Bilotta, Robert A. Dalrymple, Eugenio Rustico, Ciro Del Negro
+
+    Istituto Nazionale di Geofisica e Vulcanologia
+        Sezione di Catania, Catania, Italy
+
+    Università di Catania, Catania, Italy
+
+    Johns Hopkins University, Baltimore, MD
+
+    This file is part of GPUSPH.
+
+    GPUSPH is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GPUSPH is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GPUSPH.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <pthread.h>
+#include <stdexcept>
+
+#include "TextFormatter.h"
+
+using namespace std;
+
+TextBuffer&
+TextBuffer::operator<<(const char *str)
+{
+	const size_t len = strlen(str);
+	memcpy(reserve(len), str, len);
+	m_size += len;
+	return *this;
+}
+
+void
+TextBuffer::put_unsigned(unsigned long val)
+{
+	// digits are produced backwards
+	char digits[24];
+	char *end = digits + sizeof(digits);
+	char *start = end;
+	do {
+		*--start = '0' + (val % 10);
+		val /= 10;
+	} while (val);
+
+	const size_t len = end - start;
+	memcpy(reserve(len), start, len);
+	m_size += len;
+}
+
+void
+TextBuffer::put_signed(long val)
+{
+	if (val < 0) {
+		*this << '-';
+		// no overflow for the most negative value
+		put_unsigned(0UL - (unsigned long)val);
+	} else
+		put_unsigned(val);
+}
+
+void
+TextBuffer::put_double(double val)
+{
+	// %g with the default precision is what ostream produces, and the shortest
+	// representation would not be: keep the output of the stream-based writers
+	char *dst = reserve(32);
+	const int len = snprintf(dst, 32, "%g", val);
+	m_size += len;
+}
+
+// Chunks of a round, formatted by a group of threads, each grabbing the next chunk
+// until none are left
+struct TextChunkJobs {
+	const TextChunkFormatter	*formatter;
+	TextBuffer					*chunks;
+	uint						first;
+	uint						numChunks;
+	uint						numParts;
+	volatile uint				nextChunk;
+};
+
+static void *
+text_chunk_thread(void *arg)
+{
+	TextChunkJobs *jobs = (TextChunkJobs*)arg;
+
+	while (true) {
+		const uint c = __sync_fetch_and_add(&jobs->nextChunk, 1);
+		if (c >= jobs->numChunks)
+			break;
+
+		const uint from = (jobs->first + c)*TEXT_CHUNK_PARTS;
+		const uint to = min(from + TEXT_CHUNK_PARTS, jobs->numParts);
+		jobs->chunks[c].clear();
+		jobs->formatter->format(from, to, jobs->chunks[c]);
+	}
+	return NULL;
+}
+
+void
+write_formatted(ostream &out, TextChunkFormatter const& formatter,
+	uint numParts, uint numThreads)
+{
+	const uint totChunks = (numParts + TEXT_CHUNK_PARTS - 1)/TEXT_CHUNK_PARTS;
+	if (numThreads < 1)
+		numThreads = 1;
+
+	// a few chunks per thread at a time, to limit the memory used
+	const uint roundChunks = min(4*numThreads, totChunks);
+	vector<TextBuffer> chunks(roundChunks);
+
+	TextChunkJobs jobs;
+	jobs.formatter = &formatter;
+	jobs.chunks = roundChunks ? &chunks[0] : NULL;
+	jobs.numParts = numParts;
+
+	for (uint first = 0; first < totChunks; first += roundChunks) {
+		jobs.first = first;
+		jobs.numChunks = min(roundChunks, totChunks - first);
+		jobs.nextChunk = 0;
+
+		// the calling thread works too
+		const uint helpers = min(numThreads, jobs.numChunks) - 1;
+		vector<pthread_t> threads(helpers);
+		for (uint t = 0; t < helpers; ++t)
+			if (pthread_create(&threads[t], NULL, text_chunk_thread, &jobs))
+				throw runtime_error("cannot create text formatting thread");
+		text_chunk_thread(&jobs);
+		for (uint t = 0; t < helpers; ++t)
+			pthread_join(threads[t], NULL);
+
+		for (uint c = 0; c < jobs.numChunks; ++c)
+			if (chunks[c].size())
+				out.write(chunks[c].data(), chunks[c].size());
+	}
+}
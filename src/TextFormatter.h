@@ -0,0 +1,105 @@
+/*  Copyright 2013 Alexis Herault, Giuseppe Bilotta, Robert A. Dalrymple, Eugenio Rustico, Ciro Del Negro
+
+    Istituto Nazionale di Geofisica e Vulcanologia
+        Sezione di Catania, Catania, Italy
+
+    Università di Catania, Catania, Italy
+
+    Johns Hopkins University, Baltimore, MD
+
+    This file is part of GPUSPH.
+
+    GPUSPH is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GPUSPH is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GPUSPH.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _TEXTFORMATTER_H
+#define _TEXTFORMATTER_H
+
+#include <ostream>
+#include <vector>
+// uint
+#include <sys/types.h>
+
+// particles per chunk of formatted text
+#define TEXT_CHUNK_PARTS 16384
+
+/* Text being formatted, with the same output as an ostream with the default
+ * flags and precision (integers in decimal, floating-point values as with %g),
+ * but no locale and no virtual calls per value
+ */
+class TextBuffer {
+	std::vector<char>	m_data;
+	size_t				m_size;
+
+	inline char *reserve(size_t n)
+	{
+		if (m_size + n > m_data.size())
+			m_data.resize(2*(m_size + n));
+		return &m_data[m_size];
+	}
+
+	void put_unsigned(unsigned long val);
+	void put_signed(long val);
+	void put_double(double val);
+
+public:
+	TextBuffer() : m_size(0) {}
+
+	inline void clear()
+	{ m_size = 0; }
+
+	inline const char *data() const
+	{ return m_size ? &m_data[0] : NULL; }
+
+	inline size_t size() const
+	{ return m_size; }
+
+	inline TextBuffer& operator<<(char c)
+	{ *reserve(1) = c; ++m_size; return *this; }
+
+	TextBuffer& operator<<(const char *str);
+
+	inline TextBuffer& operator<<(unsigned short val)
+	{ put_unsigned(val); return *this; }
+	inline TextBuffer& operator<<(unsigned int val)
+	{ put_unsigned(val); return *this; }
+	inline TextBuffer& operator<<(unsigned long val)
+	{ put_unsigned(val); return *this; }
+	inline TextBuffer& operator<<(short val)
+	{ put_signed(val); return *this; }
+	inline TextBuffer& operator<<(int val)
+	{ put_signed(val); return *this; }
+	inline TextBuffer& operator<<(long val)
+	{ put_signed(val); return *this; }
+	inline TextBuffer& operator<<(float val)
+	{ put_double(val); return *this; }
+	inline TextBuffer& operator<<(double val)
+	{ put_double(val); return *this; }
+};
+
+// Formats the lines of a range of particles
+class TextChunkFormatter {
+public:
+	virtual ~TextChunkFormatter() {}
+	// append the text of the particles [from, to) to out
+	virtual void format(uint from, uint to, TextBuffer &out) const = 0;
+};
+
+// format numParts particles with up to numThreads threads, each formatting
+// TEXT_CHUNK_PARTS particles at a time, and write the chunks to out in order.
+// The result does not depend on the number of threads
+void write_formatted(std::ostream &out, TextChunkFormatter const& formatter,
+	uint numParts, uint numThreads);
+
+#endif
@@ -24,17 +24,101 @@
 */
 #include <sstream>
 #include <stdexcept>
+#include <unistd.h>
 
 #include "TextWriter.h"
+#include "TextFormatter.h"
 #include "GlobalData.h"
 
 using namespace std;
 
+// One line per particle, or per testpoint
+class TextWriterFormatter : public TextChunkFormatter {
+	const Problem		*m_problem;
+	const double4		*pos;
+	const float4		*vel;
+	const particleinfo	*info;
+	const float3		*vort;
+	bool				m_testpoints;
+
+public:
+	TextWriterFormatter(const Problem *problem, BufferList const& buffers, bool testpoints) :
+		m_problem(problem),
+		pos(buffers.getData<BUFFER_POS_GLOBAL>()),
+		vel(buffers.getData<BUFFER_VEL>()),
+		info(buffers.getData<BUFFER_INFO>()),
+		vort(buffers.getData<BUFFER_VORTICITY>()),
+		m_testpoints(testpoints)
+	{}
+
+	virtual void format(uint from, uint to, TextBuffer &fid) const
+	{
+		if (m_testpoints) {
+			for (uint i = from; i < to; i++) {
+				if (TESTPOINTS(info[i])){
+					// id, type, object, position
+					fid << id(info[i]) << "\t" << type(info[i]) << "\t" << object(info[i]) << "\t";
+					fid << pos[i].x << "\t" << pos[i].y << "\t" << pos[i].z << "\t";
+
+					// velocity and pressure
+					fid << vel[i].x << "\t" << vel[i].y << "\t" << vel[i].z << "\t" << vel[i].z << "\t";
+
+					fid << '\n';
+				}
+			}
+			return;
+		}
+
+		for (uint i = from; i < to; i++) {
+			// id, type, object, position
+			fid << id(info[i]) << "\t" << type(info[i]) << "\t" << object(info[i]) << "\t";
+			fid << pos[i].x << "\t" << pos[i].y << "\t" << pos[i].z << "\t";
+
+			// velocity
+			if (FLUID(info[i]) || TESTPOINTS(info[i]))
+				fid << vel[i].x << "\t" << vel[i].y << "\t" << vel[i].z << "\t";
+			else
+				fid << "0.0\t0.0\t0.0\t";
+
+			// mass
+			fid << pos[i].w << "\t";
+
+			// density
+			if (FLUID(info[i]))
+				fid << vel[i].w << "\t";
+			else
+				fid << "0.0\t";
+
+			// pressure
+			if (FLUID(info[i]))
+				fid << m_problem->pressure(vel[i].w, object(info[i])) << "\t";
+			else if (TESTPOINTS(info[i]))
+				fid << vel[i].w << "\t";
+			else
+				fid << "0.0\t";
+
+			// vorticity
+			if (vort) {
+				if (FLUID(info[i]))
+					fid << vort[i].x << "\t" << vort[i].y << "\t" << vort[i].z << "\t";
+				else
+					fid << "0.0\t0.0\t0.0\t";
+			}
+
+			fid << '\n';
+		}
+	}
+};
+
 TextWriter::TextWriter(const GlobalData *_gdata)
   : Writer(_gdata)
 {
 	m_fname_sfx = ".txt";
 
+	m_numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (m_numThreads < 1)
+		m_numThreads = 1;
+
 	string time_fname = open_data_file(m_timefile, "time", "", ".txt");
 }
 
@@ -49,55 +133,12 @@ TextWriter::~TextWriter()
 void
 TextWriter::write(uint numParts, BufferList const& buffers, uint node_offset, float t, const bool testpoints)
 {
-	const double4 *pos = buffers.getData<BUFFER_POS_GLOBAL>();
-	const float4 *vel = buffers.getData<BUFFER_VEL>();
-	const particleinfo *info = buffers.getData<BUFFER_INFO>();
-	const float3 *vort = buffers.getData<BUFFER_VORTICITY>();
-
 	ofstream fid;
 	const string filenum = next_filenum();
 	string filename = open_data_file(fid, "PART", filenum);
 
 	// Writing datas
-	for (uint i=0; i < numParts; i++) {
-		// id, type, object, position
-		fid << id(info[i]) << "\t" << type(info[i]) << "\t" << object(info[i]) << "\t";
-		fid << pos[i].x << "\t" << pos[i].y << "\t" << pos[i].z << "\t";
-
-		// velocity
-		if (FLUID(info[i]) || TESTPOINTS(info[i]))
-			fid << vel[i].x << "\t" << vel[i].y << "\t" << vel[i].z << "\t";
-		else
-			fid << "0.0\t0.0\t0.0\t";
-
-		// mass
-		fid << pos[i].w << "\t";
-
-		// density
-		if (FLUID(info[i]))
-			fid << vel[i].w << "\t";
-		else
-			fid << "0.0\t";
-
-		// pressure
-		if (FLUID(info[i]))
-			fid << m_problem->pressure(vel[i].w, object(info[i])) << "\t";
-		else if (TESTPOINTS(info[i]))
-			fid << vel[i].w << "\t";
-		else
-			fid << "0.0\t";
-
-		// vorticity
-		if (vort) {
-			if (FLUID(info[i]))
-				fid << vort[i].x << "\t" << vort[i].y << "\t" << vort[i].z << "\t";
-			else
-				fid << "0.0\t0.0\t0.0\t";
-		}
-
-		fid << endl;
-
-	}
+	write_formatted(fid, TextWriterFormatter(m_problem, buffers, false), numParts, m_numThreads);
 
 	fid.close();
 
@@ -106,20 +147,8 @@ TextWriter::write(uint numParts, BufferList const& buffers, uint node_offset, fl
 		filename = open_data_file(fid, "PARTTESTPOINTS", filenum);
 
 		// Writing datas
-		for (uint i=0; i < numParts; i++) {
-			if (TESTPOINTS(info[i])){
-				// id, type, object, position
-				fid << id(info[i]) << "\t" << type(info[i]) << "\t" << object(info[i]) << "\t";
-				fid << pos[i].x << "\t" << pos[i].y << "\t" << pos[i].z << "\t";
-
-				// velocity and pressure
-				fid << vel[i].x << "\t" << vel[i].y << "\t" << vel[i].z << "\t" << vel[i].z << "\t";
+		write_formatted(fid, TextWriterFormatter(m_problem, buffers, true), numParts, m_numThreads);
 
-				fid << endl;
-			}
-
-
-		}
 		fid.close();
 	}
 
@@ -31,6 +31,9 @@ using namespace std;
 
 class TextWriter : public Writer
 {
+	// number of threads formatting the particles
+	uint	m_numThreads;
+
 public:
 	TextWriter(const GlobalData *_gdata);
 	~TextWriter();
@@ -0,0 +1,222 @@
+/*  Copyright 2013 Alexis Herault, Giuseppe Bilotta, Robert A. Dalrymple, Eugenio Rustico, Ciro Del Negro
+
+    Istituto Nazionale di Geofisica e Vulcanologia
+        Sezione di Catania, Catania, Italy
+
+    Università di Catania, Catania, Italy
+
+    Johns Hopkins University, Baltimore, MD
+
+    This file is part of GPUSPH.
+
+    GPUSPH is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GPUSPH is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GPUSPH.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cstring>
+#include <limits.h>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "Tracers.h"
+#include "GlobalData.h"
+#include "Problem.h"
+
+using namespace std;
+
+#define TRACERS_BYTE_ORDER	0x01020304U
+
+Tracers::Tracers(const GlobalData *_gdata, bool restarting) :
+	gdata(_gdata),
+	m_located(0),
+	m_fp(NULL)
+{
+	TracerSpec const& spec = gdata->problem->get_tracers();
+
+	m_ids = spec.ids;
+
+	if (!spec.boxMin.empty()) {
+		double3 const& wo = gdata->problem->get_worldorigin();
+		const float4 *lpos = gdata->s_hBuffers.getData<BUFFER_POS>();
+		const hashKey *hash = gdata->s_hBuffers.getData<BUFFER_HASH>();
+		const particleinfo *info = gdata->s_hBuffers.getData<BUFFER_INFO>();
+
+		for (uint i = 0; i < gdata->totParticles; ++i) {
+			if (!FLUID(info[i]))
+				continue;
+			const uint3 gridPos = gdata->calcGridPosFromCellHash(cellHashFromParticleHash(hash[i]));
+			const double3 pos = make_double3(
+				gdata->cellSize.x*(gridPos.x + 0.5) + lpos[i].x + wo.x,
+				gdata->cellSize.y*(gridPos.y + 0.5) + lpos[i].y + wo.y,
+				gdata->cellSize.z*(gridPos.z + 0.5) + lpos[i].z + wo.z);
+			for (size_t b = 0; b < spec.boxMin.size(); ++b) {
+				double3 const& bmin = spec.boxMin[b];
+				double3 const& bmax = spec.boxMax[b];
+				if (pos.x >= bmin.x && pos.x <= bmax.x &&
+					pos.y >= bmin.y && pos.y <= bmax.y &&
+					pos.z >= bmin.z && pos.z <= bmax.z) {
+					m_ids.push_back(id(info[i]));
+					break;
+				}
+			}
+		}
+	}
+
+	sort(m_ids.begin(), m_ids.end());
+	m_ids.erase(unique(m_ids.begin(), m_ids.end()), m_ids.end());
+
+	m_samples.resize(m_ids.size());
+	m_found.assign(m_ids.size(), false);
+	// the devices don't know where the tracers are yet
+	m_expected = m_ids.size();
+
+	pthread_mutex_init(&m_mutex, NULL);
+
+	if (!m_ids.empty())
+		open(restarting);
+}
+
+Tracers::~Tracers()
+{
+	if (m_fp)
+		fclose(m_fp);
+	pthread_mutex_destroy(&m_mutex);
+}
+
+void
+Tracers::open(bool restarting)
+{
+	const string dirname = gdata->problem->get_dirname() + "/data";
+	mkdir(dirname.c_str(), S_IRWXU | S_IRWXG | S_IRWXO);
+
+	m_fname = dirname + "/TRACERS";
+	if (gdata->mpi_nodes > 1)
+		m_fname += "_n" + gdata->rankString();
+	m_fname += ".bin";
+
+	TracerFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TRACERS_MAGIC, sizeof(header.magic));
+	header.version = TRACERS_VERSION;
+	header.byteOrder = TRACERS_BYTE_ORDER;
+	header.rank = gdata->mpi_rank;
+	header.numRanks = gdata->mpi_nodes;
+	header.numTracers = m_ids.size();
+
+	const off_t idsEnd = sizeof(header) + m_ids.size()*sizeof(uint32_t);
+
+	// continue the trajectories of the same tracers, dropping the records
+	// written from the time of the checkpoint we restart from
+	if (restarting && (m_fp = fopen(m_fname.c_str(), "r+b"))) {
+		TracerFileHeader old;
+		vector<uint32_t> ids(m_ids.size());
+		bool same = fread(&old, sizeof(old), 1, m_fp) == 1 &&
+			!memcmp(&old, &header, sizeof(old)) &&
+			(ids.empty() || fread(&ids[0], sizeof(uint32_t), ids.size(), m_fp) == ids.size()) &&
+			equal(ids.begin(), ids.end(), m_ids.begin());
+
+		off_t end = idsEnd;
+		TracerRecord record;
+		while (same && fread(&record, sizeof(record), 1, m_fp) == 1 && record.t < gdata->t) {
+			const off_t next = end + sizeof(record) + (off_t)record.numSamples*sizeof(TracerSample);
+			if (fseeko(m_fp, next, SEEK_SET))
+				break;
+			end = next;
+		}
+
+		if (same) {
+			fflush(m_fp);
+			if (ftruncate(fileno(m_fp), end) || fseeko(m_fp, end, SEEK_SET))
+				throw runtime_error("cannot truncate tracer file " + m_fname);
+			return;
+		}
+
+		fclose(m_fp);
+		m_fp = NULL;
+		fprintf(stderr, "WARNING: %s holds different tracers, overwriting it\n", m_fname.c_str());
+	}
+
+	m_fp = fopen(m_fname.c_str(), "wb");
+	if (!m_fp)
+		throw runtime_error("cannot create tracer file " + m_fname);
+
+	vector<uint32_t> ids(m_ids.begin(), m_ids.end());
+	if (fwrite(&header, sizeof(header), 1, m_fp) != 1 ||
+		(!ids.empty() && fwrite(&ids[0], sizeof(uint32_t), ids.size(), m_fp) != ids.size()))
+		throw runtime_error("cannot write tracer file " + m_fname);
+}
+
+void
+Tracers::merge(const uint *index, const float4 *pos, const hashKey *hash, const float4 *vel)
+{
+	double3 const& wo = gdata->problem->get_worldorigin();
+	const uint numTracers = m_ids.size();
+
+	pthread_mutex_lock(&m_mutex);
+	for (uint t = 0; t < numTracers; ++t) {
+		// not on the device, or already found on another one
+		if (index[t] == UINT_MAX || m_found[t])
+			continue;
+
+		const uint3 gridPos = gdata->calcGridPosFromCellHash(cellHashFromParticleHash(hash[t]));
+		TracerSample &sample = m_samples[t];
+		sample.pos[0] = gdata->cellSize.x*(gridPos.x + 0.5) + pos[t].x + wo.x;
+		sample.pos[1] = gdata->cellSize.y*(gridPos.y + 0.5) + pos[t].y + wo.y;
+		sample.pos[2] = gdata->cellSize.z*(gridPos.z + 0.5) + pos[t].z + wo.z;
+		sample.vel[0] = vel[t].x;
+		sample.vel[1] = vel[t].y;
+		sample.vel[2] = vel[t].z;
+		sample.tracer = t;
+
+		m_found[t] = true;
+		m_located++;
+	}
+	pthread_mutex_unlock(&m_mutex);
+}
+
+void
+Tracers::flush()
+{
+	if (fflush(m_fp))
+		throw runtime_error("cannot write tracer file " + m_fname);
+}
+
+void
+Tracers::reset()
+{
+	m_found.assign(m_ids.size(), false);
+	m_located = 0;
+}
+
+void
+Tracers::write(double t)
+{
+	TracerRecord record;
+	memset(&record, 0, sizeof(record));
+	record.t = t;
+	record.numSamples = m_located;
+
+	bool ok = fwrite(&record, sizeof(record), 1, m_fp) == 1;
+	if (m_located == m_samples.size())
+		ok = ok && (m_samples.empty() || fwrite(&m_samples[0], sizeof(TracerSample), m_samples.size(), m_fp) == m_samples.size());
+	else for (size_t s = 0; ok && s < m_samples.size(); ++s)
+		if (m_found[s])
+			ok = fwrite(&m_samples[s], sizeof(TracerSample), 1, m_fp) == 1;
+	if (!ok)
+		throw runtime_error("cannot write tracer file " + m_fname);
+
+	reset();
+}
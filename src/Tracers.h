@@ -0,0 +1,147 @@
+/*  Copyright 2013 Alexis Herault, Giuseppe Bilotta, Robert A. Dalrymple, Eugenio Rustico, Ciro Del Negro
+
+    Istituto Nazionale di Geofisica e Vulcanologia
+        Sezione di Catania, Catania, Italy
+
+    Università di Catania, Catania, Italy
+
+    Johns Hopkins University, Baltimore, MD
+
+    This file is part of GPUSPH.
+
+    GPUSPH is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GPUSPH is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GPUSPH.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _TRACERS_H
+#define _TRACERS_H
+
+#include <cstdio>
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "particledefine.h"
+// hashKey
+#include "hashkey.h"
+
+struct GlobalData;
+
+#define TRACERS_MAGIC	"GPUSPHTR"
+#define TRACERS_VERSION	1
+
+// beginning of the trajectory file, followed by the numTracers ids of the
+// tracers, sorted, and by a TracerRecord for each iteration
+struct TracerFileHeader {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	byteOrder;	// 0x01020304 in the byte order of the machine
+	uint32_t	rank;
+	uint32_t	numRanks;
+	uint32_t	numTracers;
+	uint32_t	reserved;
+};
+
+// the samples of an iteration, followed by numSamples TracerSamples
+struct TracerRecord {
+	double		t;
+	uint32_t	numSamples;
+	uint32_t	reserved;
+};
+
+struct TracerSample {
+	double		pos[3];
+	float		vel[3];
+	// index of the tracer in the sorted ids
+	uint32_t	tracer;
+};
+
+/* Trajectories of a set of tracer particles, chosen by the Problem by id or by
+ * the region they start in (see Problem::add_tracers()), sampled at every iteration.
+ *
+ * Each device keeps the index of the tracers it holds: when the particles are
+ * sorted, the indices are moved with the inverse particle index (TRACK_TRACERS),
+ * and after each iteration the positions and velocities of the tracers are
+ * gathered into a small buffer and downloaded (GATHER_TRACERS), so the cost is
+ * proportional to the number of tracers. Tracers that moved to another device
+ * (or rank) are looked for among all the particles (LOCATE_TRACERS), but only
+ * when some of them went missing.
+ *
+ * The samples are appended to data/TRACERS.bin (one per rank in multi-node
+ * simulations) in the native byte order: a TracerFileHeader, the ids and a
+ * TracerRecord with the TracerSamples of the tracers of the rank for each
+ * iteration, in the order of the ids. When restarting, the records from the
+ * time of the checkpoint on are dropped and the new ones are appended.
+ */
+class Tracers {
+	const GlobalData	*gdata;
+
+	std::vector<uint>			m_ids;
+
+	// samples of the current iteration, by tracer, and which tracers were found
+	std::vector<TracerSample>	m_samples;
+	std::vector<bool>			m_found;
+	uint						m_located;
+	// number of tracers found the last time they were located: while no
+	// tracer goes missing, there's no need to look for them
+	uint						m_expected;
+
+	std::string					m_fname;
+	FILE						*m_fp;
+
+	// the devices merge their samples concurrently
+	pthread_mutex_t				m_mutex;
+
+	void open(bool restarting);
+
+public:
+	// the tracers are the particles with the ids given by the Problem and those
+	// in its tracer regions, among the particles in the shared host buffers.
+	// When restarting, the trajectories of the previous run are continued
+	Tracers(const GlobalData *_gdata, bool restarting);
+	~Tracers();
+
+	inline uint numTracers() const
+	{ return m_ids.size(); }
+
+	// sorted ids of the tracers
+	inline const uint *ids() const
+	{ return m_ids.empty() ? NULL : &m_ids[0]; }
+
+	// tracers of this rank found in the current iteration
+	inline uint located() const
+	{ return m_located; }
+
+	inline uint expected() const
+	{ return m_expected; }
+
+	// after the tracers were looked for, the number of them found on all the ranks
+	inline void set_expected(uint expected)
+	{ m_expected = expected; }
+
+	// merge the tracers gathered by a device: index[t] is UINT_MAX for the tracers
+	// it doesn't hold, pos, hash and vel are those of the tracers it holds
+	void merge(const uint *index, const float4 *pos, const hashKey *hash, const float4 *vel);
+
+	// forget the samples of the current iteration
+	void reset();
+
+	// append the samples of the current iteration, taken at time t, and reset
+	void write(double t);
+
+	// make sure the samples written so far are in the file, e.g. at checkpoints
+	void flush();
+};
+
+#endif
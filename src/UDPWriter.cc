@@ -23,6 +23,8 @@
     along with GPUSPH.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
+#include <cstring>
 #include <sstream>
 #include <unistd.h>
 #include <iostream>
@@ -101,11 +103,11 @@ void *UDPWriter::heartbeat_thread_main(void *user_data) {
     /* set non-blocking so we can manage timing */
     fcntl(w->mHeartbeatSocketFd, F_SETFL, O_NONBLOCK);
 
-    /* Loop until application asks us to exit */
+    /* Loop until application asks us to exit, or the writer is destroyed */
     int done = 0;
     time_t last_heartbeat_received = 0;
     time_t now;
-    while(!done) {
+    while(!done && !w->mQuit) {
        struct sockaddr_in from;
        socklen_t fromlen = sizeof(from);
 
@@ -152,6 +154,7 @@ void *UDPWriter::heartbeat_thread_main(void *user_data) {
         }
         usleep(1);
     }
+    close(w->mHeartbeatSocketFd);
 
     return(NULL);
 }
@@ -161,7 +164,17 @@ void *UDPWriter::heartbeat_thread_main(void *user_data) {
         fprintf(stderr, "%s: %s\n", str, strerror(code)); \
 }
 
-UDPWriter::UDPWriter(const GlobalData *_gdata): Writer(_gdata) {
+UDPWriter::UDPWriter(const GlobalData *_gdata): Writer(_gdata),
+    mMulticast(false),
+    mDecimate(1),
+    mDecimateCells(false),
+    mQuantize(false),
+    mPendingPackets(0),
+    mSendingPackets(0),
+    mHavePending(false),
+    mDroppedFrames(0),
+    mQuit(false)
+{
     // if UDPWRITER_HOST or UDPWRITER_PORT environment variables are set,
     // use those values, otherwise defaults
     mPort = PTP_DEFAULT_SERVER_PORT;
@@ -176,14 +189,43 @@ UDPWriter::UDPWriter(const GlobalData *_gdata): Writer(_gdata) {
     if((p = getenv("UDPWRITER_PORT"))) {
         mPort = atoi(p);
     }
-    int err;
-    if ((err = pthread_create(&mHeartbeatThread, NULL, heartbeat_thread_main,
-        (void*)this))) {
-        PT_ERR_MSG("heartbeat pthread_create", err);
+
+    // level of detail
+    if((p = getenv("UDPWRITER_DECIMATE"))) {
+        if(!strcmp(p, "cell")) {
+            mDecimateCells = true;
+        } else if(atoi(p) > 1) {
+            mDecimate = atoi(p);
+        }
+    }
+    if((p = getenv("UDPWRITER_QUANTIZE"))) {
+        mQuantize = (atoi(p) != 0);
     }
+    mPacketSize = mQuantize ? sizeof(ptp_quantized_packet_t) : sizeof(ptp_packet_t);
+
+    memset(&mMulticastAddress, 0, sizeof(mMulticastAddress));
+    if((p = getenv("UDPWRITER_MULTICAST"))) {
+        mMulticastAddress.sin_family = AF_INET;
+        mMulticastAddress.sin_port = htons(PTP_DEFAULT_CLIENT_PORT);
+        if(!inet_aton(p, &mMulticastAddress.sin_addr) ||
+            !IN_MULTICAST(ntohl(mMulticastAddress.sin_addr.s_addr))) {
+            throw runtime_error(string("UDPWRITER_MULTICAST is not a multicast group: ") + p);
+        }
+        mMulticast = true;
+    }
+
     memset(&mClientAddress, 0, sizeof(mClientAddress));
     mClientAddressLen = 0;
 
+    // with multicast, clients join the group instead of sending heartbeats
+    int err;
+    if(!mMulticast) {
+        if ((err = pthread_create(&mHeartbeatThread, NULL, heartbeat_thread_main,
+            (void*)this))) {
+            PT_ERR_MSG("heartbeat pthread_create", err);
+        }
+    }
+
     if ((mSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
         perror("socket");
         pthread_exit(NULL);
@@ -193,103 +235,254 @@ UDPWriter::UDPWriter(const GlobalData *_gdata): Writer(_gdata) {
         &udp_buffer_size, (socklen_t)(sizeof(int))) == -1) {
         perror("setsockopt(SO_SNDBUF)");
     }
+
+    if(mMulticast) {
+        unsigned char ttl = 1;
+        if((p = getenv("UDPWRITER_MULTICAST_TTL"))) {
+            ttl = atoi(p);
+        }
+        if (setsockopt(mSocket, IPPROTO_IP, IP_MULTICAST_TTL,
+            &ttl, sizeof(ttl)) == -1) {
+            perror("setsockopt(IP_MULTICAST_TTL)");
+        }
+        if(mHost[0] != '\0') {
+            struct in_addr iface;
+            if(!inet_aton(mHost, &iface) ||
+                setsockopt(mSocket, IPPROTO_IP, IP_MULTICAST_IF,
+                    &iface, sizeof(iface)) == -1) {
+                perror("setsockopt(IP_MULTICAST_IF)");
+            }
+        }
+    }
+
+    pthread_mutex_init(&mSendMutex, NULL);
+    pthread_cond_init(&mSendCond, NULL);
+    if ((err = pthread_create(&mSendThread, NULL, send_thread_main,
+        (void*)this))) {
+        PT_ERR_MSG("send pthread_create", err);
+        throw runtime_error("cannot create UDPWriter send thread");
+    }
+
+    if(mDecimateCells) {
+        printf("UDPWriter: sending one particle per cell");
+    } else {
+        printf("UDPWriter: sending one particle every %u", mDecimate);
+    }
+    printf(", %s positions, to %s\n",
+        mQuantize ? "quantized" : "full",
+        mMulticast ? inet_ntoa(mMulticastAddress.sin_addr) : "the heartbeat client");
 }
 
 UDPWriter::~UDPWriter() {
+    // the frame waiting to be sent, if any, is sent before the thread quits
+    pthread_mutex_lock(&mSendMutex);
+    mQuit = true;
+    pthread_cond_signal(&mSendCond);
+    pthread_mutex_unlock(&mSendMutex);
+    pthread_join(mSendThread, NULL);
+    // the heartbeat thread sees mQuit at its next poll
+    if(!mMulticast) {
+        pthread_join(mHeartbeatThread, NULL);
+    }
+
+    pthread_cond_destroy(&mSendCond);
+    pthread_mutex_destroy(&mSendMutex);
+
+    if(mDroppedFrames) {
+        printf("UDPWriter: %u frames dropped while sending the previous ones\n",
+            mDroppedFrames);
+    }
+
     close(mSocket);
 }
 
+void *UDPWriter::send_thread_main(void *user_data) {
+    UDPWriter *w = (UDPWriter*)user_data;
+
+    while(true) {
+        pthread_mutex_lock(&w->mSendMutex);
+        while(!w->mHavePending && !w->mQuit) {
+            pthread_cond_wait(&w->mSendCond, &w->mSendMutex);
+        }
+        if(!w->mHavePending) {
+            pthread_mutex_unlock(&w->mSendMutex);
+            break;
+        }
+        // take the pending frame, leaving our old buffer to be filled
+        w->mSending.swap(w->mPending);
+        w->mSendingPackets = w->mPendingPackets;
+        w->mSendingAddress = w->mPendingAddress;
+        w->mHavePending = false;
+        pthread_mutex_unlock(&w->mSendMutex);
+
+        w->send_frame();
+    }
+
+    return(NULL);
+}
+
 void
-UDPWriter::write(uint numParts, BufferList const& buffers, uint node_offset, float t, const bool testpoints)
+UDPWriter::send_frame()
 {
-	const double4 *pos = buffers.getData<BUFFER_POS_GLOBAL>();
-	const float4 *vel = buffers.getData<BUFFER_VEL>();
-	const particleinfo *info = buffers.getData<BUFFER_INFO>();
+    struct mmsghdr msgs[UDP_BATCH_PACKETS];
+    struct iovec iovs[UDP_BATCH_PACKETS];
+
+    uint sent = 0;
+    while(sent < mSendingPackets) {
+        const uint batch = min(mSendingPackets - sent, (uint)UDP_BATCH_PACKETS);
+        memset(msgs, 0, batch*sizeof(struct mmsghdr));
+        for(uint b = 0; b < batch; b++) {
+            iovs[b].iov_base = &mSending[(size_t)(sent + b)*mPacketSize];
+            iovs[b].iov_len = mPacketSize;
+            msgs[b].msg_hdr.msg_name = &mSendingAddress;
+            msgs[b].msg_hdr.msg_namelen = sizeof(mSendingAddress);
+            msgs[b].msg_hdr.msg_iov = &iovs[b];
+            msgs[b].msg_hdr.msg_iovlen = 1;
+        }
 
-    static short is_initialized = 0;
-    static int particles_in_last_packet = 0;
-    static uint packets_sent = 0;
-    static int packets_per_time_step = 0;
-    static ptp_packet_t packet;
-
-    if(!is_initialized) {
-        particles_in_last_packet = numParts % PTP_PARTICLES_PER_PACKET;
-        double v = numParts / PTP_PARTICLES_PER_PACKET;
-        packets_per_time_step = v;
-        if(v != 0.0) {
-            packets_per_time_step++;
+        int ret = sendmmsg(mSocket, msgs, batch, 0);
+        if(ret == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            /* e.g. the client went away: drop the rest of the frame */
+            perror("sendmmsg");
+            break;
         }
+        sent += ret;
+    }
 #ifdef DEBUG
-        cout << numParts << " particles" << endl;
-        cout << PTP_PARTICLES_PER_PACKET << " particles per packet" << endl;
-        cout << particles_in_last_packet << " particles in last packet" << endl;
-        cout << packets_per_time_step << " packets_per_time_step" << endl;
+    cout << "sent " << sent << " packets" << endl;
 #endif
-        is_initialized = 1;
+}
 
-        int udp_buffer_size = sizeof(ptp_packet_t) * packets_per_time_step;
-        if (setsockopt(mSocket, SOL_SOCKET, SO_SNDBUF,
-            &udp_buffer_size, (socklen_t)(sizeof(int))) == -1) {
-            perror("setsockopt(SO_SNDBUF)");
-        }
+static inline unsigned char
+packet_version(const ptp_packet_t *)
+{ return PTP_VERSION; }
+
+static inline unsigned char
+packet_version(const ptp_quantized_packet_t *)
+{ return PTP_VERSION_QUANTIZED; }
+
+static inline void
+set_particle(ptp_particle_data_t &data, double4 const& pos, particleinfo const& info,
+    double3 const& origin, double3 const& scale)
+{
+    data.id = id(info);
+    data.particle_type = type(info);
+    memcpy(&data.position, &pos, sizeof(double4));
+}
+
+static inline unsigned short
+quantize(double x, double origin, double scale)
+{
+    const double q = (x - origin)*scale + 0.5;
+    return q <= 0 ? 0 : q >= PTP_QUANTIZED_MAX ? PTP_QUANTIZED_MAX : (unsigned short)q;
+}
 
-        // Initialize common packet data
-        packet.total_particle_count = numParts;
+static inline void
+set_particle(ptp_quantized_particle_data_t &data, double4 const& pos, particleinfo const& info,
+    double3 const& origin, double3 const& scale)
+{
+    data.id = id(info);
+    data.particle_type = type(info);
+    data.position[0] = quantize(pos.x, origin.x, scale.x);
+    data.position[1] = quantize(pos.y, origin.y, scale.y);
+    data.position[2] = quantize(pos.z, origin.z, scale.z);
+}
+
+// fill mPending with the packets of the mSelected particles, returning their number
+template<typename Packet>
+uint
+UDPWriter::fill_packets(const double4 *pos, const particleinfo *info, float t)
+{
+    const uint per_packet = sizeof(((Packet*)0)->data)/sizeof(((Packet*)0)->data[0]);
+    const uint count = mSelected.size();
+    const uint num_packets = (count + per_packet - 1)/per_packet;
+
+    double3 scale = make_double3(0.0);
+    if(mWorldSize.x > 0) scale.x = PTP_QUANTIZED_MAX/mWorldSize.x;
+    if(mWorldSize.y > 0) scale.y = PTP_QUANTIZED_MAX/mWorldSize.y;
+    if(mWorldSize.z > 0) scale.z = PTP_QUANTIZED_MAX/mWorldSize.z;
+
+    mPending.resize((size_t)num_packets*sizeof(Packet));
+    uint next = 0;
+    for(uint pi = 0; pi < num_packets; pi++) {
+        Packet &packet = ((Packet*)&mPending[0])[pi];
+
+        packet.version = packet_version(&packet);
+        packet.model_id = getpid();
+        packet.total_particle_count = count;
+        packet.particle_count = min(per_packet, count - next);
+        packet.t = t;
         packet.world_size[0] = mWorldSize.x;
         packet.world_size[1] = mWorldSize.y;
         packet.world_size[2] = mWorldSize.z;
         packet.world_origin[0] = mWorldOrigin.x;
         packet.world_origin[1] = mWorldOrigin.y;
         packet.world_origin[2] = mWorldOrigin.z;
-        packet.model_id = getpid();
-    }
-    if(mClientAddressLen == 0) {
-        return;
-    } else {
-        char str[INET6_ADDRSTRLEN];
-        if(inet_ntop(AF_INET,
-            &mClientAddress.sin_addr.s_addr,
-            str, INET6_ADDRSTRLEN) == NULL) {
-            perror("inet_ntop");
+
+        for(uint i = 0; i < packet.particle_count; i++, next++) {
+            const uint index = mSelected[next];
+            set_particle(packet.data[i], pos[index], info[index], mWorldOrigin, scale);
+        }
+        // don't send stale data in the unused part of the last packet
+        if(packet.particle_count < per_packet) {
+            memset(&packet.data[packet.particle_count], 0,
+                (per_packet - packet.particle_count)*sizeof(packet.data[0]));
         }
     }
+    return num_packets;
+}
 
-    /* set the outgoing port number */
-    mClientAddress.sin_port = htons(PTP_DEFAULT_CLIENT_PORT);
-
-    int total_particles_sent = 0;
-	for (int pi = 0; pi < packets_per_time_step; pi++) {
-        // Send time stamp
-        packet.t = t;
+void
+UDPWriter::write(uint numParts, BufferList const& buffers, uint node_offset, float t, const bool testpoints)
+{
+	const double4 *pos = buffers.getData<BUFFER_POS_GLOBAL>();
+	const particleinfo *info = buffers.getData<BUFFER_INFO>();
+	const hashKey *hash = buffers.getData<BUFFER_HASH>();
 
-        // How many particles in this packet?
-        packet.particle_count = (pi == (packets_per_time_step - 1)) ?
-            particles_in_last_packet : PTP_PARTICLES_PER_PACKET;
-
-        // Copy particle data into packet
-        for(uint i = 0; i < packet.particle_count; i++) {
-            int offset = (pi * PTP_PARTICLES_PER_PACKET) + i;
-            packet.data[i].id = offset;
-            packet.data[i].particle_type = info[offset].x;
-            memcpy(&packet.data[i].position, &pos[offset], sizeof(double4));
-            total_particles_sent++;
+    struct sockaddr_in destination;
+    if(mMulticast) {
+        destination = mMulticastAddress;
+    } else {
+        if(mClientAddressLen == 0) {
+            /* no client */
+            return;
         }
+        destination = mClientAddress;
+        /* set the outgoing port number */
+        destination.sin_port = htons(PTP_DEFAULT_CLIENT_PORT);
+    }
 
-        // Send it
-        if(sendto(mSocket, (void*)&packet, sizeof(ptp_packet_t), 0,
-            (const sockaddr*)&mClientAddress, mClientAddressLen) == -1) {
-            if(mClientAddressLen == 0) {
-                /* client went away */
-                break;
+    // select the particles to send: the particles are sorted by cell,
+    // so the first of each cell starts a new run of cell hashes
+    mSelected.clear();
+    if(mDecimateCells && hash) {
+        uint last_cell = 0;
+        for(uint i = 0; i < numParts; i++) {
+            const uint cell = cellHashFromParticleHash(hash[i]);
+            if(i == 0 || cell != last_cell) {
+                mSelected.push_back(i);
             }
-            perror("sendto");
+            last_cell = cell;
         }
-        packets_sent++;
-        //usleep(10);
-	}
-#ifdef DEBUG
-    cout << "sent " << packets_sent << " total packets, " <<
-        total_particles_sent << " particles in last packet" << endl;
-#endif
-}
+    } else {
+        for(uint i = 0; i < numParts; i += mDecimate) {
+            mSelected.push_back(i);
+        }
+    }
 
+    // compose the frame, replacing the pending one if it hasn't been sent yet
+    pthread_mutex_lock(&mSendMutex);
+    if(mHavePending) {
+        mDroppedFrames++;
+    }
+    mPendingPackets = mQuantize ?
+        fill_packets<ptp_quantized_packet_t>(pos, info, t) :
+        fill_packets<ptp_packet_t>(pos, info, t);
+    mPendingAddress = destination;
+    mHavePending = true;
+    pthread_cond_signal(&mSendCond);
+    pthread_mutex_unlock(&mSendMutex);
+}
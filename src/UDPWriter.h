@@ -32,13 +32,31 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <vector>
 
 using namespace std;
 
 /*
 UDP packet writer.
+
+The particles are sent as ptp packets to the client that sent the last heartbeat
+or, if UDPWRITER_MULTICAST is set, to a multicast group, so that any number of
+clients can subscribe to it without additional traffic from the simulation.
+It is configured with the environment variables:
+  UDPWRITER_HOST, UDPWRITER_PORT  address and port of the heartbeats; with multicast,
+                                  UDPWRITER_HOST selects the interface to send from
+  UDPWRITER_MULTICAST             multicast group to send to (e.g. 239.0.0.1)
+  UDPWRITER_MULTICAST_TTL         hops of the multicast packets (default 1: local network)
+  UDPWRITER_DECIMATE              send every Nth particle (default 1), or "cell" to send
+                                  the first particle of each cell
+  UDPWRITER_QUANTIZE              if 1, send ptp_quantized_packet_t (16-bit positions)
+The packets of a frame are sent in batches with sendmmsg() by a thread of the
+writer. If the thread is still sending when the next frame is ready, the frame
+waiting to be sent is replaced, so a slow client never blocks the simulation.
 */
 #define UDP_PACKET_SIZE 1024*32
+// packets per sendmmsg()
+#define UDP_BATCH_PACKETS 64
 class UDPWriter : public Writer
 {
 public:
@@ -74,6 +92,41 @@ protected:
     int         mHeartbeatSocketFd;
     struct sockaddr_in  mClientAddress;
     socklen_t           mClientAddressLen;
+
+    /** send to the multicast group in mMulticastAddress instead of the heartbeat client */
+    bool        mMulticast;
+    struct sockaddr_in  mMulticastAddress;
+
+    /** level of detail: every mDecimate-th particle, or the first of each cell */
+    uint        mDecimate;
+    bool        mDecimateCells;
+    bool        mQuantize;
+
+    /** indices of the particles to send */
+    vector<uint>    mSelected;
+
+    /** frame being filled by write() and waiting to be sent, and frame being sent:
+     * mPendingPackets (mSendingPackets) packets of mPacketSize bytes each */
+    size_t      mPacketSize;
+    vector<char>    mPending,
+                    mSending;
+    uint        mPendingPackets,
+                mSendingPackets;
+    struct sockaddr_in  mPendingAddress,
+                        mSendingAddress;
+    bool        mHavePending;
+    uint        mDroppedFrames;
+
+    pthread_t   mSendThread;
+    pthread_mutex_t mSendMutex;
+    pthread_cond_t  mSendCond;
+    bool        mQuit;
+
+    static void *send_thread_main(void *user_data);
+    void send_frame();
+
+    template<typename Packet>
+    uint fill_packets(const double4 *pos, const particleinfo *info, float t);
 };
 
 #endif
@@ -24,22 +24,137 @@
 */
 #include <sstream>
 #include <stdexcept>
+#include <unistd.h>
 
 #include "VTKLegacyWriter.h"
+#include "TextFormatter.h"
 #include "GlobalData.h"
 
 using namespace std;
 
 static inline void print_lookup(ofstream &fid)
 {
-	fid << "LOOKUP_TABLE default" << endl;
+	fid << "LOOKUP_TABLE default\n";
 }
 
+// The lines of one section of the file, one per particle
+class VTKLegacyFormatter : public TextChunkFormatter {
+public:
+	enum Section {
+		POINTS,
+		CELLS,
+		CELL_TYPES,
+		VELOCITY,
+		PRESSURE,
+		DENSITY,
+		MASS,
+		VORTICITY,
+		TYPE,
+		OBJECT,
+		PARTICLE_ID
+	};
+
+private:
+	const Problem		*m_problem;
+	const double4		*pos;
+	const float4		*vel;
+	const particleinfo	*info;
+	const float3		*vort;
+	Section				m_section;
+
+public:
+	VTKLegacyFormatter(const Problem *problem, BufferList const& buffers) :
+		m_problem(problem),
+		pos(buffers.getData<BUFFER_POS_GLOBAL>()),
+		vel(buffers.getData<BUFFER_VEL>()),
+		info(buffers.getData<BUFFER_INFO>()),
+		vort(buffers.getData<BUFFER_VORTICITY>()),
+		m_section(POINTS)
+	{}
+
+	inline VTKLegacyFormatter& section(Section s)
+	{ m_section = s; return *this; }
+
+	virtual void format(uint from, uint to, TextBuffer &fid) const
+	{
+		switch (m_section) {
+		case POINTS:
+			for (uint i = from; i < to; ++i)
+				fid << pos[i].x << " " << pos[i].y << " " << pos[i].z << '\n';
+			break;
+		case CELLS:
+			for (uint i = from; i < to; ++i)
+				fid << "1  " << i << '\n';
+			break;
+		case CELL_TYPES:
+			for (uint i = from; i < to; ++i)
+				fid << "1\n";
+			break;
+		case VELOCITY:
+			for (uint i = from; i < to; ++i)
+				fid << vel[i].x << " " << vel[i].y << " " << vel[i].z << '\n';
+			break;
+		case PRESSURE:
+			for (uint i = from; i < to; ++i) {
+				float value = 0.0;
+				if (TESTPOINTS(info[i]))
+					value = vel[i].w;
+				else
+					value = m_problem->pressure(vel[i].w, object(info[i]));
+
+				fid << value << '\n';
+			}
+			break;
+		case DENSITY:
+			for (uint i = from; i < to; ++i) {
+				float value = 0.0;
+				if (TESTPOINTS(info[i]))
+					// TODO FIXME: Testpoints compute pressure only
+					// In the future we would like to have a density here
+					// but this needs to be done correctly for multifluids
+					value = NAN;
+				else
+					value = vel[i].w;
+				fid << value << '\n';
+			}
+			break;
+		case MASS:
+			for (uint i = from; i < to; ++i)
+				fid << pos[i].w << '\n';
+			break;
+		case VORTICITY:
+			for (uint i = from; i < to; ++i) {
+				if (FLUID(info[i]))
+					fid << vort[i].x << " " << vort[i].y << " " << vort[i].z << '\n';
+				else
+					fid << "0.0 0.0 0.0\n";
+			}
+			break;
+		case TYPE:
+			for (uint i = from; i < to; ++i)
+				fid << type(info[i]) << '\n';
+			break;
+		case OBJECT:
+			for (uint i = from; i < to; ++i)
+				fid << object(info[i]) << '\n';
+			break;
+		case PARTICLE_ID:
+			for (uint i = from; i < to; ++i)
+				fid << id(info[i]) << '\n';
+			break;
+		}
+	}
+};
+
 VTKLegacyWriter::VTKLegacyWriter(const GlobalData *_gdata)
   : Writer(_gdata)
 {
 	m_fname_sfx = ".vtk";
 
+	m_numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (m_numThreads < 1)
+		m_numThreads = 1;
+
 	string time_fname = open_data_file(m_timefile, "VTUinp", "", ".pvd");
 
 	// Writing header of VTUinp.pvd file
@@ -60,113 +175,82 @@ VTKLegacyWriter::~VTKLegacyWriter()
 void
 VTKLegacyWriter::write(uint numParts, BufferList const& buffers, uint node_offset, float t, const bool testpoints)
 {
-	const double4 *pos = buffers.getData<BUFFER_POS_GLOBAL>();
-	const float4 *vel = buffers.getData<BUFFER_VEL>();
-	const particleinfo *info = buffers.getData<BUFFER_INFO>();
 	const float3 *vort = buffers.getData<BUFFER_VORTICITY>();
+	const particleinfo *info = buffers.getData<BUFFER_INFO>();
+
+	VTKLegacyFormatter formatter(m_problem, buffers);
 
 	ofstream fid;
 	string filename = open_data_file(fid, "PART", next_filenum());
 
 	// Header
-	fid << "# vtk DataFile Version 2.0\n" << m_dirname << endl;
-	fid << "ASCII\nDATASET UNSTRUCTURED_GRID" << endl;
+	fid << "# vtk DataFile Version 2.0\n" << m_dirname << "\n";
+	fid << "ASCII\nDATASET UNSTRUCTURED_GRID\n";
 
-	fid << "POINTS " << numParts << "double" << endl;
+	fid << "POINTS " << numParts << "double\n";
 
 	// Start with particle positions
-	for (uint i=0; i < numParts; ++i)
-		fid << pos[i].x << " " << pos[i].y << " " << pos[i].z << endl;
-	fid << endl;
+	write_formatted(fid, formatter.section(VTKLegacyFormatter::POINTS), numParts, m_numThreads);
+	fid << "\n";
 
 	// Cells = particles
-	fid << "CELLS " << numParts << " " << (2*numParts) << endl;
-	for (uint i=0; i < numParts; ++i)
-		fid << "1  " << i << endl;
-	fid << endl;
+	fid << "CELLS " << numParts << " " << (2*numParts) << "\n";
+	write_formatted(fid, formatter.section(VTKLegacyFormatter::CELLS), numParts, m_numThreads);
+	fid << "\n";
 
-	fid << "CELL_TYPES " << numParts << endl;
-	for (uint i=0; i < numParts; ++i)
-		fid << "1\n";
-	fid << endl;
+	fid << "CELL_TYPES " << numParts << "\n";
+	write_formatted(fid, formatter.section(VTKLegacyFormatter::CELL_TYPES), numParts, m_numThreads);
+	fid << "\n";
 
 	// Now, the data
-	fid << "POINT_DATA " << numParts << endl;
+	fid << "POINT_DATA " << numParts << "\n";
 
 	// Velocity
-	fid << "VECTORS Velocity float" << endl;
-	for (uint i=0; i < numParts; ++i)
-		fid << vel[i].x << " " << vel[i].y << " " << vel[i].z << endl;
-	fid << endl;
+	fid << "VECTORS Velocity float\n";
+	write_formatted(fid, formatter.section(VTKLegacyFormatter::VELOCITY), numParts, m_numThreads);
+	fid << "\n";
 
 	// Pressure
-	fid << "SCALARS Pressure float" << endl;
+	fid << "SCALARS Pressure float\n";
 	print_lookup(fid);
-	for (uint i=0; i < numParts; ++i) {
-		float value = 0.0;
-		if (TESTPOINTS(info[i]))
-			value = vel[i].w;
-		else
-			value = m_problem->pressure(vel[i].w, object(info[i]));
-
-		fid << value << endl;
-	}
-	fid << endl;
+	write_formatted(fid, formatter.section(VTKLegacyFormatter::PRESSURE), numParts, m_numThreads);
+	fid << "\n";
 
 	// Density
-	fid << "SCALARS Density float" << endl;
+	fid << "SCALARS Density float\n";
 	print_lookup(fid);
-	for (uint i=0; i < numParts; ++i) {
-		float value = 0.0;
-		if (TESTPOINTS(info[i]))
-			// TODO FIXME: Testpoints compute pressure only
-			// In the future we would like to have a density here
-			// but this needs to be done correctly for multifluids
-			value = NAN;
-		else
-			value = vel[i].w;
-		fid << value << endl;
-	}
-	fid << endl;
+	write_formatted(fid, formatter.section(VTKLegacyFormatter::DENSITY), numParts, m_numThreads);
+	fid << "\n";
 
 	// Mass
-	fid << "SCALARS Mass float" << endl;
+	fid << "SCALARS Mass float\n";
 	print_lookup(fid);
-	for (uint i=0; i < numParts; ++i)
-		fid << pos[i].w << endl;
-	fid << endl;
+	write_formatted(fid, formatter.section(VTKLegacyFormatter::MASS), numParts, m_numThreads);
+	fid << "\n";
 
 	// Vorticity
 	if (vort) {
-		fid << "VECTORS Vorticity float" << endl;
-		for (uint i=0; i < numParts; ++i) {
-			if (FLUID(info[i]))
-				fid << vort[i].x << " " << vort[i].y << " " << vort[i].z << endl;
-			else
-				fid << "0.0 0.0 0.0" << endl;
-		}
-		fid << endl;
+		fid << "VECTORS Vorticity float\n";
+		write_formatted(fid, formatter.section(VTKLegacyFormatter::VORTICITY), numParts, m_numThreads);
+		fid << "\n";
 	}
 
 	// Info
 	if (info) {
-		fid << "SCALARS Type int" << endl;
+		fid << "SCALARS Type int\n";
 		print_lookup(fid);
-		for (uint i=0; i < numParts; ++i)
-			fid << type(info[i]) << endl;
-		fid << endl;
+		write_formatted(fid, formatter.section(VTKLegacyFormatter::TYPE), numParts, m_numThreads);
+		fid << "\n";
 
-		fid << "SCALARS Object int" << endl;
+		fid << "SCALARS Object int\n";
 		print_lookup(fid);
-		for (uint i=0; i < numParts; ++i)
-			fid << object(info[i]) << endl;
-		fid << endl;
+		write_formatted(fid, formatter.section(VTKLegacyFormatter::OBJECT), numParts, m_numThreads);
+		fid << "\n";
 
-		fid << "SCALARS ParticleId int" << endl;
+		fid << "SCALARS ParticleId int\n";
 		print_lookup(fid);
-		for (uint i=0; i < numParts; ++i)
-			fid << id(info[i]) << endl;
-		fid << endl;
+		write_formatted(fid, formatter.section(VTKLegacyFormatter::PARTICLE_ID), numParts, m_numThreads);
+		fid << "\n";
 	}
 
 	fid.close();
@@ -32,6 +32,9 @@ using namespace std;
 
 class VTKLegacyWriter : public Writer
 {
+	// number of threads formatting the particles
+	uint	m_numThreads;
+
 public:
 	VTKLegacyWriter(const GlobalData *_gdata);
 	~VTKLegacyWriter();
@@ -26,6 +26,12 @@
 #include <sstream>
 #include <fstream>
 #include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <pthread.h>
+// sysconf
+#include <unistd.h>
+#include <zlib.h>
 
 #include "VTKWriter.h"
 // GlobalData is required for writing the device index. With some order
@@ -45,10 +51,19 @@ VTKWriter::VTKWriter(const GlobalData *_gdata)
 {
 	m_fname_sfx = ".vtu";
 
-	string time_fname = open_data_file(m_timefile, "VTUinp", "", ".pvd");
+	m_compression = gdata->clOptions->vtk_compression;
+	m_numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (m_numThreads < 1)
+		m_numThreads = 1;
+
+	m_partitioned = MULTI_DEVICE;
+
+	// the frames of all the ranks are collected by rank 0
+	if (!MULTI_NODE || gdata->mpi_rank == 0)
+		open_master_file(m_timefile, "VTUinp", "", ".pvd");
 
 	// Writing header of VTUinp.pvd file
-	if (m_timefile) {
+	if (m_timefile.is_open()) {
 		m_timefile << "<?xml version='1.0'?>\n";
 		m_timefile << "<VTKFile type='Collection' version='0.1'>\n";
 		m_timefile << " <Collection>\n";
@@ -71,14 +86,14 @@ static float zeroes[4];
 
 /* auxiliary functions to write data array entrypoints */
 inline void
-scalar_array(ofstream &out, const char *type, const char *name, size_t offset)
+scalar_array(ostream &out, const char *type, const char *name, size_t offset)
 {
 	out << "	<DataArray type='" << type << "' Name='" << name
 		<< "' format='appended' offset='" << offset << "'/>" << endl;
 }
 
 inline void
-vector_array(ofstream &out, const char *type, const char *name, uint dim, size_t offset)
+vector_array(ostream &out, const char *type, const char *name, uint dim, size_t offset)
 {
 	out << "	<DataArray type='" << type << "' Name='" << name
 		<< "' NumberOfComponents='" << dim
@@ -86,7 +101,7 @@ vector_array(ofstream &out, const char *type, const char *name, uint dim, size_t
 }
 
 inline void
-vector_array(ofstream &out, const char *type, uint dim, size_t offset)
+vector_array(ostream &out, const char *type, uint dim, size_t offset)
 {
 	out << "	<DataArray type='" << type
 		<< "' NumberOfComponents='" << dim
@@ -96,474 +111,811 @@ vector_array(ofstream &out, const char *type, uint dim, size_t offset)
 // Binary dump a single variable of a given type
 template<typename T>
 inline void
-write_var(ofstream &out, T const& var)
+write_var(DirectFile &out, T const& var)
 {
-	out.write(reinterpret_cast<const char *>(&var), sizeof(T));
+	out.write(&var, sizeof(T));
 }
 
 // Binary dump an array of variables of given type and size
 template<typename T>
 inline void
-write_arr(ofstream &out, T const *var, size_t len)
+write_arr(DirectFile &out, T const *var, size_t len)
 {
-	out.write(reinterpret_cast<const char *>(var), sizeof(T)*len);
+	out.write(var, sizeof(T)*len);
 }
 
+// Binary encode a single variable of a given type in a memory buffer,
+// advancing the buffer pointer
+template<typename T>
+inline void
+put_var(char * &out, T const& var)
+{
+	memcpy(out, &var, sizeof(T));
+	out += sizeof(T);
+}
 
-void
-VTKWriter::write(uint numParts, BufferList const& buffers, uint node_offset, float t, const bool testpoints)
+// Binary encode an array of variables of given type and size
+template<typename T>
+inline void
+put_arr(char * &out, T const *var, size_t len)
 {
-	const double4 *pos = buffers.getData<BUFFER_POS_GLOBAL>();
-	const hashKey *particleHash = buffers.getData<BUFFER_HASH>();
-	const float4 *vel = buffers.getData<BUFFER_VEL>();
-	const particleinfo *info = buffers.getData<BUFFER_INFO>();
-	const float3 *vort = buffers.getData<BUFFER_VORTICITY>();
-	const float4 *normals = buffers.getData<BUFFER_NORMALS>();
-	const float4 *gradGamma = buffers.getData<BUFFER_GRADGAMMA>();
-	const float *tke = buffers.getData<BUFFER_TKE>();
-	const float *eps = buffers.getData<BUFFER_EPSILON>();
-	const float *turbvisc = buffers.getData<BUFFER_TURBVISC>();
-	const float *priv = buffers.getData<BUFFER_PRIVATE>();
+	memcpy(out, var, sizeof(T)*len);
+	out += sizeof(T)*len;
+}
 
-	// CSV file for tespoints
-	string testpoints_fname = m_dirname + "/testpoints/testpoints_" + current_filenum() + ".csv";
-	ofstream testpoints_file;
-	if (gdata->problem->get_simparams()->csvtestpoints) {
-		testpoints_file.open(testpoints_fname.c_str());
-		if (!testpoints_file) {
-			stringstream ss;
-			ss << "Cannot open testpoints file " << testpoints_fname;
-			throw runtime_error(ss.str());
-		}
-		// write CSV header
-		testpoints_file << "T,ID,Pressure,Object,CellIndex,PosX,PosY,PosZ,VelX,VelY,VelZ" << endl;
+/* The appended arrays are encoded by blocks of particles, so that the encoding
+ * and the compression can be split across threads. Each array has a fill function
+ * encoding the particles [from, to) (relative to node_offset) in a memory buffer.
+ */
+
+// the data being written, for the fill functions
+struct VTKData {
+	const double4 *pos;
+	const hashKey *particleHash;
+	const float4 *vel;
+	const particleinfo *info;
+	const float3 *vort;
+	const float4 *normals;
+	const float4 *gradGamma;
+	const float *tke;
+	const float *eps;
+	const float *turbvisc;
+	const float *priv;
+	const Problem *problem;
+	uint node_offset;
+	// number of particles and global id of each device, for the device index
+	uint devices;
+	const uint *partsPerDevice;
+	dev_idx_t devIds[MAX_DEVICES_PER_NODE];
+};
+
+typedef void (*VTKFillFunc)(VTKData const& data, uint from, uint to, char *out);
+
+// where the array goes in the XML
+enum VTKSection {
+	VTK_POINT_DATA,
+	VTK_POINTS,
+	VTK_CELLS
+};
+
+struct VTKArray {
+	VTKSection	section;
+	const char	*type;
+	const char	*name;	// NULL for the points
+	uint		dim;	// 1 for scalar arrays
+	size_t		elsize;	// bytes per particle
+	VTKFillFunc	fill;
+};
+
+#define FOR_PARTS(i) for (uint i = data.node_offset + from; i < data.node_offset + to; i++)
+
+static void
+fill_pressure(VTKData const& data, uint from, uint to, char *out)
+{
+	FOR_PARTS(i) {
+		float value = 0.0;
+		if (TESTPOINTS(data.info[i]))
+			value = data.vel[i].w;
+		else
+			value = data.problem->pressure(data.vel[i].w, PART_FLUID_NUM(data.info[i]));
+		put_var(out, value);
 	}
+}
 
-	string filename;
-
-	ofstream fid;
-	filename = open_data_file(fid, "PART", next_filenum());
+static void
+fill_density(VTKData const& data, uint from, uint to, char *out)
+{
+	FOR_PARTS(i) {
+		float value = 0.0;
+		if (TESTPOINTS(data.info[i]))
+			// TODO FIXME: Testpoints compute pressure only
+			// In the future we would like to have a density here
+			// but this needs to be done correctly for multifluids
+			value = NAN;
+		else
+			value = data.vel[i].w;
+		put_var(out, value);
+	}
+}
 
-	// Header
-	//====================================================================================
-	fid << "<?xml version='1.0'?>" << endl;
-	fid << "<VTKFile type='UnstructuredGrid'  version='0.1'  byte_order='" <<
-		endianness[*(char*)&endian_int & 1] << "'>" << endl;
-	fid << " <UnstructuredGrid>" << endl;
-	fid << "  <Piece NumberOfPoints='" << numParts << "' NumberOfCells='" << numParts << "'>" << endl;
-	fid << "   <PointData Scalars='Pressure' Vectors='Velocity'>" << endl;
+static void
+fill_mass(VTKData const& data, uint from, uint to, char *out)
+{
+	FOR_PARTS(i) {
+		float value = data.pos[i].w;
+		put_var(out, value);
+	}
+}
 
-	size_t offset = 0;
+static void
+fill_gamma(VTKData const& data, uint from, uint to, char *out)
+{
+	FOR_PARTS(i) {
+		float value = data.gradGamma[i].w;
+		put_var(out, value);
+	}
+}
 
-	// pressure
-	scalar_array(fid, "Float32", "Pressure", offset);
-	offset += sizeof(float)*numParts+sizeof(int);
+static void
+fill_tke(VTKData const& data, uint from, uint to, char *out)
+{
+	put_arr(out, data.tke + data.node_offset + from, to - from);
+}
 
-	// density
-	scalar_array(fid, "Float32", "Density", offset);
-	offset += sizeof(float)*numParts+sizeof(int);
+static void
+fill_eps(VTKData const& data, uint from, uint to, char *out)
+{
+	put_arr(out, data.eps + data.node_offset + from, to - from);
+}
 
-	// mass
-	scalar_array(fid, "Float32", "Mass", offset);
-	offset += sizeof(float)*numParts+sizeof(int);
+static void
+fill_turbvisc(VTKData const& data, uint from, uint to, char *out)
+{
+	put_arr(out, data.turbvisc + data.node_offset + from, to - from);
+}
 
-	// gamma
-	if (gradGamma) {
-		scalar_array(fid, "Float32", "Gamma", offset);
-		offset += sizeof(float)*numParts+sizeof(int);
+static void
+fill_part_type(VTKData const& data, uint from, uint to, char *out)
+{
+	FOR_PARTS(i) {
+		uchar value = PART_TYPE(data.info[i]);
+		put_var(out, value);
 	}
+}
 
-	// turbulent kinetic energy
-	if (tke) {
-		scalar_array(fid, "Float32", "TKE", offset);
-		offset += sizeof(float)*numParts+sizeof(int);
+static void
+fill_part_flag(VTKData const& data, uint from, uint to, char *out)
+{
+	FOR_PARTS(i) {
+		uchar value = PART_FLAG(data.info[i]);
+		put_var(out, value);
 	}
+}
 
-	// turbulent epsilon
-	if (eps) {
-		scalar_array(fid, "Float32", "Epsilon", offset);
-		offset += sizeof(float)*numParts+sizeof(int);
+static void
+fill_fluid_num(VTKData const& data, uint from, uint to, char *out)
+{
+	FOR_PARTS(i) {
+		uchar value = PART_FLUID_NUM(data.info[i]);
+		put_var(out, value);
 	}
+}
 
-	// eddy viscosity
-	if (turbvisc) {
-		scalar_array(fid, "Float32", "Eddy viscosity", offset);
-		offset += sizeof(float)*numParts+sizeof(int);
+static void
+fill_part_obj(VTKData const& data, uint from, uint to, char *out)
+{
+	FOR_PARTS(i) {
+		uchar value = object(data.info[i]);
+		put_var(out, value);
 	}
+}
 
-	/* Fluid number is only included if there are more than 1 */
-	bool write_fluid_num = (gdata->problem->get_physparams()->numFluids > 1);
+static void
+fill_part_id(VTKData const& data, uint from, uint to, char *out)
+{
+	FOR_PARTS(i) {
+		uint value = id(data.info[i]);
+		put_var(out, value);
+	}
+}
 
-	/* Object number is only included if there are any */
-	// TODO a better way would be for GPUSPH to expose the highest
-	// object number ever associated with any particle, so that we
-	// could check that
-	bool write_part_obj = (gdata->problem->get_simparams()->numODEbodies > 0);
+// The previous way was to compute the theoretical containing cell solely according on the particle position. This, however,
+// was inconsistent with the actual particle distribution among the devices, since one particle can be physically out of the
+// containing cell until next calchash/reorder.
+// The current policy is: just list the particles according to how the global array is partitioned. In other words, we rely
+// on the particle index to understad which device downloaded the particle data.
+// To use the particle hash instead, the value would be gdata->s_hDeviceMap[ cellHashFromParticleHash(particleHash[i]) ].
+// This should be equivalent to the current "listing" approach. If for any reason (e.g. debug) one needs to write the
+// device index according to the current spatial position, it is enough to compute the particle hash from its position
+// instead of reading it from the particlehash array. Please note that this would reflect the spatial split but not the
+// actual assignments: until the next calchash is performed, one particle remains in the containing device even if it
+// it is slightly outside the domain.
+static void
+fill_device_index(VTKData const& data, uint from, uint to, char *out)
+{
+	uint d = 0, dev_end = data.partsPerDevice[0];
+	for (uint p = from; p < to; p++) {
+		while (p >= dev_end && d + 1 < data.devices)
+			dev_end += data.partsPerDevice[++d];
+		put_var(out, data.devIds[d]);
+	}
+}
 
-	// particle info
-	// TODO check the highest part type/flag/fluid/object and select the type
-	// appropriately; presently none of it is > 256, so assume UInt8 suffices
-	if (info) {
-		scalar_array(fid, "UInt8", "Part type", offset);
-		offset += sizeof(uchar)*numParts+sizeof(int);
-		// TODO don't write Part flag unless it's needed
-		scalar_array(fid, "UInt8", "Part flag", offset);
-		offset += sizeof(uchar)*numParts+sizeof(int);
-		if (write_fluid_num) {
-			scalar_array(fid, "UInt8", "Fluid number", offset);
-			offset += sizeof(uchar)*numParts+sizeof(int);
-		}
-		if (write_part_obj) {
-			scalar_array(fid, "UInt8", "Part object", offset);
-			offset += sizeof(uchar)*numParts+sizeof(int);
-		}
-		scalar_array(fid, "UInt32", "Part id", offset);
-		offset += sizeof(uint)*numParts+sizeof(int);
+// linearized cell index (NOTE: particles might be slightly off the belonging cell)
+static void
+fill_cell_index(VTKData const& data, uint from, uint to, char *out)
+{
+	FOR_PARTS(i) {
+		uint value = cellHashFromParticleHash( data.particleHash[i] );
+		put_var(out, value);
 	}
+}
 
-	// device index
-	if (MULTI_DEVICE) {
-		scalar_array(fid, dev_idx_str, "DeviceIndex", offset);
-		offset += sizeof(dev_idx_t)*numParts+sizeof(int);
+static void
+fill_velocity(VTKData const& data, uint from, uint to, char *out)
+{
+	FOR_PARTS(i) {
+		float *value = zeroes;
+		//if (FLUID(info[i]) || TESTPOINTS(info[i]))
+			value = (float*)(data.vel + i);
+		put_arr(out, value, 3);
 	}
+}
 
-	// cell index
-	scalar_array(fid, "UInt32", "CellIndex", offset);
-	offset += sizeof(uint)*numParts+sizeof(int);
+static void
+fill_grad_gamma(VTKData const& data, uint from, uint to, char *out)
+{
+	FOR_PARTS(i) {
+		float *value = (float*)(data.gradGamma + i);
+		put_arr(out, value, 3);
+	}
+}
 
-	// velocity
-	vector_array(fid, "Float32", "Velocity", 3, offset);
-	offset += sizeof(float)*3*numParts+sizeof(int);
+static void
+fill_vorticity(VTKData const& data, uint from, uint to, char *out)
+{
+	FOR_PARTS(i) {
+		float *value = zeroes;
+		if (FLUID(data.info[i])) {
+			value = (float*)(data.vort + i);
+		}
+		put_arr(out, value, 3);
+	}
+}
 
-	// gradient gamma
-	if (gradGamma) {
-		vector_array(fid, "Float32", "Gradient Gamma", 3, offset);
-		offset += sizeof(float)*3*numParts+sizeof(int);
+static void
+fill_normals(VTKData const& data, uint from, uint to, char *out)
+{
+	FOR_PARTS(i) {
+		float *value = zeroes;
+		if (FLUID(data.info[i])) {
+			value = (float*)(data.normals + i);
+		}
+		put_arr(out, value, 3);
 	}
+}
 
-	// vorticity
-	if (vort) {
-		vector_array(fid, "Float32", "Vorticity", 3, offset);
-		offset += sizeof(float)*3*numParts+sizeof(int);
+static void
+fill_criteria(VTKData const& data, uint from, uint to, char *out)
+{
+	FOR_PARTS(i) {
+		float value = 0;
+		if (FLUID(data.info[i]))
+			value = data.normals[i].w;
+		put_var(out, value);
 	}
+}
 
-	// normals
-	if (normals) {
-		vector_array(fid, "Float32", "Normals", 3, offset);
-		offset += sizeof(float)*3*numParts+sizeof(int);
+static void
+fill_private(VTKData const& data, uint from, uint to, char *out)
+{
+	put_arr(out, data.priv + data.node_offset + from, to - from);
+}
 
-		scalar_array(fid, "Float32", "Criteria", offset);
-		offset += sizeof(float)*numParts+sizeof(int);
+static void
+fill_position(VTKData const& data, uint from, uint to, char *out)
+{
+	FOR_PARTS(i) {
+		double *value = (double*)(data.pos + i);
+		put_arr(out, value, 3);
 	}
+}
 
-	// private
-	if (priv) {
-		scalar_array(fid, "Float32", "Private", offset);
-		offset += sizeof(float)*numParts+sizeof(int);
+static void
+fill_connectivity(VTKData const& data, uint from, uint to, char *out)
+{
+	for (uint i = from; i < to; i++) {
+		uint value = i;
+		put_var(out, value);
 	}
+}
 
-	fid << "   </PointData>" << endl;
+static void
+fill_offsets(VTKData const& data, uint from, uint to, char *out)
+{
+	for (uint i = from; i < to; i++) {
+		uint value = i+1;
+		put_var(out, value);
+	}
+}
 
-	// position
-	fid << "   <Points>" << endl;
-	vector_array(fid, "Float64", 3, offset);
-	offset += sizeof(double)*3*numParts+sizeof(int);
-	fid << "   </Points>" << endl;
+// types (currently all cells type=1, single vertex, the particle)
+static void
+fill_types(VTKData const& data, uint from, uint to, char *out)
+{
+	memset(out, 1, to - from);
+}
 
-	// Cells data
-	fid << "   <Cells>" << endl;
-	scalar_array(fid, "Int32", "connectivity", offset);
-	offset += sizeof(uint)*numParts+sizeof(int);
-	scalar_array(fid, "Int32", "offsets", offset);
-	offset += sizeof(uint)*numParts+sizeof(int);
-	scalar_array(fid, "UInt8", "types", offset);
-	offset += sizeof(uchar)*numParts+sizeof(int);
-	fid << "   </Cells>" << endl;
-	fid << "  </Piece>" << endl;
-
-	fid << " </UnstructuredGrid>" << endl;
-	fid << " <AppendedData encoding='raw'>\n_";
-	//====================================================================================
+#undef FOR_PARTS
+
+// number of particles in each block. The compressed blocks must all have the same
+// uncompressed size but the last one, so an array is split at multiples of this
+#define VTK_BLOCK_PARTS	32768U
+
+// A block of an appended array: its particles, and the encoded (and possibly compressed) data
+struct VTKBlock {
+	const VTKArray	*array;
+	uint			from;
+	uint			to;
+	vector<char>	out;
+};
+
+// Blocks to be encoded by a group of threads, each grabbing the next block until none are left
+struct VTKBlockJobs {
+	const VTKData	*data;
+	VTKBlock		*blocks;
+	uint			numBlocks;
+	int				compression;
+	volatile uint	nextBlock;
+	volatile bool	failed;
+};
+
+static void *
+vtk_block_thread(void *arg)
+{
+	VTKBlockJobs *jobs = (VTKBlockJobs*)arg;
+	vector<char> raw, compressed;
+
+	while (true) {
+		const uint b = __sync_fetch_and_add(&jobs->nextBlock, 1);
+		if (b >= jobs->numBlocks)
+			break;
+
+		VTKBlock &block = jobs->blocks[b];
+		const size_t rawsize = block.array->elsize*(block.to - block.from);
+
+		if (!jobs->compression) {
+			block.out.resize(rawsize);
+			if (rawsize)
+				block.array->fill(*jobs->data, block.from, block.to, &block.out[0]);
+			continue;
+		}
 
-	int numbytes=sizeof(float)*numParts;
+		raw.resize(rawsize);
+		block.array->fill(*jobs->data, block.from, block.to, &raw[0]);
 
-	// pressure
-	write_var(fid, numbytes);
-	for (uint i=node_offset; i < node_offset + numParts; i++) {
-		float value = 0.0;
-		if (TESTPOINTS(info[i]))
-			value = vel[i].w;
-		else
-			value = m_problem->pressure(vel[i].w, PART_FLUID_NUM(info[i]));
-		write_var(fid, value);
+		uLongf complen = compressBound(rawsize);
+		compressed.resize(complen);
+		if (compress2((Bytef*)&compressed[0], &complen, (const Bytef*)&raw[0], rawsize,
+				jobs->compression) != Z_OK) {
+			jobs->failed = true;
+			break;
+		}
+		block.out.assign(compressed.begin(), compressed.begin() + complen);
 	}
+	return NULL;
+}
 
-	// density
-	write_var(fid, numbytes);
-	for (uint i=node_offset; i < node_offset + numParts; i++) {
-		float value = 0.0;
-		if (TESTPOINTS(info[i]))
-			// TODO FIXME: Testpoints compute pressure only
-			// In the future we would like to have a density here
-			// but this needs to be done correctly for multifluids
-			value = NAN;
-		else
-			value = vel[i].w;
-		write_var(fid, value);
-	}
+// encode (and compress, if compression is not 0) the given blocks with up to numThreads threads.
+// The result does not depend on the number of threads
+static void
+encode_blocks(VTKData const& data, VTKBlock *blocks, uint numBlocks, int compression, uint numThreads)
+{
+	VTKBlockJobs jobs;
+	jobs.data = &data;
+	jobs.blocks = blocks;
+	jobs.numBlocks = numBlocks;
+	jobs.compression = compression;
+	jobs.nextBlock = 0;
+	jobs.failed = false;
+
+	// the calling thread works too
+	const uint helpers = min(numThreads, numBlocks) - (numBlocks ? 1 : 0);
+	vector<pthread_t> threads(helpers);
+	for (uint t = 0; t < helpers; ++t)
+		if (pthread_create(&threads[t], NULL, vtk_block_thread, &jobs))
+			throw runtime_error("cannot create VTK encoding thread");
+	vtk_block_thread(&jobs);
+	for (uint t = 0; t < helpers; ++t)
+		pthread_join(threads[t], NULL);
+
+	if (jobs.failed)
+		throw runtime_error("zlib compression of VTK data failed");
+}
 
-	// mass
-	write_var(fid, numbytes);
-	for (uint i=node_offset; i < node_offset + numParts; i++) {
-		float value = pos[i].w;
-		write_var(fid, value);
+// split an array into blocks
+static void
+add_blocks(vector<VTKBlock> &blocks, const VTKArray *array, uint numParts)
+{
+	for (uint from = 0; from < numParts; from += VTK_BLOCK_PARTS) {
+		VTKBlock block;
+		block.array = array;
+		block.from = from;
+		block.to = min(from + VTK_BLOCK_PARTS, numParts);
+		blocks.push_back(block);
 	}
+}
 
-	// gamma
-	if (gradGamma) {
-		write_var(fid, numbytes);
-		for (uint i=node_offset; i < node_offset + numParts; i++) {
-			float value = gradGamma[i].w;
-			write_var(fid, value);
-		}
+// write the header of a compressed array (number of blocks, uncompressed size of
+// the blocks and of the last partial one, compressed size of each block); blocks
+// are the blocks of the array
+static void
+write_compression_header(DirectFile &out, VTKBlock const* blocks, uint numBlocks,
+	size_t elsize, uint numParts)
+{
+	const uint blocksize = elsize*VTK_BLOCK_PARTS;
+	const uint lastsize = (elsize*numParts) % blocksize;
+	write_var(out, numBlocks);
+	write_var(out, blocksize);
+	write_var(out, lastsize);
+	for (uint b = 0; b < numBlocks; ++b) {
+		const uint compsize = blocks[b].out.size();
+		write_var(out, compsize);
 	}
+}
 
-	// turbulent kinetic energy
-	if (tke) {
-		write_var(fid, numbytes);
-		for (uint i=node_offset; i < node_offset + numParts; i++) {
-			float value = tke[i];
-			write_var(fid, value);
-		}
-	}
+// number of blocks of an array of numParts particles
+static inline uint
+num_blocks(uint numParts)
+{
+	return (numParts + VTK_BLOCK_PARTS - 1)/VTK_BLOCK_PARTS;
+}
 
-	// turbulent epsilon
-	if (eps) {
-		write_var(fid, numbytes);
-		for (uint i=0; i < numParts; i++) {
-			float value = eps[i];
-			write_var(fid, value);
-		}
-	}
+// A piece of the particles of the rank, written by its own thread
+struct VTKPiece {
+	VTKWriter				*writer;
+	VTKData					data;
+	const vector<VTKArray>	*arrays;
+	uint					numParts;
+	string					base;
+	string					filenum;
+	uint					numThreads;
+	// the file written, or the error met
+	string					filename;
+	string					error;
+};
+
+static void *
+vtk_piece_thread(void *arg)
+{
+	VTKPiece *piece = (VTKPiece*)arg;
+	try {
+		piece->filename = piece->writer->write_piece(piece->data, *piece->arrays,
+			piece->numParts, piece->base, piece->filenum, piece->numThreads);
+	} catch (exception &e) {
+		piece->error = e.what();
+	}
+	return NULL;
+}
 
-	// eddy viscosity
-	if (turbvisc) {
-		write_var(fid, numbytes);
-		for (uint i=node_offset; i < node_offset + numParts; i++) {
-			float value = turbvisc[i];
-			write_var(fid, value);
-		}
-	}
+void
+VTKWriter::write(uint numParts, BufferList const& buffers, uint node_offset, float t, const bool testpoints)
+{
+	VTKData data;
+	data.pos = buffers.getData<BUFFER_POS_GLOBAL>();
+	data.particleHash = buffers.getData<BUFFER_HASH>();
+	data.vel = buffers.getData<BUFFER_VEL>();
+	data.info = buffers.getData<BUFFER_INFO>();
+	data.vort = buffers.getData<BUFFER_VORTICITY>();
+	data.normals = buffers.getData<BUFFER_NORMALS>();
+	data.gradGamma = buffers.getData<BUFFER_GRADGAMMA>();
+	data.tke = buffers.getData<BUFFER_TKE>();
+	data.eps = buffers.getData<BUFFER_EPSILON>();
+	data.turbvisc = buffers.getData<BUFFER_TURBVISC>();
+	data.priv = buffers.getData<BUFFER_PRIVATE>();
+	data.problem = m_problem;
+	data.node_offset = node_offset;
+	data.devices = gdata->devices;
+	data.partsPerDevice = m_partsPerDevice;
+	for (uint d = 0; d < gdata->devices; d++)
+		// compute the global device ID for each device
+		data.devIds[d] = gdata->GLOBAL_DEVICE_ID(gdata->mpi_rank, d);
+
+	// CSV file for tespoints
+	if (gdata->problem->get_simparams()->csvtestpoints && data.info)
+		write_testpoints_csv(numParts, data.pos, data.particleHash, data.vel, data.info, node_offset, t);
+
+	/* Fluid number is only included if there are more than 1 */
+	bool write_fluid_num = (gdata->problem->get_physparams()->numFluids > 1);
+
+	/* Object number is only included if there are any */
+	// TODO a better way would be for GPUSPH to expose the highest
+	// object number ever associated with any particle, so that we
+	// could check that
+	bool write_part_obj = (gdata->problem->get_simparams()->numODEbodies > 0);
+
+	// the appended arrays, in order
+	vector<VTKArray> arrays;
+#define ADD_ARRAY(section, type, name, dim, elsize, fill) do { \
+		VTKArray array = { section, type, name, dim, elsize, fill }; \
+		arrays.push_back(array); \
+	} while (0)
+
+	ADD_ARRAY(VTK_POINT_DATA, "Float32", "Pressure", 1, sizeof(float), fill_pressure);
+	ADD_ARRAY(VTK_POINT_DATA, "Float32", "Density", 1, sizeof(float), fill_density);
+	ADD_ARRAY(VTK_POINT_DATA, "Float32", "Mass", 1, sizeof(float), fill_mass);
+	if (data.gradGamma)
+		ADD_ARRAY(VTK_POINT_DATA, "Float32", "Gamma", 1, sizeof(float), fill_gamma);
+	if (data.tke)
+		ADD_ARRAY(VTK_POINT_DATA, "Float32", "TKE", 1, sizeof(float), fill_tke);
+	if (data.eps)
+		ADD_ARRAY(VTK_POINT_DATA, "Float32", "Epsilon", 1, sizeof(float), fill_eps);
+	if (data.turbvisc)
+		ADD_ARRAY(VTK_POINT_DATA, "Float32", "Eddy viscosity", 1, sizeof(float), fill_turbvisc);
 
 	// particle info
-	if (info) {
-		numbytes=sizeof(uchar)*numParts;
-
-		// type
-		write_var(fid, numbytes);
-		for (uint i=node_offset; i < node_offset + numParts; i++) {
-			uchar value = PART_TYPE(info[i]);
-			if (gdata->problem->get_simparams()->csvtestpoints && value == (TESTPOINTSPART >> MAX_FLUID_BITS)) {
-				testpoints_file << t << ","
-					<< id(info[i]) << ","
-					<< vel[i].w << ","
-					<< object(info[i]) << ","
-					<< cellHashFromParticleHash( particleHash[i] ) << ","
-					<< pos[i].x << ","
-					<< pos[i].y << ","
-					<< pos[i].z << ","
-					<< vel[i].x << ","
-					<< vel[i].y << ","
-					<< vel[i].z << endl;
-			}
-			write_var(fid, value);
+	// TODO check the highest part type/flag/fluid/object and select the type
+	// appropriately; presently none of it is > 256, so assume UInt8 suffices
+	if (data.info) {
+		ADD_ARRAY(VTK_POINT_DATA, "UInt8", "Part type", 1, sizeof(uchar), fill_part_type);
+		// TODO don't write Part flag unless it's needed
+		ADD_ARRAY(VTK_POINT_DATA, "UInt8", "Part flag", 1, sizeof(uchar), fill_part_flag);
+		if (write_fluid_num)
+			ADD_ARRAY(VTK_POINT_DATA, "UInt8", "Fluid number", 1, sizeof(uchar), fill_fluid_num);
+		if (write_part_obj)
+			ADD_ARRAY(VTK_POINT_DATA, "UInt8", "Part object", 1, sizeof(uchar), fill_part_obj);
+		ADD_ARRAY(VTK_POINT_DATA, "UInt32", "Part id", 1, sizeof(uint), fill_part_id);
+	}
+
+	if (MULTI_DEVICE)
+		ADD_ARRAY(VTK_POINT_DATA, dev_idx_str, "DeviceIndex", 1, sizeof(dev_idx_t), fill_device_index);
+
+	ADD_ARRAY(VTK_POINT_DATA, "UInt32", "CellIndex", 1, sizeof(uint), fill_cell_index);
+	ADD_ARRAY(VTK_POINT_DATA, "Float32", "Velocity", 3, sizeof(float)*3, fill_velocity);
+	if (data.gradGamma)
+		ADD_ARRAY(VTK_POINT_DATA, "Float32", "Gradient Gamma", 3, sizeof(float)*3, fill_grad_gamma);
+	if (data.vort)
+		ADD_ARRAY(VTK_POINT_DATA, "Float32", "Vorticity", 3, sizeof(float)*3, fill_vorticity);
+	if (data.normals) {
+		ADD_ARRAY(VTK_POINT_DATA, "Float32", "Normals", 3, sizeof(float)*3, fill_normals);
+		ADD_ARRAY(VTK_POINT_DATA, "Float32", "Criteria", 1, sizeof(float), fill_criteria);
+	}
+	if (data.priv)
+		ADD_ARRAY(VTK_POINT_DATA, "Float32", "Private", 1, sizeof(float), fill_private);
+
+	ADD_ARRAY(VTK_POINTS, "Float64", NULL, 3, sizeof(double)*3, fill_position);
+
+	ADD_ARRAY(VTK_CELLS, "Int32", "connectivity", 1, sizeof(uint), fill_connectivity);
+	ADD_ARRAY(VTK_CELLS, "Int32", "offsets", 1, sizeof(uint), fill_offsets);
+	ADD_ARRAY(VTK_CELLS, "UInt8", "types", 1, sizeof(uchar), fill_types);
+#undef ADD_ARRAY
+
+	const string filenum = next_filenum();
+
+	// one piece per device, unless the particles of the devices are not known
+	const bool split = m_partitioned && gdata->devices > 1 && m_partsPerDevice;
+	const uint numPieces = split ? gdata->devices : 1;
+
+	vector<VTKPiece> pieces(numPieces);
+	uint offset = 0;
+	for (uint d = 0; d < numPieces; ++d) {
+		VTKPiece &piece = pieces[d];
+		piece.writer = this;
+		piece.data = data;
+		piece.arrays = &arrays;
+		piece.numParts = split ? m_partsPerDevice[d] : numParts;
+		piece.base = piece_base(d);
+		piece.filenum = filenum;
+		piece.numThreads = max(m_numThreads/numPieces, 1U);
+		if (split) {
+			piece.data.node_offset += offset;
+			piece.data.devices = 1;
+			piece.data.partsPerDevice = &piece.numParts;
+			piece.data.devIds[0] = data.devIds[d];
 		}
+		offset += piece.numParts;
+	}
+	if (offset != numParts)
+		throw runtime_error("the particles of the devices do not add up to the particles to write");
 
-		// flag
-		write_var(fid, numbytes);
-		for (uint i=node_offset; i < node_offset + numParts; i++) {
-			uchar value = PART_FLAG(info[i]);
-			write_var(fid, value);
-		}
+	// the calling thread writes the first piece
+	vector<pthread_t> threads(numPieces - 1);
+	for (uint d = 1; d < numPieces; ++d)
+		if (pthread_create(&threads[d - 1], NULL, vtk_piece_thread, &pieces[d]))
+			throw runtime_error("cannot create VTK piece thread");
+	vtk_piece_thread(&pieces[0]);
+	for (uint d = 1; d < numPieces; ++d)
+		pthread_join(threads[d - 1], NULL);
 
-		// fluid number
-		if (write_fluid_num) {
-			write_var(fid, numbytes);
-			for (uint i=node_offset; i < node_offset + numParts; i++) {
-				uchar value = PART_FLUID_NUM(info[i]);
-				write_var(fid, value);
-			}
-		}
+	for (uint d = 0; d < numPieces; ++d)
+		if (!pieces[d].error.empty())
+			throw runtime_error(pieces[d].error);
 
-		// object
-		if (write_part_obj) {
-			write_var(fid, numbytes);
-			for (uint i=node_offset; i < node_offset + numParts; i++) {
-				uchar value = object(info[i]);
-				write_var(fid, value);
-			}
-		}
+	if (!m_timefile.is_open())
+		return;
 
-		numbytes=sizeof(uint)*numParts;
+	const string filename = m_partitioned ? write_master(arrays, filenum) : pieces[0].filename;
 
-		// id
-		write_var(fid, numbytes);
-		for (uint i=node_offset; i < node_offset + numParts; i++) {
-			uint value = id(info[i]);
-			write_var(fid, value);
-		}
-	}
+	// Writing time to VTUinp.pvd file
+	m_timefile << "<DataSet timestep='" << t << "' group='' part='0' "
+		<< "file='" << filename << "'/>" << endl;
+	mark_timefile();
+}
 
-	// device index
-	if (MULTI_DEVICE) {
-		numbytes = sizeof(dev_idx_t)*numParts;
-		write_var(fid, numbytes);
-		// The previous way was to compute the theoretical containing cell solely according on the particle position. This, however,
-		// was inconsistent with the actual particle distribution among the devices, since one particle can be physically out of the
-		// containing cell until next calchash/reorder.
-		// The current policy is: just list the particles according to how the global array is partitioned. In other words, we rely
-		// on the particle index to understad which device downloaded the particle data.
-		for (uint d = 0; d < gdata->devices; d++) {
-			// compute the global device ID for each device
-			dev_idx_t value = gdata->GLOBAL_DEVICE_ID(gdata->mpi_rank, d);
-			// write one for each particle (no need for the "absolute" particle index)
-			for (uint p = 0; p < gdata->s_hPartsPerDevice[d]; p++)
-				write_var(fid, value);
-		}
-		// There two alternate policies: 1. use particle hash or 2. compute belonging device.
-		// To use the particle hash, instead of just relying on the particle index, use the following code:
-		/*
-		for (uint i=node_offset; i < node_offset + numParts; i++) {
-			uint value = gdata->s_hDeviceMap[ cellHashFromParticleHash(particleHash[i]) ];
-			write_var(fid, value);
-		}
-		*/
-		// This should be equivalent to the current "listing" approach. If for any reason (e.g. debug) one needs to write the
-		// device index according to the current spatial position, it is enough to compute the particle hash from its position
-		// instead of reading it from the particlehash array. Please note that this would reflect the spatial split but not the
-		// actual assignments: until the next calchash is performed, one particle remains in the containing device even if it
-		// it is slightly outside the domain.
-	}
+string
+VTKWriter::write_piece(VTKData const& data, vector<VTKArray> const& arrays, uint numParts,
+	string const& base, string const& filenum, uint numThreads)
+{
+	const uint blocksPerArray = num_blocks(numParts);
 
-	// linearized cell index (NOTE: particles might be slightly off the belonging cell)
-	numbytes = sizeof(uint)*numParts;
-	write_var(fid, numbytes);
-	for (uint i=node_offset; i < node_offset + numParts; i++) {
-		uint value = cellHashFromParticleHash( particleHash[i] );
-		write_var(fid, value);
+	// compressed arrays are encoded before the header, which needs their sizes;
+	// uncompressed ones are encoded a few blocks at a time while writing them
+	vector<VTKBlock> blocks;
+	if (m_compression) {
+		for (size_t a = 0; a < arrays.size(); ++a)
+			add_blocks(blocks, &arrays[a], numParts);
+		if (!blocks.empty())
+			encode_blocks(data, &blocks[0], blocks.size(), m_compression, numThreads);
 	}
 
-	numbytes=sizeof(float)*3*numParts;
+	DirectFile fid;
+	string filename = open_data_file(fid, base.c_str(), filenum);
 
-	// velocity
-	write_var(fid, numbytes);
-	for (uint i=node_offset; i < node_offset + numParts; i++) {
-		float *value = zeroes;
-		//if (FLUID(info[i]) || TESTPOINTS(info[i]))
-			value = (float*)(vel + i);
-		write_arr(fid, value, 3);
-	}
+	// Header, assembled in memory and written with the data
+	//====================================================================================
+	stringstream head;
+	head << "<?xml version='1.0'?>" << endl;
+	head << "<VTKFile type='UnstructuredGrid'  version='0.1'  byte_order='" <<
+		endianness[*(char*)&endian_int & 1] << "'";
+	if (m_compression)
+		head << " compressor='vtkZLibDataCompressor'";
+	head << ">" << endl;
+	head << " <UnstructuredGrid>" << endl;
+	head << "  <Piece NumberOfPoints='" << numParts << "' NumberOfCells='" << numParts << "'>" << endl;
 
-	// gradient gamma
-	if (gradGamma) {
-		write_var(fid, numbytes);
-		for (uint i=node_offset; i < node_offset + numParts; i++) {
-			float *value = zeroes;
-			value = (float*)(gradGamma + i);
-			write_arr(fid, value, 3);
+	size_t offset = 0;
+	VTKSection section = VTK_POINT_DATA;
+	head << "   <PointData Scalars='Pressure' Vectors='Velocity'>" << endl;
+	for (size_t a = 0; a < arrays.size(); ++a) {
+		VTKArray const& array = arrays[a];
+		if (array.section != section) {
+			if (section == VTK_POINT_DATA)
+				head << "   </PointData>" << endl;
+			else
+				head << "   </Points>" << endl;
+			section = array.section;
+			if (section == VTK_POINTS)
+				head << "   <Points>" << endl;
+			else
+				head << "   <Cells>" << endl;
 		}
-	}
 
-	// vorticity
-	if (vort) {
-		write_var(fid, numbytes);
-		for (uint i=node_offset; i < node_offset + numParts; i++) {
-			float *value = zeroes;
-			if (FLUID(info[i])) {
-				value = (float*)(vort + i);
-			}
-			write_arr(fid, value, 3);
+		if (!array.name)
+			vector_array(head, array.type, array.dim, offset);
+		else if (array.dim > 1)
+			vector_array(head, array.type, array.name, array.dim, offset);
+		else
+			scalar_array(head, array.type, array.name, offset);
+
+		if (m_compression) {
+			offset += sizeof(uint)*(3 + blocksPerArray);
+			for (uint b = 0; b < blocksPerArray; ++b)
+				offset += blocks[a*blocksPerArray + b].out.size();
+		} else {
+			offset += array.elsize*numParts+sizeof(int);
 		}
 	}
+	head << "   </Cells>" << endl;
+	head << "  </Piece>" << endl;
 
-	// normals
-	if (normals) {
-		write_var(fid, numbytes);
-		for (uint i=node_offset; i < node_offset + numParts; i++) {
-			float *value = zeroes;
-			if (FLUID(info[i])) {
-				value = (float*)(normals + i);
-			}
-			write_arr(fid, value, 3);
-		}
+	head << " </UnstructuredGrid>" << endl;
+	head << " <AppendedData encoding='raw'>\n_";
+	fid.write(head.str());
+	//====================================================================================
 
-		numbytes=sizeof(float)*numParts;
-		// criteria
-		write_var(fid, numbytes);
-		for (uint i=node_offset; i < node_offset + numParts; i++) {
-			float value = 0;
-			if (FLUID(info[i]))
-				value = normals[i].w;
-			write_var(fid, value);
+	if (m_compression) {
+		for (size_t a = 0; a < arrays.size(); ++a) {
+			VTKBlock const* array_blocks = blocksPerArray ? &blocks[a*blocksPerArray] : NULL;
+			write_compression_header(fid, array_blocks, blocksPerArray, arrays[a].elsize, numParts);
+			for (uint b = 0; b < blocksPerArray; ++b)
+				write_arr(fid, &array_blocks[b].out[0], array_blocks[b].out.size());
 		}
-	}
-
-	numbytes=sizeof(float)*numParts;
+	} else {
+		// a few blocks per thread at a time, to limit the memory used
+		const uint round = 4*numThreads;
+		for (size_t a = 0; a < arrays.size(); ++a) {
+			int numbytes = arrays[a].elsize*numParts;
+			write_var(fid, numbytes);
 
-	// private
-	if (priv) {
-		write_var(fid, numbytes);
-		for (uint i=node_offset; i < node_offset + numParts; i++) {
-			float value = priv[i];
-			write_var(fid, value);
+			for (uint b = 0; b < blocksPerArray; b += round) {
+				blocks.clear();
+				for (uint rb = b; rb < min(b + round, blocksPerArray); ++rb) {
+					VTKBlock block;
+					block.array = &arrays[a];
+					block.from = rb*VTK_BLOCK_PARTS;
+					block.to = min(block.from + VTK_BLOCK_PARTS, numParts);
+					blocks.push_back(block);
+				}
+				encode_blocks(data, &blocks[0], blocks.size(), 0, numThreads);
+				for (size_t rb = 0; rb < blocks.size(); ++rb)
+					write_arr(fid, &blocks[rb].out[0], blocks[rb].out.size());
+			}
 		}
 	}
 
-	numbytes=sizeof(double)*3*numParts;
+	fid.write(string(" </AppendedData>\n</VTKFile>\n"));
+	fid.close();
 
-	// position
-	write_var(fid, numbytes);
-	for (uint i=node_offset; i < node_offset + numParts; i++) {
-		double *value = (double*)(pos + i);
-		write_arr(fid, value, 3);
-	}
+	return filename;
+}
 
-	numbytes=sizeof(int)*numParts;
-	// connectivity
-	write_var(fid, numbytes);
-	for (uint i=0; i < numParts; i++) {
-		uint value = i;
-		write_var(fid, value);
-	}
-	// offsets
-	write_var(fid, numbytes);
-	for (uint i=0; i < numParts; i++) {
-		uint value = i+1;
-		write_var(fid, value);
-	}
+string
+VTKWriter::piece_base(uint d) const
+{
+	if (!m_partitioned || gdata->devices < 2)
+		return "PART";
+	return "PART_dev" + gdata->to_string(d) + "." + gdata->to_string(gdata->devices);
+}
 
-	// types (currently all cells type=1, single vertex, the particle)
-	numbytes=sizeof(uchar)*numParts;
-	write_var(fid, numbytes);
-	for (uint i=0; i < numParts; i++) {
-		uchar value = 1;
-		write_var(fid, value);
-	}
+string
+VTKWriter::write_master(vector<VTKArray> const& arrays, string const& filenum)
+{
+	ofstream fid;
+	string filename = open_master_file(fid, "PART", filenum, ".pvtu");
 
-	fid << " </AppendedData>" << endl;
+	fid << "<?xml version='1.0'?>" << endl;
+	fid << "<VTKFile type='PUnstructuredGrid'  version='0.1'  byte_order='" <<
+		endianness[*(char*)&endian_int & 1] << "'";
+	if (m_compression)
+		fid << " compressor='vtkZLibDataCompressor'";
+	fid << ">" << endl;
+	fid << " <PUnstructuredGrid GhostLevel='0'>" << endl;
+
+	fid << "  <PPointData Scalars='Pressure' Vectors='Velocity'>" << endl;
+	for (size_t a = 0; a < arrays.size(); ++a) {
+		VTKArray const& array = arrays[a];
+		if (array.section != VTK_POINT_DATA)
+			continue;
+		fid << "	<PDataArray type='" << array.type << "' Name='" << array.name << "'";
+		if (array.dim > 1)
+			fid << " NumberOfComponents='" << array.dim << "'";
+		fid << "/>" << endl;
+	}
+	fid << "  </PPointData>" << endl;
+
+	fid << "  <PPoints>" << endl;
+	for (size_t a = 0; a < arrays.size(); ++a)
+		if (arrays[a].section == VTK_POINTS)
+			fid << "	<PDataArray type='" << arrays[a].type << "' NumberOfComponents='"
+				<< arrays[a].dim << "'/>" << endl;
+	fid << "  </PPoints>" << endl;
+
+	// all ranks have the same number of devices (checked at startup in main)
+	const uint numRanks = max(gdata->mpi_nodes, 1U);
+	for (uint rank = 0; rank < numRanks; ++rank)
+		for (uint d = 0; d < gdata->devices; ++d)
+			fid << "  <Piece Source='" <<
+				data_file_name(piece_base(d).c_str(), rank, filenum, m_fname_sfx) << "'/>" << endl;
+
+	fid << " </PUnstructuredGrid>" << endl;
 	fid << "</VTKFile>" << endl;
 
-	// Writing time to VTUinp.pvd file
-	if (m_timefile) {
-		// TODO should node info for multinode be stored in group or part?
-		m_timefile << "<DataSet timestep='" << t << "' group='' part='0' "
-			<< "file='" << filename << "'/>" << endl;
-		mark_timefile();
+	return filename;
+}
+
+void
+VTKWriter::write_testpoints_csv(uint numParts, const double4 *pos, const hashKey *particleHash,
+	const float4 *vel, const particleinfo *info, uint node_offset, float t)
+{
+	string testpoints_fname = m_dirname + "/testpoints/testpoints_" + current_filenum() + ".csv";
+	ofstream testpoints_file;
+	testpoints_file.open(testpoints_fname.c_str());
+	if (!testpoints_file) {
+		stringstream ss;
+		ss << "Cannot open testpoints file " << testpoints_fname;
+		throw runtime_error(ss.str());
+	}
+	// write CSV header
+	testpoints_file << "T,ID,Pressure,Object,CellIndex,PosX,PosY,PosZ,VelX,VelY,VelZ" << endl;
+
+	for (uint i=node_offset; i < node_offset + numParts; i++) {
+		uchar value = PART_TYPE(info[i]);
+		if (value == (TESTPOINTSPART >> MAX_FLUID_BITS)) {
+			testpoints_file << t << ","
+				<< id(info[i]) << ","
+				<< vel[i].w << ","
+				<< object(info[i]) << ","
+				<< cellHashFromParticleHash( particleHash[i] ) << ","
+				<< pos[i].x << ","
+				<< pos[i].y << ","
+				<< pos[i].z << ","
+				<< vel[i].x << ","
+				<< vel[i].y << ","
+				<< vel[i].z << endl;
+		}
 	}
 
-	// close testpoints file
-	if (testpoints_file)
-		testpoints_file.close();
+	testpoints_file.close();
 }
 
 void
@@ -631,7 +983,7 @@ VTKWriter::write_WaveGage(float t, GageList const& gage)
 void
 VTKWriter::mark_timefile()
 {
-	if (!m_timefile)
+	if (!m_timefile.is_open())
 		return;
 	// Mark the current position, close the XML, go back
 	// to the marked position
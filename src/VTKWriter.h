@@ -26,12 +26,42 @@
 #ifndef _VTKWRITER_H
 #define	_VTKWRITER_H
 
+#include <vector>
+
 #include "Writer.h"
 
 using namespace std;
 
+// defined in VTKWriter.cc
+struct VTKData;
+struct VTKArray;
+
+/* In multi-device simulations the particles of each device are written as a
+ * separate piece (PART_dev<d>.<devices>_..., with the node in multi-node runs),
+ * each by its own thread, and rank 0 writes a PART_<num>.pvtu master file
+ * referencing the pieces of all the devices of all the ranks, so that each frame
+ * can be loaded in parallel. VTUinp.pvd, also written by rank 0 only, references
+ * the master files. Single-device simulations write a single .vtu per frame.
+ * All the ranks are assumed to have the same number of devices.
+ */
 class VTKWriter : public Writer
 {
+	// zlib compression level of the appended data, 0 for uncompressed (see --vtk-compress)
+	int		m_compression;
+	// number of threads encoding and compressing the data
+	uint	m_numThreads;
+	// is the output split in pieces, one per device?
+	bool	m_partitioned;
+
+	// base name of the pieces of device d
+	string piece_base(uint d) const;
+
+	// write the master file of the pieces of the given arrays
+	string write_master(vector<VTKArray> const& arrays, string const& filenum);
+
+	void write_testpoints_csv(uint numParts, const double4 *pos, const hashKey *particleHash,
+		const float4 *vel, const particleinfo *info, uint node_offset, float t);
+
 public:
 	VTKWriter(const GlobalData *_gdata);
 	~VTKWriter();
@@ -39,6 +69,12 @@ public:
 	virtual void write(uint numParts, BufferList const& buffers, uint node_offset, float t, const bool testpoints);
 	virtual void write_WaveGage(float t, GageList const& gage);
 
+	// write the given arrays of numParts particles of data in the file base_filenum,
+	// encoding them with up to numThreads threads; returns the file name
+	// (public for the threads writing the pieces)
+	string write_piece(VTKData const& data, vector<VTKArray> const& arrays, uint numParts,
+		string const& base, string const& filenum, uint numThreads);
+
 	// this method is used to close the XML in the timefile,
 	// so that the timefile is always valid, and then seek back to the pre-close
 	// position so that the next entry is properly inserted
@@ -29,17 +29,50 @@
 #include "Writer.h"
 #include "GlobalData.h"
 
+#include "ColumnWriter.h"
 #include "CustomTextWriter.h"
+#include "GridWriter.h"
+#include "ShmWriter.h"
+#include "SurfaceWriter.h"
 #include "TextWriter.h"
 #include "UDPWriter.h"
 #include "VTKLegacyWriter.h"
 #include "VTKWriter.h"
 #include "Writer.h"
 
+static const char *
+writer_name(WriterType type)
+{
+	switch (type) {
+	case TEXTWRITER:		return "TextWriter";
+	case VTKWRITER:			return "VTKWriter";
+	case VTKLEGACYWRITER:	return "VTKLegacyWriter";
+	case CUSTOMTEXTWRITER:	return "CustomTextWriter";
+	case UDPWRITER:			return "UDPWriter";
+	case COLUMNWRITER:		return "ColumnWriter";
+	case GRIDWRITER:		return "GridWriter";
+	case SURFACEWRITER:		return "SurfaceWriter";
+	case SHMWRITER:			return "ShmWriter";
+	}
+	return "Writer";
+}
+
 vector<Writer*> Writer::m_writers = vector<Writer*>();
 float Writer::m_timer_tick = 0;
 bool Writer::m_forced = false;
 
+bool Writer::m_async = false;
+bool Writer::m_dropWhenFull = false;
+vector<WriteSnapshot> Writer::m_snapshots = vector<WriteSnapshot>();
+unsigned long Writer::m_produced = 0;
+vector<unsigned long> Writer::m_consumed = vector<unsigned long>();
+unsigned long Writer::m_dropped = 0;
+bool Writer::m_asyncQuit = false;
+string Writer::m_asyncError = string();
+vector<pthread_t> Writer::m_threads = vector<pthread_t>();
+pthread_mutex_t Writer::m_asyncMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t Writer::m_asyncCond = PTHREAD_COND_INITIALIZER;
+
 void
 Writer::Create(GlobalData *_gdata)
 {
@@ -50,8 +83,8 @@ Writer::Create(GlobalData *_gdata)
 
 	for (; it != end; ++it) {
 		Writer *writer = NULL;
-		WriterType wt = it->first;
-		int freq = it->second;
+		WriterType wt = it->type;
+		int freq = it->freq;
 		switch (wt) {
 		case TEXTWRITER:
 			writer = new TextWriter(_gdata);
@@ -68,12 +101,26 @@ Writer::Create(GlobalData *_gdata)
 		case UDPWRITER:
 			writer = new UDPWriter(_gdata);
 			break;
+		case COLUMNWRITER:
+			writer = new ColumnWriter(_gdata);
+			break;
+		case GRIDWRITER:
+			writer = new GridWriter(_gdata, it->grids);
+			break;
+		case SURFACEWRITER:
+			writer = new SurfaceWriter(_gdata);
+			break;
+		case SHMWRITER:
+			writer = new ShmWriter(_gdata);
+			break;
 		default:
 			stringstream ss;
 			ss << "Unknown writer type " << wt;
 			throw runtime_error(ss.str());
 		}
+		writer->m_type = wt;
 		writer->set_write_freq(freq);
+		writer->set_filter(it->filter);
 		m_writers.push_back(writer);
 	}
 }
@@ -103,16 +150,57 @@ Writer::MarkWritten(float t, bool force)
 	}
 }
 
+flag_t
+Writer::NeededBuffers(float t, bool force)
+{
+	flag_t needed = NO_FLAGS;
+	vector<Writer*>::iterator it(m_writers.begin());
+	vector<Writer*>::iterator end(m_writers.end());
+	for ( ; it != end; ++it) {
+		Writer *writer = *it;
+		if (!(writer->need_write(t) || force || m_forced))
+			continue;
+		if (writer->m_filter.fields)
+			needed |= writer->m_filter.fields | WRITER_CORE_BUFFERS;
+		else
+			needed |= ALL_PARTICLE_BUFFERS;
+	}
+	return needed;
+}
+
+bool
+Writer::NeededCells(float t, bool force, CellRuns &runs)
+{
+	runs.clear();
+	bool any = false;
+	vector<Writer*>::iterator it(m_writers.begin());
+	vector<Writer*>::iterator end(m_writers.end());
+	for ( ; it != end; ++it) {
+		Writer *writer = *it;
+		if (!(writer->need_write(t) || force || m_forced))
+			continue;
+		if (!writer->m_filter.spatial()) {
+			runs.clear();
+			return false;
+		}
+		writer->get_cell_runs(runs);
+		any = true;
+	}
+	merge_cell_runs(runs);
+	return any;
+}
+
 void
 Writer::Write(uint numParts, BufferList const& buffers,
-	uint node_offset, float t, const bool testpoints)
+	uint node_offset, float t, const bool testpoints, flag_t dumped, const uint *partsPerDevice)
 {
 	vector<Writer*>::iterator it(m_writers.begin());
 	vector<Writer*>::iterator end(m_writers.end());
 	for ( ; it != end; ++it) {
 		Writer *writer = *it;
 		if (writer->need_write(t) || m_forced)
-			writer->write(numParts, buffers, node_offset, t, testpoints);
+			writer->write_filtered(numParts, buffers, node_offset, t, testpoints, dumped,
+				partsPerDevice);
 	}
 }
 
@@ -128,6 +216,209 @@ Writer::WriteWaveGage(float t, GageList const& gage)
 	}
 }
 
+void
+Writer::StartAsync(vector<BufferList*> const& snapshotBuffers, bool dropWhenFull)
+{
+	if (m_writers.empty() || snapshotBuffers.empty())
+		return;
+
+	m_snapshots.resize(snapshotBuffers.size());
+	for (size_t s = 0; s < snapshotBuffers.size(); ++s)
+		m_snapshots[s].buffers = snapshotBuffers[s];
+
+	m_dropWhenFull = dropWhenFull;
+	m_produced = m_dropped = 0;
+	m_asyncQuit = false;
+	m_consumed.assign(m_writers.size(), 0);
+	m_threads.resize(m_writers.size());
+
+	for (size_t w = 0; w < m_writers.size(); ++w) {
+		int err = pthread_create(&m_threads[w], NULL, asyncWriterThread, (void*)w);
+		if (err) {
+			stringstream ss;
+			ss << "cannot create writer thread (error " << err << ")";
+			throw runtime_error(ss.str());
+		}
+	}
+
+	m_async = true;
+}
+
+unsigned long
+Writer::queuedSnapshots()
+{
+	unsigned long oldest = m_produced;
+	for (size_t w = 0; w < m_consumed.size(); ++w)
+		if (m_consumed[w] < oldest)
+			oldest = m_consumed[w];
+	return m_produced - oldest;
+}
+
+void
+Writer::checkAsyncError()
+{
+	if (!m_asyncError.empty()) {
+		string error = m_asyncError;
+		m_asyncError.clear();
+		pthread_mutex_unlock(&m_asyncMutex);
+		throw runtime_error(error);
+	}
+}
+
+bool
+Writer::WriteAsync(uint numParts, BufferList &buffers, uint node_offset, float t, const bool testpoints,
+	flag_t dumped, GageList const& gage, const uint *partsPerDevice)
+{
+	pthread_mutex_lock(&m_asyncMutex);
+	checkAsyncError();
+
+	// wait for a free snapshot, unless we can drop this one
+	while (queuedSnapshots() == m_snapshots.size()) {
+		if (m_dropWhenFull && !m_forced) {
+			m_dropped++;
+			pthread_mutex_unlock(&m_asyncMutex);
+			return false;
+		}
+		pthread_cond_wait(&m_asyncCond, &m_asyncMutex);
+		checkAsyncError();
+	}
+	// no writer thread looks at the slot until m_produced is advanced
+	WriteSnapshot &snap = m_snapshots[m_produced % m_snapshots.size()];
+	pthread_mutex_unlock(&m_asyncMutex);
+
+	// take the dumped particles, giving back the buffers of an old snapshot
+	snap.buffers->swap(buffers);
+	snap.numParts = numParts;
+	snap.node_offset = node_offset;
+	snap.t = t;
+	snap.testpoints = testpoints;
+	snap.dumped = dumped;
+	snap.gages = gage;
+	for (uint d = 0; d < MAX_DEVICES_PER_NODE; d++)
+		snap.partsPerDevice[d] = partsPerDevice[d];
+	snap.writers.resize(m_writers.size());
+	for (size_t w = 0; w < m_writers.size(); ++w)
+		snap.writers[w] = m_writers[w]->need_write(t) || m_forced;
+
+	pthread_mutex_lock(&m_asyncMutex);
+	m_produced++;
+	pthread_cond_broadcast(&m_asyncCond);
+	pthread_mutex_unlock(&m_asyncMutex);
+
+	return true;
+}
+
+void *
+Writer::asyncWriterThread(void *arg)
+{
+	const size_t w = (size_t)arg;
+	Writer *writer = m_writers[w];
+
+	pthread_mutex_lock(&m_asyncMutex);
+	while (true) {
+		while (m_consumed[w] == m_produced && !m_asyncQuit)
+			pthread_cond_wait(&m_asyncCond, &m_asyncMutex);
+		// the queue is drained before quitting
+		if (m_consumed[w] == m_produced)
+			break;
+
+		const WriteSnapshot &snap = m_snapshots[m_consumed[w] % m_snapshots.size()];
+		pthread_mutex_unlock(&m_asyncMutex);
+
+		// same order as the synchronous writes: wave gages first
+		string error;
+		if (snap.writers[w]) {
+			try {
+				if (!snap.gages.empty())
+					writer->write_WaveGage(snap.t, snap.gages);
+				writer->write_filtered(snap.numParts, *snap.buffers, snap.node_offset, snap.t,
+					snap.testpoints, snap.dumped, snap.partsPerDevice);
+			} catch (exception &e) {
+				error = e.what();
+			}
+		}
+
+		pthread_mutex_lock(&m_asyncMutex);
+		if (!error.empty() && m_asyncError.empty())
+			m_asyncError = error;
+		m_consumed[w]++;
+		pthread_cond_broadcast(&m_asyncCond);
+	}
+	pthread_mutex_unlock(&m_asyncMutex);
+
+	return NULL;
+}
+
+void
+Writer::StopAsync()
+{
+	if (!m_async)
+		return;
+
+	pthread_mutex_lock(&m_asyncMutex);
+	m_asyncQuit = true;
+	pthread_cond_broadcast(&m_asyncCond);
+	pthread_mutex_unlock(&m_asyncMutex);
+
+	for (size_t w = 0; w < m_threads.size(); ++w)
+		pthread_join(m_threads[w], NULL);
+	m_threads.clear();
+	m_async = false;
+
+	if (m_dropped)
+		printf("Dropped %lu of %lu writes because the writers could not keep up\n",
+			m_dropped, m_dropped + m_produced);
+
+	m_snapshots.clear();
+
+	pthread_mutex_lock(&m_asyncMutex);
+	checkAsyncError();
+	pthread_mutex_unlock(&m_asyncMutex);
+}
+
+void
+Writer::FlushAsync()
+{
+	if (!m_async)
+		return;
+
+	pthread_mutex_lock(&m_asyncMutex);
+	while (queuedSnapshots() > 0)
+		pthread_cond_wait(&m_asyncCond, &m_asyncMutex);
+	checkAsyncError();
+	pthread_mutex_unlock(&m_asyncMutex);
+}
+
+WriterStateList
+Writer::GetState()
+{
+	// the writer threads update the file counters
+	FlushAsync();
+
+	WriterStateList state(m_writers.size());
+	for (size_t w = 0; w < m_writers.size(); ++w) {
+		state[w].file_counter = m_writers[w]->m_FileCounter;
+		state[w].last_write_time = m_writers[w]->m_last_write_time;
+	}
+	return state;
+}
+
+void
+Writer::SetState(WriterStateList const& state)
+{
+	if (state.size() != m_writers.size()) {
+		stringstream ss;
+		ss << "cannot restore the state of " << state.size() << " writers into "
+			<< m_writers.size() << " writers";
+		throw runtime_error(ss.str());
+	}
+
+	for (size_t w = 0; w < m_writers.size(); ++w) {
+		m_writers[w]->m_FileCounter = state[w].file_counter;
+		m_writers[w]->m_last_write_time = state[w].last_write_time;
+	}
+}
+
 void
 Writer::Destroy()
 {
@@ -144,7 +435,7 @@ Writer::Destroy()
  *  Default Constructor; makes sure the file output format starts at PART_00000
  */
 Writer::Writer(const GlobalData *_gdata) :
-	m_FileCounter(0), gdata(_gdata),
+	m_partsPerDevice(NULL), m_filteredCapacity(0), m_FileCounter(0), gdata(_gdata),
 	m_writefreq(0), m_last_write_time(-1)
 {
 	m_problem = _gdata->problem;
@@ -181,7 +472,148 @@ Writer::Writer(const GlobalData *_gdata) :
 
 Writer::~Writer()
 {
-	// hi
+	m_filtered.clear();
+
+	// the files of the derived writers are closed by now
+	const uint64_t bytes = m_io.bytes();
+	if (bytes) {
+		const double mib = bytes/1048576.0;
+		const double seconds = m_io.seconds();
+		printf("%s wrote %.1f MiB in %u files, %.3f s (%.1f MiB/s)\n",
+			writer_name(m_type), mib, m_io.files(), seconds,
+			seconds > 0 ? mib/seconds : 0.0);
+	}
+}
+
+bool
+Writer::selects(double4 const& pos, particleinfo const& info) const
+{
+	if (m_filter.partTypes && !(m_filter.partTypes & (1U << PART_TYPE(info))))
+		return false;
+
+	if (m_filter.hasBox && (
+			pos.x < m_filter.boxMin.x || pos.x > m_filter.boxMax.x ||
+			pos.y < m_filter.boxMin.y || pos.y > m_filter.boxMax.y ||
+			pos.z < m_filter.boxMin.z || pos.z > m_filter.boxMax.z))
+		return false;
+
+	if (m_filter.hasCells) {
+		const int3 cell = gdata->calcGridPosHost(pos.x, pos.y, pos.z);
+		if (cell.x < m_filter.cellMin.x || cell.x > m_filter.cellMax.x ||
+			cell.y < m_filter.cellMin.y || cell.y > m_filter.cellMax.y ||
+			cell.z < m_filter.cellMin.z || cell.z > m_filter.cellMax.z)
+			return false;
+	}
+
+	return true;
+}
+
+void
+Writer::get_cell_runs(CellRuns &runs) const
+{
+	const int3 gridSize = make_int3(gdata->gridSize.x, gdata->gridSize.y, gdata->gridSize.z);
+	int3 cmin = make_int3(0, 0, 0);
+	int3 cmax = make_int3(gridSize.x - 1, gridSize.y - 1, gridSize.z - 1);
+
+	if (m_filter.hasBox) {
+		// particles may be up to a cell away from the cell of their hash
+		// until the next neighbor list construction
+		const int3 bmin = gdata->calcGridPosHost(m_filter.boxMin.x, m_filter.boxMin.y, m_filter.boxMin.z);
+		const int3 bmax = gdata->calcGridPosHost(m_filter.boxMax.x, m_filter.boxMax.y, m_filter.boxMax.z);
+		cmin = make_int3(max(cmin.x, bmin.x - 1), max(cmin.y, bmin.y - 1), max(cmin.z, bmin.z - 1));
+		cmax = make_int3(min(cmax.x, bmax.x + 1), min(cmax.y, bmax.y + 1), min(cmax.z, bmax.z + 1));
+	}
+	if (m_filter.hasCells) {
+		cmin = make_int3(max(cmin.x, m_filter.cellMin.x - 1), max(cmin.y, m_filter.cellMin.y - 1),
+			max(cmin.z, m_filter.cellMin.z - 1));
+		cmax = make_int3(min(cmax.x, m_filter.cellMax.x + 1), min(cmax.y, m_filter.cellMax.y + 1),
+			min(cmax.z, m_filter.cellMax.z + 1));
+	}
+
+	// one run for each row of cells along the fastest coordinate of the linearization
+	for (int c3 = cmin.COORD3; c3 <= cmax.COORD3; ++c3)
+		for (int c2 = cmin.COORD2; c2 <= cmax.COORD2; ++c2) {
+			if (cmin.COORD1 > cmax.COORD1)
+				continue;
+			int3 first, last;
+			first.COORD1 = cmin.COORD1;
+			last.COORD1 = cmax.COORD1;
+			first.COORD2 = last.COORD2 = c2;
+			first.COORD3 = last.COORD3 = c3;
+			runs.push_back(make_pair(gdata->calcGridHashHost(first), gdata->calcGridHashHost(last) + 1));
+		}
+}
+
+void
+Writer::write_filtered(uint numParts, BufferList const& buffers, uint node_offset, float t,
+	const bool testpoints, flag_t dumped, const uint *partsPerDevice)
+{
+	// the buffers the writer gets: the ones it asked for, among those refreshed
+	// by the DUMP (and the global positions, computed from them)
+	const flag_t fields = (m_filter.fields ? m_filter.fields | WRITER_CORE_BUFFERS : ALL_PARTICLE_BUFFERS) &
+		(dumped | BUFFER_POS_GLOBAL);
+
+	// the writer gets borrowed buffers, or filtered copies
+	BufferList selected;
+
+	if (!m_filter.selective()) {
+		BufferList::const_iterator iter = buffers.begin();
+		for ( ; iter != buffers.end(); ++iter)
+			if (iter->first & fields)
+				selected.insert(*iter);
+		m_partsPerDevice = partsPerDevice;
+		write(numParts, selected, node_offset, t, testpoints);
+		return;
+	}
+
+	const double4 *pos = buffers.getData<BUFFER_POS_GLOBAL>();
+	const particleinfo *info = buffers.getData<BUFFER_INFO>();
+
+	vector<uint> indices;
+	uint d = 0, dev_end = partsPerDevice[0];
+	for (uint dev = 0; dev < MAX_DEVICES_PER_NODE; ++dev)
+		m_filteredPartsPerDevice[dev] = 0;
+	for (uint p = 0; p < numParts; ++p) {
+		while (p >= dev_end && d + 1 < gdata->devices)
+			dev_end += partsPerDevice[++d];
+		const uint i = node_offset + p;
+		if (selects(pos[i], info[i])) {
+			indices.push_back(i);
+			m_filteredPartsPerDevice[d]++;
+		}
+	}
+
+	// grow the copies geometrically, so that they are seldom reallocated
+	if (indices.size() > m_filteredCapacity) {
+		m_filteredCapacity = max(indices.size(), m_filteredCapacity + m_filteredCapacity/2);
+		BufferList::iterator copy = m_filtered.begin();
+		for ( ; copy != m_filtered.end(); ++copy)
+			copy->second->alloc(m_filteredCapacity);
+	}
+
+	BufferList::const_iterator iter = buffers.begin();
+	for ( ; iter != buffers.end(); ++iter) {
+		if (!(iter->first & fields))
+			continue;
+
+		AbstractBuffer *dst = m_filtered[iter->first];
+		if (!dst) {
+			dst = iter->second->clone_empty();
+			m_filtered.insert(make_pair(iter->first, dst));
+			dst->alloc(m_filteredCapacity);
+		}
+
+		const size_t elsize = iter->second->get_element_size();
+		const char *src = (const char*)iter->second->get_buffer();
+		char *out = (char*)dst->get_buffer();
+		for (size_t j = 0; j < indices.size(); ++j)
+			memcpy(out + j*elsize, src + (size_t)indices[j]*elsize, elsize);
+
+		selected.insert(make_pair(iter->first, dst));
+	}
+
+	m_partsPerDevice = m_filteredPartsPerDevice;
+	write(indices.size(), selected, 0, t, testpoints);
 }
 
 void
@@ -190,6 +622,12 @@ Writer::set_write_freq(int f)
 	m_writefreq = f;
 }
 
+void
+Writer::set_filter(WriterFilter const& filter)
+{
+	m_filter = filter;
+}
+
 bool
 Writer::need_write(float t) const
 {
@@ -261,30 +699,56 @@ uint Writer::getLastFilenum()
 }
 
 string
-Writer::open_data_file(ofstream &out, const char* base, string const& num, string const& sfx)
+Writer::data_file_name(const char* base, int rank, string const& num, string const& sfx) const
 {
-	string filename(base), full_filename;
+	string filename(base);
 
-	if (gdata && gdata->mpi_nodes > 1)
-		filename += "_n" + gdata->rankString();
+	if (rank >= 0 && gdata && gdata->mpi_nodes > 1)
+		filename += "_n" + gdata->to_string(rank) + "." + gdata->to_string(gdata->mpi_nodes);
 
 	if (!num.empty())
 		filename += "_" + num;
 
 	filename += sfx;
 
-	full_filename = m_dirname + "/" + filename;
+	return filename;
+}
+
+// open the given file in the data directory
+static void
+open_in_dir(ofstream &out, string const& dirname, string const& filename)
+{
+	const string full_filename = dirname + "/" + filename;
 
 	out.open(full_filename.c_str());
 
-	if (!out) {
-		stringstream ss;
-		ss << "Cannot open data file " << full_filename;
+	if (!out)
 		throw runtime_error("Cannot open data file " + full_filename);
-	}
 
 	out.exceptions(ofstream::failbit | ofstream::badbit);
+}
+
+string
+Writer::open_data_file(ofstream &out, const char* base, string const& num, string const& sfx)
+{
+	const string filename = data_file_name(base, gdata ? gdata->mpi_rank : 0, num, sfx);
+	open_in_dir(out, m_dirname, filename);
+	return filename;
+}
 
+string
+Writer::open_data_file(DirectFile &out, const char* base, string const& num, string const& sfx)
+{
+	const string filename = data_file_name(base, gdata ? gdata->mpi_rank : 0, num, sfx);
+	out.open(m_dirname + "/" + filename, gdata && gdata->clOptions->direct_io, &m_io);
+	return filename;
+}
+
+string
+Writer::open_master_file(ofstream &out, const char* base, string const& num, string const& sfx)
+{
+	const string filename = data_file_name(base, -1, num, sfx);
+	open_in_dir(out, m_dirname, filename);
 	return filename;
 }
 
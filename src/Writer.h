@@ -31,6 +31,7 @@
 #include <stdlib.h>
 // TODO on Windows it's direct.h
 #include <sys/stat.h>
+#include <pthread.h>
 
 #include "particledefine.h"
 
@@ -40,6 +41,15 @@
 // GageList
 #include "simparams.h"
 
+// MAX_DEVICES_PER_NODE
+#include "multi_gpu_defines.h"
+
+// CellRuns
+#include "cellruns.h"
+
+// DirectFile, IOStats
+#include "DirectFile.h"
+
 // Forward declaration of GlobalData and Problem, instead of inclusion
 // of the respective headers, to avoid cross-include messes
 
@@ -57,11 +67,119 @@ enum WriterType
 	VTKWRITER,
 	VTKLEGACYWRITER,
 	CUSTOMTEXTWRITER,
-	UDPWRITER
+	UDPWRITER,
+	COLUMNWRITER,
+	GRIDWRITER,
+	SURFACEWRITER,
+	SHMWRITER
+};
+
+// buffers every writer gets, regardless of the fields of its WriterFilter
+#define WRITER_CORE_BUFFERS	(BUFFER_POS_GLOBAL | BUFFER_POS | BUFFER_HASH | BUFFER_VEL | BUFFER_INFO)
+
+/* Particles and fields written by a writer (see Problem::add_writer()).
+ * The default filter selects everything; the setters can be chained, e.g.
+ *
+ *   add_writer(VTKWRITER, 10, WriterFilter().types(1 << PT_FLUID).box(bmin, bmax));
+ *
+ * When all the writers due at some time restrict the particles to a region
+ * (box or cells), only the particles of the cells of the region are DUMPed.
+ */
+struct WriterFilter {
+	// buffers to write besides the WRITER_CORE_BUFFERS (e.g. BUFFER_VORTICITY), 0 for all
+	flag_t	fields;
+	// bitmask of the particle types to write (1 << PT_FLUID etc), 0 for all
+	uint	partTypes;
+	// axis-aligned box, in world coordinates
+	bool	hasBox;
+	double3	boxMin, boxMax;
+	// range of grid cells, bounds included
+	bool	hasCells;
+	int3	cellMin, cellMax;
+
+	WriterFilter() : fields(0), partTypes(0), hasBox(false), hasCells(false) {}
+
+	WriterFilter& only(flag_t _fields)
+	{ fields = _fields; return *this; }
+
+	WriterFilter& types(uint _partTypes)
+	{ partTypes = _partTypes; return *this; }
+
+	WriterFilter& box(double3 const& _min, double3 const& _max)
+	{ hasBox = true; boxMin = _min; boxMax = _max; return *this; }
+
+	WriterFilter& cells(int3 const& _min, int3 const& _max)
+	{ hasCells = true; cellMin = _min; cellMax = _max; return *this; }
+
+	// are the particles restricted to a region of the domain?
+	inline bool spatial() const
+	{ return hasBox || hasCells; }
+
+	// are some particles left out?
+	inline bool selective() const
+	{ return partTypes || spatial(); }
+};
+
+/* Regular grid of points the GRIDWRITER resamples the particle fields onto:
+ * size.x*size.y*size.z points, the first at origin, spaced by spacing.
+ * A slice is a grid with a single point along one of the axes.
+ */
+struct ResampleGrid {
+	// used in the file names, so it should be unique among the grids of a writer
+	string	name;
+	double3	origin;
+	double3	spacing;
+	uint3	size;
+
+	ResampleGrid(string const& _name, double3 const& _origin, double3 const& _spacing,
+		uint3 const& _size) :
+		name(_name), origin(_origin), spacing(_spacing), size(_size) {}
+
+	inline double3 corner() const
+	{
+		return make_double3(
+			origin.x + spacing.x*(size.x ? size.x - 1 : 0),
+			origin.y + spacing.y*(size.y ? size.y - 1 : 0),
+			origin.z + spacing.z*(size.z ? size.z - 1 : 0));
+	}
+};
+
+typedef vector<ResampleGrid> ResampleGridList;
+
+// a writer requested by the Problem
+struct WriterSpec {
+	WriterType		type;
+	uint			freq;
+	WriterFilter	filter;
+	// only used by the GRIDWRITER
+	ResampleGridList	grids;
+};
+
+typedef vector<WriterSpec> WriterList;
+
+// counters of a writer, saved in checkpoints (see Writer::GetState())
+struct WriterState {
+	uint	file_counter;
+	float	last_write_time;
 };
 
-// list of writer type, write freq pairs
-typedef vector<pair<WriterType, uint> > WriterList;
+typedef vector<WriterState> WriterStateList;
+
+// A write in flight, with asynchronous writing (see Writer::StartAsync()):
+// the host buffers holding the dumped particles and the parameters of the write
+struct WriteSnapshot {
+	BufferList		*buffers;
+	uint			numParts;
+	uint			node_offset;
+	float			t;
+	bool			testpoints;
+	// buffers refreshed by the DUMP, the others are not passed to the writers
+	flag_t			dumped;
+	GageList		gages;
+	uint			partsPerDevice[MAX_DEVICES_PER_NODE];
+	// which writers (by index in the list) need to write this snapshot
+	vector<bool>	writers;
+};
 
 /*! The Writer class acts both as base class for the actual writers,
  * and a dispatcher. It holds a (static) list of writers
@@ -83,6 +201,29 @@ class Writer
 	// to handle this
 	static bool m_forced;
 
+	// asynchronous writing: ring of snapshots, number of snapshots queued
+	// so far and number of snapshots processed by each writer thread. A slot
+	// is free when all the writers are done with it
+	static bool m_async;
+	static bool m_dropWhenFull;
+	static vector<WriteSnapshot> m_snapshots;
+	static unsigned long m_produced;
+	static vector<unsigned long> m_consumed;
+	static unsigned long m_dropped;
+	static bool m_asyncQuit;
+	// first error thrown by a writer thread, rethrown by the main thread
+	static string m_asyncError;
+	static vector<pthread_t> m_threads;
+	static pthread_mutex_t m_asyncMutex;
+	static pthread_cond_t m_asyncCond;
+
+	// number of snapshots some writer has yet to process; call with m_asyncMutex held
+	static unsigned long queuedSnapshots();
+	// writer thread, the argument is the index of the writer in the list
+	static void *asyncWriterThread(void *arg);
+	// rethrow the error of a writer thread, if any; call with m_asyncMutex held
+	static void checkAsyncError();
+
 public:
 	// maximum number of files
 	static const uint MAX_FILES = 99999;
@@ -102,14 +243,58 @@ public:
 	static void
 	MarkWritten(float t, bool force=false);
 
-	// write points
+	// buffers needed by the writers that write at time t (all of them if force)
+	static flag_t NeededBuffers(float t, bool force);
+
+	// runs of the cells holding the particles needed by the writers that write
+	// at time t (all of them if force); returns false if all the particles are needed
+	static bool NeededCells(float t, bool force, CellRuns &runs);
+
+	// write points; only the buffers in dumped are passed to the writers, and
+	// partsPerDevice is the number of particles of each device in the buffers
 	static void
-	Write(uint numParts, BufferList const& buffers, uint node_offset, float t, const bool testpoints);
+	Write(uint numParts, BufferList const& buffers, uint node_offset, float t, const bool testpoints,
+		flag_t dumped, const uint *partsPerDevice);
 
 	// write wave gages
 	static void
 	WriteWaveGage(float t, GageList const& gage);
 
+	// start writing asynchronously: each writer gets its own thread, and the
+	// given (allocated) buffer lists are used as snapshots. When all snapshots
+	// are waiting to be written, WriteAsync() blocks, or drops the snapshot if
+	// dropWhenFull is set (forced writes are never dropped)
+	static void
+	StartAsync(vector<BufferList*> const& snapshotBuffers, bool dropWhenFull);
+
+	// are we writing asynchronously?
+	static inline bool IsAsync()
+	{ return m_async; }
+
+	// queue a write of points and wave gages: the contents of buffers are
+	// swapped with those of a free snapshot. Returns false if the snapshot
+	// was dropped
+	static bool
+	WriteAsync(uint numParts, BufferList &buffers, uint node_offset, float t, const bool testpoints,
+		flag_t dumped, GageList const& gage, const uint *partsPerDevice);
+
+	// wait for the queued snapshots to be written and stop the writer threads
+	static void
+	StopAsync();
+
+	// wait for the queued snapshots to be written, keeping the writer threads
+	static void
+	FlushAsync();
+
+	// counters of all the writers, in the order they were created. With
+	// asynchronous writing, waits for the queued snapshots to be written first
+	static WriterStateList
+	GetState();
+
+	// restore the counters of the writers, e.g. from a checkpoint
+	static void
+	SetState(WriterStateList const& state);
+
 	// set the timer tick
 	static inline void SetTimerTick(float t)
 	{ m_timer_tick = t; }
@@ -134,6 +319,10 @@ protected:
 
 	void set_write_freq(int f);
 
+	// set the particles and fields to write; writers that need more
+	// particles than the filter selects can widen it
+	virtual void set_filter(WriterFilter const& filter);
+
 	bool need_write(float t) const;
 
 	virtual void
@@ -141,6 +330,16 @@ protected:
 
 	inline void mark_written(float t) { m_last_write_time = t; }
 
+	// apply the filter of the writer to the particles and call write()
+	void write_filtered(uint numParts, BufferList const& buffers, uint node_offset, float t,
+		const bool testpoints, flag_t dumped, const uint *partsPerDevice);
+
+	// does the filter of the writer select the given particle?
+	bool selects(double4 const& pos, particleinfo const& info) const;
+
+	// append the runs of cells of the region of the filter
+	void get_cell_runs(CellRuns &runs) const;
+
 	virtual void
 	write_energy(float t, float4 *energy);
 
@@ -161,13 +360,39 @@ protected:
 	string
 	open_data_file(ofstream &out, const char* base, string const& num, string const& sfx);
 
+	/* name of the data file open_data_file() opens on the given rank, or of a
+	 * file shared by all the ranks (without the node part) if rank is negative
+	 */
+	string
+	data_file_name(const char* base, int rank, string const& num, string const& sfx) const;
+
+	// open a file shared by all the ranks, such as a master file referencing the
+	// data files of all the ranks: only rank 0 should write it
+	string
+	open_master_file(ofstream &out, const char* base, string const& num, string const& sfx);
+
 	inline string
 	open_data_file(ofstream &out, const char* base, string const& num)
 	{ return open_data_file(out, base, num, m_fname_sfx); }
 
+	/* open a data file for large binary payloads, named as above: with --direct-io
+	 * it's written with O_DIRECT through io_uring, where available. The bytes
+	 * written to it are accounted in m_io when it's closed
+	 */
+	string
+	open_data_file(DirectFile &out, const char* base, string const& num, string const& sfx);
+
+	inline string
+	open_data_file(DirectFile &out, const char* base, string const& num)
+	{ return open_data_file(out, base, num, m_fname_sfx); }
+
 	float			m_last_write_time;
 	int				m_writefreq;
 
+	WriterType		m_type;
+	// bytes written to the DirectFiles of the writer, and the time it took
+	IOStats			m_io;
+
 	string			m_dirname;
 	uint			m_FileCounter;
 	ofstream		m_timefile;
@@ -175,6 +400,15 @@ protected:
 	ofstream		m_WaveGagefile;
 
 	const Problem	*m_problem;
+	// number of particles of each device in the buffers being written
+	const uint		*m_partsPerDevice;
+
+	WriterFilter	m_filter;
+	// copies of the particles selected by the filter, allocated for
+	// m_filteredCapacity particles, and their number for each device
+	BufferList		m_filtered;
+	size_t			m_filteredCapacity;
+	uint			m_filteredPartsPerDevice[MAX_DEVICES_PER_NODE];
 	string			next_filenum();
 	string			current_filenum();
 	const GlobalData*		gdata;
@@ -97,6 +97,11 @@ public:
 	virtual void swap_elements(uint idx1, uint idx2, uint _buf=0) {
 		throw runtime_error("can't swap elements in AbstractBuffer");
 	};
+
+	// a new, unallocated buffer of the same kind and key
+	virtual AbstractBuffer *clone_empty() const {
+		throw runtime_error("can't clone AbstractBuffer");
+	}
 };
 
 /* This class encapsulates type-specific arrays of buffers.
@@ -56,6 +56,15 @@ setneibsconstants(const SimParams *simparams, const PhysParams *physparams,
 }
 
 
+void
+setneibsloads(uint numloads, const uint *object)
+{
+	CUDA_SAFE_CALL(cudaMemcpyToSymbol(cuneibs::d_numloads, &numloads, sizeof(uint)));
+	if (numloads)
+		CUDA_SAFE_CALL(cudaMemcpyToSymbol(cuneibs::d_loadobject, object, numloads*sizeof(uint)));
+}
+
+
 void
 getneibsconstants(SimParams *simparams, PhysParams *physparams)
 {
@@ -94,42 +103,42 @@ calcHash(float4*	pos,
 
 	switch (periodicbound) {
 		case PERIODIC_NONE:
-			cuneibs::calcHashDevice<PERIODIC_NONE><<< numBlocks, numThreads >>>(pos, particleHash, particleIndex,
+			cuneibs::calcHashDevice<PERIODIC_NONE><<< numBlocks, numThreads, 0, kernelStream() >>>(pos, particleHash, particleIndex,
 						particleInfo, compactDeviceMap, numParticles);
 			break;
 
 		case PERIODIC_X:
-			cuneibs::calcHashDevice<PERIODIC_X><<< numBlocks, numThreads >>>(pos, particleHash, particleIndex,
+			cuneibs::calcHashDevice<PERIODIC_X><<< numBlocks, numThreads, 0, kernelStream() >>>(pos, particleHash, particleIndex,
 						particleInfo, compactDeviceMap, numParticles);
 			break;
 
 		case PERIODIC_Y:
-			cuneibs::calcHashDevice<PERIODIC_Y><<< numBlocks, numThreads >>>(pos, particleHash, particleIndex,
+			cuneibs::calcHashDevice<PERIODIC_Y><<< numBlocks, numThreads, 0, kernelStream() >>>(pos, particleHash, particleIndex,
 						particleInfo, compactDeviceMap, numParticles);
 			break;
 
 		case PERIODIC_XY:
-			cuneibs::calcHashDevice<PERIODIC_XY><<< numBlocks, numThreads >>>(pos, particleHash, particleIndex,
+			cuneibs::calcHashDevice<PERIODIC_XY><<< numBlocks, numThreads, 0, kernelStream() >>>(pos, particleHash, particleIndex,
 						particleInfo, compactDeviceMap, numParticles);
 			break;
 
 		case PERIODIC_Z:
-			cuneibs::calcHashDevice<PERIODIC_Z><<< numBlocks, numThreads >>>(pos, particleHash, particleIndex,
+			cuneibs::calcHashDevice<PERIODIC_Z><<< numBlocks, numThreads, 0, kernelStream() >>>(pos, particleHash, particleIndex,
 						particleInfo, compactDeviceMap, numParticles);
 			break;
 
 		case PERIODIC_XZ:
-			cuneibs::calcHashDevice<PERIODIC_XZ><<< numBlocks, numThreads >>>(pos, particleHash, particleIndex,
+			cuneibs::calcHashDevice<PERIODIC_XZ><<< numBlocks, numThreads, 0, kernelStream() >>>(pos, particleHash, particleIndex,
 						particleInfo, compactDeviceMap, numParticles);
 			break;
 
 		case PERIODIC_YZ:
-			cuneibs::calcHashDevice<PERIODIC_YZ><<< numBlocks, numThreads >>>(pos, particleHash, particleIndex,
+			cuneibs::calcHashDevice<PERIODIC_YZ><<< numBlocks, numThreads, 0, kernelStream() >>>(pos, particleHash, particleIndex,
 						particleInfo, compactDeviceMap, numParticles);
 			break;
 
 		case PERIODIC_XYZ:
-			cuneibs::calcHashDevice<PERIODIC_XYZ><<< numBlocks, numThreads >>>(pos, particleHash, particleIndex,
+			cuneibs::calcHashDevice<PERIODIC_XYZ><<< numBlocks, numThreads, 0, kernelStream() >>>(pos, particleHash, particleIndex,
 						particleInfo, compactDeviceMap, numParticles);
 			break;
 
@@ -151,7 +160,7 @@ fixHash(hashKey*	particleHash,
 	uint numThreads = min(BLOCK_SIZE_CALCHASH, numParticles);
 	uint numBlocks = div_up(numParticles, numThreads);
 
-	cuneibs::fixHashDevice<<< numBlocks, numThreads >>>(particleHash, particleIndex,
+	cuneibs::fixHashDevice<<< numBlocks, numThreads, 0, kernelStream() >>>(particleHash, particleIndex,
 				particleInfo, compactDeviceMap, numParticles);
 
 	// check if kernel invocation generated an error
@@ -167,12 +176,74 @@ inverseParticleIndex (	uint*	particleIndex,
 	int numThreads = min(BLOCK_SIZE_REORDERDATA, numParticles);
 	int numBlocks = (int) ceil(numParticles / (float) numThreads);
 
-	cuneibs::inverseParticleIndexDevice<<< numBlocks, numThreads >>>(particleIndex, inversedParticleIndex, numParticles);
+	cuneibs::inverseParticleIndexDevice<<< numBlocks, numThreads, 0, kernelStream() >>>(particleIndex, inversedParticleIndex, numParticles);
 
 	// check if kernel invocation generated an error
 	CUT_CHECK_ERROR("InverseParticleIndex kernel execution failed");
 }
 
+void
+trackTracers(	uint*	tracerIndex,
+		const	uint*	inversedParticleIndex,
+				uint	numTracers,
+				uint	numParticles)
+{
+	uint numThreads = min(BLOCK_SIZE_TRACERS, numTracers);
+	uint numBlocks = div_up(numTracers, numThreads);
+
+	cuneibs::trackTracersDevice<<< numBlocks, numThreads, 0, kernelStream() >>>(tracerIndex, inversedParticleIndex,
+				numTracers, numParticles);
+
+	// check if kernel invocation generated an error
+	CUT_CHECK_ERROR("TrackTracers kernel execution failed");
+}
+
+void
+locateTracers(	uint*			tracerIndex,
+		const	uint*			tracerIds,
+		const	particleinfo*	info,
+				uint			numTracers,
+				uint			numParticles)
+{
+	CUDA_SAFE_CALL(cudaMemset(tracerIndex, 0xff, numTracers*sizeof(uint)));
+
+	if (!numParticles)
+		return;
+
+	uint numThreads = min(BLOCK_SIZE_TRACERS, numParticles);
+	uint numBlocks = div_up(numParticles, numThreads);
+
+	cuneibs::locateTracersDevice<<< numBlocks, numThreads, 0, kernelStream() >>>(tracerIndex, tracerIds, info,
+				numTracers, numParticles);
+
+	// check if kernel invocation generated an error
+	CUT_CHECK_ERROR("LocateTracers kernel execution failed");
+}
+
+void
+gatherTracers(	uint*			tracerIndex,
+		const	uint*			tracerIds,
+				float4*			tracerPos,
+				hashKey*		tracerHash,
+				float4*			tracerVel,
+		const	float4*			pos,
+		const	hashKey*		particleHash,
+		const	float4*			vel,
+		const	particleinfo*	info,
+				uint			numTracers,
+				uint			numParticles)
+{
+	uint numThreads = min(BLOCK_SIZE_TRACERS, numTracers);
+	uint numBlocks = div_up(numTracers, numThreads);
+
+	cuneibs::gatherTracersDevice<<< numBlocks, numThreads, 0, kernelStream() >>>(tracerIndex, tracerIds,
+				tracerPos, tracerHash, tracerVel, pos, particleHash, vel, info,
+				numTracers, numParticles);
+
+	// check if kernel invocation generated an error
+	CUT_CHECK_ERROR("GatherTracers kernel execution failed");
+}
+
 void reorderDataAndFindCellStart(	uint*				cellStart,			// output: cell start index
 									uint*				cellEnd,			// output: cell end index
 									uint*				segmentStart,
@@ -227,7 +298,7 @@ void reorderDataAndFindCellStart(	uint*				cellStart,			// output: cell start in
 		CUDA_SAFE_CALL(cudaBindTexture(0, tviscTex, oldTurbVisc, numParticles*sizeof(float)));
 
 	uint smemSize = sizeof(uint)*(numThreads+1);
-	cuneibs::reorderDataAndFindCellStartDevice<<< numBlocks, numThreads, smemSize >>>(cellStart, cellEnd, segmentStart,
+	cuneibs::reorderDataAndFindCellStartDevice<<< numBlocks, numThreads, smemSize, kernelStream() >>>(cellStart, cellEnd, segmentStart,
 		newPos, newVel, newInfo, newBoundElement, newGradGamma, newVertices, newTKE, newEps, newTurbVisc,
 												particleHash, particleIndex, numParticles, inversedParticleIndex);
 
@@ -296,7 +367,7 @@ buildNeibsList(	neibdata*			neibsList,
 
 #define BUILDNEIBS_CASE(use_sa, periodic) \
 	case periodic: \
-		cuneibs::buildNeibsListDevice<use_sa, periodic, true><<<numBlocks, numThreads>>>(params); \
+		cuneibs::buildNeibsListDevice<use_sa, periodic, true><<<numBlocks, numThreads, 0, kernelStream()>>>(params); \
 		break;
 
 #define BUILDNEIBS_SWITCH(use_sa) \
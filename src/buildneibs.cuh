@@ -46,6 +46,7 @@
 	#define MIN_BLOCKS_REORDERDATA	6
 	#define BLOCK_SIZE_BUILDNEIBS	256
 	#define MIN_BLOCKS_BUILDNEIBS	5
+	#define BLOCK_SIZE_TRACERS		128
 #else
 	#define BLOCK_SIZE_CALCHASH		256
 	#define MIN_BLOCKS_CALCHASH		1
@@ -53,6 +54,7 @@
 	#define MIN_BLOCKS_REORDERDATA	1
 	#define BLOCK_SIZE_BUILDNEIBS	256
 	#define MIN_BLOCKS_BUILDNEIBS	1
+	#define BLOCK_SIZE_TRACERS		128
 #endif
 
 
@@ -63,6 +65,10 @@ setneibsconstants(const SimParams *simparams, const PhysParams *physparams,
 	float3 const& worldOrigin, uint3 const& gridSize, float3 const& cellSize,
 	idx_t const& allocatedParticles);
 
+// object numbers of the loaded objects, whose particles need a neighbor list
+void
+setneibsloads(uint numloads, const uint *object);
+
 void
 getneibsconstants(SimParams *simparams, PhysParams *physparams);
 
@@ -93,6 +99,39 @@ inverseParticleIndex (	uint*	particleIndex,
 			uint*	inversedParticleIndex,
 			uint	numParticles);
 
+// move the indices of the numTracers tracers after a sort with the inverse particle
+// index; numParticles is the number of particles sorted. The tracers not held by the
+// device have index UINT_MAX (see Tracers.h)
+void
+trackTracers(	uint*	tracerIndex,
+		const	uint*	inversedParticleIndex,
+				uint	numTracers,
+				uint	numParticles);
+
+// find the indices of the tracers, whose sorted ids are tracerIds, among the
+// particles [0, numParticles)
+void
+locateTracers(	uint*			tracerIndex,
+		const	uint*			tracerIds,
+		const	particleinfo*	info,
+				uint			numTracers,
+				uint			numParticles);
+
+// gather the positions, hashes and velocities of the tracers among the particles
+// [0, numParticles), forgetting the tracers that are not there
+void
+gatherTracers(	uint*			tracerIndex,
+		const	uint*			tracerIds,
+				float4*			tracerPos,
+				hashKey*		tracerHash,
+				float4*			tracerVel,
+		const	float4*			pos,
+		const	hashKey*		particleHash,
+		const	float4*			vel,
+		const	particleinfo*	info,
+				uint			numTracers,
+				uint			numParticles);
+
 void reorderDataAndFindCellStart(	uint*				cellStart,			// output: cell start index
 									uint*				cellEnd,			// output: cell end index
 									uint*				segmentStart,
@@ -36,6 +36,9 @@
 #ifndef _BUILDNEIBS_KERNEL_
 #define _BUILDNEIBS_KERNEL_
 
+// UINT_MAX
+#include <limits.h>
+
 #include "particledefine.h"
 #include "textures.cuh"
 #include "vector_math.h"
@@ -48,8 +51,24 @@ __constant__ idx_t d_neiblist_stride;
 __device__ int d_numInteractions;
 __device__ int d_maxNeibs;
 
+// object numbers of the objects whose loads are computed (see Loads.h)
+__constant__ uint d_numloads;
+__constant__ uint d_loadobject[MAXLOADS];
+
 #include "cellgrid.h"
 
+/// Does the particle belong to an object whose loads are computed?
+__device__ __forceinline__ bool
+isLoaded(const particleinfo &info)
+{
+	if (!WALL(info))
+		return false;
+	for (uint load = 0; load < d_numloads; ++load)
+		if (d_loadobject[load] == object(info))
+			return true;
+	return false;
+}
+
 /// Clamp grid position to edges according to periodicity
 /*! This function clamp grid position to edges according to the chosen
  * periodicity, returns the new grid position and update the grid offset.
@@ -261,6 +280,109 @@ void inverseParticleIndexDevice (   uint*   particleIndex,
     }
 }
 
+/// Moves the indices of the tracers after the sort
+/*! The index of each tracer held by the device is replaced by the one
+ *	it has after the sort, read from the inverse particle index. Tracers
+ *	which were not held by the device are marked by UINT_MAX.
+ *
+ *	\param[in,out] tracerIndex : index of each tracer
+ *	\param[in] inversedParticleIndex : new index of each particle
+ *	\param[in] numTracers : number of tracers
+ *	\param[in] numParticles : number of particles before the sort
+ */
+__global__
+void trackTracersDevice(	uint*		tracerIndex,
+					const	uint*		inversedParticleIndex,
+					const	uint		numTracers,
+					const	uint		numParticles)
+{
+	const uint tracer = INTMUL(blockIdx.x,blockDim.x) + threadIdx.x;
+
+	if (tracer < numTracers) {
+		const uint index = tracerIndex[tracer];
+		tracerIndex[tracer] = (index < numParticles ? inversedParticleIndex[index] : UINT_MAX);
+	}
+}
+
+/// Finds the tracers among the particles
+/*! Each particle looks for its id among the sorted ids of the tracers,
+ *	and stores its index for the tracer, if it is one.
+ *
+ *	\param[out] tracerIndex : index of each tracer
+ *	\param[in] tracerIds : sorted ids of the tracers
+ *	\param[in] info : particle info
+ *	\param[in] numTracers : number of tracers
+ *	\param[in] numParticles : number of particles to look at
+ */
+__global__
+void locateTracersDevice(	uint*			tracerIndex,
+					const	uint*			tracerIds,
+					const	particleinfo*	info,
+					const	uint			numTracers,
+					const	uint			numParticles)
+{
+	const uint index = INTMUL(blockIdx.x,blockDim.x) + threadIdx.x;
+
+	if (index >= numParticles)
+		return;
+
+	const uint pid = id(info[index]);
+
+	// binary search of the first id not less than pid
+	uint lo = 0, hi = numTracers;
+	while (lo < hi) {
+		const uint mid = (lo + hi)/2;
+		if (tracerIds[mid] < pid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo < numTracers && tracerIds[lo] == pid)
+		tracerIndex[lo] = index;
+}
+
+/// Gathers the positions, hashes and velocities of the tracers
+/*! A tracer is held by the device if its index is one of the given particles,
+ *	and the particle has the id of the tracer: the others are forgotten, by
+ *	setting their index to UINT_MAX.
+ *
+ *	\param[in,out] tracerIndex : index of each tracer
+ *	\param[in] tracerIds : sorted ids of the tracers
+ *	\param[out] tracerPos, tracerHash, tracerVel : gathered values
+ *	\param[in] pos, particleHash, vel, info : particle data
+ *	\param[in] numTracers : number of tracers
+ *	\param[in] numParticles : number of particles held by the device
+ */
+__global__
+void gatherTracersDevice(	uint*			tracerIndex,
+					const	uint*			tracerIds,
+							float4*			tracerPos,
+							hashKey*		tracerHash,
+							float4*			tracerVel,
+					const	float4*			pos,
+					const	hashKey*		particleHash,
+					const	float4*			vel,
+					const	particleinfo*	info,
+					const	uint			numTracers,
+					const	uint			numParticles)
+{
+	const uint tracer = INTMUL(blockIdx.x,blockDim.x) + threadIdx.x;
+
+	if (tracer >= numTracers)
+		return;
+
+	const uint index = tracerIndex[tracer];
+	if (index >= numParticles || id(info[index]) != tracerIds[tracer]) {
+		tracerIndex[tracer] = UINT_MAX;
+		return;
+	}
+
+	tracerPos[tracer] = pos[index];
+	tracerHash[tracer] = particleHash[index];
+	tracerVel[tracer] = vel[index];
+}
+
 /// Reorders particles data after the sort and updates cells informations
 /*! This kernel should be called after the sort. It
  * 		- computes the index of the first and last particle of
@@ -729,11 +851,14 @@ buildNeibsListDevice(buildneibs_params<use_sa_boundary> params)
 		// Read particle info from texture
 		const particleinfo info = tex1Dfetch(infoTex, index);
 
-		// the neighbor list is only constructed for fluid, testpoint, and object particles.
+		// the neighbor list is only constructed for fluid, testpoint, object particles
+		// and the particles of the loaded objects.
 		// if we use SA_BOUNDARY, also for vertex and boundary particles
 		bool build_nl = FLUID(info) || TESTPOINTS(info) || OBJECT(info);
 		if (use_sa_boundary)
 			build_nl = build_nl || VERTEX(info) || BOUNDARY(info);
+		else
+			build_nl = build_nl || isLoaded(info);
 		if (!build_nl)
 			break; // nothing to do for other particles
 
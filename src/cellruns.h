@@ -0,0 +1,86 @@
+/*  Copyright 2013 Alexis Herault, Giuseppe Bilotta, Robert A. Dalrymple, Eugenio Rustico, Ciro Del Negro
+
+    Istituto Nazionale di Geofisica e Vulcanologia
+        Sezione di Catania, Catania, Italy
+
+    Università di Catania, Catania, Italy
+
+    Johns Hopkins University, Baltimore, MD
+
+    This file is part of GPUSPH.
+
+    GPUSPH is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GPUSPH is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GPUSPH.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _CELLRUNS_H
+#define _CELLRUNS_H
+
+/* Runs of consecutive (linearized) cells and ranges of consecutive particles,
+ * used to DUMP only the particles in a region of the domain (see Writer::NeededCells()
+ * and the dumpBuffers() method of the workers)
+ */
+
+#include <algorithm>
+#include <climits>
+#include <utility>
+#include <vector>
+
+// uint
+#include "common_types.h"
+// EMPTY_CELL
+#include "multi_gpu_defines.h"
+
+// cells [first, second) of the linearized grid
+typedef std::vector<std::pair<uint, uint> > CellRuns;
+// particles [first, second)
+typedef std::vector<std::pair<uint, uint> > ParticleRanges;
+
+// sort the runs and merge the overlapping or adjacent ones
+inline void
+merge_cell_runs(CellRuns &runs)
+{
+	if (runs.empty())
+		return;
+
+	std::sort(runs.begin(), runs.end());
+	size_t last = 0;
+	for (size_t r = 1; r < runs.size(); ++r) {
+		if (runs[r].first <= runs[last].second)
+			runs[last].second = std::max(runs[last].second, runs[r].second);
+		else
+			runs[++last] = runs[r];
+	}
+	runs.resize(last + 1);
+}
+
+// append to ranges the particles of numCells cells, given their cellStart and cellEnd,
+// merging contiguous ranges. Only the internal particles (those below numInternal)
+// are considered: cells of the neighboring devices hold external particles
+inline void
+append_particle_ranges(const uint *cellStart, const uint *cellEnd, uint numCells,
+	uint numInternal, ParticleRanges &ranges)
+{
+	for (uint c = 0; c < numCells; ++c) {
+		const uint start = cellStart[c];
+		if (start == EMPTY_CELL || start >= numInternal)
+			continue;
+		const uint end = std::min(cellEnd[c], numInternal);
+		if (!ranges.empty() && ranges.back().second == start)
+			ranges.back().second = end;
+		else
+			ranges.push_back(std::make_pair(start, end));
+	}
+}
+
+#endif
@@ -0,0 +1,94 @@
+/*  Copyright 2013 Alexis Herault, Giuseppe Bilotta, Robert A. Dalrymple, Eugenio Rustico, Ciro Del Negro
+
+    Istituto Nazionale di Geofisica e Vulcanologia
+        Sezione di Catania, Catania, Italy
+
+    Università di Catania, Catania, Italy
+
+    Johns Hopkins University, Baltimore, MD
+
+    This file is part of GPUSPH.
+
+    GPUSPH is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GPUSPH is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GPUSPH.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _CPU_BUFFER_H
+#define _CPU_BUFFER_H
+
+#include "buffer.h"
+
+/* Specializations of the buffer class that reside in host
+ * memory and are used as the working arrays of a CPUWorker */
+
+// malloc
+#include <cstdlib>
+// memset
+#include <cstring>
+
+// bad_alloc
+#include <new>
+
+// swap
+#include <algorithm>
+
+// a specialization of buffers, with host allocation and free.
+// Unlike HostBuffer, all the arrays of multi-buffered keys
+// are allocated, since the CPUWorker ping-pongs between them
+// exactly as the GPUWorker does on the device
+template<flag_t Key>
+class CPUBuffer : public Buffer<Key>
+{
+	typedef Buffer<Key> baseclass;
+public:
+	typedef typename baseclass::element_type element_type;
+
+	// constructor: nothing to do
+	CPUBuffer(int _init = 0) : Buffer<Key>(_init) {}
+
+	// destructor: free allocated memory
+	virtual ~CPUBuffer() {
+		const int N = baseclass::array_count;
+		element_type **bufs = baseclass::get_raw_ptr();
+		for (int i = 0; i < N; ++i) {
+			if (bufs[i]) {
+				free(bufs[i]);
+				bufs[i] = NULL;
+			}
+		}
+	}
+
+	// allocate and clear buffer on host
+	virtual size_t alloc(size_t elems) {
+		size_t bufmem = elems*sizeof(element_type);
+		const int N = baseclass::array_count;
+		element_type **bufs = baseclass::get_raw_ptr();
+		for (int i = 0; i < N; ++i) {
+			// malloc instead of calloc since the init
+			// value might be nonzero
+			bufs[i] = (element_type*)malloc(bufmem);
+			if (!bufs[i])
+				throw std::bad_alloc();
+			memset(bufs[i], baseclass::get_init_value(), bufmem);
+		}
+		return bufmem*N;
+	}
+
+	virtual void swap_elements(uint idx1, uint idx2, uint _buf=0) {
+		element_type *buf = baseclass::get_raw_ptr()[_buf];
+		std::swap(buf[idx1], buf[idx2]);
+	}
+
+};
+
+#endif
@@ -9,6 +9,13 @@
 #define CUDA_SAFE_CALL(err)			__cudaSafeCall(err, __FILE__, __LINE__)
 #define CUT_CHECK_ERROR(err)		__cutilGetSyncError(err, __FILE__, __LINE__)
 
+/* Stream the kernels of the calling thread are launched on (see cudautil.cu).
+ * It is the default stream, except while a worker runs the independent steps of
+ * a command sequence concurrently (see GPUWorker::runCommandSequence). On the
+ * other streams the checks below don't synchronize, or the steps would be
+ * serialized again: errors are caught when the worker joins the streams. */
+cudaStream_t kernelStream();
+
 inline void __cudaSafeCallNoSync( cudaError err, const char *file, const int line )
 {
     if( cudaSuccess != err) {
@@ -21,7 +28,7 @@ inline void __cudaSafeCallNoSync( cudaError err, const char *file, const int lin
 
 inline void __cudaSafeCall( cudaError err, const char *file, const int line )
 {
-	if( err == cudaSuccess) err = cudaDeviceSynchronize();
+	if( err == cudaSuccess && !kernelStream()) err = cudaDeviceSynchronize();
     if( cudaSuccess != err) {
 		fprintf(stderr, "%s(%i) : cudaSafeCall() Runtime API error %d: %s.\n",
                 file, line, (int)err, cudaGetErrorString( err ) );
@@ -48,7 +55,7 @@ inline void __cutilGetLastError( const char *errorMessage, const char *file, con
 
 inline void __cutilGetSyncError( const char *errorMessage, const char *file, const int line )
 {
-    cudaError_t err = cudaDeviceSynchronize();
+    cudaError_t err = kernelStream() ? cudaGetLastError() : cudaDeviceSynchronize();
     if( cudaSuccess != err) {
         fprintf(stderr, "%s(%i) : cutilCheckMsg() CUTIL CUDA error : %s : (%d) %s.\n",
                 file, line, errorMessage, (int)err, cudaGetErrorString( err ) );
@@ -125,3 +125,16 @@ void threadSync()
 	CUDA_SAFE_CALL(cudaThreadSynchronize());
 }
 
+
+// each worker thread has its own current stream
+static __thread cudaStream_t s_kernelStream = 0;
+
+void setKernelStream(cudaStream_t stream)
+{
+	s_kernelStream = stream;
+}
+
+cudaStream_t kernelStream()
+{
+	return s_kernelStream;
+}
@@ -15,4 +15,7 @@ void freeArray(void *devPtr);
 
 void threadSync();
 
+// launch the kernels of the calling thread on the given stream (0: the default one)
+void setKernelStream(cudaStream_t stream);
+
 #endif
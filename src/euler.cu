@@ -79,7 +79,7 @@ seteulerrbsteprot(const float* rot, int numbodies)
 }
 
 
-void
+float
 euler(	const float4*		oldPos,
 		const hashKey*		particleHash,
 		const float4*		oldVel,
@@ -99,30 +99,52 @@ euler(	const float4*		oldPos,
 		const float			dt2,
 		const int			step,
 		const float			t,
-		const bool			xsphcorr)
+		const bool			xsphcorr,
+		const bool			trackDisplacement)
 {
 	// thread per particle
 	uint numThreads = min(BLOCK_SIZE_INTEGRATE, particleRangeEnd);
 	uint numBlocks = div_up(particleRangeEnd, numThreads);
 
+	if (trackDisplacement) {
+		const uint zero = 0;
+		CUDA_SAFE_CALL(cudaMemcpyToSymbol(cueuler::d_maxDisplacement, &zero, sizeof(uint)));
+	}
+
 	// execute the kernel
 	if (step == 1) {
 		if (xsphcorr)
-			cueuler::eulerDevice<1, 1><<< numBlocks, numThreads >>>(oldPos, particleHash, oldVel, oldTKE, oldEps,
-								info, forces, keps_dkde, xsph, newPos, newVel, newTKE, newEps, particleRangeEnd, dt, dt2, t);
+			cueuler::eulerDevice<1, 1><<< numBlocks, numThreads, 0, kernelStream() >>>(oldPos, particleHash, oldVel, oldTKE, oldEps,
+								info, forces, keps_dkde, xsph, newPos, newVel, newTKE, newEps, particleRangeEnd, dt, dt2, t, trackDisplacement);
 		else
-			cueuler::eulerDevice<1, 0><<< numBlocks, numThreads >>>(oldPos, particleHash, oldVel, oldTKE, oldEps,
-								info, forces, keps_dkde, xsph, newPos, newVel, newTKE, newEps, particleRangeEnd, dt, dt2, t);
+			cueuler::eulerDevice<1, 0><<< numBlocks, numThreads, 0, kernelStream() >>>(oldPos, particleHash, oldVel, oldTKE, oldEps,
+								info, forces, keps_dkde, xsph, newPos, newVel, newTKE, newEps, particleRangeEnd, dt, dt2, t, trackDisplacement);
 	} else if (step == 2) {
 		if (xsphcorr)
-			cueuler::eulerDevice<2, 1><<< numBlocks, numThreads >>>(oldPos, particleHash, oldVel, oldTKE, oldEps,
-								info, forces, keps_dkde, xsph, newPos, newVel, newTKE, newEps, particleRangeEnd, dt, dt2, t);
+			cueuler::eulerDevice<2, 1><<< numBlocks, numThreads, 0, kernelStream() >>>(oldPos, particleHash, oldVel, oldTKE, oldEps,
+								info, forces, keps_dkde, xsph, newPos, newVel, newTKE, newEps, particleRangeEnd, dt, dt2, t, trackDisplacement);
 		else
-			cueuler::eulerDevice<2, 0><<< numBlocks, numThreads >>>(oldPos, particleHash, oldVel, oldTKE, oldEps,
-								info, forces, keps_dkde, xsph, newPos, newVel, newTKE, newEps, particleRangeEnd, dt, dt2, t);
-	} // if (step == 2)
+			cueuler::eulerDevice<2, 0><<< numBlocks, numThreads, 0, kernelStream() >>>(oldPos, particleHash, oldVel, oldTKE, oldEps,
+								info, forces, keps_dkde, xsph, newPos, newVel, newTKE, newEps, particleRangeEnd, dt, dt2, t, trackDisplacement);
+	} else if (step == 3) {
+		if (xsphcorr)
+			cueuler::eulerDevice<3, 1><<< numBlocks, numThreads, 0, kernelStream() >>>(oldPos, particleHash, oldVel, oldTKE, oldEps,
+								info, forces, keps_dkde, xsph, newPos, newVel, newTKE, newEps, particleRangeEnd, dt, dt2, t, trackDisplacement);
+		else
+			cueuler::eulerDevice<3, 0><<< numBlocks, numThreads, 0, kernelStream() >>>(oldPos, particleHash, oldVel, oldTKE, oldEps,
+								info, forces, keps_dkde, xsph, newPos, newVel, newTKE, newEps, particleRangeEnd, dt, dt2, t, trackDisplacement);
+	} else if (step == 4) {
+		// positions are not updated, so XSPH makes no difference
+		cueuler::eulerDevice<4, 0><<< numBlocks, numThreads, 0, kernelStream() >>>(oldPos, particleHash, oldVel, oldTKE, oldEps,
+							info, forces, keps_dkde, xsph, newPos, newVel, newTKE, newEps, particleRangeEnd, dt, dt2, t, trackDisplacement);
+	} // if (step == 4)
 
 	// check if kernel invocation generated an error
 	CUT_CHECK_ERROR("Euler kernel execution failed");
+
+	float maxDisplacement = 0;
+	if (trackDisplacement)
+		CUDA_SAFE_CALL(cudaMemcpyFromSymbol(&maxDisplacement, cueuler::d_maxDisplacement, sizeof(float), 0));
+	return maxDisplacement;
 }
 }
@@ -53,7 +53,10 @@ seteulerrbtrans(const float3* trans, int numbodies);
 void
 seteulerrbsteprot(const float* rot, int numbodies);
 
-void
+// step is 1 or 2 for the predictor-corrector, 3 (kick and drift) or 4 (closing kick)
+// for the kick-drift-kick scheme (see eulerStep() in GlobalData.h)
+// returns the maximum displacement of the particles if trackDisplacement is set, 0 otherwise
+float
 euler(	const float4*		oldPos,
 		const hashKey*		particleHash,
 		const float4*		oldVel,
@@ -73,6 +76,7 @@ euler(	const float4*		oldPos,
 		const float			dt2,
 		const int			step,
 		const float			t,
-		const bool			xsphcorr);
+		const bool			xsphcorr,
+		const bool			trackDisplacement);
 }
 #endif
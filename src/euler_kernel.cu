@@ -44,6 +44,10 @@ __constant__ float3	d_rbcg[MAXBODIES];
 __constant__ float3	d_rbtrans[MAXBODIES];
 __constant__ float	d_rbsteprot[9*MAXBODIES];
 
+// maximum displacement of the particles in the last step (see euler()), stored as
+// the bits of a non-negative float, which compare like the float itself
+__device__ uint		d_maxDisplacement;
+
 #include "cellgrid.h"
 
 /// Apply rotation to a given vector
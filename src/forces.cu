@@ -26,6 +26,7 @@
 #include <stdio.h>
 #include <thrust/device_vector.h>
 #include <thrust/scan.h>
+#include <thrust/reduce.h>
 #include <thrust/functional.h>
 
 #include "textures.cuh"
@@ -58,7 +59,7 @@ void*	reduce_buffer = NULL;
  */
 #define FORCES_PARAMS(kernel, boundarytype, visc, dyndt, usexsph) \
 		forces_params<kernel, boundarytype, visc, dyndt, usexsph>( \
-			forces, rbforces, rbtorques, \
+			forces, rbforces, rbtorques, loadforces, \
 			pos, particleHash, cellStart, neibsList, fromParticle, toParticle, \
 			deltap, slength, influenceradius, \
 			cfl, cflTVisc, cflOffset, \
@@ -69,16 +70,16 @@ void*	reduce_buffer = NULL;
 #define KERNEL_CHECK(kernel, boundarytype, formulation, visc, dem) \
 	case kernel: \
 		if (!dtadapt && !xsphcorr) \
-				cuforces::forcesDevice<kernel, formulation, boundarytype, visc, false, false, dem><<< numBlocks, numThreads, dummy_shared >>>\
+				cuforces::forcesDevice<kernel, formulation, boundarytype, visc, false, false, dem><<< numBlocks, numThreads, dummy_shared, kernelStream() >>>\
 						(FORCES_PARAMS(kernel, boundarytype, visc, false, false)); \
 		else if (!dtadapt && xsphcorr) \
-				cuforces::forcesDevice<kernel, formulation, boundarytype, visc, false, true, dem><<< numBlocks, numThreads, dummy_shared >>>\
+				cuforces::forcesDevice<kernel, formulation, boundarytype, visc, false, true, dem><<< numBlocks, numThreads, dummy_shared, kernelStream() >>>\
 						(FORCES_PARAMS(kernel, boundarytype, visc, false, true)); \
 		else if (dtadapt && !xsphcorr) \
-				cuforces::forcesDevice<kernel, formulation, boundarytype, visc, true, false, dem><<< numBlocks, numThreads, dummy_shared >>>\
+				cuforces::forcesDevice<kernel, formulation, boundarytype, visc, true, false, dem><<< numBlocks, numThreads, dummy_shared, kernelStream() >>>\
 						(FORCES_PARAMS(kernel, boundarytype, visc, true, false)); \
 		else if (dtadapt && xsphcorr) \
-				cuforces::forcesDevice<kernel, formulation, boundarytype, visc, true, true, dem><<< numBlocks, numThreads, dummy_shared >>>\
+				cuforces::forcesDevice<kernel, formulation, boundarytype, visc, true, true, dem><<< numBlocks, numThreads, dummy_shared, kernelStream() >>>\
 						(FORCES_PARAMS(kernel, boundarytype, visc, true, true)); \
 		break
 
@@ -134,45 +135,45 @@ void*	reduce_buffer = NULL;
 
 #define SPS_CHECK(kernel) \
 	case kernel: \
-		cuforces::SPSstressMatrixDevice<kernel><<< numBlocks, numThreads, dummy_shared >>> \
+		cuforces::SPSstressMatrixDevice<kernel><<< numBlocks, numThreads, dummy_shared, kernelStream() >>> \
 				(pos, tau[0], tau[1], tau[2], particleHash, cellStart, neibsList, particleRangeEnd, slength, influenceradius); \
 		break
 
 #define SHEPARD_CHECK(kernel) \
 	case kernel: \
-		cuforces::shepardDevice<kernel><<< numBlocks, numThreads, dummy_shared >>> \
+		cuforces::shepardDevice<kernel><<< numBlocks, numThreads, dummy_shared, kernelStream() >>> \
 				 (pos, newVel, particleHash, cellStart, neibsList, particleRangeEnd, slength, influenceradius); \
 	break
 
 #define MLS_CHECK(kernel) \
 	case kernel: \
-		cuforces::MlsDevice<kernel><<< numBlocks, numThreads, dummy_shared >>> \
+		cuforces::MlsDevice<kernel><<< numBlocks, numThreads, dummy_shared, kernelStream() >>> \
 				(pos, newVel, particleHash, cellStart, neibsList, particleRangeEnd, slength, influenceradius); \
 	break
 
 #define VORT_CHECK(kernel) \
 	case kernel: \
-		cuforces::calcVortDevice<kernel><<< numBlocks, numThreads >>> \
+		cuforces::calcVortDevice<kernel><<< numBlocks, numThreads, 0, kernelStream() >>> \
 				 (pos, vort, particleHash, cellStart, neibsList, particleRangeEnd, slength, influenceradius); \
 	break
 
 //Testpoints
 #define TEST_CHECK(kernel) \
 	case kernel: \
-		cuforces::calcTestpointsVelocityDevice<kernel><<< numBlocks, numThreads >>> \
+		cuforces::calcTestpointsVelocityDevice<kernel><<< numBlocks, numThreads, 0, kernelStream() >>> \
 				(pos, newVel, particleHash, cellStart, neibsList, particleRangeEnd, slength, influenceradius); \
 	break
 
 // Free surface detection
 #define SURFACE_CHECK(kernel, savenormals) \
 	case kernel: \
-		cuforces::calcSurfaceparticleDevice<kernel, savenormals><<< numBlocks, numThreads >>> \
+		cuforces::calcSurfaceparticleDevice<kernel, savenormals><<< numBlocks, numThreads, 0, kernelStream() >>> \
 				(pos, normals, newInfo, particleHash, cellStart, neibsList, particleRangeEnd, slength, influenceradius); \
 	break
 
 #define DYNBOUNDARY_CHECK(kernel) \
 	case kernel: \
-		cuforces::dynamicBoundConditionsDevice<kernel><<< numBlocks, numThreads, dummy_shared >>> \
+		cuforces::dynamicBoundConditionsDevice<kernel><<< numBlocks, numThreads, dummy_shared, kernelStream() >>> \
 				 (oldPos, oldVel, oldTKE, oldEps, newGam, particleHash, cellStart, neibsList, particleRangeEnd, deltap, slength, influenceradius, initStep); \
 	break
 
@@ -323,6 +324,21 @@ setforcesrbstart(const uint* rbfirstindex, int numbodies)
 	CUDA_SAFE_CALL(cudaMemcpyToSymbol(cuforces::d_rbstartindex, rbfirstindex, numbodies*sizeof(uint)));
 }
 
+
+void
+setforcesloads(uint numloads, const uint *object, const uint *firstid, const uint *numids,
+	const uint *firstslot, const float3 *center)
+{
+	CUDA_SAFE_CALL(cudaMemcpyToSymbol(cuforces::d_numloads, &numloads, sizeof(uint)));
+	if (!numloads)
+		return;
+	CUDA_SAFE_CALL(cudaMemcpyToSymbol(cuforces::d_loadobject, object, numloads*sizeof(uint)));
+	CUDA_SAFE_CALL(cudaMemcpyToSymbol(cuforces::d_loadfirstid, firstid, numloads*sizeof(uint)));
+	CUDA_SAFE_CALL(cudaMemcpyToSymbol(cuforces::d_loadnumids, numids, numloads*sizeof(uint)));
+	CUDA_SAFE_CALL(cudaMemcpyToSymbol(cuforces::d_loadfirstslot, firstslot, numloads*sizeof(uint)));
+	CUDA_SAFE_CALL(cudaMemcpyToSymbol(cuforces::d_loadcenter, center, numloads*sizeof(float3)));
+}
+
 void
 sps(		float2*			tau[],
 	const	float4	*pos,
@@ -486,6 +502,7 @@ forces(
 	const	float4	*boundelem,
 			float4	*rbforces,
 			float4	*rbtorques,
+			float4	*loadforces,
 			float4	*xsph,
 	const	particleinfo	*info,
 	const	hashKey	*particleHash,
@@ -827,6 +844,29 @@ void reduceRbForces(float4*		forces,
 }
 
 
+void reduceLoads(	const	float4*		loads,
+					const	uint*		keys,
+							float4*		reduced,
+							uint*		reducedKeys,
+							float4*		totals,
+							uint		numLoads,
+							uint		numSlots)
+{
+	thrust::device_ptr<const float4> loads_devptr = thrust::device_pointer_cast(loads);
+	thrust::device_ptr<const uint> keys_devptr = thrust::device_pointer_cast(keys);
+	thrust::device_ptr<float4> reduced_devptr = thrust::device_pointer_cast(reduced);
+	thrust::device_ptr<uint> reducedKeys_devptr = thrust::device_pointer_cast(reducedKeys);
+
+	// the keys are 2*l for the forces of the l-th object and 2*l + 1 for its moments,
+	// so the sums come out in the order of the totals and are downloaded at once
+	thrust::reduce_by_key(keys_devptr, keys_devptr + numSlots, loads_devptr,
+				reducedKeys_devptr, reduced_devptr,
+				thrust::equal_to<uint>(), thrust::plus<float4>());
+
+	CUDA_SAFE_CALL(cudaMemcpy(totals, reduced, 2*numLoads*sizeof(float4), cudaMemcpyDeviceToHost));
+}
+
+
 void
 reducefmax(	const int	size,
 			const int	threads,
@@ -844,25 +884,25 @@ reducefmax(	const int	size,
 	switch (threads)
 	{
 		case 512:
-			cuforces::fmaxDevice<512><<< dimGrid, dimBlock, smemSize >>>(d_idata, d_odata, size); break;
+			cuforces::fmaxDevice<512><<< dimGrid, dimBlock, smemSize, kernelStream() >>>(d_idata, d_odata, size); break;
 		case 256:
-			cuforces::fmaxDevice<256><<< dimGrid, dimBlock, smemSize >>>(d_idata, d_odata, size); break;
+			cuforces::fmaxDevice<256><<< dimGrid, dimBlock, smemSize, kernelStream() >>>(d_idata, d_odata, size); break;
 		case 128:
-			cuforces::fmaxDevice<128><<< dimGrid, dimBlock, smemSize >>>(d_idata, d_odata, size); break;
+			cuforces::fmaxDevice<128><<< dimGrid, dimBlock, smemSize, kernelStream() >>>(d_idata, d_odata, size); break;
 		case 64:
-			cuforces::fmaxDevice<64><<< dimGrid, dimBlock, smemSize >>>(d_idata, d_odata, size); break;
+			cuforces::fmaxDevice<64><<< dimGrid, dimBlock, smemSize, kernelStream() >>>(d_idata, d_odata, size); break;
 		case 32:
-			cuforces::fmaxDevice<32><<< dimGrid, dimBlock, smemSize >>>(d_idata, d_odata, size); break;
+			cuforces::fmaxDevice<32><<< dimGrid, dimBlock, smemSize, kernelStream() >>>(d_idata, d_odata, size); break;
 		case 16:
-			cuforces::fmaxDevice<16><<< dimGrid, dimBlock, smemSize >>>(d_idata, d_odata, size); break;
+			cuforces::fmaxDevice<16><<< dimGrid, dimBlock, smemSize, kernelStream() >>>(d_idata, d_odata, size); break;
 		case  8:
-			cuforces::fmaxDevice<8><<< dimGrid, dimBlock, smemSize >>>(d_idata, d_odata, size); break;
+			cuforces::fmaxDevice<8><<< dimGrid, dimBlock, smemSize, kernelStream() >>>(d_idata, d_odata, size); break;
 		case  4:
-			cuforces::fmaxDevice<4><<< dimGrid, dimBlock, smemSize >>>(d_idata, d_odata, size); break;
+			cuforces::fmaxDevice<4><<< dimGrid, dimBlock, smemSize, kernelStream() >>>(d_idata, d_odata, size); break;
 		case  2:
-			cuforces::fmaxDevice<2><<< dimGrid, dimBlock, smemSize >>>(d_idata, d_odata, size); break;
+			cuforces::fmaxDevice<2><<< dimGrid, dimBlock, smemSize, kernelStream() >>>(d_idata, d_odata, size); break;
 		case  1:
-			cuforces::fmaxDevice<1><<< dimGrid, dimBlock, smemSize >>>(d_idata, d_odata, size); break;
+			cuforces::fmaxDevice<1><<< dimGrid, dimBlock, smemSize, kernelStream() >>>(d_idata, d_odata, size); break;
 	}
 }
 
@@ -988,11 +1028,11 @@ void calc_energy(
 	while (blocksize*2 < blocksize_max)
 		blocksize<<=1;
 
-	cuforces::calcEnergiesDevice<<<reduce_blocks, blocksize, blocksize*shmem_thread>>>(
+	cuforces::calcEnergiesDevice<<<reduce_blocks, blocksize, blocksize*shmem_thread, kernelStream()>>>(
 			pos, vel, pinfo, particleHash, numParticles, numFluids, (float4*)reduce_buffer);
 	CUT_CHECK_ERROR("System energy stage 1 failed");
 
-	cuforces::calcEnergies2Device<<<1, reduce_bs2, reduce_bs2*shmem_thread>>>(
+	cuforces::calcEnergies2Device<<<1, reduce_bs2, reduce_bs2*shmem_thread, kernelStream()>>>(
 			(float4*)reduce_buffer, reduce_blocks, numFluids);
 	CUT_CHECK_ERROR("System energy stage 2 failed");
 	CUDA_SAFE_CALL(cudaMemcpy(output, reduce_buffer, numFluids*sizeof(float4), cudaMemcpyDeviceToHost));
@@ -1021,7 +1061,7 @@ calcPrivate(const	float4*			pos,
 	CUDA_SAFE_CALL(cudaBindTexture(0, velTex, vel, numParticles*sizeof(float4)));
 
 	//execute kernel
-	cuforces::calcPrivateDevice<<<numBlocks, numThreads>>>
+	cuforces::calcPrivateDevice<<<numBlocks, numThreads, 0, kernelStream()>>>
 		(	pos,
 			priv,
 			particleHash,
@@ -1041,6 +1081,59 @@ calcPrivate(const	float4*			pos,
 	CUT_CHECK_ERROR("UpdatePositions kernel execution failed");
 }
 
+void
+accumulateStats(const	float4*			vel,
+				const	particleinfo*	info,
+				const	float*			tke,
+				const	float*			eps,
+				const	uint*			cellStart,
+				const	uint*			cellEnd,
+						uint*			cellCount,
+						float4*			cellStats,
+						uint			numCells,
+				const	uint*			probeIds,
+						uint*			probeCount,
+						float4*			probeStats,
+						uint			numProbes,
+						uint			particleRangeEnd)
+{
+	// thread per cell
+	uint numThreads = min(BLOCK_SIZE_STATS, numCells);
+	uint numBlocks = div_up(numCells, numThreads);
+
+	cuforces::accumulateCellStatsDevice<<<numBlocks, numThreads, 0, kernelStream()>>>
+		(	vel,
+			info,
+			tke,
+			eps,
+			cellStart,
+			cellEnd,
+			cellCount,
+			cellStats,
+			numCells,
+			particleRangeEnd);
+
+	CUT_CHECK_ERROR("AccumulateCellStats kernel execution failed");
+
+	if (!numProbes || !particleRangeEnd)
+		return;
+
+	// thread per particle
+	numThreads = min(BLOCK_SIZE_STATS, particleRangeEnd);
+	numBlocks = div_up(particleRangeEnd, numThreads);
+
+	cuforces::accumulateProbeStatsDevice<<<numBlocks, numThreads, 0, kernelStream()>>>
+		(	vel,
+			info,
+			probeIds,
+			probeCount,
+			probeStats,
+			numProbes,
+			particleRangeEnd);
+
+	CUT_CHECK_ERROR("AccumulateProbeStats kernel execution failed");
+}
+
 void
 updateBoundValues(	float4*		oldVel,
 			float*		oldTKE,
@@ -1058,7 +1151,7 @@ updateBoundValues(	float4*		oldVel,
 	CUDA_SAFE_CALL(cudaBindTexture(0, vertTex, vertices, numParticles*sizeof(vertexinfo)));
 
 	//execute kernel
-	cuforces::updateBoundValuesDevice<<<numBlocks, numThreads>>>(oldVel, oldTKE, oldEps, numParticles, initStep);
+	cuforces::updateBoundValuesDevice<<<numBlocks, numThreads, 0, kernelStream()>>>(oldVel, oldTKE, oldEps, numParticles, initStep);
 
 	CUDA_SAFE_CALL(cudaUnbindTexture(infoTex));
 	CUDA_SAFE_CALL(cudaUnbindTexture(vertTex));
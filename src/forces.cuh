@@ -50,6 +50,7 @@
 	#define MIN_BLOCKS_SPS			6
 	#define BLOCK_SIZE_FMAX			256
 	#define MAX_BLOCKS_FMAX			64
+	#define BLOCK_SIZE_STATS		128
 #else
 	#define BLOCK_SIZE_FORCES		64
 	#define BLOCK_SIZE_CALCVORT		128
@@ -64,6 +65,7 @@
 	#define MIN_BLOCKS_SPS			1
 	#define BLOCK_SIZE_FMAX			256
 	#define MAX_BLOCKS_FMAX			64
+	#define BLOCK_SIZE_STATS		128
 #endif
 
 
@@ -89,6 +91,11 @@ setforcesrbcg(const float3* cg, int numbodies);
 void
 setforcesrbstart(const uint* rbfirstindex, int numbodies);
 
+// see the d_load* constants in forces_kernel.cu
+void
+setforcesloads(uint numloads, const uint *object, const uint *firstid, const uint *numids,
+	const uint *firstslot, const float3 *center);
+
 void
 forces_bind_textures(	const	float4	*pos,
 						const	float4	*vel,
@@ -126,6 +133,7 @@ forces(
 	const	float4	*boundelem,
 			float4	*rbforces,
 			float4	*rbtorques,
+			float4	*loadforces,
 			float4	*xsph,
 	const	particleinfo	*info,
 	const	hashKey	*particleHash,
@@ -261,6 +269,17 @@ reduceRbForces(	float4*		forces,
 				uint		numbodies,
 				uint		numBodiesParticles);
 
+// sum the numSlots forces and moments of the loaded objects by key, into the
+// 2*numLoads float4 at totals on host (force and moment of each object)
+void
+reduceLoads(const	float4*		loads,
+			const	uint*		keys,
+					float4*		reduced,
+					uint*		reducedKeys,
+					float4*		totals,
+					uint		numLoads,
+					uint		numSlots);
+
 uint
 getFmaxElements(const uint n);
 
@@ -301,6 +320,26 @@ calcPrivate(const	float4*			pos,
 					uint			numParticles,
 					uint			particleRangeEnd);
 
+// accumulate the running statistics of the fluid particles of each cell (cellCount
+// and cellStats, for numCells cells) and of the testpoints (probeCount and probeStats,
+// for the numProbes testpoints whose sorted ids are probeIds); tke and eps are
+// NULL without k-epsilon (see RunningStats.h for the layout)
+void
+accumulateStats(const	float4*			vel,
+				const	particleinfo*	info,
+				const	float*			tke,
+				const	float*			eps,
+				const	uint*			cellStart,
+				const	uint*			cellEnd,
+						uint*			cellCount,
+						float4*			cellStats,
+						uint			numCells,
+				const	uint*			probeIds,
+						uint*			probeCount,
+						float4*			probeStats,
+						uint			numProbes,
+						uint			particleRangeEnd);
+
 // Recomputes values at the boundary elements (currently only density) as an average
 // over three vertices of this element
 void
@@ -38,6 +38,9 @@
 #include "kahan.h"
 #include "tensor.cu"
 
+// StatsField
+#include "RunningStats.h"
+
 // an auxiliary function that fetches the tau tensor
 // for particle i from the textures where it's stored
 __device__
@@ -135,6 +138,16 @@ __constant__ uint	d_rbstartindex[MAXBODIES];
 __constant__ float	d_objectobjectdf;
 __constant__ float	d_objectboundarydf;
 
+// Objects whose loads are computed (see Loads.h): object number, range of
+// the ids of their particles, first slot of their forces in the load array
+// (followed by numids moments) and center of the moments
+__constant__ uint	d_numloads;
+__constant__ uint	d_loadobject[MAXLOADS];
+__constant__ uint	d_loadfirstid[MAXLOADS];
+__constant__ uint	d_loadnumids[MAXLOADS];
+__constant__ uint	d_loadfirstslot[MAXLOADS];
+__constant__ float3	d_loadcenter[MAXLOADS];
+
 // Grid data
 #include "cellgrid.h"
 
@@ -301,6 +314,18 @@ MKForce(const float r, const float slength,
 
 	return force;
 }
+
+// Index of the loaded object a particle belongs to, d_numloads if none
+__device__ __forceinline__ uint
+loadIndex(const particleinfo &info)
+{
+	uint load = d_numloads;
+	if (WALL(info))
+		for (load = 0; load < d_numloads; ++load)
+			if (d_loadobject[load] == object(info))
+				break;
+	return load;
+}
 /************************************************************************************************************/
 
 /************************************************************************************************************/
@@ -2051,5 +2076,138 @@ calcSurfaceparticleDevice(	const	float4*			posArray,
 }
 /************************************************************************************************************/
 
+/************************************************************************************************************/
+/*					   Running statistics (see RunningStats.h)												*/
+/************************************************************************************************************/
+
+// Welford's update of the accumulator (mean, sum of the squared deviations,
+// min, max) of a field with its n-th sample
+__device__ __forceinline__ void
+statsUpdate(float4 &acc, const float value, const uint n)
+{
+	if (n == 1) {
+		acc = make_float4(value, 0.0f, value, value);
+		return;
+	}
+	const float delta = value - acc.x;
+	acc.x += delta/n;
+	acc.y += delta*(value - acc.x);
+	acc.z = fminf(acc.z, value);
+	acc.w = fmaxf(acc.w, value);
+}
+
+// Each thread accumulates the fluid particles of a cell: the cells of the
+// external particles are left to the devices they belong to
+__global__ void
+accumulateCellStatsDevice(	const	float4*			vel,
+							const	particleinfo*	info,
+							const	float*			tke,
+							const	float*			eps,
+							const	uint*			cellStart,
+							const	uint*			cellEnd,
+									uint*			cellCount,
+									float4*			cellStats,
+							const	uint			numCells,
+							const	uint			particleRangeEnd)
+{
+	const uint cell = INTMUL(blockIdx.x,blockDim.x) + threadIdx.x;
+
+	if (cell >= numCells)
+		return;
+
+	const uint start = cellStart[cell];
+	if (start == 0xffffffff || start >= particleRangeEnd)
+		return;
+	const uint end = cellEnd[cell];
+
+	const uint numFields = (tke ? STATS_MAX_FIELDS : STATS_TKE);
+
+	uint n = cellCount[cell];
+	float4 acc[STATS_MAX_FIELDS];
+	for (uint f = 0; f < numFields; ++f)
+		acc[f] = cellStats[f*numCells + cell];
+
+	const uint old_n = n;
+	for (uint index = start; index < end; ++index) {
+		const particleinfo pinfo = info[index];
+		if (NOT_FLUID(pinfo))
+			continue;
+
+		const float4 v = vel[index];
+		++n;
+		statsUpdate(acc[STATS_VELX], v.x, n);
+		statsUpdate(acc[STATS_VELY], v.y, n);
+		statsUpdate(acc[STATS_VELZ], v.z, n);
+		statsUpdate(acc[STATS_DENSITY], v.w, n);
+		statsUpdate(acc[STATS_PRESSURE], P(v.w, PART_FLUID_NUM(pinfo)), n);
+		if (tke) {
+			statsUpdate(acc[STATS_TKE], tke[index], n);
+			statsUpdate(acc[STATS_EPSILON], eps[index], n);
+		}
+	}
+
+	if (n == old_n)
+		return;
+
+	cellCount[cell] = n;
+	for (uint f = 0; f < numFields; ++f)
+		cellStats[f*numCells + cell] = acc[f];
+}
+
+// Each thread accumulates the velocity and pressure interpolated at a testpoint
+// onto the probe with the same id; the other fields are not sampled
+__global__ void
+accumulateProbeStatsDevice(	const	float4*			vel,
+							const	particleinfo*	info,
+							const	uint*			probeIds,
+									uint*			probeCount,
+									float4*			probeStats,
+							const	uint			numProbes,
+							const	uint			particleRangeEnd)
+{
+	const uint index = INTMUL(blockIdx.x,blockDim.x) + threadIdx.x;
+
+	if (index >= particleRangeEnd)
+		return;
+
+	const particleinfo pinfo = info[index];
+	if (type(pinfo) != TESTPOINTSPART)
+		return;
+
+	// binary search of the probe
+	const uint pid = id(pinfo);
+	uint lo = 0, hi = numProbes;
+	while (lo < hi) {
+		const uint mid = (lo + hi)/2;
+		if (probeIds[mid] < pid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == numProbes || probeIds[lo] != pid)
+		return;
+
+	const float4 v = vel[index];
+	const uint n = probeCount[lo] + 1;
+	probeCount[lo] = n;
+
+	float4 acc = probeStats[STATS_VELX*numProbes + lo];
+	statsUpdate(acc, v.x, n);
+	probeStats[STATS_VELX*numProbes + lo] = acc;
+
+	acc = probeStats[STATS_VELY*numProbes + lo];
+	statsUpdate(acc, v.y, n);
+	probeStats[STATS_VELY*numProbes + lo] = acc;
+
+	acc = probeStats[STATS_VELZ*numProbes + lo];
+	statsUpdate(acc, v.z, n);
+	probeStats[STATS_VELZ*numProbes + lo] = acc;
+
+	acc = probeStats[STATS_PRESSURE*numProbes + lo];
+	statsUpdate(acc, v.w, n);
+	probeStats[STATS_PRESSURE*numProbes + lo] = acc;
+}
+/************************************************************************************************************/
+
 } //namespace cuforces
 #endif
@@ -58,6 +58,7 @@ struct common_forces_params
 			float4	*forces;
 			float4	*rbforces;
 			float4	*rbtorques;
+			float4	*loadforces;
 	const	float4	*posArray;
 	const	hashKey *particleHash;
 	const	uint	*cellStart;
@@ -77,6 +78,7 @@ struct common_forces_params
 				float4	*_forces,
 				float4	*_rbforces,
 				float4	*_rbtorques,
+				float4	*_loadforces,
 		const	float4	*_posArray,
 		const	hashKey *_particleHash,
 		const	uint	*_cellStart,
@@ -89,6 +91,7 @@ struct common_forces_params
 		forces(_forces),
 		rbforces(_rbforces),
 		rbtorques(_rbtorques),
+		loadforces(_loadforces),
 		posArray(_posArray),
 		particleHash(_particleHash),
 		cellStart(_cellStart),
@@ -185,6 +188,7 @@ struct forces_params :
 				float4	*_forces,
 				float4	*_rbforces,
 				float4	*_rbtorques,
+				float4	*_loadforces,
 		const	float4	*_pos,
 		const	hashKey	*_particleHash,
 		const	uint	*_cellStart,
@@ -214,7 +218,7 @@ struct forces_params :
 				float2	*_keps_dkde,
 				float	*_turbvisc
 		) :
-		common_forces_params(_forces, _rbforces, _rbtorques,
+		common_forces_params(_forces, _rbforces, _rbtorques, _loadforces,
 			_pos, _particleHash, _cellStart,
 			_neibsList, _fromParticle, _toParticle,
 			_deltap, _slength, _influenceradius),
@@ -68,12 +68,13 @@ public:
 		}
 	}
 
-	// allocate and clear buffer on device
+	// allocate and clear buffer on device, releasing the previous allocation if any
 	virtual size_t alloc(size_t elems) {
 		size_t bufmem = elems*sizeof(element_type);
 		const int N = 1; // see NOTE for this class
 		element_type **bufs = baseclass::get_raw_ptr();
 		for (int i = 0; i < N; ++i) {
+			free(bufs[i]);
 			// malloc instead of calloc since the init
 			// value might be nonzero
 			bufs[i] = (element_type*)malloc(bufmem);
@@ -87,6 +88,10 @@ public:
 		std::swap(buf[idx1], buf[idx2]);
 	}
 
+	virtual AbstractBuffer *clone_empty() const {
+		return new HostBuffer<Key>(baseclass::get_init_value());
+	}
+
 };
 
 #endif
@@ -95,7 +95,11 @@ void print_usage() {
 	cout << "Syntax: " << endl;
 	cout << "\tGPUSPH [--device n[,n...]] [--dem dem_file] [--deltap VAL] [--tend VAL]\n";
 	cout << "\t       [--dir directory] [--nosave] [--striping] [--gpudirect [--asyncmpi]]\n";
-	cout << "\t       [--num_hosts VAL [--byslot_scheduling]]\n";
+	cout << "\t       [--num_hosts VAL [--byslot_scheduling]] [--cpu [--threads VAL]]\n";
+	cout << "\t       [--autonomous] [--profile] [--trace FILE]\n";
+	cout << "\t       [--async-write [VAL] [--drop-writes]] [--direct-io] [--checkpoint VAL] [--restart DIR]\n";
+	cout << "\t       [--vtk-compress [VAL]] [--column-compress [VAL]]\n";
+	cout << "\t       [--column-keyframes VAL [--column-tolerance VAL]]\n";
 	cout << "\tGPUSPH --help\n\n";
 	cout << " --device n[,n...] : Use device number n; runs multi-gpu if multiple n are given\n";
 	cout << " --dem : Use given DEM (if problem supports it)\n";
@@ -108,6 +112,23 @@ void print_usage() {
 	cout << " --asyncmpi : Enable asynchronous network transfers (requires GPUDirect and 1 process per device)\n";
 	cout << " --num_hosts : Uses multiple processes per node by specifying the number of nodes (VAL is cast to uint)\n";
 	cout << " --byslot_scheduling : MPI scheduler is filling hosts first, as opposite to round robin scheduling\n";
+	cout << " --cpu : Run the simulation on the host CPU instead of the GPU (single device only)\n";
+	cout << " --threads : Number of CPU threads used by --cpu (VAL is cast to uint, default: one per core)\n";
+	cout << " --autonomous : Let the workers run each integration step on their own, syncing with the main thread only when needed,\n";
+	cout << "                with the independent commands running concurrently\n";
+	cout << " --profile : Time each command, printing per-command statistics with the simulation status\n";
+	cout << " --trace : Write a timeline of the commands, barriers and writes of each thread to FILE (trace-event JSON), implies --profile;\n";
+	cout << "           in multi-node runs each rank writes FILE.rank<N>\n";
+	cout << " --async-write : Write on background threads, keeping up to VAL snapshots of the particles in flight (default: 2)\n";
+	cout << " --drop-writes : With --async-write, skip non-forced writes instead of waiting when all snapshots are in flight\n";
+	cout << " --direct-io : Write the VTK, grid and columnar files with O_DIRECT, through io_uring, where the system allows\n";
+	cout << " --checkpoint : Save a checkpoint every VAL seconds of simulated time (VAL is cast to float)\n";
+	cout << " --restart : Resume the simulation from the checkpoint in DIR (the checkpoint/ directory of a previous run, whose latest\n";
+	cout << "             file names its last complete checkpoint, or one of its checkpoint/<iteration>/ directories)\n";
+	cout << " --vtk-compress : Compress the VTK files with zlib, at level VAL (1 to 9, default: 1)\n";
+	cout << " --column-compress : Compress the columnar output (COLUMNWRITER) with zlib, at level VAL (1 to 9, default: 1)\n";
+	cout << " --column-keyframes : Store one frame every VAL whole in the columnar output, and the differences from the previous frame in the others\n";
+	cout << " --column-tolerance : Maximum error of the differences, as a fraction of deltap for positions and of the range of the values for the other fields (default: 0.01)\n";
 	//cout << " --nobalance : Disable dynamic load balancing\n";
 	//cout << " --lb-threshold : Set custom LB activation threshold (VAL is cast to float)\n";
 	cout << " --help: Show this help and exit\n";
@@ -192,6 +213,77 @@ int parse_options(int argc, char **argv, GlobalData *gdata)
 			return 0;
 		} else if (!strcmp(arg, "--byslot_scheduling")) {
 			_clOptions->byslot_scheduling = true;
+		} else if (!strcmp(arg, "--cpu")) {
+			_clOptions->cpu = true;
+		} else if (!strcmp(arg, "--autonomous")) {
+			_clOptions->autonomous = true;
+		} else if (!strcmp(arg, "--profile")) {
+			_clOptions->profile = true;
+		} else if (!strcmp(arg, "--trace")) {
+			_clOptions->trace_file = std::string(*argv);
+			argv++;
+			argc--;
+		} else if (!strcmp(arg, "--async-write")) {
+			_clOptions->async_writes = 2;
+			/* read the next arg as a uint, if it is one */
+			if (argc > 0 && sscanf(*argv, "%u", &(_clOptions->async_writes)) > 0) {
+				argv++;
+				argc--;
+			}
+		} else if (!strcmp(arg, "--drop-writes")) {
+			_clOptions->drop_writes = true;
+		} else if (!strcmp(arg, "--direct-io")) {
+			_clOptions->direct_io = true;
+		} else if (!strcmp(arg, "--checkpoint")) {
+			/* read the next arg as a float */
+			sscanf(*argv, "%f", &(_clOptions->checkpoint_interval));
+			argv++;
+			argc--;
+		} else if (!strcmp(arg, "--vtk-compress")) {
+			_clOptions->vtk_compression = 1;
+			/* read the next arg as an int, if it is one */
+			if (argc > 0 && sscanf(*argv, "%d", &(_clOptions->vtk_compression)) > 0) {
+				argv++;
+				argc--;
+			}
+			if (_clOptions->vtk_compression < 0 || _clOptions->vtk_compression > 9) {
+				fprintf(stderr, "ERROR: --vtk-compress level must be between 1 and 9\n");
+				return -1;
+			}
+		} else if (!strcmp(arg, "--column-compress")) {
+			_clOptions->column_compression = 1;
+			/* read the next arg as an int, if it is one */
+			if (argc > 0 && sscanf(*argv, "%d", &(_clOptions->column_compression)) > 0) {
+				argv++;
+				argc--;
+			}
+			if (_clOptions->column_compression < 0 || _clOptions->column_compression > 9) {
+				fprintf(stderr, "ERROR: --column-compress level must be between 1 and 9\n");
+				return -1;
+			}
+		} else if (!strcmp(arg, "--column-keyframes")) {
+			/* read the next arg as a uint */
+			sscanf(*argv, "%u", &(_clOptions->column_keyframes));
+			argv++;
+			argc--;
+		} else if (!strcmp(arg, "--column-tolerance")) {
+			/* read the next arg as a float */
+			sscanf(*argv, "%f", &(_clOptions->column_tolerance));
+			argv++;
+			argc--;
+			if (!(_clOptions->column_tolerance > 0)) {
+				fprintf(stderr, "ERROR: --column-tolerance must be positive\n");
+				return -1;
+			}
+		} else if (!strcmp(arg, "--restart")) {
+			_clOptions->restart_dir = std::string(*argv);
+			argv++;
+			argc--;
+		} else if (!strcmp(arg, "--threads")) {
+			/* read the next arg as a uint */
+			sscanf(*argv, "%u", &(_clOptions->num_threads));
+			argv++;
+			argc--;
 #if 0 // options will be enabled later
 		} else if (!strcmp(arg, "--nobalance")) {
 			_clOptions->nobalance = true;
@@ -225,6 +317,12 @@ int parse_options(int argc, char **argv, GlobalData *gdata)
 		gdata->device[gdata->devices++] = 0;
 	}
 
+	// the CPU worker handles the whole domain by itself
+	if (_clOptions->cpu && gdata->devices > 1) {
+		fprintf(stderr, "FATAL: --cpu only supports a single device (%u requested)\n", gdata->devices);
+		return -1;
+	}
+
 	// only for single-gpu
 	_clOptions->device = gdata->device[0];
 
@@ -252,6 +350,8 @@ void sigint_handler(int signum) {
 		if (reachedt > 0 && reachedt < maxt && !gdata_static_pointer->threadSynchronizer->didForceUnlockOccurr()) {
 			printf("Second quit request - threads waiting: %u/%u. Forcing unlock...\n", reachedt, maxt);
 			gdata_static_pointer->threadSynchronizer->forceUnlock();
+			if (gdata_static_pointer->sequenceSynchronizer)
+				gdata_static_pointer->sequenceSynchronizer->forceUnlock();
 		} else {
 			printf("Unable to force unlock. Issuing exit(1)\n");
 			exit(1);
@@ -323,6 +423,20 @@ int main(int argc, char** argv) {
 		if (gdata.clOptions->byslot_scheduling)
 			printf("WARNING: --byslot_scheduling was enabled, but number of hosts is zero!\n");
 
+	// the global device numbering, the domain split and the per-device output
+	// files all assume that every process drives the same number of devices
+	if (gdata.mpi_nodes > 1) {
+		std::vector<uint> rankDevices(gdata.mpi_nodes);
+		gdata.networkManager->allGatherUints(&gdata.devices, &rankDevices[0]);
+		for (uint r = 0; r < gdata.mpi_nodes; r++)
+			if (rankDevices[r] != gdata.devices) {
+				fprintf(stderr, "FATAL: rank %u has %u devices, rank %u has %u: all ranks must use the same number of devices\n",
+					r, rankDevices[r], gdata.mpi_rank, gdata.devices);
+				gdata.networkManager->finalizeNetwork();
+				return 1;
+			}
+	}
+
 	gdata.totDevices = gdata.mpi_nodes * gdata.devices;
 	printf(" tot devs = %u (%u * %u)\n",gdata.totDevices, gdata.mpi_nodes, gdata.devices );
 	if (gdata.clOptions->num_hosts > 0)
@@ -355,9 +469,33 @@ int main(int argc, char** argv) {
 
 	}
 
+	if (gdata.clOptions->cpu && gdata.mpi_nodes > 1) {
+		fprintf(stderr, "FATAL: --cpu only supports a single process (%u requested)\n", gdata.mpi_nodes);
+		gdata.networkManager->finalizeNetwork();
+		return 1;
+	}
+
 	// the Problem could (should?) be initialized inside GPUSPH::initialize()
 	gdata.problem = new PROBLEM(&gdata);
 
+	// the CPU worker does not implement the features which only exist in the CUDA kernels
+	if (gdata.clOptions->cpu) {
+		const SimParams *simparams = gdata.problem->get_simparams();
+		const char *unsupported = NULL;
+		if (simparams->boundarytype == SA_BOUNDARY)
+			unsupported = "SA_BOUNDARY";
+		else if (simparams->visctype == KEPSVISC)
+			unsupported = "KEPSVISC";
+		else if (simparams->usedem)
+			unsupported = "DEM geometries";
+		if (unsupported) {
+			fprintf(stderr, "FATAL: --cpu does not support %s, used by problem %s\n",
+				unsupported, QUOTED_PROBLEM);
+			gdata.networkManager->finalizeNetwork();
+			return 1;
+		}
+	}
+
 	// get - and actually instantiate - the existing instance of GPUSPH
 	GPUSPH *Simulator = GPUSPH::getInstance();
 
@@ -130,6 +130,25 @@ const char* ViscosityName[INVALID_VISCOSITY+1]
 #endif
 ;
 
+enum IntegratorType {
+	PREDICTOR_CORRECTOR,
+	KICK_DRIFT_KICK,
+	INVALID_INTEGRATOR
+} ;
+
+#ifndef GPUSPH_MAIN
+extern
+#endif
+const char* IntegratorName[INVALID_INTEGRATOR+1]
+#ifdef GPUSPH_MAIN
+= {
+	"Predictor-corrector",
+	"Kick-drift-kick",
+	"(invalid)"
+}
+#endif
+;
+
 /* Periodic boundary */
 enum Periodicity {
 	PERIODIC_NONE = 0,
@@ -268,6 +287,8 @@ disable_particle(float4 &pos) {
 #define BOUNDARY(f)		(type(f) == BOUNDPART)
 // Vertex particle
 #define VERTEX(f)		(type(f) == VERTEXPART)
+// Fixed or moving boundary particle, which can be loaded by the fluid (see Loads.h)
+#define WALL(f)			(NOT_FLUID(f) && !OBJECT(f) && !TESTPOINTS(f) && !VERTEX(f))
 
 /* Tests for particle flags */
 // Free surface detection
@@ -289,6 +310,9 @@ disable_particle(float4 &pos) {
 /* Maximum number of floating bodies*/
 #define	MAXBODIES				10
 
+/* Maximum number of objects whose loads are computed (see Loads.h) */
+#define	MAXLOADS				10
+
 #define MAX_CUDA_LINEAR_TEXTURE_ELEMENTS (1U << 27)
 
 #define NEIBINDEX_INTERLEAVE		32U
@@ -65,5 +65,30 @@ typedef struct __attribute__ ((packed)) {
 	unsigned int count;
 } ptp_heartbeat_packet_t;
 
+/* Packets with quantized positions have version PTP_VERSION_QUANTIZED and the same
+ * header as the ptp_packet_t. Each coordinate is stored as the fraction of the world
+ * size, from the world origin, in units of 1/PTP_QUANTIZED_MAX */
+#define PTP_VERSION_QUANTIZED 1
+#define PTP_QUANTIZED_MAX 65535
+
+typedef struct __attribute__ ((packed)) {
+    unsigned int id;
+    unsigned short position[3];
+    short particle_type;
+} ptp_quantized_particle_data_t;
+
+#define PTP_QUANTIZED_PARTICLES_PER_PACKET ((PTP_UDP_PACKET_MAX - PTP_PACKET_HEADER_SIZE) / sizeof(ptp_quantized_particle_data_t))
+
+typedef struct __attribute__ ((packed)) {
+    unsigned char   version;
+    pid_t           model_id;
+    unsigned int total_particle_count;
+    unsigned int particle_count;
+    float t;
+    float world_origin[3];
+    float world_size[3];
+    ptp_quantized_particle_data_t data[PTP_QUANTIZED_PARTICLES_PER_PACKET];
+} ptp_quantized_packet_t;
+
 
 #endif /* PTP_H_ */
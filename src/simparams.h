@@ -60,10 +60,15 @@ typedef struct SimParams {
 	float			tend;				// simulation end time (0 means run forever)
 	bool			xsph;				// true if XSPH correction
 	bool			dtadapt;			// true if adaptive timestep
+	IntegratorType	integratortype;		// time integration scheme (see Integrator.h)
 	float			dtadaptfactor;		// safety factor in the adaptive time step formula
 	uint			buildneibsfreq;		// frequency (in iterations) of neib list rebuilding
+	bool			adaptiveneibsfreq;	// rebuild the neib list only when the particles may have moved more than
+										// half the skin (nlInfluenceRadius - influenceRadius), ignoring buildneibsfreq
 	uint			shepardfreq;		// frequency (in iterations) of Shepard density filter
 	uint			mlsfreq;			// frequency (in iterations) of MLS density filter
+	uint			statsfreq;			// frequency (in iterations) of the accumulation of the running
+										// statistics of the fluid (see RunningStats.h), 0 to disable
 	float			ferrari;			// coefficient for Ferrari correction
 	ViscosityType	visctype;			// viscosity type (1 artificial, 2 laminar)
 	bool			mbcallback;			// true if moving boundary velocity varies
@@ -99,10 +104,13 @@ typedef struct SimParams {
 		tend(0),
 		xsph(false),
 		dtadapt(true),
+		integratortype(PREDICTOR_CORRECTOR),
 		dtadaptfactor(0.3),
 		buildneibsfreq(10),
+		adaptiveneibsfreq(false),
 		shepardfreq(0),
 		mlsfreq(15),
+		statsfreq(0),
 		ferrari(0),
 		visctype(ARTVISC),
 		mbcallback(false),
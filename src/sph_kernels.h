@@ -0,0 +1,83 @@
+/*  Copyright 2013 Alexis Herault, Giuseppe Bilotta, Robert A. Dalrymple, Eugenio Rustico, Ciro Del Negro
+
+    Istituto Nazionale di Geofisica e Vulcanologia
+        Sezione di Catania, Catania, Italy
+
+    Università di Catania, Catania, Italy
+
+    Johns Hopkins University, Baltimore, MD
+
+    This file is part of GPUSPH.
+
+    GPUSPH is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GPUSPH is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GPUSPH.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _SPH_KERNELS_H
+#define _SPH_KERNELS_H
+
+// M_PI
+#include <cmath>
+
+#include "particledefine.h"
+
+/* Host version of the smoothing kernels of forces_kernel.cu, without the
+ * normalization coefficient, as a function of R = r/slength (0 <= R <= kernelradius)
+ */
+static inline float
+kernel_shape(KernelType kernel, float R)
+{
+	float val = 0.0f;
+
+	switch (kernel) {
+	case CUBICSPLINE:
+		if (R < 1)
+			val = 1.0f - 1.5f*R*R + 0.75f*R*R*R;			// val = 1 - 3/2 R^2 + 3/4 R^3
+		else
+			val = 0.25f*(2.0f - R)*(2.0f - R)*(2.0f - R);	// val = 1/4 (2 - R)^3
+		break;
+	case QUADRATIC:
+		val = 0.25f*R*R - R + 1.0f;		// val = 1/4 R^2 -  R + 1
+		break;
+	case WENDLAND:
+		val = 1.0f - 0.5f*R;
+		val *= val;
+		val *= val;						// val = (1 - R/2)^4
+		val *= 1.0f + 2.0f*R;			// val = (2R + 1)(1 - R/2)^4*
+		break;
+	default:
+		break;
+	}
+
+	return val;
+}
+
+// normalization coefficient of the kernel, W(r) = kernel_coeff*kernel_shape(r/slength)
+static inline float
+kernel_coeff(KernelType kernel, float slength)
+{
+	const float h3 = slength*slength*slength;
+
+	switch (kernel) {
+	case CUBICSPLINE:
+		return 1.0f/(M_PI*h3);
+	case QUADRATIC:
+		return 15.0f/(16.0f*M_PI*h3);
+	case WENDLAND:
+		return 21.0f/(16.0f*M_PI*h3);
+	default:
+		return 0.0f;
+	}
+}
+
+#endif
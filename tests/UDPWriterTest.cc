@@ -0,0 +1,318 @@
+/*  Copyright 2011-2013 Alexis Herault, Giuseppe Bilotta, Robert A. Dalrymple, Eugenio Rustico, Ciro Del Negro
+
+    Istituto Nazionale di Geofisica e Vulcanologia
+        Sezione di Catania, Catania, Italy
+
+    Università di Catania, Catania, Italy
+
+    Johns Hopkins University, Baltimore, MD
+
+    This file is part of GPUSPH.
+
+    GPUSPH is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GPUSPH is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GPUSPH.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Test of the UDPWriter with a local receiver: the test binds the client port
+ * on 127.0.0.1, sends heartbeats to the writer as a client would, and checks the
+ * header, the decimation, the positions and the particle types of the datagrams
+ * of a few frames, with full and quantized positions. Run with make udpwriter-test.
+ */
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "GlobalData.h"
+#include "UDPWriter.h"
+#include "hostbuffer.h"
+#include "hashkey.h"
+#include "ptp.h"
+
+using namespace std;
+
+// particles per frame, and per cell for the cell decimation
+#define NUM_PARTS		1000
+#define PARTS_PER_CELL	4
+
+// the writer only needs the directory, the domain and the parameters of a Problem
+class UDPTestProblem : public Problem {
+public:
+	UDPTestProblem(const GlobalData *_gdata) : Problem(_gdata)
+	{
+		m_size = make_double3(2.0, 1.0, 0.5);
+		m_origin = make_double3(-1.0, 0.0, -0.25);
+		m_name = "UDPWriterTest";
+	}
+	int fill_parts(void) { return 0; }
+	void copy_to_array(BufferList &) {}
+	void release_memory(void) {}
+};
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "FAILED: " __VA_ARGS__); \
+		fprintf(stderr, "\n"); \
+		failures++; \
+	} } while (0)
+
+// a frame is complete when the particles of all its datagrams add up to the total
+struct Frame {
+	float t;
+	uint total;
+	vector<ptp_particle_data_t> parts;
+	vector<ptp_quantized_particle_data_t> qparts;
+};
+
+static void
+add_particle(Frame &frame, ptp_particle_data_t const& data)
+{ frame.parts.push_back(data); }
+
+static void
+add_particle(Frame &frame, ptp_quantized_particle_data_t const& data)
+{ frame.qparts.push_back(data); }
+
+// receive the datagrams of one frame, within one second
+template<typename Packet>
+static bool
+receive_frame(int sock, Frame &frame, unsigned char version)
+{
+	frame.total = 0;
+	frame.parts.clear();
+	frame.qparts.clear();
+	uint received = 0;
+	char buf[65536];
+
+	while (true) {
+		struct pollfd pfd = { sock, POLLIN, 0 };
+		if (poll(&pfd, 1, 1000) <= 0)
+			return false;
+		const ssize_t len = recv(sock, buf, sizeof(buf), 0);
+		CHECK(len == sizeof(Packet), "datagram of %zd bytes instead of %zu", len, sizeof(Packet));
+		if (len != sizeof(Packet))
+			return false;
+
+		const Packet *packet = (const Packet*)buf;
+		CHECK(packet->version == version, "version %u instead of %u", packet->version, version);
+		CHECK(packet->model_id == getpid(), "model id %d instead of %d", packet->model_id, getpid());
+		CHECK(packet->world_origin[0] == -1.0f && packet->world_origin[1] == 0.0f &&
+			packet->world_origin[2] == -0.25f, "wrong world origin");
+		CHECK(packet->world_size[0] == 2.0f && packet->world_size[1] == 1.0f &&
+			packet->world_size[2] == 0.5f, "wrong world size");
+		if (received == 0) {
+			frame.t = packet->t;
+			frame.total = packet->total_particle_count;
+		}
+		CHECK(packet->t == frame.t && packet->total_particle_count == frame.total,
+			"datagrams of different frames mixed");
+
+		const uint per_packet = sizeof(packet->data)/sizeof(packet->data[0]);
+		CHECK(packet->particle_count <= per_packet, "%u particles in a datagram", packet->particle_count);
+		for (uint i = 0; i < packet->particle_count && i < per_packet; i++)
+			add_particle(frame, packet->data[i]);
+		received += packet->particle_count;
+		if (received >= frame.total)
+			return received == frame.total;
+	}
+}
+
+static void
+send_heartbeat(int sock, unsigned short port)
+{
+	struct sockaddr_in server;
+	memset(&server, 0, sizeof(server));
+	server.sin_family = AF_INET;
+	server.sin_port = htons(port);
+	inet_aton("127.0.0.1", &server.sin_addr);
+	ptp_heartbeat_packet_t packet;
+	packet.count = 1;
+	sendto(sock, &packet, sizeof(packet), 0, (struct sockaddr*)&server, sizeof(server));
+}
+
+// write frames until the writer has seen our heartbeat and the first one arrives
+template<typename Packet>
+static bool
+connect_writer(UDPWriter &writer, int sock, unsigned short port, BufferList const& buffers,
+	Frame &frame, unsigned char version)
+{
+	for (uint attempt = 0; attempt < 50; attempt++) {
+		send_heartbeat(sock, port);
+		usleep(20000);
+		writer.write(NUM_PARTS, buffers, 0, 0.5f, false);
+		if (receive_frame<Packet>(sock, frame, version))
+			return true;
+	}
+	return false;
+}
+
+// the particle of a datagram must be the particle with the same id
+static void
+check_particle(ptp_particle_data_t const& data, const double4 *pos, const particleinfo *info)
+{
+	const uint i = data.id;
+	CHECK(i < NUM_PARTS, "unknown particle id %u", i);
+	if (i >= NUM_PARTS) return;
+	CHECK(data.particle_type == type(info[i]), "particle %u has type %d instead of %d",
+		i, data.particle_type, type(info[i]));
+	CHECK(!memcmp(data.position, &pos[i], sizeof(double4)), "particle %u has the wrong position", i);
+}
+
+static void
+check_particle(ptp_quantized_particle_data_t const& data, const double4 *pos, const particleinfo *info)
+{
+	const uint i = data.id;
+	CHECK(i < NUM_PARTS, "unknown particle id %u", i);
+	if (i >= NUM_PARTS) return;
+	CHECK(data.particle_type == type(info[i]), "particle %u has type %d instead of %d",
+		i, data.particle_type, type(info[i]));
+	// half a quantum
+	const double x = -1.0 + data.position[0]*2.0/PTP_QUANTIZED_MAX;
+	const double y = data.position[1]*1.0/PTP_QUANTIZED_MAX;
+	const double z = -0.25 + data.position[2]*0.5/PTP_QUANTIZED_MAX;
+	CHECK(fabs(x - pos[i].x) <= 1.0/PTP_QUANTIZED_MAX && fabs(y - pos[i].y) <= 0.5/PTP_QUANTIZED_MAX &&
+		fabs(z - pos[i].z) <= 0.25/PTP_QUANTIZED_MAX, "particle %u has the wrong quantized position", i);
+}
+
+// check that the frame holds exactly the expected particles
+template<typename Data>
+static void
+check_frame(vector<Data> const& parts, vector<uint> const& expected,
+	const double4 *pos, const particleinfo *info, const char *what)
+{
+	CHECK(parts.size() == expected.size(), "%s: %zu particles instead of %zu",
+		what, parts.size(), expected.size());
+	vector<uint> ids;
+	for (size_t p = 0; p < parts.size(); p++) {
+		check_particle(parts[p], pos, info);
+		ids.push_back(parts[p].id);
+	}
+	CHECK(ids == expected, "%s: wrong particles", what);
+}
+
+// run a writer configured by the given decimation and quantization, checking a frame
+template<typename Packet>
+static void
+test_writer(GlobalData const& gdata, int sock, unsigned short port, const char *decimate,
+	BufferList const& buffers, vector<uint> const& expected, const char *what)
+{
+	char portstr[16];
+	sprintf(portstr, "%u", port);
+	setenv("UDPWRITER_HOST", "127.0.0.1", 1);
+	setenv("UDPWRITER_PORT", portstr, 1);
+	setenv("UDPWRITER_DECIMATE", decimate, 1);
+	setenv("UDPWRITER_QUANTIZE", sizeof(Packet) == sizeof(ptp_quantized_packet_t) ? "1" : "0", 1);
+	const unsigned char version = sizeof(Packet) == sizeof(ptp_quantized_packet_t) ?
+		PTP_VERSION_QUANTIZED : PTP_VERSION;
+
+	const double4 *pos = buffers.getData<BUFFER_POS_GLOBAL>();
+	const particleinfo *info = buffers.getData<BUFFER_INFO>();
+
+	UDPWriter writer(&gdata);
+	Frame frame;
+	if (!connect_writer<Packet>(writer, sock, port, buffers, frame, version)) {
+		CHECK(false, "%s: no frame received", what);
+		return;
+	}
+	CHECK(frame.t == 0.5f, "%s: frame time %g instead of 0.5", what, frame.t);
+	CHECK(frame.total == expected.size(), "%s: %u particles announced instead of %zu",
+		what, frame.total, expected.size());
+	if (frame.parts.size())
+		check_frame(frame.parts, expected, pos, info, what);
+	else
+		check_frame(frame.qparts, expected, pos, info, what);
+
+	// a second frame, after the first one has been sent
+	writer.write(NUM_PARTS, buffers, 0, 0.75f, false);
+	CHECK(receive_frame<Packet>(sock, frame, version), "%s: second frame not received", what);
+	CHECK(frame.t == 0.75f, "%s: second frame time %g instead of 0.75", what, frame.t);
+}
+
+int main(int argc, char **argv)
+{
+	// the writers create their data/ directory in the problem directory
+	char dirname[] = "/tmp/udpwriter-test.XXXXXX";
+	if (!mkdtemp(dirname)) {
+		perror("mkdtemp");
+		return 1;
+	}
+
+	Options options;
+	options.dir = dirname;
+	GlobalData gdata;
+	gdata.clOptions = &options;
+	UDPTestProblem problem(&gdata);
+	gdata.problem = &problem;
+
+	// the particles, sorted by cell, of alternating types
+	BufferList buffers;
+	buffers << new HostBuffer<BUFFER_POS_GLOBAL>();
+	buffers << new HostBuffer<BUFFER_INFO>();
+	buffers << new HostBuffer<BUFFER_HASH>();
+	BufferList::iterator iter = buffers.begin();
+	for ( ; iter != buffers.end(); ++iter)
+		iter->second->alloc(NUM_PARTS);
+
+	double4 *pos = buffers.getData<BUFFER_POS_GLOBAL>();
+	particleinfo *info = buffers.getData<BUFFER_INFO>();
+	hashKey *hash = buffers.getData<BUFFER_HASH>();
+	for (uint i = 0; i < NUM_PARTS; i++) {
+		pos[i] = make_double4(-1.0 + 2.0*i/NUM_PARTS, 0.5 + 0.25*sin(i), -0.25 + 0.5*(i % 7)/7, 0.001);
+		info[i] = make_particleinfo(i % 3 ? FLUIDPART : BOUNDPART, 0, i);
+		hash[i] = makeParticleHash(i/PARTS_PER_CELL, info[i]);
+	}
+
+	// the client socket, on the port the writer sends to
+	int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	struct sockaddr_in client;
+	memset(&client, 0, sizeof(client));
+	client.sin_family = AF_INET;
+	client.sin_port = htons(PTP_DEFAULT_CLIENT_PORT);
+	inet_aton("127.0.0.1", &client.sin_addr);
+	if (sock < 0 || bind(sock, (struct sockaddr*)&client, sizeof(client))) {
+		perror("cannot bind the client port");
+		return 1;
+	}
+
+	vector<uint> all, every3, cells;
+	for (uint i = 0; i < NUM_PARTS; i++) {
+		all.push_back(i);
+		if (i % 3 == 0)
+			every3.push_back(i);
+		if (i % PARTS_PER_CELL == 0)
+			cells.push_back(i);
+	}
+
+	// each writer listens for the heartbeats on its own port
+	test_writer<ptp_packet_t>(gdata, sock, PTP_DEFAULT_SERVER_PORT, "1", buffers, all, "full");
+	test_writer<ptp_packet_t>(gdata, sock, PTP_DEFAULT_SERVER_PORT + 1, "3", buffers, every3, "decimated");
+	test_writer<ptp_quantized_packet_t>(gdata, sock, PTP_DEFAULT_SERVER_PORT + 2, "cell", buffers, cells,
+		"quantized, one per cell");
+
+	close(sock);
+
+	if (failures) {
+		fprintf(stderr, "UDPWriter test: %d checks failed\n", failures);
+		return 1;
+	}
+	printf("UDPWriter test passed\n");
+	return 0;
+}